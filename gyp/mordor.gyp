@@ -2,6 +2,9 @@
   'includes': ['common.gypi'],
   'variables': {
     'openssl_include_path%': '<(openssl_path)',
+    # Set when libxxhash was built with DISPATCH=1 (it then installs
+    # xxh_x86dispatch.h), so XXH3Stream picks AVX2/AVX-512 at runtime
+    'xxhash_x86dispatch%': 0,
   },
 #  'conditions': [
 #    ['OS == "mac"',{
@@ -35,6 +38,9 @@
       'CLANG_CXX_LIBRARY': 'libc++',             # libc++ requires OS X 10.7 or later
     },
     'conditions': [
+      ['xxhash_x86dispatch == 1', {
+        'defines': ['HAVE_XXH_X86DISPATCH'],
+      }],
       ['OS == "mac"',{
         "cflags": [ "<!@(llvm-config-mp-3.6 --cxxflags)" ],
         "cflags!": ['-funsigned-char'],
@@ -67,8 +73,11 @@
 #            '-L /usr/local/lib',
 #            '-lssl',
 #            '-lcrypto',
-#            '-llzma',
-#            '-lz',
+            '-llz4',
+            '-llzma',
+            '-lxxhash',
+            '-lz',
+            '-lzstd',
           ],
         },
         'cflags': ['-include <!(pwd)/../mordor/pch.h'],
@@ -97,6 +106,7 @@
       'sources': [
         '../mordor/assert.cpp',
         '../mordor/config.cpp',
+        '../mordor/connectionpool.cpp',
         '../mordor/cxa_exception.cpp',
         '../mordor/date_time.cpp',
         '../mordor/string.cpp',
@@ -119,6 +129,8 @@
         '../mordor/streams/buffer.cpp',
         '../mordor/streams/buffered.cpp',
         '../mordor/streams/cat.cpp',
+        '../mordor/streams/chunked_crypto.cpp',
+        '../mordor/streams/compression.cpp',
         '../mordor/streams/counter.cpp',
         '../mordor/streams/crypto.cpp',
         '../mordor/streams/stream.cpp',
@@ -126,10 +138,16 @@
         '../mordor/streams/fd.cpp',
         '../mordor/streams/file.cpp',
         '../mordor/streams/filter.cpp',
+        '../mordor/streams/framed.cpp',
         '../mordor/streams/hash.cpp',
         '../mordor/streams/limited.cpp',
+        '../mordor/streams/lz4.cpp',
+        '../mordor/streams/lzma2.cpp',
+        '../mordor/streams/mapped_file.cpp',
         '../mordor/streams/memory.cpp',
+        '../mordor/streams/multi_hash.cpp',
         '../mordor/streams/null.cpp',
+        '../mordor/streams/parallel_compression.cpp',
         '../mordor/streams/temp.cpp',
         '../mordor/streams/timeout.cpp',
         '../mordor/streams/singleplex.cpp',
@@ -138,9 +156,12 @@
         '../mordor/streams/pipe.cpp',
         '../mordor/streams/random.cpp',
         '../mordor/streams/transfer.cpp',
+        '../mordor/streams/tree_hash.cpp',
         '../mordor/streams/throttle.cpp',
         '../mordor/streams/test.cpp',
         '../mordor/streams/zero.cpp',
+        '../mordor/streams/zlib.cpp',
+        '../mordor/streams/zstd.cpp',
       ],
       'conditions': [
         ['OS == "linux"', {
@@ -199,6 +220,7 @@
         '../mordor/tests/atomic.cpp',
         '../mordor/tests/buffer.cpp',
         '../mordor/tests/config.cpp',
+        '../mordor/tests/connection_pool.cpp',
         '../mordor/tests/coroutine.cpp',
         '../mordor/tests/crypto.cpp',
         '../mordor/tests/endian.cpp',
@@ -218,16 +240,23 @@
         '../mordor/tests/socket.cpp',
         '../mordor/tests/stream.cpp',
         '../mordor/tests/buffered_stream.cpp',
+        '../mordor/tests/chunked_crypto.cpp',
         '../mordor/tests/counter_stream.cpp',
         '../mordor/tests/file_stream.cpp',
+        '../mordor/tests/framed_stream.cpp',
         '../mordor/tests/hash_stream.cpp',
         '../mordor/tests/memory_stream.cpp',
+        '../mordor/tests/multi_hash_stream.cpp',
 #        '../mordor/tests/notify_stream.cpp',
+        '../mordor/tests/parallel_compression.cpp',
         '../mordor/tests/pipe_stream.cpp',
         '../mordor/tests/ssl_stream.cpp',
         '../mordor/tests/temp_stream.cpp',
 #        '../mordor/tests/timeout_stream.cpp',
         '../mordor/tests/transfer_stream.cpp',
+        '../mordor/tests/tree_hash_stream.cpp',
+        '../mordor/tests/zlib.cpp',
+        '../mordor/tests/zstd.cpp',
         '../mordor/tests/run_tests.cpp',
       ],
       'xcode_settings': {
@@ -257,5 +286,81 @@
         ],
       },
     }, # cat
+    {
+      'target_name': 'compressbench',
+      'product_name': 'compressbench',
+      'type': 'executable',
+      'dependencies': [
+        'mordor_base',
+        '<(openssl_include_path)/../../openssl.gyp:openssl',
+      ],
+      'sources': [
+        '../mordor/examples/compressbench.cpp',
+      ],
+      'xcode_settings': {
+        'GCC_ENABLE_CPP_EXCEPTIONS': 'YES',        # -fno-exceptions
+        'GCC_ENABLE_CPP_RTTI': 'YES',              # -fno-rtti
+        'OTHER_LDFLAGS': [
+          '-Wl,-force_load,<(PRODUCT_DIR)/libopenssl.a',
+        ],
+      },
+    }, # compressbench
+    {
+      'target_name': 'sslbench',
+      'product_name': 'sslbench',
+      'type': 'executable',
+      'dependencies': [
+        'mordor_base',
+        '<(openssl_include_path)/../../openssl.gyp:openssl',
+      ],
+      'sources': [
+        '../mordor/examples/sslbench.cpp',
+      ],
+      'xcode_settings': {
+        'GCC_ENABLE_CPP_EXCEPTIONS': 'YES',        # -fno-exceptions
+        'GCC_ENABLE_CPP_RTTI': 'YES',              # -fno-rtti
+        'OTHER_LDFLAGS': [
+          '-Wl,-force_load,<(PRODUCT_DIR)/libopenssl.a',
+        ],
+      },
+    }, # sslbench
+    {
+      'target_name': 'hashbench',
+      'product_name': 'hashbench',
+      'type': 'executable',
+      'dependencies': [
+        'mordor_base',
+        '<(openssl_include_path)/../../openssl.gyp:openssl',
+      ],
+      'sources': [
+        '../mordor/examples/hashbench.cpp',
+      ],
+      'xcode_settings': {
+        'GCC_ENABLE_CPP_EXCEPTIONS': 'YES',        # -fno-exceptions
+        'GCC_ENABLE_CPP_RTTI': 'YES',              # -fno-rtti
+        'OTHER_LDFLAGS': [
+          '-Wl,-force_load,<(PRODUCT_DIR)/libopenssl.a',
+        ],
+      },
+    }, # hashbench
+    {
+      'target_name': 'bufferbench',
+      'product_name': 'bufferbench',
+      'type': 'executable',
+      'dependencies': [
+        'mordor_base',
+        '<(openssl_include_path)/../../openssl.gyp:openssl',
+      ],
+      'sources': [
+        '../mordor/examples/bufferbench.cpp',
+      ],
+      'xcode_settings': {
+        'GCC_ENABLE_CPP_EXCEPTIONS': 'YES',        # -fno-exceptions
+        'GCC_ENABLE_CPP_RTTI': 'YES',              # -fno-rtti
+        'OTHER_LDFLAGS': [
+          '-Wl,-force_load,<(PRODUCT_DIR)/libopenssl.a',
+        ],
+      },
+    }, # bufferbench
   ] # targets
 }
@@ -0,0 +1,284 @@
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include "connectionpool.h"
+
+#include "assert.h"
+#include "iomanager.h"
+#include "log.h"
+#include "statistics.h"
+
+namespace Mordor {
+
+static Logger::ptr g_log = Log::lookup("mordor:connectionpool");
+
+static CountStatistic<unsigned long long> &g_statReused =
+    Statistics::registerStatistic("connectionpool.reused",
+    CountStatistic<unsigned long long>());
+static CountStatistic<unsigned long long> &g_statConnected =
+    Statistics::registerStatistic("connectionpool.connected",
+    CountStatistic<unsigned long long>());
+static CountStatistic<unsigned long long> &g_statEvicted =
+    Statistics::registerStatistic("connectionpool.evicted",
+    CountStatistic<unsigned long long>());
+
+ConnectionPool::ConnectionPool(IOManager &ioManager, int type, int protocol)
+    : m_ioManager(ioManager),
+      m_type(type),
+      m_protocol(protocol),
+      m_maxIdle(64),
+      m_maxPerHost(0),
+      m_idleTimeout(60000000ull),
+      m_connectTimeout(~0ull),
+      m_healthCheck(true),
+      m_condition(m_mutex),
+      m_idleCount(0)
+{}
+
+ConnectionPool::~ConnectionPool()
+{
+    for (HostMap::iterator it = m_hosts.begin(); it != m_hosts.end(); ++it) {
+        for (std::list<IdleConnection>::iterator connection =
+            it->second.idle.begin(); connection != it->second.idle.end();
+            ++connection)
+            retire(*connection);
+    }
+}
+
+void
+ConnectionPool::maxIdle(size_t max)
+{
+    FiberMutex::ScopedLock lock(m_mutex);
+    m_maxIdle = max;
+    while (m_idleCount > m_maxIdle && evictOldest());
+}
+
+Socket::ptr
+ConnectionPool::checkout(Address::ptr address)
+{
+    FiberMutex::ScopedLock lock(m_mutex);
+    HostMap::iterator it;
+    while (true) {
+        it = m_hosts.find(address);
+        if (it == m_hosts.end())
+            it = m_hosts.insert(std::make_pair(address->clone(), Host())).first;
+        Host &host = it->second;
+        while (!host.idle.empty()) {
+            IdleConnection connection = host.idle.back();
+            host.idle.pop_back();
+            --m_idleCount;
+            retire(connection);
+            if (m_healthCheck && !connection.socket->probeIdle()) {
+                MORDOR_LOG_DEBUG(g_log) << this << " discarding stale "
+                    << connection.socket << " to " << *address;
+                g_statEvicted.increment();
+                continue;
+            }
+            ++host.active;
+            m_checkedOut[connection.socket.get()] = it->first;
+            g_statReused.increment();
+            MORDOR_LOG_DEBUG(g_log) << this << " reusing "
+                << connection.socket << " to " << *address;
+            return connection.socket;
+        }
+        if (m_maxPerHost == 0 || host.active < m_maxPerHost)
+            break;
+        MORDOR_LOG_DEBUG(g_log) << this << " waiting for a connection to "
+            << *address;
+        m_condition.wait();
+    }
+    Address::ptr key = it->first;
+    ++it->second.active;
+    lock.unlock();
+
+    Socket::ptr socket;
+    try {
+        socket = key->createSocket(m_ioManager, m_type, m_protocol);
+        socket->sendTimeout(m_connectTimeout);
+        socket->connect(key);
+        socket->sendTimeout(~0ull);
+    } catch (...) {
+        lock.lock();
+        HostMap::iterator it = m_hosts.find(key);
+        --it->second.active;
+        // Don't keep every unreachable address around forever
+        if (it->second.idle.empty() && it->second.active == 0)
+            m_hosts.erase(it);
+        m_condition.broadcast();
+        throw;
+    }
+    g_statConnected.increment();
+    MORDOR_LOG_DEBUG(g_log) << this << " connected " << socket << " to "
+        << *key;
+    lock.lock();
+    m_checkedOut[socket.get()] = key;
+    return socket;
+}
+
+void
+ConnectionPool::checkin(Socket::ptr socket)
+{
+    FiberMutex::ScopedLock lock(m_mutex);
+    Address::ptr address;
+    release(socket.get(), address);
+    if (m_maxIdle == 0) {
+        HostMap::iterator it = m_hosts.find(address);
+        if (it->second.idle.empty() && it->second.active == 0)
+            m_hosts.erase(it);
+        return;
+    }
+    if (m_idleCount >= m_maxIdle)
+        evictOldest();
+
+    IdleConnection connection;
+    connection.socket = socket;
+    connection.since = TimerManager::now();
+    if (m_idleTimeout != ~0ull)
+        connection.timer = m_ioManager.registerConditionTimer(m_idleTimeout,
+            std::bind(&ConnectionPool::onIdleTimeout, this, socket.get()),
+            shared_from_this());
+    connection.onRemoteClose = socket->onRemoteClose(std::bind(
+        &ConnectionPool::onRemoteClose, weak_ptr(shared_from_this()),
+        socket.get()));
+    m_hosts[address].idle.push_back(connection);
+    ++m_idleCount;
+    MORDOR_LOG_DEBUG(g_log) << this << " idle " << socket << " to "
+        << *address;
+}
+
+void
+ConnectionPool::discard(Socket::ptr socket)
+{
+    FiberMutex::ScopedLock lock(m_mutex);
+    Address::ptr address;
+    release(socket.get(), address);
+    MORDOR_LOG_DEBUG(g_log) << this << " discarded " << socket << " to "
+        << *address;
+    HostMap::iterator it = m_hosts.find(address);
+    if (it->second.idle.empty() && it->second.active == 0)
+        m_hosts.erase(it);
+}
+
+void
+ConnectionPool::closeIdle()
+{
+    FiberMutex::ScopedLock lock(m_mutex);
+    while (evictOldest());
+}
+
+size_t
+ConnectionPool::idle()
+{
+    FiberMutex::ScopedLock lock(m_mutex);
+    return m_idleCount;
+}
+
+size_t
+ConnectionPool::idle(Address::ptr address)
+{
+    FiberMutex::ScopedLock lock(m_mutex);
+    HostMap::iterator it = m_hosts.find(address);
+    return it == m_hosts.end() ? 0 : it->second.idle.size();
+}
+
+size_t
+ConnectionPool::active(Address::ptr address)
+{
+    FiberMutex::ScopedLock lock(m_mutex);
+    HostMap::iterator it = m_hosts.find(address);
+    return it == m_hosts.end() ? 0 : it->second.active;
+}
+
+size_t
+ConnectionPool::hosts()
+{
+    FiberMutex::ScopedLock lock(m_mutex);
+    return m_hosts.size();
+}
+
+void
+ConnectionPool::release(Socket *socket, Address::ptr &address)
+{
+    std::map<Socket *, Address::ptr>::iterator it = m_checkedOut.find(socket);
+    MORDOR_ASSERT(it != m_checkedOut.end());
+    address = it->second;
+    m_checkedOut.erase(it);
+    Host &host = m_hosts[address];
+    MORDOR_ASSERT(host.active > 0);
+    --host.active;
+    m_condition.broadcast();
+}
+
+void
+ConnectionPool::retire(IdleConnection &connection)
+{
+    if (connection.timer) {
+        connection.timer->cancel();
+        connection.timer.reset();
+    }
+    connection.onRemoteClose.disconnect();
+    connection.socket->unregisterForRemoteClose();
+}
+
+bool
+ConnectionPool::evictOldest()
+{
+    HostMap::iterator oldest = m_hosts.end();
+    for (HostMap::iterator it = m_hosts.begin(); it != m_hosts.end(); ++it) {
+        if (it->second.idle.empty())
+            continue;
+        if (oldest == m_hosts.end() || it->second.idle.front().since <
+            oldest->second.idle.front().since)
+            oldest = it;
+    }
+    if (oldest == m_hosts.end())
+        return false;
+    IdleConnection &connection = oldest->second.idle.front();
+    MORDOR_LOG_DEBUG(g_log) << this << " evicting " << connection.socket
+        << " to " << *oldest->first;
+    retire(connection);
+    oldest->second.idle.pop_front();
+    --m_idleCount;
+    g_statEvicted.increment();
+    if (oldest->second.idle.empty() && oldest->second.active == 0)
+        m_hosts.erase(oldest);
+    return true;
+}
+
+void
+ConnectionPool::evict(Socket *socket, const char *reason)
+{
+    FiberMutex::ScopedLock lock(m_mutex);
+    for (HostMap::iterator it = m_hosts.begin(); it != m_hosts.end(); ++it) {
+        std::list<IdleConnection> &idle = it->second.idle;
+        for (std::list<IdleConnection>::iterator connection = idle.begin();
+            connection != idle.end(); ++connection) {
+            if (connection->socket.get() != socket)
+                continue;
+            MORDOR_LOG_DEBUG(g_log) << this << " " << reason << " "
+                << connection->socket << " to " << *it->first;
+            retire(*connection);
+            idle.erase(connection);
+            --m_idleCount;
+            g_statEvicted.increment();
+            if (idle.empty() && it->second.active == 0)
+                m_hosts.erase(it);
+            return;
+        }
+    }
+}
+
+void
+ConnectionPool::onRemoteClose(weak_ptr self, Socket *socket)
+{
+    ptr strongSelf = self.lock();
+    if (strongSelf)
+        strongSelf->evict(socket, "remote closed");
+}
+
+void
+ConnectionPool::onIdleTimeout(Socket *socket)
+{
+    evict(socket, "idle timeout");
+}
+
+}
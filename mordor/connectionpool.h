@@ -0,0 +1,131 @@
+#ifndef __MORDOR_CONNECTIONPOOL_H__
+#define __MORDOR_CONNECTIONPOOL_H__
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include <list>
+#include <map>
+
+#include "fibersynchronization.h"
+#include "socket.h"
+#include "timer.h"
+
+namespace Mordor {
+
+class IOManager;
+
+/// Pool of outbound connections, keyed by remote Address
+
+/// A ConnectionPool hands out connected Sockets, reusing a previously
+/// returned connection to the same Address when one is idle.  Idle
+/// connections are evicted as soon as the remote end closes them (via
+/// Socket::onRemoteClose), when they have been idle longer than idleTimeout(),
+/// or when the pool holds more than maxIdle() of them.
+///
+/// A ConnectionPool must be owned by a shared_ptr, and all of its methods
+/// must be called from a Fiber running on a Scheduler.
+class ConnectionPool
+    : public std::enable_shared_from_this<ConnectionPool>,
+      Mordor::noncopyable
+{
+public:
+    typedef std::shared_ptr<ConnectionPool> ptr;
+    typedef std::weak_ptr<ConnectionPool> weak_ptr;
+
+public:
+    ConnectionPool(IOManager &ioManager, int type = SOCK_STREAM,
+        int protocol = 0);
+    ~ConnectionPool();
+
+    /// Maximum number of idle connections kept, across all Addresses
+    size_t maxIdle() const { return m_maxIdle; }
+    void maxIdle(size_t max);
+    /// Maximum number of connections (checked out and idle) to a single
+    /// Address; 0 means unlimited.  checkout() waits for a connection to be
+    /// returned once this is reached.
+    size_t maxPerHost() const { return m_maxPerHost; }
+    void maxPerHost(size_t max) { m_maxPerHost = max; }
+    /// How long a connection may stay idle before it is closed, in
+    /// microseconds; ~0ull means forever
+    unsigned long long idleTimeout() const { return m_idleTimeout; }
+    void idleTimeout(unsigned long long us) { m_idleTimeout = us; }
+    /// Timeout for establishing new connections, in microseconds
+    unsigned long long connectTimeout() const { return m_connectTimeout; }
+    void connectTimeout(unsigned long long us) { m_connectTimeout = us; }
+    /// If idle connections should be probed (Socket::probeIdle) before being
+    /// handed out again
+    bool healthCheck() const { return m_healthCheck; }
+    void healthCheck(bool check) { m_healthCheck = check; }
+
+    /// Get a connected Socket to address, reusing an idle one if possible
+    /// @note The returned Socket must be given back with checkin() or
+    /// discard()
+    Socket::ptr checkout(Address::ptr address);
+    /// Return a Socket obtained from checkout() so that it can be reused
+    /// @pre The connection is in a clean state (no request is half written,
+    /// and no response is left unread)
+    void checkin(Socket::ptr socket);
+    /// Return a Socket obtained from checkout() that must not be reused
+    void discard(Socket::ptr socket);
+
+    /// Close all idle connections
+    void closeIdle();
+
+    /// Number of idle connections, across all Addresses
+    size_t idle();
+    /// Number of idle connections to address
+    size_t idle(Address::ptr address);
+    /// Number of checked out (or connecting) connections to address
+    size_t active(Address::ptr address);
+    /// Number of Addresses with any idle or active connections
+    size_t hosts();
+
+private:
+    struct AddressLess
+    {
+        bool operator()(const Address::ptr &lhs, const Address::ptr &rhs) const
+        { return *lhs < *rhs; }
+    };
+
+    struct IdleConnection
+    {
+        Socket::ptr socket;
+        unsigned long long since;
+        Timer::ptr timer;
+        Signal11::ConnectionRef onRemoteClose;
+    };
+
+    struct Host
+    {
+        Host() : active(0) {}
+
+        // Most recently returned at the back
+        std::list<IdleConnection> idle;
+        size_t active;
+    };
+
+    typedef std::map<Address::ptr, Host, AddressLess> HostMap;
+
+private:
+    void release(Socket *socket, Address::ptr &address);
+    void retire(IdleConnection &connection);
+    bool evictOldest();
+    void evict(Socket *socket, const char *reason);
+    static void onRemoteClose(weak_ptr self, Socket *socket);
+    void onIdleTimeout(Socket *socket);
+
+private:
+    IOManager &m_ioManager;
+    int m_type, m_protocol;
+    size_t m_maxIdle, m_maxPerHost;
+    unsigned long long m_idleTimeout, m_connectTimeout;
+    bool m_healthCheck;
+    FiberMutex m_mutex;
+    FiberCondition m_condition;
+    HostMap m_hosts;
+    std::map<Socket *, Address::ptr> m_checkedOut;
+    size_t m_idleCount;
+};
+
+}
+
+#endif
@@ -0,0 +1,122 @@
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include "mordor/predef.h"
+
+#include <string.h>
+
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+#include "mordor/config.h"
+#include "mordor/main.h"
+#include "mordor/streams/buffer.h"
+#include "mordor/timer.h"
+
+using namespace Mordor;
+
+// Measures Buffer::find() over HTTP-like text, with the only match at the
+// very end, as the buffer is split into more and more segments.  find(char)
+// (memchr) and memmem() over the same bytes in one piece are there for
+// scale.
+
+static const size_t DATA_SIZE = 1024 * 1024;
+static const int ITERATIONS = 1000;
+
+static std::string
+generateText(const std::string &terminator)
+{
+    std::ostringstream os;
+    for (unsigned int i = 0; (size_t)os.tellp() < DATA_SIZE; ++i)
+        os << "X-Header-" << i << ": some value, with a \r in it " << i * 7
+            << "\r\n";
+    std::string result = os.str().substr(0, DATA_SIZE - terminator.size());
+    return result + terminator;
+}
+
+static Buffer
+split(const std::string &text, size_t segmentSize)
+{
+    Buffer result;
+    for (size_t offset = 0; offset < text.size(); offset += segmentSize) {
+        // Each one its own segment
+        Buffer segment(text.substr(offset, segmentSize));
+        result.copyIn(segment);
+    }
+    return result;
+}
+
+static void
+report(const char *name, size_t segments, unsigned long long elapsed)
+{
+    double perFind = (double)elapsed / ITERATIONS;
+    std::cout << std::setw(10) << name << std::setw(10) << segments
+        << std::fixed << std::setprecision(1) << std::setw(12) << perFind
+        << " us" << std::setw(12) << DATA_SIZE / perFind << " MB/s"
+        << std::endl;
+}
+
+static void
+benchmark(const std::string &needle, size_t segmentSize)
+{
+    std::string text = generateText(needle);
+    Buffer buffer = split(text, segmentSize);
+    ptrdiff_t expected = (ptrdiff_t)(DATA_SIZE - needle.size());
+    unsigned long long start = TimerManager::now();
+    for (int i = 0; i < ITERATIONS; ++i) {
+        if (buffer.find(needle) != expected)
+            throw std::runtime_error("wrong result from Buffer::find");
+    }
+    std::ostringstream name;
+    name << segmentSize;
+    report(name.str().c_str(), buffer.segments(),
+        TimerManager::now() - start);
+}
+
+static void
+baselines(const std::string &needle)
+{
+    std::string text = generateText(needle);
+    Buffer buffer(text);
+    unsigned long long start = TimerManager::now();
+    for (int i = 0; i < ITERATIONS; ++i) {
+        if (buffer.find('\x01') != -1)
+            throw std::runtime_error("wrong result from Buffer::find");
+    }
+    report("memchr", 1, TimerManager::now() - start);
+#ifndef WINDOWS
+    // memmem() is pure; don't let the loop be hoisted out of existence
+    const char * volatile data = text.c_str();
+    start = TimerManager::now();
+    for (int i = 0; i < ITERATIONS; ++i) {
+        if (!memmem(data, text.size(), needle.c_str(), needle.size()))
+            throw std::runtime_error("wrong result from memmem");
+    }
+    report("memmem", 1, TimerManager::now() - start);
+#endif
+}
+
+MORDOR_MAIN(int argc, const char * const argv[])
+{
+    try {
+        Config::loadFromEnvironment();
+        std::cout << DATA_SIZE << " bytes x " << ITERATIONS << std::endl;
+        const char *needles[] = { "\r\n\r\n",
+            "\r\n--mordor-multipart-boundary--\r\n" };
+        for (size_t i = 0; i < sizeof(needles) / sizeof(needles[0]); ++i) {
+            std::string needle(needles[i]);
+            std::cout << needle.size() << " byte needle" << std::endl
+                << std::setw(10) << "segment" << std::setw(10) << "segments"
+                << std::setw(15) << "per find" << std::setw(17)
+                << "throughput" << std::endl;
+            benchmark(needle, DATA_SIZE);
+            benchmark(needle, 65536);
+            benchmark(needle, 4096);
+            benchmark(needle, 256);
+            baselines(needle);
+        }
+    } catch (const std::exception& ex) {
+        std::cerr << ex.what() << std::endl;
+    }
+    return 0;
+}
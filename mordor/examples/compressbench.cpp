@@ -0,0 +1,196 @@
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include "mordor/predef.h"
+
+#include <iomanip>
+#include <iostream>
+#include <thread>
+
+#include "mordor/config.h"
+#include "mordor/main.h"
+#include "mordor/streams/file.h"
+#include "mordor/streams/gzip.h"
+#include "mordor/streams/lz4.h"
+#include "mordor/streams/lzma2.h"
+#include "mordor/streams/memory.h"
+#include "mordor/streams/parallel_compression.h"
+#include "mordor/streams/singleplex.h"
+#include "mordor/streams/zstd.h"
+#include "mordor/timer.h"
+#include "mordor/workerpool.h"
+
+using namespace Mordor;
+
+// Compares throughput and ratio of the compression streams over a corpus.
+// With no arguments the corpus is generated, so that runs on different
+// machines (and different builds) are comparable; otherwise it is the
+// concatenation of the named files.
+
+static const size_t CORPUS_SIZE = 32 * 1024 * 1024;
+
+static void
+generateCorpus(Buffer &corpus)
+{
+    // Log-like lines: a small vocabulary, increasing timestamps and
+    // pseudo-random ids, from a fixed seed
+    static const char *words[] = { "GET", "PUT", "POST", "DELETE", "/api/v1/",
+        "objects", "buckets", "users", "200", "204", "404", "503", "OK",
+        "Created", "Not Found", "retrying", "backend", "cache", "hit",
+        "miss" };
+    unsigned int seed = 12345;
+    unsigned long long timestamp = 1262304000000ull;
+    std::ostringstream os;
+    while (corpus.readAvailable() < CORPUS_SIZE) {
+        os.str(std::string());
+        for (int i = 0; i < 1024; ++i) {
+            seed = seed * 1103515245 + 12345;
+            timestamp += seed % 1000;
+            os << timestamp << " [" << std::hex << (seed >> 8) << std::dec
+                << "]";
+            for (unsigned int j = 0; j < 4 + (seed >> 28); ++j) {
+                seed = seed * 1103515245 + 12345;
+                os << ' ' << words[(seed >> 16) % 20];
+            }
+            os << '\n';
+        }
+        corpus.copyIn(os.str());
+    }
+    corpus.truncate(CORPUS_SIZE);
+}
+
+static void
+report(const char *name, const Buffer &corpus, size_t compressed,
+    unsigned long long compressTime, unsigned long long decompressTime)
+{
+    double size = (double)corpus.readAvailable();
+    std::cout << std::left << std::setw(16) << name << std::right
+        << std::fixed << std::setprecision(1)
+        << std::setw(10) << size / compressTime << " MB/s"
+        << std::setw(10) << size / decompressTime << " MB/s"
+        << std::setprecision(3) << std::setw(10) << size / compressed
+        << std::endl;
+}
+
+template <class T>
+static Stream::ptr
+createStream(Stream::ptr parent, int level)
+{
+    return Stream::ptr(new T(parent, level));
+}
+
+template <class T>
+static Stream::ptr
+createConcatenatedStream(Stream::ptr parent, int level)
+{
+    std::shared_ptr<T> result(new T(parent, level));
+    result->concatenated(true);
+    return result;
+}
+
+static void
+benchmark(const char *name, const Buffer &corpus,
+    Stream::ptr (*create)(Stream::ptr, int), int level)
+{
+    std::shared_ptr<MemoryStream> compressed(new MemoryStream());
+    unsigned long long start = TimerManager::now();
+    Stream::ptr stream = create(Stream::ptr(new SingleplexStream(compressed,
+        SingleplexStream::WRITE)), level);
+    Buffer data(corpus);
+    while (data.readAvailable() > 0)
+        data.consume(stream->write(data, data.readAvailable()));
+    stream->close();
+    unsigned long long compressTime = TimerManager::now() - start;
+
+    start = TimerManager::now();
+    stream = create(Stream::ptr(new SingleplexStream(
+        Stream::ptr(new MemoryStream(compressed->buffer())),
+        SingleplexStream::READ)), level);
+    Buffer decompressed;
+    while (stream->read(decompressed, 65536) > 0);
+    unsigned long long decompressTime = TimerManager::now() - start;
+    if (decompressed != corpus)
+        std::cerr << name << ": round trip mismatch" << std::endl;
+
+    report(name, corpus, compressed->buffer().readAvailable(),
+        compressTime, decompressTime);
+}
+
+// Compress with ParallelCompressionStream on 1 to maxThreads threads
+static void
+scaling(const char *name, const Buffer &corpus,
+    Stream::ptr (*create)(Stream::ptr, int), int level, size_t maxThreads)
+{
+    double size = (double)corpus.readAvailable();
+    double base = 0.0;
+    for (size_t threads = 1; threads <= maxThreads; ++threads) {
+        WorkerPool pool(threads, false);
+        std::shared_ptr<MemoryStream> compressed(new MemoryStream());
+        unsigned long long start = TimerManager::now();
+        ParallelCompressionStream stream(Stream::ptr(new SingleplexStream(
+            compressed, SingleplexStream::WRITE)), pool,
+            std::bind(create, std::placeholders::_1, level));
+        Buffer data(corpus);
+        while (data.readAvailable() > 0)
+            data.consume(stream.write(data, data.readAvailable()));
+        stream.close();
+        double speed = size / (TimerManager::now() - start);
+        if (threads == 1)
+            base = speed;
+        pool.stop();
+
+        Stream::ptr decompress = create(Stream::ptr(new SingleplexStream(
+            Stream::ptr(new MemoryStream(compressed->buffer())),
+            SingleplexStream::READ)), level);
+        Buffer decompressed;
+        while (decompress->read(decompressed, 65536) > 0);
+        if (decompressed != corpus)
+            std::cerr << name << ": round trip mismatch" << std::endl;
+
+        std::cout << std::left << std::setw(16) << name << std::right
+            << std::setw(3) << threads << " threads" << std::fixed
+            << std::setprecision(1) << std::setw(10) << speed << " MB/s"
+            << std::setprecision(2) << std::setw(8) << speed / base << "x"
+            << std::setprecision(3) << std::setw(10)
+            << size / compressed->buffer().readAvailable() << std::endl;
+    }
+}
+
+MORDOR_MAIN(int argc, const char * const argv[])
+{
+    try {
+        Config::loadFromEnvironment();
+        Buffer corpus;
+        if (argc == 1) {
+            generateCorpus(corpus);
+        } else {
+            for (int i = 1; i < argc; ++i) {
+                FileStream file(argv[i], FileStream::READ);
+                while (file.read(corpus, 65536) > 0);
+            }
+        }
+        std::cout << corpus.readAvailable() << " bytes" << std::endl
+            << std::left << std::setw(16) << "codec" << std::right
+            << std::setw(15) << "compress" << std::setw(15) << "decompress"
+            << std::setw(10) << "ratio" << std::endl;
+        benchmark("lz4", corpus, &createStream<LZ4Stream>, 0);
+        benchmark("lz4hc-9", corpus, &createStream<LZ4Stream>, 9);
+        benchmark("zstd-1", corpus, &createStream<ZstdStream>, 1);
+        benchmark("zstd-3", corpus, &createStream<ZstdStream>, 3);
+        benchmark("zstd-9", corpus, &createStream<ZstdStream>, 9);
+        benchmark("gzip-1", corpus, &createStream<GzipStream>, 1);
+        benchmark("gzip-6", corpus, &createStream<GzipStream>, 6);
+        benchmark("xz-1", corpus, &createStream<LZMAStream>, 1);
+
+        // ParallelCompressionStream waits on Fibers
+        WorkerPool caller;
+        size_t maxThreads = (std::max)(1u, std::thread::hardware_concurrency());
+        std::cout << std::endl << "parallel, 1MB blocks" << std::endl;
+        scaling("zstd-3", corpus, &createConcatenatedStream<ZstdStream>, 3,
+            maxThreads);
+        scaling("gzip-6", corpus, &createConcatenatedStream<GzipStream>, 6,
+            maxThreads);
+    } catch (const std::exception& ex) {
+        std::cerr << ex.what() << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,195 @@
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include "mordor/predef.h"
+
+#include <iomanip>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "mordor/config.h"
+#include "mordor/main.h"
+#include "mordor/streams/hash.h"
+#include "mordor/streams/multi_hash.h"
+#include "mordor/streams/null.h"
+#include "mordor/streams/temp.h"
+#include "mordor/streams/tree_hash.h"
+#include "mordor/timer.h"
+#include "mordor/workerpool.h"
+
+using namespace Mordor;
+
+// Measures HashStream throughput, writing a pseudo-random buffer through
+// each one to a NullStream, a segment at a time; every HASH_TYPE, the CRCs,
+// and xxHash.  Then MD5, SHA-1 and SHA-256 together, as stacked
+// HashStreams and as a MultiHashStream.  Last, how TreeHashStream (and
+// TreeHashStream::hashFile() of the same data) scale with threads: 1, 2, 4
+// and so on up to the number of cores, and the number of cores itself.
+
+static const size_t DATA_SIZE = 64 * 1024 * 1024;
+static const size_t SEGMENT_SIZE = 65536;
+static const int ITERATIONS = 4;
+
+static Buffer
+generateData()
+{
+    std::string segment(SEGMENT_SIZE, '\0');
+    unsigned int seed = 12345;
+    Buffer result;
+    while (result.readAvailable() < DATA_SIZE) {
+        for (size_t i = 0; i < segment.size(); ++i) {
+            seed = seed * 1103515245 + 12345;
+            segment[i] = (char)(seed >> 16);
+        }
+        result.copyIn(segment);
+    }
+    return result;
+}
+
+template <class T>
+static Stream::ptr
+create()
+{
+    return Stream::ptr(new T(NullStream::get_ptr()));
+}
+
+template <unsigned int P>
+static Stream::ptr
+createCRC32()
+{
+    return Stream::ptr(new CRC32Stream(NullStream::get_ptr(), P));
+}
+
+static Stream::ptr
+createStacked()
+{
+    return Stream::ptr(new MD5Stream(Stream::ptr(new SHA1Stream(
+        Stream::ptr(new SHA256Stream(NullStream::get_ptr()))))));
+}
+
+template <size_t ParallelThreshold>
+static Stream::ptr
+createMulti()
+{
+    MultiHashStream::ptr result(new MultiHashStream(NullStream::get_ptr(),
+        ParallelThreshold));
+    result->add(Mordor::MD5);
+    result->add(Mordor::SHA1);
+    result->add(Mordor::SHA256);
+    return result;
+}
+
+static void
+write(Stream &stream, const Buffer &data)
+{
+    Buffer copy(data);
+    while (copy.readAvailable() > 0)
+        copy.consume(stream.write(copy, SEGMENT_SIZE));
+}
+
+static void
+benchmark(const char *name, Stream::ptr (*create)(), const Buffer &data)
+{
+    unsigned long long start = TimerManager::now();
+    for (int i = 0; i < ITERATIONS; ++i) {
+        Stream::ptr stream = create();
+        write(*stream, data);
+        stream->close();
+    }
+    unsigned long long elapsed = TimerManager::now() - start;
+    std::cout << std::setw(16) << name << std::fixed << std::setprecision(1)
+        << std::setw(12) << (double)DATA_SIZE * ITERATIONS / elapsed
+        << " MB/s" << std::endl;
+}
+
+static void
+treeScaling(const Buffer &data, const std::vector<size_t> &threadCounts)
+{
+#ifndef WINDOWS
+    TempStream temp("hashbench", false);
+    std::string path = temp.path();
+    write(temp, data);
+    temp.close();
+#endif
+    double size = (double)DATA_SIZE;
+    double base = 0.0;
+    for (size_t i = 0; i < threadCounts.size(); ++i) {
+        size_t threads = threadCounts[i];
+        WorkerPool pool(threads, false);
+        unsigned long long start = TimerManager::now();
+        {
+            TreeHashStream stream(NullStream::get_ptr(), pool);
+            write(stream, data);
+            stream.hash();
+        }
+        double speed = size / (TimerManager::now() - start);
+        if (threads == 1)
+            base = speed;
+        std::cout << std::setw(16) << "tree" << std::setw(3) << threads
+            << " threads" << std::fixed << std::setprecision(1)
+            << std::setw(10) << speed << " MB/s" << std::setprecision(2)
+            << std::setw(8) << speed / base << "x";
+#ifndef WINDOWS
+        start = TimerManager::now();
+        {
+            SchedulerSwitcher switcher(&pool);
+            TreeHashStream::hashFile(path);
+        }
+        std::cout << std::setprecision(1) << std::setw(10)
+            << size / (TimerManager::now() - start) << " MB/s (file)";
+#endif
+        std::cout << std::endl;
+        pool.stop();
+    }
+#ifndef WINDOWS
+    unlink(path.c_str());
+#endif
+}
+
+MORDOR_MAIN(int argc, const char * const argv[])
+{
+    try {
+        Config::loadFromEnvironment();
+        // For MultiHashStream's parallel hashing
+        WorkerPool pool;
+        Buffer data = generateData();
+        std::cout << DATA_SIZE << " bytes x " << ITERATIONS << std::endl;
+        benchmark("crc32-ieee", &createCRC32<CRC32Stream::IEEE>, data);
+        benchmark("crc32c", &createCRC32<CRC32Stream::CASTAGNOLI>, data);
+        benchmark("crc32k", &createCRC32<CRC32Stream::KOOPMAN>, data);
+        benchmark("xxh64", &create<XXH64Stream>, data);
+        benchmark("xxh3", &create<XXH3Stream>, data);
+        benchmark("md5", &create<MD5Stream>, data);
+#ifndef OPENSSL_NO_SHA0
+        benchmark("sha0", &create<SHA0Stream>, data);
+#endif
+#ifndef OPENSSL_NO_SHA1
+        benchmark("sha1", &create<SHA1Stream>, data);
+#endif
+#ifndef OPENSSL_NO_SHA256
+        benchmark("sha224", &create<SHA224Stream>, data);
+        benchmark("sha256", &create<SHA256Stream>, data);
+#endif
+#ifndef OPENSSL_NO_SHA512
+        benchmark("sha384", &create<SHA384Stream>, data);
+        benchmark("sha512", &create<SHA512Stream>, data);
+#endif
+#if !defined(OPENSSL_NO_SHA1) && !defined(OPENSSL_NO_SHA256)
+        benchmark("md5+sha1+sha256", &createStacked, data);
+        benchmark("multi", &createMulti<0>, data);
+        benchmark("multi-parallel", &createMulti<SEGMENT_SIZE>, data);
+#endif
+        size_t cores = (std::max)(1u, std::thread::hardware_concurrency());
+        std::vector<size_t> threadCounts;
+        for (size_t threads = 1; threads <= (std::max)(cores, (size_t)4);
+            threads *= 2)
+            threadCounts.push_back(threads);
+        if (cores != threadCounts.back() && cores > 4)
+            threadCounts.push_back(cores);
+        std::cout << cores << " cores" << std::endl;
+        treeScaling(data, threadCounts);
+    } catch (const std::exception& ex) {
+        std::cerr << ex.what() << std::endl;
+    }
+    return 0;
+}
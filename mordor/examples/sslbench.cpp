@@ -0,0 +1,94 @@
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include "mordor/predef.h"
+
+#include <iomanip>
+#include <iostream>
+
+#include "mordor/config.h"
+#include "mordor/main.h"
+#include "mordor/parallel.h"
+#include "mordor/streams/pipe.h"
+#include "mordor/streams/ssl.h"
+#include "mordor/timer.h"
+#include "mordor/workerpool.h"
+
+using namespace Mordor;
+
+// Measures SSLStream throughput over a loopback pipeStream pair, so that
+// only the TLS record layer and SSLStream's own buffering are measured.
+
+static const unsigned long long TRANSFER_SIZE = 256 * 1024 * 1024;
+
+static void
+acceptSSL(SSLStream::ptr server)
+{
+    server->accept();
+}
+
+static void
+writeAll(Stream::ptr stream, size_t writeSize)
+{
+    Buffer buffer(std::string(writeSize, 'x'));
+    for (unsigned long long written = 0; written < TRANSFER_SIZE;) {
+        size_t toWrite = (size_t)(std::min)((unsigned long long)writeSize,
+            TRANSFER_SIZE - written);
+        written += stream->write(buffer, toWrite);
+    }
+    stream->flush();
+}
+
+static void
+readAll(Stream::ptr stream)
+{
+    Buffer buffer;
+    for (unsigned long long read = 0; read < TRANSFER_SIZE;) {
+        size_t result = stream->read(buffer, 65536);
+        if (result == 0)
+            MORDOR_THROW_EXCEPTION(UnexpectedEofException());
+        read += result;
+        buffer.clear();
+    }
+}
+
+static void
+benchmark(size_t writeSize, size_t pipeSize)
+{
+    std::pair<Stream::ptr, Stream::ptr> pipes = pipeStream(pipeSize);
+    SSLStream::ptr server(new SSLStream(pipes.first, false));
+    SSLStream::ptr client(new SSLStream(pipes.second, true));
+    std::vector<std::function<void ()> > dgs;
+    dgs.push_back(std::bind(&acceptSSL, server));
+    dgs.push_back(std::bind(&SSLStream::connect, client));
+    parallel_do(dgs);
+
+    dgs.clear();
+    dgs.push_back(std::bind(&writeAll, client, writeSize));
+    dgs.push_back(std::bind(&readAll, server));
+    unsigned long long start = TimerManager::now();
+    parallel_do(dgs);
+    unsigned long long elapsed = TimerManager::now() - start;
+
+    std::cout << std::setw(10) << writeSize << std::setw(10) << pipeSize
+        << std::fixed << std::setprecision(1) << std::setw(12)
+        << (double)TRANSFER_SIZE / elapsed << " MB/s" << std::endl;
+}
+
+MORDOR_MAIN(int argc, const char * const argv[])
+{
+    try {
+        Config::loadFromEnvironment();
+        WorkerPool pool;
+        std::cout << TRANSFER_SIZE << " bytes" << std::endl << std::setw(10)
+            << "write" << std::setw(10) << "pipe" << std::setw(17)
+            << "throughput" << std::endl;
+        benchmark(1024, 65536);
+        benchmark(16384, 65536);
+        benchmark(65536, 65536);
+        benchmark(1024 * 1024, 65536);
+        benchmark(65536, 1024 * 1024);
+    } catch (const std::exception& ex) {
+        std::cerr << ex.what() << std::endl;
+    }
+    return 0;
+}
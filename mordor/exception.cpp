@@ -379,6 +379,7 @@ template struct Mordor::ErrorInfo<std::runtime_error>;
 template struct Mordor::ErrorInfo<std::bad_alloc>;
 template struct Mordor::ErrorInfo<std::out_of_range>;
 template struct Mordor::ErrorInfo<std::invalid_argument>;
+template struct Mordor::ErrorInfo<std::logic_error>;
 template struct Mordor::ErrorInfo<Mordor::StreamException>;
 template struct Mordor::ErrorInfo<Mordor::UnexpectedEofException>;
 template struct Mordor::ErrorInfo<Mordor::WriteBeyondEofException>;
@@ -191,6 +191,7 @@ extern template struct Mordor::ErrorInfo<std::runtime_error>;
 extern template struct Mordor::ErrorInfo<std::bad_alloc>;
 extern template struct Mordor::ErrorInfo<std::out_of_range>;
 extern template struct Mordor::ErrorInfo<std::invalid_argument>;
+extern template struct Mordor::ErrorInfo<std::logic_error>;
 extern template struct Mordor::ErrorInfo<Mordor::StreamException>;
 extern template struct Mordor::ErrorInfo<Mordor::UnexpectedEofException>;
 extern template struct Mordor::ErrorInfo<Mordor::WriteBeyondEofException>;
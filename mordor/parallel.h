@@ -2,13 +2,16 @@
 #define __MORDOR_PARALLEL_H__
 // Copyright (c) 2009 - Mozy, Inc.
 
+#include <deque>
 #include <vector>
 #include <mutex>
 
 #include "atomic.h"
 #include "fiber.h"
+#include "fibersynchronization.h"
 #include "log.h"
 #include "scheduler.h"
+#include "util.h"
 
 namespace Mordor {
 
@@ -131,6 +134,142 @@ parallel_foreach(Iterator begin, Iterator end, Functor functor,
         Mordor::rethrow_exception(exception);
 }
 
+/// Work done in parallel on another Scheduler, handed back in order
+
+/// Each item pushed is processed by its own functor on scheduler, while the
+/// caller carries on; pop() then returns the items in the order they were
+/// pushed, each once its functor has finished.  Nothing limits how many
+/// items are in flight (pushed, and not yet popped) except the caller, who
+/// is expected to pop(maxInFlight() - 1) before each push().
+///
+/// Not thread-safe itself: push() and pop() are meant to be called by one
+/// Fiber at a time (the owner of a Stream, say).  Destroying the queue
+/// waits for the functors still running, since they usually refer back to
+/// whatever owns it.
+template <class T>
+class OrderedWorkQueue : Mordor::noncopyable
+{
+public:
+    typedef std::shared_ptr<T> ptr;
+    typedef std::function<void (T &)> Processor;
+
+private:
+    struct Entry
+    {
+        Entry(ptr _item) : item(_item), done(false) {}
+
+        ptr item;
+        bool done;
+        std::exception_ptr exception;
+    };
+
+public:
+    /// @param maxInFlight 0 means twice as many as scheduler has threads
+    OrderedWorkQueue(Scheduler &scheduler, size_t maxInFlight = 0)
+        : m_scheduler(scheduler),
+          m_maxInFlight(maxInFlight),
+          m_condition(m_mutex)
+    {
+        if (m_maxInFlight == 0)
+            m_maxInFlight = 2 * scheduler.threadCount();
+    }
+    ~OrderedWorkQueue() { wait(); }
+
+    size_t maxInFlight() const { return m_maxInFlight; }
+    size_t size() const
+    {
+        FiberMutex::ScopedLock lock(m_mutex);
+        return m_entries.size();
+    }
+
+    /// Schedules processor(*item) on scheduler
+    void push(ptr item, const Processor &processor)
+    {
+        std::shared_ptr<Entry> entry(new Entry(item));
+        {
+            FiberMutex::ScopedLock lock(m_mutex);
+            m_entries.push_back(entry);
+        }
+        m_scheduler.schedule(std::bind(&OrderedWorkQueue::process, this,
+            entry, processor));
+    }
+
+    /// Removes the oldest item, waiting for it to be processed if more than
+    /// keep are in flight
+    /// @return The item, or NULL if there are no more than keep in flight,
+    /// and the oldest isn't done yet
+    /// @throws Whatever the item's processor threw; the item is still removed
+    ptr pop(size_t keep = 0)
+    {
+        std::shared_ptr<Entry> entry;
+        {
+            FiberMutex::ScopedLock lock(m_mutex);
+            if (m_entries.empty())
+                return ptr();
+            entry = m_entries.front();
+            if (!entry->done && m_entries.size() <= keep)
+                return ptr();
+            while (!entry->done)
+                m_condition.wait();
+            m_entries.pop_front();
+        }
+        if (entry->exception)
+            Mordor::rethrow_exception(entry->exception);
+        return entry->item;
+    }
+
+    /// Waits for every item in flight to be processed
+    void wait() const
+    {
+        FiberMutex::ScopedLock lock(m_mutex);
+        for (typename std::deque<std::shared_ptr<Entry> >::const_iterator it =
+            m_entries.begin(); it != m_entries.end(); ++it) {
+            while (!(*it)->done)
+                m_condition.wait();
+        }
+    }
+
+    /// Waits for every item in flight, then calls dg on each, oldest first,
+    /// leaving them in flight; exceptions from processors are ignored
+    void visit(const std::function<void (const T &)> &dg) const
+    {
+        wait();
+        for (typename std::deque<std::shared_ptr<Entry> >::const_iterator it =
+            m_entries.begin(); it != m_entries.end(); ++it)
+            dg(*(*it)->item);
+    }
+
+    /// Waits for every item in flight, and drops them, exceptions and all
+    void clear()
+    {
+        wait();
+        FiberMutex::ScopedLock lock(m_mutex);
+        m_entries.clear();
+    }
+
+private:
+    void process(std::shared_ptr<Entry> entry, Processor processor)
+    {
+        std::exception_ptr exception;
+        try {
+            processor(*entry->item);
+        } catch (...) {
+            exception = std::current_exception();
+        }
+        FiberMutex::ScopedLock lock(m_mutex);
+        entry->exception = exception;
+        entry->done = true;
+        m_condition.broadcast();
+    }
+
+private:
+    Scheduler &m_scheduler;
+    size_t m_maxInFlight;
+    mutable FiberMutex m_mutex;
+    mutable FiberCondition m_condition;
+    std::deque<std::shared_ptr<Entry> > m_entries;
+};
+
 }
 
 #endif
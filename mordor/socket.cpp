@@ -4,10 +4,12 @@
 
 #include "assert.h"
 #include "fiber.h"
+#include "fibersynchronization.h"
 #include "iomanager.h"
 #include "string.h"
 #include "version.h"
 #include "mordor/config.h"
+#include "mordor/streams/buffer.h"
 
 #ifdef WINDOWS
 #include <mswsock.h>
@@ -24,6 +26,7 @@
 #include <fcntl.h>
 #include <ifaddrs.h>
 #include <netdb.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #define closesocket close
 #endif
@@ -186,7 +189,8 @@ Socket::Socket(IOManager *ioManager, int family, int type, int protocol, int ini
   m_scheduler(NULL),
 #endif
   m_isConnected(false),
-  m_isRegisteredForRemoteClose(false)
+  m_isRegisteredForRemoteClose(false),
+  m_isParked(false)
 {
     // Windows accepts type == 0 as implying SOCK_STREAM; other OS's aren't so
     // lenient
@@ -212,7 +216,8 @@ Socket::Socket(int family, int type, int protocol)
   m_protocol(protocol),
   m_ioManager(NULL),
   m_isConnected(false),
-  m_isRegisteredForRemoteClose(false)
+  m_isRegisteredForRemoteClose(false),
+  m_isParked(false)
 {
 #ifdef WINDOWS
     m_useAcceptEx = g_useAcceptEx->val();   //remember the setting for the entire life of the socket
@@ -250,7 +255,8 @@ Socket::Socket(IOManager &ioManager, int family, int type, int protocol)
   m_scheduler(NULL),
 #endif
   m_isConnected(false),
-  m_isRegisteredForRemoteClose(false)
+  m_isRegisteredForRemoteClose(false),
+  m_isParked(false)
 {
 #ifdef WINDOWS
     m_useAcceptEx = g_useAcceptEx->val();   //remember the setting for the entire life of the socket
@@ -304,6 +310,8 @@ Socket::~Socket()
 #else
     if (m_isRegisteredForRemoteClose)
         m_ioManager->unregisterEvent(m_sock, IOManager::CLOSE);
+    if (m_isParked)
+        m_ioManager->unregisterEvent(m_sock, IOManager::READ);
 #endif
     if (m_sock != -1) {
         int rc = ::closesocket(m_sock);
@@ -518,38 +526,7 @@ suckylsp:
             return;
         }
         if (errno == EINPROGRESS) {
-            m_ioManager->registerEvent(m_sock, IOManager::WRITE);
-            if (m_cancelledSend) {
-                MORDOR_LOG_ERROR(g_log) << this << " connect(" << m_sock << ", " << to
-                    << "): (" << m_cancelledSend << ")";
-                m_ioManager->cancelEvent(m_sock, IOManager::WRITE);
-                Scheduler::yieldTo();
-                MORDOR_THROW_EXCEPTION_FROM_ERROR_API(m_cancelledSend, "connect");
-            }
-            Timer::ptr timeout;
-            if (m_sendTimeout != ~0ull)
-                timeout = m_ioManager->registerConditionTimer(m_sendTimeout,
-                    std::bind(&Socket::cancelIo, this, IOManager::WRITE,
-                        std::ref(m_cancelledSend), ETIMEDOUT),
-                    weak_ptr(shared_from_this()));
-            Scheduler::yieldTo();
-            if (timeout)
-                timeout->cancel();
-            if (m_cancelledSend) {
-                MORDOR_LOG_ERROR(g_log) << this << " connect(" << m_sock << ", " << to
-                    << "): (" << m_cancelledSend << ")";
-                MORDOR_THROW_EXCEPTION_FROM_ERROR_API(m_cancelledSend, "connect");
-            }
-            int err;
-            size_t size = sizeof(int);
-            getOption(SOL_SOCKET, SO_ERROR, &err, &size);
-            if (err != 0) {
-                MORDOR_LOG_ERROR(g_log) << this << " connect(" << m_sock << ", " << to
-                    << "): (" << err << ")";
-                MORDOR_THROW_EXCEPTION_FROM_ERROR_API(err, "connect");
-            }
-            MORDOR_LOG_INFO(g_log) << this << " connect(" << m_sock << ", "
-                << to << ") local: " << *(localAddress());
+            waitForConnect(to);
         } else {
             MORDOR_LOG_ERROR(g_log) << this << " connect(" << m_sock << ", " << to
                 << "): (" << lastError() << ")";
@@ -562,9 +539,118 @@ suckylsp:
     }
 }
 
+#ifndef WINDOWS
 void
-Socket::listen(int backlog)
+Socket::waitForConnect(const Address &to)
 {
+    m_ioManager->registerEvent(m_sock, IOManager::WRITE);
+    if (m_cancelledSend) {
+        MORDOR_LOG_ERROR(g_log) << this << " connect(" << m_sock << ", " << to
+            << "): (" << m_cancelledSend << ")";
+        m_ioManager->cancelEvent(m_sock, IOManager::WRITE);
+        Scheduler::yieldTo();
+        MORDOR_THROW_EXCEPTION_FROM_ERROR_API(m_cancelledSend, "connect");
+    }
+    Timer::ptr timeout;
+    if (m_sendTimeout != ~0ull)
+        timeout = m_ioManager->registerConditionTimer(m_sendTimeout,
+            std::bind(&Socket::cancelIo, this, IOManager::WRITE,
+                std::ref(m_cancelledSend), ETIMEDOUT),
+            weak_ptr(shared_from_this()));
+    Scheduler::yieldTo();
+    if (timeout)
+        timeout->cancel();
+    if (m_cancelledSend) {
+        MORDOR_LOG_ERROR(g_log) << this << " connect(" << m_sock << ", " << to
+            << "): (" << m_cancelledSend << ")";
+        MORDOR_THROW_EXCEPTION_FROM_ERROR_API(m_cancelledSend, "connect");
+    }
+    int err;
+    size_t size = sizeof(int);
+    getOption(SOL_SOCKET, SO_ERROR, &err, &size);
+    if (err != 0) {
+        MORDOR_LOG_ERROR(g_log) << this << " connect(" << m_sock << ", " << to
+            << "): (" << err << ")";
+        MORDOR_THROW_EXCEPTION_FROM_ERROR_API(err, "connect");
+    }
+    MORDOR_LOG_INFO(g_log) << this << " connect(" << m_sock << ", "
+        << to << ") local: " << *(localAddress());
+}
+#endif
+
+size_t
+Socket::connect(const Address &to, const Buffer &buffer, size_t length)
+{
+#if defined(MSG_FASTOPEN) && !defined(WINDOWS)
+    MORDOR_ASSERT(to.family() == m_family);
+    length = std::min(length, buffer.readAvailable());
+    if (length == 0) {
+        connect(to);
+        return 0;
+    }
+    iovec iovs[Buffer::STACK_IOVECS];
+    msghdr msg;
+    memset(&msg, 0, sizeof(msghdr));
+    msg.msg_iov = iovs;
+    msg.msg_iovlen = buffer.readBuffers(iovs, Buffer::STACK_IOVECS, length);
+    msg.msg_name = (sockaddr *)to.name();
+    msg.msg_namelen = to.nameLen();
+    int rc;
+    error_t error;
+    do {
+        rc = sendmsg(m_sock, &msg, MSG_FASTOPEN | MSG_NOSIGNAL);
+        error = errno;
+    } while (rc == -1 && error == EINTR);
+    if (rc == -1 && error == EOPNOTSUPP) {
+        // Fast Open is disabled for this socket or by the kernel; the data
+        // has to go out after an ordinary handshake
+        MORDOR_LOG_DEBUG(g_log) << this << " sendmsg(" << m_sock << ", "
+            << to << ", MSG_FASTOPEN): not supported";
+        connect(to);
+        return 0;
+    }
+    if (rc == -1 && !(m_ioManager && error == EINPROGRESS)) {
+        MORDOR_LOG_ERROR(g_log) << this << " sendmsg(" << m_sock << ", " << to
+            << ", MSG_FASTOPEN): (" << error << ")";
+        MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, "sendmsg");
+    }
+    // If no Fast Open cookie was available for this server, the SYN went out
+    // with a cookie request instead of data, and nothing was sent
+    size_t result = rc == -1 ? 0 : (size_t)rc;
+    MORDOR_LOG_DEBUG(g_log) << this << " sendmsg(" << m_sock << ", " << to
+        << ", MSG_FASTOPEN): " << result;
+    if (m_ioManager)
+        waitForConnect(to);
+    else
+        MORDOR_LOG_INFO(g_log) << this << " connect(" << m_sock << ", "
+            << to << ") local: " << *(localAddress());
+    m_isConnected = true;
+    if (m_ioManager && !m_onRemoteClose.empty())
+        registerForRemoteClose();
+    return result;
+#else
+    connect(to);
+    return 0;
+#endif
+}
+
+void
+Socket::listen(int backlog, int fastOpenQueue)
+{
+    if (fastOpenQueue > 0) {
+#ifdef TCP_FASTOPEN
+        // Best effort; the kernel may have server side Fast Open disabled
+        if (setsockopt(m_sock, IPPROTO_TCP, TCP_FASTOPEN,
+            (const char *)&fastOpenQueue, sizeof(int))) {
+            MORDOR_LOG_WARNING(g_log) << this << " setsockopt(" << m_sock
+                << ", TCP_FASTOPEN, " << fastOpenQueue << "): ("
+                << lastError() << ")";
+        } else {
+            MORDOR_LOG_DEBUG(g_log) << this << " setsockopt(" << m_sock
+                << ", TCP_FASTOPEN, " << fastOpenQueue << ")";
+        }
+#endif
+    }
     int rc = ::listen(m_sock, backlog);
     MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::DBG) << this << " listen("
         << m_sock << ", " << backlog << "): " << rc << " (" << lastError()
@@ -805,16 +891,7 @@ Socket::shutdown(int how)
             << how << "): (" << lastError() << ")";
         MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("shutdown");
     }
-    if (m_isRegisteredForRemoteClose) {
-#ifdef WINDOWS
-        m_ioManager->unregisterEvent(m_hEvent);
-        WSAEventSelect(m_sock, m_hEvent, 0);
-#else
-        if (m_isRegisteredForRemoteClose)
-            m_ioManager->unregisterEvent(m_sock, IOManager::CLOSE);
-#endif
-        m_isRegisteredForRemoteClose = false;
-    }
+    unregisterForRemoteClose();
     m_isConnected = false;
     MORDOR_LOG_VERBOSE(g_log) << this << " shutdown(" << m_sock << ", "
         << how << ")";
@@ -1279,6 +1356,32 @@ Socket::type()
     return result;
 }
 
+bool
+Socket::probeIdle()
+{
+#ifdef WINDOWS
+    fd_set readSet;
+    FD_ZERO(&readSet);
+    FD_SET(m_sock, &readSet);
+    timeval zero = { 0, 0 };
+    int rc = ::select(0, &readSet, NULL, NULL, &zero);
+    // Readable means either unsolicited data or EOF; neither is idle
+    bool result = rc == 0;
+    MORDOR_LOG_DEBUG(g_log) << this << " probeIdle(" << m_sock << "): "
+        << result << " (" << lastError() << ")";
+#else
+    char c;
+    int rc;
+    do {
+        rc = ::recv(m_sock, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    } while (rc == -1 && errno == EINTR);
+    bool result = rc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    MORDOR_LOG_DEBUG(g_log) << this << " probeIdle(" << m_sock << "): "
+        << result << " (" << lastError() << ")";
+#endif
+    return result;
+}
+
 Signal11::ConnectionRef
 Socket::onRemoteClose(
         const Signal11::Signal<void()>::CallbackFunction &slot)
@@ -1320,6 +1423,94 @@ Socket::registerForRemoteClose()
     m_isRegisteredForRemoteClose = true;
 }
 
+void
+Socket::unregisterForRemoteClose()
+{
+    if (!m_isRegisteredForRemoteClose)
+        return;
+#ifdef WINDOWS
+    m_ioManager->unregisterEvent(m_hEvent);
+    WSAEventSelect(m_sock, m_hEvent, 0);
+#else
+    m_ioManager->unregisterEvent(m_sock, IOManager::CLOSE);
+#endif
+    m_isRegisteredForRemoteClose = false;
+}
+
+void
+Socket::park(std::function<void ()> dg)
+{
+    MORDOR_ASSERT(m_ioManager);
+    MORDOR_ASSERT(dg);
+    MORDOR_LOG_DEBUG(g_log) << this << " park(" << m_sock << ")";
+#ifdef WINDOWS
+    // Completion ports only report completed I/O, not readiness, so a Fiber
+    // has to sit in a (peeking) receive on our behalf
+    m_ioManager->schedule(std::bind(&Socket::parkedReceive,
+        weak_ptr(shared_from_this()), dg));
+#else
+    if (m_cancelledReceive) {
+        // Let dg discover the cancellation from its own receive
+        m_ioManager->schedule(dg);
+        return;
+    }
+    m_isParked = true;
+    m_ioManager->registerEvent(m_sock, IOManager::READ,
+        std::bind(&Socket::parkedReady, weak_ptr(shared_from_this()), dg));
+#endif
+}
+
+bool
+Socket::unpark()
+{
+#ifdef WINDOWS
+    return false;
+#else
+    // Only one of us and parkedReady() gets to clear it
+    if (!m_isParked.exchange(false))
+        return false;
+    bool result = m_ioManager->unregisterEvent(m_sock, IOManager::READ);
+    MORDOR_LOG_DEBUG(g_log) << this << " unpark(" << m_sock << "): "
+        << result;
+    return result;
+#endif
+}
+
+#ifndef WINDOWS
+void
+Socket::parkedReady(weak_ptr self, std::function<void ()> dg)
+{
+    {
+        // No longer parked, so unpark() (or the destructor) mustn't cancel
+        // a READ that dg itself is waiting on
+        ptr strongSelf = self.lock();
+        if (strongSelf)
+            strongSelf->m_isParked = false;
+    }
+    dg();
+}
+#endif
+
+#ifdef WINDOWS
+void
+Socket::parkedReceive(weak_ptr self, std::function<void ()> dg)
+{
+    {
+        ptr strongSelf = self.lock();
+        if (!strongSelf)
+            return;
+        char byte;
+        int flags = MSG_PEEK;
+        try {
+            strongSelf->receive(&byte, 1, &flags);
+        } catch (...) {
+            // dg will see the error when it does a real receive
+        }
+    }
+    dg();
+}
+#endif
+
 static void throwGaiException(int error)
 {
     switch (error) {
@@ -1988,6 +2179,156 @@ std::ostream &excludePort(std::ostream &os)
     return os;
 }
 
+namespace {
+struct ConnectRace : Mordor::noncopyable
+{
+    ConnectRace() : finished(0), advance(false) {}
+
+    void attempt(Socket::ptr socket, Address::ptr address)
+    {
+        std::exception_ptr exception;
+        try {
+            socket->connect(address);
+        } catch (...) {
+            exception = std::current_exception();
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ++finished;
+            if (exception) {
+                error = exception;
+                advance = true;
+            } else if (!winner) {
+                winner = socket;
+            }
+        }
+        event.set();
+    }
+
+    void attemptDelayElapsed()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            advance = true;
+        }
+        event.set();
+    }
+
+    std::mutex mutex;
+    FiberEvent event;
+    std::vector<Socket::ptr> sockets;
+    Socket::ptr winner;
+    std::exception_ptr error;
+    size_t finished;
+    bool advance;
+};
+}
+
+Socket::ptr
+connectFirst(IOManager &ioManager, const std::vector<Address::ptr> &addresses,
+    int type, int protocol, unsigned long long attemptDelay,
+    unsigned long long timeout)
+{
+    MORDOR_ASSERT(!addresses.empty());
+    MORDOR_ASSERT(Scheduler::getThis() == &ioManager);
+
+    // Alternate address families, preferring the family of the first address
+    std::vector<Address::ptr> ordered;
+    ordered.reserve(addresses.size());
+    {
+        std::list<Address::ptr> preferred, other;
+        int family = addresses.front()->family();
+        for (size_t i = 0; i < addresses.size(); ++i)
+            (addresses[i]->family() == family ? preferred : other)
+                .push_back(addresses[i]);
+        while (!preferred.empty() || !other.empty()) {
+            if (!preferred.empty()) {
+                ordered.push_back(preferred.front());
+                preferred.pop_front();
+            }
+            if (!other.empty()) {
+                ordered.push_back(other.front());
+                other.pop_front();
+            }
+        }
+    }
+
+    std::shared_ptr<ConnectRace> race(new ConnectRace());
+    Timer::ptr timer;
+    size_t next = 0;
+    // timeout only applies to connecting; the winner gets its own back
+    unsigned long long sendTimeout = ~0ull;
+    while (true) {
+        bool launch;
+        {
+            std::lock_guard<std::mutex> lock(race->mutex);
+            if (race->winner || race->finished == ordered.size())
+                break;
+            // Start the next attempt once the previous one has had
+            // attemptDelay to complete, or has already failed
+            launch = next < ordered.size() &&
+                (race->advance || race->finished == next);
+            race->advance = false;
+        }
+        if (!launch) {
+            race->event.wait();
+            continue;
+        }
+        if (timer)
+            timer->cancel();
+        Address::ptr address = ordered[next++];
+        Socket::ptr socket;
+        try {
+            socket = address->createSocket(ioManager, type, protocol);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(race->mutex);
+            race->error = std::current_exception();
+            ++race->finished;
+            race->advance = true;
+            continue;
+        }
+        sendTimeout = socket->sendTimeout();
+        socket->sendTimeout(timeout);
+        race->sockets.push_back(socket);
+        MORDOR_LOG_DEBUG(g_log) << socket.get() << " racing connect to "
+            << *address;
+        ioManager.schedule(std::bind(&ConnectRace::attempt, race, socket,
+            address));
+        if (next < ordered.size())
+            timer = ioManager.registerConditionTimer(attemptDelay,
+                std::bind(&ConnectRace::attemptDelayElapsed, race.get()),
+                race);
+    }
+    if (timer)
+        timer->cancel();
+
+    // Cancel the losers, and wait for them to notice so that no attempt is
+    // left running against this race
+    Socket::ptr winner;
+    {
+        std::lock_guard<std::mutex> lock(race->mutex);
+        winner = race->winner;
+    }
+    for (size_t i = 0; i < race->sockets.size(); ++i)
+        if (race->sockets[i] != winner)
+            race->sockets[i]->cancelConnect();
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lock(race->mutex);
+            if (race->finished == next)
+                break;
+        }
+        race->event.wait();
+    }
+
+    if (!winner)
+        Mordor::rethrow_exception(race->error);
+    winner->sendTimeout(sendTimeout);
+    MORDOR_LOG_DEBUG(g_log) << winner.get() << " won connect race to "
+        << *winner->remoteAddress();
+    return winner;
+}
+
 }
 
 #include "error_info.cpp"
@@ -2,6 +2,8 @@
 #define __MORDOR_SOCKET_H__
 // Copyright (c) 2009 - Mozy, Inc.
 
+#include <atomic>
+#include <functional>
 #include <vector>
 #include <map>
 
@@ -66,6 +68,7 @@ struct NetworkUnreachableException : virtual SocketException {};
 struct TimedOutException : virtual SocketException {};
 
 struct Address;
+struct Buffer;
 
 class Socket : public std::enable_shared_from_this<Socket>, Mordor::noncopyable
 {
@@ -89,7 +92,22 @@ public:
     void connect(const Address &to);
     void connect(const std::shared_ptr<Address> addr)
     { connect(*addr.get()); }
-    void listen(int backlog = SOMAXCONN);
+    /// Connect, sending the start of buffer along with the SYN (TCP Fast
+    /// Open) if possible
+    ///
+    /// Data only goes out with the SYN if the server has previously handed
+    /// out a Fast Open cookie; the caller must send whatever was not sent
+    /// once connect returns.  Falls back to an ordinary connect where Fast
+    /// Open is unavailable.
+    /// @return How many bytes of buffer were sent
+    size_t connect(const Address &to, const Buffer &buffer,
+        size_t length = ~0);
+    size_t connect(const std::shared_ptr<Address> addr, const Buffer &buffer,
+        size_t length = ~0)
+    { return connect(*addr.get(), buffer, length); }
+    /// @param fastOpenQueue If positive, enable TCP Fast Open for incoming
+    ///        connections, with at most this many pending Fast Open requests
+    void listen(int backlog = SOMAXCONN, int fastOpenQueue = 0);
 
     Socket::ptr accept();
     void shutdown(int how = SHUT_RDWR);
@@ -115,6 +133,20 @@ public:
     void cancelSend();
     void cancelReceive();
 
+    /// Wait for the socket to become readable without tying up a Fiber
+
+    /// Instead of blocking the calling Fiber in receive(), dg is scheduled on
+    /// the IOManager once data (or EOF, or an error) is available.  The
+    /// caller can then let its Fiber (and any read buffer) go, so an idle
+    /// keep-alive connection costs only its registration.  dg should do the
+    /// actual receive.
+    /// @note On Windows a Fiber still waits in a one byte peek on dg's
+    /// behalf, and unpark() is not supported.
+    void park(std::function<void ()> dg);
+    /// Stop waiting on behalf of a previous park()
+    /// @return If dg was unregistered before it was scheduled
+    bool unpark();
+
     size_t send(const void *buffer, size_t length, int flags = 0);
     size_t send(const iovec *buffers, size_t length, int flags = 0);
     size_t sendTo(const void *buffer, size_t length, int flags, const Address &to);
@@ -135,6 +167,12 @@ public:
 
     int family() { return m_family; }
     int type();
+
+    /// Non-blocking check that an idle, connected stream socket can be reused
+    ///
+    /// @return false if the remote end has closed or reset the connection, or
+    /// if it has sent data that nobody asked for
+    bool probeIdle();
     int protocol() { return m_protocol; }
 
     /// Event triggered when the remote end of the connection closes the
@@ -145,13 +183,26 @@ public:
     /// the socket to be read after this event has been received)
     Signal11::ConnectionRef onRemoteClose(
         const Signal11::Signal<void()>::CallbackFunction &slot);
+    /// Stop watching for the remote end closing the virtual circuit
+    ///
+    /// Slots stay connected to onRemoteClose, but are not triggered until
+    /// another slot is connected (which resumes watching)
+    void unregisterForRemoteClose();
 
 private:
     template <bool isSend>
     size_t doIO(iovec *buffers, size_t length, int &flags, Address *address = NULL);
     static void callOnRemoteClose(weak_ptr self);
+#ifdef WINDOWS
+    static void parkedReceive(weak_ptr self, std::function<void ()> dg);
+#else
+    static void parkedReady(weak_ptr self, std::function<void ()> dg);
+#endif
     void registerForRemoteClose();
     void accept(Socket &target);
+#ifndef WINDOWS
+    void waitForConnect(const Address &to);
+#endif
 
 #ifdef WINDOWS
     // For WSAEventSelect
@@ -181,6 +232,8 @@ private:
 
 #endif
     bool m_isConnected, m_isRegisteredForRemoteClose;
+    // Cleared by parkedReady() on whichever thread the READ fires on
+    std::atomic<bool> m_isParked;
     Signal11::Signal<void ()> m_onRemoteClose;
 };
 
@@ -354,6 +407,25 @@ bool operator<(const Address::ptr &lhs, const Address::ptr &rhs);
 std::ostream &includePort(std::ostream &os);
 std::ostream &excludePort(std::ostream &os);
 
+/// Connect to whichever of addresses accepts first ("Happy Eyeballs",
+/// RFC 8305)
+///
+/// addresses are reordered so that address families alternate (keeping the
+/// family of the first address first), and a connection attempt is started
+/// for each of them in turn, attemptDelay apart, or as soon as the previous
+/// attempt fails.  Once one attempt succeeds, the attempts still in progress
+/// are cancelled with Socket::cancelConnect.
+/// @param timeout Timeout of each individual connection attempt, in
+///        microseconds
+/// @return The first established Socket, with its sendTimeout as created
+/// @throws The exception from the last failed attempt, if all of them fail
+/// @pre Scheduler::getThis() == &ioManager
+/// @pre !addresses.empty()
+Socket::ptr connectFirst(IOManager &ioManager,
+    const std::vector<Address::ptr> &addresses, int type = SOCK_STREAM,
+    int protocol = 0, unsigned long long attemptDelay = 250000ull,
+    unsigned long long timeout = ~0ull);
+
 }
 
 extern template struct Mordor::ErrorInfo<Mordor::SocketException>;
@@ -6,8 +6,22 @@
 #include <algorithm>
 
 #include "mordor/assert.h"
+#include "mordor/atomic.h"
+#include "mordor/statistics.h"
 #include "mordor/util.h"
 
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64)
+#define MORDOR_BUFFER_SSE2
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#if defined(__GNUC__)
+#define MORDOR_BUFFER_AVX2
+#include <immintrin.h>
+#endif
+#endif
+
 #ifdef WINDOWS
 static u_long iovLength(size_t length)
 {
@@ -22,7 +36,282 @@ static size_t iovLength(size_t length)
 
 namespace Mordor {
 
+const size_t Buffer::STACK_IOVECS;
+
+// Substring search within one contiguous block.  All of these return the
+// offset of the first occurrence of needle (of size >= 2) that lies entirely
+// within haystack, or -1
+typedef ptrdiff_t (*SearchFunction)(const unsigned char *haystack,
+    size_t length, const unsigned char *needle, size_t size);
+
+static ptrdiff_t
+searchScalar(const unsigned char *haystack, size_t length,
+    const unsigned char *needle, size_t size)
+{
+    size_t offset = 0;
+    while (offset + size <= length) {
+        const unsigned char *point = (const unsigned char *)memchr(
+            haystack + offset, needle[0], length - size + 1 - offset);
+        if (!point)
+            return -1;
+        offset = point - haystack;
+        if (memcmp(point + 1, needle + 1, size - 1) == 0)
+            return offset;
+        ++offset;
+    }
+    return -1;
+}
+
+#ifdef MORDOR_BUFFER_SSE2
+static inline unsigned
+lowestBit(unsigned mask)
+{
+#ifdef _MSC_VER
+    unsigned long result;
+    _BitScanForward(&result, mask);
+    return result;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+// Compare 16 candidate positions at once against both the first and last
+// byte of needle, and only memcmp where both match
+static ptrdiff_t
+searchSSE2(const unsigned char *haystack, size_t length,
+    const unsigned char *needle, size_t size)
+{
+    const __m128i first = _mm_set1_epi8((char)needle[0]);
+    const __m128i last = _mm_set1_epi8((char)needle[size - 1]);
+    size_t offset = 0;
+    for (; offset + size - 1 + 16 <= length; offset += 16) {
+        __m128i blockFirst = _mm_loadu_si128(
+            (const __m128i *)(haystack + offset));
+        __m128i blockLast = _mm_loadu_si128(
+            (const __m128i *)(haystack + offset + size - 1));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(
+            _mm_cmpeq_epi8(first, blockFirst),
+            _mm_cmpeq_epi8(last, blockLast)));
+        while (mask) {
+            unsigned bit = lowestBit(mask);
+            if (memcmp(haystack + offset + bit + 1, needle + 1,
+                size - 2) == 0)
+                return offset + bit;
+            mask &= mask - 1;
+        }
+    }
+    ptrdiff_t result = searchScalar(haystack + offset, length - offset,
+        needle, size);
+    return result == -1 ? -1 : result + offset;
+}
+
+#ifdef MORDOR_BUFFER_AVX2
+__attribute__((target("avx2")))
+static ptrdiff_t
+searchAVX2(const unsigned char *haystack, size_t length,
+    const unsigned char *needle, size_t size)
+{
+    const __m256i first = _mm256_set1_epi8((char)needle[0]);
+    const __m256i last = _mm256_set1_epi8((char)needle[size - 1]);
+    size_t offset = 0;
+    for (; offset + size - 1 + 32 <= length; offset += 32) {
+        __m256i blockFirst = _mm256_loadu_si256(
+            (const __m256i *)(haystack + offset));
+        __m256i blockLast = _mm256_loadu_si256(
+            (const __m256i *)(haystack + offset + size - 1));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_and_si256(
+            _mm256_cmpeq_epi8(first, blockFirst),
+            _mm256_cmpeq_epi8(last, blockLast)));
+        while (mask) {
+            unsigned bit = lowestBit(mask);
+            if (memcmp(haystack + offset + bit + 1, needle + 1,
+                size - 2) == 0)
+                return offset + bit;
+            mask &= mask - 1;
+        }
+    }
+    ptrdiff_t result = searchSSE2(haystack + offset, length - offset,
+        needle, size);
+    return result == -1 ? -1 : result + offset;
+}
+#endif
+#endif
+
+static SearchFunction
+chooseSearch()
+{
+#ifdef MORDOR_BUFFER_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return &searchAVX2;
+#endif
+#ifdef MORDOR_BUFFER_SSE2
+    return &searchSSE2;
+#else
+    return &searchScalar;
+#endif
+}
+
+static CountStatistic<unsigned long long> &g_statPoolHits =
+    Statistics::registerStatistic("buffer.pool.hits",
+    CountStatistic<unsigned long long>());
+static CountStatistic<unsigned long long> &g_statPoolMisses =
+    Statistics::registerStatistic("buffer.pool.misses",
+    CountStatistic<unsigned long long>());
+static CountStatistic<long long> &g_statPoolCached =
+    Statistics::registerStatistic("buffer.pool.cached",
+    CountStatistic<long long>("bytes"));
+
+namespace Detail {
+struct BufferBlock
+{
+    volatile size_t refs;
+    // Index into g_sizeClasses, or one of the values below
+    size_t sizeClass;
+    unsigned char *data;
+    // Next free Block in the pool
+    BufferBlock *next;
+
+    // Memory belongs to someone else (Buffer::adopt)
+    static const size_t ADOPTED = ~(size_t)0;
+    // Exactly sized allocation, not returned to the pool
+    static const size_t UNPOOLED = ADOPTED - 1;
+    // An OwnedBlock
+    static const size_t OWNED = ADOPTED - 2;
+};
+
+struct OwnedBlock : BufferBlock
+{
+    std::shared_ptr<const void> owner;
+};
+}
+
+namespace {
+// Smaller requests aren't worth rounding up to 4K; larger ones are rare
+// enough (and big enough) that the allocator can deal with them.  Classes are
+// a power of two apart, so rounding up never wastes more than half a block
+static const size_t g_minPooled = 2048;
+static const size_t g_sizeClasses[] = {
+    4096, 8192, 16384, 32768, 65536, 131072, 262144
+};
+static const size_t g_numSizeClasses =
+    sizeof(g_sizeClasses) / sizeof(g_sizeClasses[0]);
+// How much each thread keeps around, per size class
+static const size_t g_maxCachedPerClass = 1024 * 1024;
+
+typedef Detail::BufferBlock Block;
+
+struct SegmentPool
+{
+    SegmentPool();
+    ~SegmentPool();
+
+    Block *free[g_numSizeClasses];
+    size_t count[g_numSizeClasses];
+};
+}
+
+// Plain pointers can be used after the thread's destructors have run (i.e.
+// by Buffers that are static, or owned by something that is), t_poolOwner
+// only exists to clean up
+static thread_local SegmentPool *t_pool;
+static thread_local bool t_poolDestroyed;
+static thread_local std::unique_ptr<SegmentPool> t_poolOwner;
+
+SegmentPool::SegmentPool()
+{
+    for (size_t i = 0; i < g_numSizeClasses; ++i) {
+        free[i] = NULL;
+        count[i] = 0;
+    }
+}
+
+SegmentPool::~SegmentPool()
+{
+    t_pool = NULL;
+    t_poolDestroyed = true;
+    for (size_t i = 0; i < g_numSizeClasses; ++i) {
+        while (free[i]) {
+            Block *block = free[i];
+            free[i] = block->next;
+            g_statPoolCached.add(-(long long)g_sizeClasses[i]);
+            ::operator delete(block);
+        }
+    }
+}
+
+static SegmentPool *
+segmentPool()
+{
+    if (!t_pool && !t_poolDestroyed) {
+        t_poolOwner.reset(new SegmentPool());
+        t_pool = t_poolOwner.get();
+    }
+    return t_pool;
+}
+
+static Block *
+allocateBlock(size_t length)
+{
+    size_t sizeClass = Block::UNPOOLED;
+    if (length >= g_minPooled) {
+        for (size_t i = 0; i < g_numSizeClasses; ++i) {
+            if (length <= g_sizeClasses[i]) {
+                sizeClass = i;
+                length = g_sizeClasses[i];
+                break;
+            }
+        }
+    }
+    Block *block = NULL;
+    if (sizeClass != Block::UNPOOLED) {
+        SegmentPool *pool = segmentPool();
+        if (pool && pool->free[sizeClass]) {
+            block = pool->free[sizeClass];
+            pool->free[sizeClass] = block->next;
+            --pool->count[sizeClass];
+            g_statPoolCached.add(-(long long)length);
+            g_statPoolHits.increment();
+        } else {
+            g_statPoolMisses.increment();
+        }
+    }
+    if (!block) {
+        block = (Block *)::operator new(sizeof(Block) + length);
+        block->sizeClass = sizeClass;
+        block->data = (unsigned char *)(block + 1);
+    }
+    block->refs = 1;
+    block->next = NULL;
+    return block;
+}
+
+static void
+releaseBlock(Block *block)
+{
+    if (!block || atomicDecrement(block->refs) != 0)
+        return;
+    size_t sizeClass = block->sizeClass;
+    if (sizeClass == Block::OWNED) {
+        delete static_cast<Detail::OwnedBlock *>(block);
+        return;
+    }
+    if (sizeClass < g_numSizeClasses) {
+        SegmentPool *pool = segmentPool();
+        if (pool && pool->count[sizeClass] * g_sizeClasses[sizeClass] <
+            g_maxCachedPerClass) {
+            block->next = pool->free[sizeClass];
+            pool->free[sizeClass] = block;
+            ++pool->count[sizeClass];
+            g_statPoolCached.add((long long)g_sizeClasses[sizeClass]);
+            return;
+        }
+    }
+    ::operator delete(block);
+}
+
 Buffer::SegmentData::SegmentData()
+: m_block(NULL)
 {
     start(NULL);
     length(0);
@@ -30,18 +319,83 @@ Buffer::SegmentData::SegmentData()
 
 Buffer::SegmentData::SegmentData(size_t length)
 {
-    m_array.reset(new unsigned char[length], std::default_delete<unsigned char[]>());
-    start(m_array.get());
+    m_block = allocateBlock(length);
+    start(m_block->data);
     this->length(length);
 }
 
 Buffer::SegmentData::SegmentData(void *buffer, size_t length)
 {
-    m_array.reset((unsigned char *)buffer, &nop<unsigned char *>);
-    start(m_array.get());
+    m_block = (Block *)::operator new(sizeof(Block));
+    m_block->refs = 1;
+    m_block->sizeClass = Block::ADOPTED;
+    m_block->data = (unsigned char *)buffer;
+    m_block->next = NULL;
+    start(buffer);
+    this->length(length);
+}
+
+Buffer::SegmentData::SegmentData(const void *buffer, size_t length,
+    std::shared_ptr<const void> owner)
+{
+    Detail::OwnedBlock *block = new Detail::OwnedBlock();
+    block->refs = 1;
+    block->sizeClass = Block::OWNED;
+    block->data = (unsigned char *)buffer;
+    block->next = NULL;
+    block->owner.swap(owner);
+    m_block = block;
+    start((void *)buffer);
     this->length(length);
 }
 
+Buffer::SegmentData::SegmentData(const SegmentData &copy)
+: m_start(copy.m_start),
+  m_length(copy.m_length),
+  m_block(copy.m_block)
+{
+    if (m_block)
+        atomicIncrement(m_block->refs);
+}
+
+Buffer::SegmentData::SegmentData(SegmentData &&move)
+: m_start(move.m_start),
+  m_length(move.m_length),
+  m_block(move.m_block)
+{
+    move.m_block = NULL;
+}
+
+Buffer::SegmentData::~SegmentData()
+{
+    releaseBlock(m_block);
+}
+
+Buffer::SegmentData &
+Buffer::SegmentData::operator =(const SegmentData &copy)
+{
+    if (copy.m_block)
+        atomicIncrement(copy.m_block->refs);
+    releaseBlock(m_block);
+    m_start = copy.m_start;
+    m_length = copy.m_length;
+    m_block = copy.m_block;
+    return *this;
+}
+
+Buffer::SegmentData &
+Buffer::SegmentData::operator =(SegmentData &&move)
+{
+    if (this != &move) {
+        releaseBlock(m_block);
+        m_start = move.m_start;
+        m_length = move.m_length;
+        m_block = move.m_block;
+        move.m_block = NULL;
+    }
+    return *this;
+}
+
 Buffer::SegmentData
 Buffer::SegmentData::slice(size_t start, size_t length)
 {
@@ -50,7 +404,7 @@ Buffer::SegmentData::slice(size_t start, size_t length)
     MORDOR_ASSERT(start <= this->length());
     MORDOR_ASSERT(length + start <= this->length());
     SegmentData result;
-    result.m_array = m_array;
+    result = *this;
     result.start((unsigned char*)this->start() + start);
     result.length(length);
     return result;
@@ -64,7 +418,7 @@ Buffer::SegmentData::slice(size_t start, size_t length) const
     MORDOR_ASSERT(start <= this->length());
     MORDOR_ASSERT(length + start <= this->length());
     SegmentData result;
-    result.m_array = m_array;
+    result = *this;
     result.start((unsigned char*)this->start() + start);
     result.length(length);
     return result;
@@ -178,38 +532,162 @@ Buffer::Segment::invariant() const
 }
 
 
+Buffer::SegmentList::SegmentList()
+: m_heap(NULL),
+  m_head(0),
+  m_size(0),
+  m_capacity(INLINE_SEGMENTS)
+{}
+
+Buffer::SegmentList::~SegmentList()
+{
+    clear();
+    ::operator delete(m_heap);
+}
+
+void
+Buffer::SegmentList::push_front(Segment segment)
+{
+    if (m_size == m_capacity)
+        grow();
+    m_head = (m_head - 1) & (m_capacity - 1);
+    new (&slots()[m_head]) Segment(std::move(segment));
+    ++m_size;
+}
+
+void
+Buffer::SegmentList::push_back(Segment segment)
+{
+    if (m_size == m_capacity)
+        grow();
+    new (&slots()[(m_head + m_size) & (m_capacity - 1)])
+        Segment(std::move(segment));
+    ++m_size;
+}
+
+void
+Buffer::SegmentList::pop_front()
+{
+    MORDOR_ASSERT(m_size > 0);
+    front().~Segment();
+    m_head = (m_head + 1) & (m_capacity - 1);
+    --m_size;
+}
+
+void
+Buffer::SegmentList::pop_back()
+{
+    MORDOR_ASSERT(m_size > 0);
+    back().~Segment();
+    --m_size;
+}
+
+void
+Buffer::SegmentList::insert(size_t index, Segment segment)
+{
+    MORDOR_ASSERT(index <= m_size);
+    if (index == 0) {
+        push_front(std::move(segment));
+        return;
+    }
+    if (m_size == m_capacity)
+        grow();
+    // Shift whichever side of index is shorter
+    if (index < m_size - index) {
+        m_head = (m_head - 1) & (m_capacity - 1);
+        new (&(*this)[0]) Segment(std::move((*this)[1]));
+        for (size_t i = 1; i < index; ++i)
+            (*this)[i] = std::move((*this)[i + 1]);
+    } else {
+        if (index == m_size) {
+            push_back(std::move(segment));
+            return;
+        }
+        new (&(*this)[m_size]) Segment(std::move((*this)[m_size - 1]));
+        for (size_t i = m_size - 1; i > index; --i)
+            (*this)[i] = std::move((*this)[i - 1]);
+    }
+    (*this)[index] = std::move(segment);
+    ++m_size;
+}
+
+void
+Buffer::SegmentList::erase(size_t first, size_t last)
+{
+    MORDOR_ASSERT(first <= last);
+    MORDOR_ASSERT(last <= m_size);
+    size_t count = last - first;
+    if (count == 0)
+        return;
+    if (first < m_size - last) {
+        for (size_t i = last; i-- > count;)
+            (*this)[i] = std::move((*this)[i - count]);
+        for (size_t i = 0; i < count; ++i)
+            pop_front();
+    } else {
+        for (size_t i = first; i + count < m_size; ++i)
+            (*this)[i] = std::move((*this)[i + count]);
+        for (size_t i = 0; i < count; ++i)
+            pop_back();
+    }
+}
+
+void
+Buffer::SegmentList::clear()
+{
+    while (m_size > 0)
+        pop_back();
+    m_head = 0;
+}
+
+void
+Buffer::SegmentList::grow()
+{
+    size_t capacity = m_capacity * 2;
+    Segment *heap = (Segment *)::operator new(capacity * sizeof(Segment));
+    for (size_t i = 0; i < m_size; ++i) {
+        new (&heap[i]) Segment(std::move((*this)[i]));
+        (*this)[i].~Segment();
+    }
+    ::operator delete(m_heap);
+    m_heap = heap;
+    m_head = 0;
+    m_capacity = capacity;
+}
+
+
 Buffer::Buffer()
 {
     m_readAvailable = m_writeAvailable = 0;
-    m_writeIt = m_segments.end();
+    m_writeIt = 0;
     invariant();
 }
 
 Buffer::Buffer(const Buffer &copy)
 {
     m_readAvailable = m_writeAvailable = 0;
-    m_writeIt = m_segments.end();
+    m_writeIt = 0;
     copyIn(copy);
 }
 
 Buffer::Buffer(const char *string)
 {
     m_readAvailable = m_writeAvailable = 0;
-    m_writeIt = m_segments.end();
+    m_writeIt = 0;
     copyIn(string, strlen(string));
 }
 
 Buffer::Buffer(const std::string &string)
 {
     m_readAvailable = m_writeAvailable = 0;
-    m_writeIt = m_segments.end();
+    m_writeIt = 0;
     copyIn(string);
 }
 
 Buffer::Buffer(const void *data, size_t length)
 {
     m_readAvailable = m_writeAvailable = 0;
-    m_writeIt = m_segments.end();
+    m_writeIt = 0;
     copyIn(data, length);
 }
 
@@ -248,35 +726,64 @@ Buffer::adopt(void *buffer, size_t length)
         // put the new buffer at the front if possible to avoid
         // fragmentation
         m_segments.push_front(newSegment);
-        m_writeIt = m_segments.begin();
+        m_writeIt = 0;
     } else {
         m_segments.push_back(newSegment);
-        if (m_writeAvailable == 0) {
-            m_writeIt = m_segments.end();
-            --m_writeIt;
-        }
+        if (m_writeAvailable == 0)
+            m_writeIt = m_segments.size() - 1;
     }
     m_writeAvailable += length;
     invariant();
 }
 
+void
+Buffer::adoptMapping(const void *buffer, size_t length,
+    std::shared_ptr<const void> mapping)
+{
+    invariant();
+    if (length == 0)
+        return;
+    // Split any mixed read/write bufs
+    if (m_writeIt != m_segments.size() &&
+        m_segments[m_writeIt].readAvailable() != 0) {
+        m_segments.insert(m_writeIt,
+            Segment(m_segments[m_writeIt].readBuffer()));
+        Segment &segment = m_segments[++m_writeIt];
+        segment.consume(segment.readAvailable());
+    }
+    if (m_writeIt > 0) {
+        Segment &previous = m_segments[m_writeIt - 1];
+        Block *block = previous.m_data.m_block;
+        if (block && block->sizeClass == Block::OWNED &&
+            static_cast<Detail::OwnedBlock *>(block)->owner == mapping &&
+            (const unsigned char *)previous.m_data.start() +
+            previous.readAvailable() == buffer) {
+            previous.extend(length);
+            m_readAvailable += length;
+            invariant();
+            return;
+        }
+    }
+    m_segments.insert(m_writeIt++,
+        Segment(SegmentData(buffer, length, mapping)));
+    m_readAvailable += length;
+    invariant();
+}
+
 void
 Buffer::reserve(size_t length)
 {
     if (writeAvailable() < length) {
-        // over-reserve to avoid fragmentation
-        Segment newSegment(length * 2 - writeAvailable());
+        Segment newSegment(length - writeAvailable());
         if (readAvailable() == 0) {
             // put the new buffer at the front if possible to avoid
             // fragmentation
             m_segments.push_front(newSegment);
-            m_writeIt = m_segments.begin();
+            m_writeIt = 0;
         } else {
             m_segments.push_back(newSegment);
-            if (m_writeAvailable == 0) {
-                m_writeIt = m_segments.end();
-                --m_writeIt;
-            }
+            if (m_writeAvailable == 0)
+                m_writeIt = m_segments.size() - 1;
         }
         m_writeAvailable += newSegment.length();
         invariant();
@@ -287,12 +794,12 @@ void
 Buffer::compact()
 {
     invariant();
-    if (m_writeIt != m_segments.end()) {
-        if (m_writeIt->readAvailable() > 0) {
-            Segment newSegment = Segment(m_writeIt->readBuffer());
-            m_segments.insert(m_writeIt, newSegment);
+    if (m_writeIt != m_segments.size()) {
+        if (m_segments[m_writeIt].readAvailable() > 0) {
+            Segment newSegment = Segment(m_segments[m_writeIt].readBuffer());
+            m_segments.insert(m_writeIt++, newSegment);
         }
-        m_writeIt = m_segments.erase(m_writeIt, m_segments.end());
+        m_segments.erase(m_writeIt, m_segments.size());
         m_writeAvailable = 0;
     }
     MORDOR_ASSERT(writeAvailable() == 0);
@@ -305,12 +812,15 @@ Buffer::clear(bool clearWriteAvailableAsWell)
     if (clearWriteAvailableAsWell) {
         m_readAvailable = m_writeAvailable = 0;
         m_segments.clear();
-        m_writeIt = m_segments.end();
+        m_writeIt = 0;
     } else {
         m_readAvailable = 0;
-        if (m_writeIt != m_segments.end() && m_writeIt->readAvailable())
-            m_writeIt->consume(m_writeIt->readAvailable());
-        m_segments.erase(m_segments.begin(), m_writeIt);
+        if (m_writeIt != m_segments.size() &&
+            m_segments[m_writeIt].readAvailable())
+            m_segments[m_writeIt].consume(
+                m_segments[m_writeIt].readAvailable());
+        m_segments.erase(0, m_writeIt);
+        m_writeIt = 0;
     }
     invariant();
     MORDOR_ASSERT(m_readAvailable == 0);
@@ -323,7 +833,7 @@ Buffer::produce(size_t length)
     m_readAvailable += length;
     m_writeAvailable -= length;
     while (length > 0) {
-        Segment &segment = *m_writeIt;
+        Segment &segment = m_segments[m_writeIt];
         size_t toProduce = (std::min)(segment.writeAvailable(), length);
         segment.produce(toProduce);
         length -= toProduce;
@@ -340,12 +850,15 @@ Buffer::consume(size_t length)
     MORDOR_ASSERT(length <= readAvailable());
     m_readAvailable -= length;
     while (length > 0) {
-        Segment &segment = *m_segments.begin();
+        Segment &segment = m_segments.front();
         size_t toConsume = (std::min)(segment.readAvailable(), length);
         segment.consume(toConsume);
         length -= toConsume;
-        if (segment.length() == 0)
+        if (segment.length() == 0) {
+            MORDOR_ASSERT(m_writeIt > 0);
             m_segments.pop_front();
+            --m_writeIt;
+        }
     }
     MORDOR_ASSERT(length == 0);
     invariant();
@@ -358,14 +871,17 @@ Buffer::truncate(size_t length)
     if (length == m_readAvailable)
         return;
     // Split any mixed read/write bufs
-    if (m_writeIt != m_segments.end() && m_writeIt->readAvailable() != 0) {
-        m_segments.insert(m_writeIt, Segment(m_writeIt->readBuffer()));
-        m_writeIt->consume(m_writeIt->readAvailable());
+    if (m_writeIt != m_segments.size() &&
+        m_segments[m_writeIt].readAvailable() != 0) {
+        m_segments.insert(m_writeIt,
+            Segment(m_segments[m_writeIt].readBuffer()));
+        Segment &segment = m_segments[++m_writeIt];
+        segment.consume(segment.readAvailable());
     }
     m_readAvailable = length;
-    std::list<Segment>::iterator it;
-    for (it = m_segments.begin(); it != m_segments.end() && length > 0; ++it) {
-        Segment &segment = *it;
+    size_t it;
+    for (it = 0; it < m_segments.size() && length > 0; ++it) {
+        Segment &segment = m_segments[it];
         if (length <= segment.readAvailable()) {
             segment.truncate(length);
             length = 0;
@@ -376,10 +892,13 @@ Buffer::truncate(size_t length)
         }
     }
     MORDOR_ASSERT(length == 0);
-    while (it != m_segments.end() && it->readAvailable() > 0) {
-        MORDOR_ASSERT(it->writeAvailable() == 0);
-        it = m_segments.erase(it);
+    size_t last = it;
+    while (last < m_segments.size() && m_segments[last].readAvailable() > 0) {
+        MORDOR_ASSERT(m_segments[last].writeAvailable() == 0);
+        ++last;
     }
+    m_segments.erase(it, last);
+    m_writeIt -= last - it;
     invariant();
 }
 
@@ -392,10 +911,10 @@ Buffer::readBuffers(size_t length) const
     std::vector<iovec> result;
     result.reserve(m_segments.size());
     size_t remaining = length;
-    std::list<Segment>::const_iterator it;
-    for (it = m_segments.begin(); it != m_segments.end(); ++it) {
-        size_t toConsume = (std::min)(it->readAvailable(), remaining);
-        SegmentData data = it->readBuffer().slice(0, toConsume);
+    for (size_t i = 0; i < m_segments.size(); ++i) {
+        const Segment &segment = m_segments[i];
+        size_t toConsume = (std::min)(segment.readAvailable(), remaining);
+        SegmentData data = segment.readBuffer().slice(0, toConsume);
 #ifdef WINDOWS
         while (data.length() > 0) {
             iovec wsabuf;
@@ -449,15 +968,16 @@ Buffer::readBuffer(size_t length, bool coalesce) const
     // Breaking constness!
     Buffer* _this = const_cast<Buffer*>(this);
     // try to avoid allocation
-    if (m_writeIt != m_segments.end() && m_writeIt->writeAvailable()
-        >= readAvailable()) {
-        copyOut(m_writeIt->writeBuffer().start(), readAvailable());
-        Segment newSegment = Segment(m_writeIt->writeBuffer().slice(0,
-            readAvailable()));
+    if (m_writeIt != m_segments.size() &&
+        m_segments[m_writeIt].writeAvailable() >= readAvailable()) {
+        Segment &writeSegment = _this->m_segments[m_writeIt];
+        copyOut(writeSegment.writeBuffer().start(), readAvailable());
+        Segment newSegment = Segment(
+            writeSegment.writeBuffer().slice(0, readAvailable()));
         _this->m_segments.clear();
         _this->m_segments.push_back(newSegment);
         _this->m_writeAvailable = 0;
-        _this->m_writeIt = _this->m_segments.end();
+        _this->m_writeIt = _this->m_segments.size();
         invariant();
         SegmentData data = newSegment.readBuffer().slice(0, length);
         result.iov_base = data.start();
@@ -470,7 +990,7 @@ Buffer::readBuffer(size_t length, bool coalesce) const
     _this->m_segments.clear();
     _this->m_segments.push_back(newSegment);
     _this->m_writeAvailable = 0;
-    _this->m_writeIt = _this->m_segments.end();
+    _this->m_writeIt = _this->m_segments.size();
     invariant();
     SegmentData data = newSegment.readBuffer().slice(0, length);
     result.iov_base = data.start();
@@ -487,9 +1007,9 @@ Buffer::writeBuffers(size_t length)
     std::vector<iovec> result;
     result.reserve(m_segments.size());
     size_t remaining = length;
-    std::list<Segment>::iterator it = m_writeIt;
+    size_t it = m_writeIt;
     while (remaining > 0) {
-        Segment& segment = *it;
+        Segment& segment = m_segments[it];
         size_t toProduce = (std::min)(segment.writeAvailable(), remaining);
         SegmentData data = segment.writeBuffer().slice(0, toProduce);
 #ifdef WINDOWS
@@ -514,6 +1034,55 @@ Buffer::writeBuffers(size_t length)
     return result;
 }
 
+size_t
+Buffer::readBuffers(iovec *iovs, size_t count, size_t length) const
+{
+    if (length == (size_t)~0)
+        length = readAvailable();
+    MORDOR_ASSERT(length <= readAvailable());
+    size_t result = 0;
+    for (size_t i = 0; i < m_segments.size() && length > 0 && result < count;
+        ++i) {
+        const Segment &segment = m_segments[i];
+        const unsigned char *start =
+            (const unsigned char *)segment.m_data.start();
+        size_t todo = (std::min)(segment.readAvailable(), length);
+        length -= todo;
+        while (todo > 0 && result < count) {
+            iovs[result].iov_base = (void *)start;
+            iovs[result].iov_len = iovLength(todo);
+            start += iovs[result].iov_len;
+            todo -= iovs[result].iov_len;
+            ++result;
+        }
+    }
+    return result;
+}
+
+size_t
+Buffer::writeBuffers(iovec *iovs, size_t count, size_t length)
+{
+    if (length == (size_t)~0)
+        length = writeAvailable();
+    reserve(length);
+    size_t result = 0;
+    for (size_t i = m_writeIt; length > 0 && result < count; ++i) {
+        Segment &segment = m_segments[i];
+        unsigned char *start = (unsigned char *)segment.m_data.start() +
+            segment.m_writeIndex;
+        size_t todo = (std::min)(segment.writeAvailable(), length);
+        length -= todo;
+        while (todo > 0 && result < count) {
+            iovs[result].iov_base = start;
+            iovs[result].iov_len = iovLength(todo);
+            start += iovs[result].iov_len;
+            todo -= iovs[result].iov_len;
+            ++result;
+        }
+    }
+    return result;
+}
+
 iovec
 Buffer::writeBuffer(size_t length, bool coalesce)
 {
@@ -525,16 +1094,19 @@ Buffer::writeBuffer(size_t length, bool coalesce)
     // Must allocate just the write segment
     if (writeAvailable() == 0) {
         reserve(length);
-        MORDOR_ASSERT(m_writeIt != m_segments.end());
-        MORDOR_ASSERT(m_writeIt->writeAvailable() >= length);
-        SegmentData data = m_writeIt->writeBuffer().slice(0, length);
+        MORDOR_ASSERT(m_writeIt != m_segments.size());
+        MORDOR_ASSERT(m_segments[m_writeIt].writeAvailable() >= length);
+        SegmentData data = m_segments[m_writeIt].writeBuffer().slice(0,
+            length);
         result.iov_base = data.start();
         result.iov_len = iovLength(data.length());
         return result;
     }
     // Can use an existing write segment
-    if (writeAvailable() > 0 && m_writeIt->writeAvailable() >= length) {
-        SegmentData data = m_writeIt->writeBuffer().slice(0, length);
+    if (writeAvailable() > 0 &&
+        m_segments[m_writeIt].writeAvailable() >= length) {
+        SegmentData data = m_segments[m_writeIt].writeBuffer().slice(0,
+            length);
         result.iov_base = data.start();
         result.iov_len = iovLength(data.length());
         return result;
@@ -542,7 +1114,7 @@ Buffer::writeBuffer(size_t length, bool coalesce)
     // If they don't want us to coalesce, just return as much as we can from
     // the first segment
     if (!coalesce) {
-        SegmentData data = m_writeIt->writeBuffer();
+        SegmentData data = m_segments[m_writeIt].writeBuffer();
         result.iov_base = data.start();
         result.iov_len = iovLength(data.length());
         return result;
@@ -550,9 +1122,9 @@ Buffer::writeBuffer(size_t length, bool coalesce)
     // Existing bufs are insufficient... remove them and reserve anew
     compact();
     reserve(length);
-    MORDOR_ASSERT(m_writeIt != m_segments.end());
-    MORDOR_ASSERT(m_writeIt->writeAvailable() >= length);
-    SegmentData data = m_writeIt->writeBuffer().slice(0, length);
+    MORDOR_ASSERT(m_writeIt != m_segments.size());
+    MORDOR_ASSERT(m_segments[m_writeIt].writeAvailable() >= length);
+    SegmentData data = m_segments[m_writeIt].writeBuffer().slice(0, length);
     result.iov_base = data.start();
     result.iov_len = iovLength(data.length());
     return result;
@@ -572,30 +1144,33 @@ Buffer::copyIn(const Buffer &buffer, size_t length, size_t pos)
         return;
 
     // Split any mixed read/write bufs
-    if (m_writeIt != m_segments.end() && m_writeIt->readAvailable() != 0) {
-        m_segments.insert(m_writeIt, Segment(m_writeIt->readBuffer()));
-        m_writeIt->consume(m_writeIt->readAvailable());
+    if (m_writeIt != m_segments.size() &&
+        m_segments[m_writeIt].readAvailable() != 0) {
+        m_segments.insert(m_writeIt,
+            Segment(m_segments[m_writeIt].readBuffer()));
+        Segment &segment = m_segments[++m_writeIt];
+        segment.consume(segment.readAvailable());
         invariant();
     }
 
-    std::list<Segment>::const_iterator it = buffer.m_segments.begin();
-    while (pos != 0 && it != buffer.m_segments.end()) {
-        if (pos < it->readAvailable())
+    size_t it = 0;
+    while (pos != 0 && it != buffer.m_segments.size()) {
+        if (pos < buffer.m_segments[it].readAvailable())
             break;
-        pos -= it->readAvailable();
+        pos -= buffer.m_segments[it].readAvailable();
         ++it;
     }
-    MORDOR_ASSERT(it != buffer.m_segments.end());
-    for (; it != buffer.m_segments.end(); ++it) {
-        size_t toConsume = (std::min)(it->readAvailable() - pos, length);
-        if (m_readAvailable != 0 && it == buffer.m_segments.begin()) {
-            std::list<Segment>::iterator previousIt = m_writeIt;
-            --previousIt;
-            if ((char *)previousIt->readBuffer().start() +
-                previousIt->readBuffer().length() == (char *)it->readBuffer().start() + pos &&
-                previousIt->m_data.m_array.get() == it->m_data.m_array.get()) {
-                MORDOR_ASSERT(previousIt->writeAvailable() == 0);
-                previousIt->extend(toConsume);
+    MORDOR_ASSERT(it != buffer.m_segments.size());
+    for (; it != buffer.m_segments.size(); ++it) {
+        const Segment &segment = buffer.m_segments[it];
+        size_t toConsume = (std::min)(segment.readAvailable() - pos, length);
+        if (m_readAvailable != 0 && it == 0) {
+            Segment &previous = m_segments[m_writeIt - 1];
+            if ((char *)previous.readBuffer().start() +
+                previous.readBuffer().length() == (char *)segment.readBuffer().start() + pos &&
+                previous.m_data.m_block == segment.m_data.m_block) {
+                MORDOR_ASSERT(previous.writeAvailable() == 0);
+                previous.extend(toConsume);
                 m_readAvailable += toConsume;
                 length -= toConsume;
                 pos = 0;
@@ -604,8 +1179,8 @@ Buffer::copyIn(const Buffer &buffer, size_t length, size_t pos)
                 continue;
             }
         }
-        Segment newSegment = Segment(it->readBuffer().slice(pos, toConsume));
-        m_segments.insert(m_writeIt, newSegment);
+        Segment newSegment = Segment(segment.readBuffer().slice(pos, toConsume));
+        m_segments.insert(m_writeIt++, newSegment);
         m_readAvailable += toConsume;
         length -= toConsume;
         pos = 0;
@@ -621,15 +1196,16 @@ Buffer::copyIn(const void *data, size_t length)
 {
     invariant();
 
-    while (m_writeIt != m_segments.end() && length > 0) {
-        size_t todo = (std::min)(length, m_writeIt->writeAvailable());
-        memcpy(m_writeIt->writeBuffer().start(), data, todo);
-        m_writeIt->produce(todo);
+    while (m_writeIt != m_segments.size() && length > 0) {
+        Segment &segment = m_segments[m_writeIt];
+        size_t todo = (std::min)(length, segment.writeAvailable());
+        memcpy(segment.writeBuffer().start(), data, todo);
+        segment.produce(todo);
         m_writeAvailable -= todo;
         m_readAvailable += todo;
         data = (unsigned char*)data + todo;
         length -= todo;
-        if (m_writeIt->writeAvailable() == 0)
+        if (segment.writeAvailable() == 0)
             ++m_writeIt;
         invariant();
     }
@@ -639,6 +1215,7 @@ Buffer::copyIn(const void *data, size_t length)
         memcpy(newSegment.writeBuffer().start(), data, length);
         newSegment.produce(length);
         m_segments.push_back(newSegment);
+        m_writeIt = m_segments.size();
         m_readAvailable += length;
     }
 
@@ -665,17 +1242,18 @@ Buffer::copyOut(void *buffer, size_t length, size_t pos) const
 
     MORDOR_ASSERT(length + pos <= readAvailable());
     unsigned char *next = (unsigned char*)buffer;
-    std::list<Segment>::const_iterator it = m_segments.begin();
-    while (pos != 0 && it != m_segments.end()) {
-        if (pos < it->readAvailable())
+    size_t it = 0;
+    while (pos != 0 && it != m_segments.size()) {
+        if (pos < m_segments[it].readAvailable())
             break;
-        pos -= it->readAvailable();
+        pos -= m_segments[it].readAvailable();
         ++it;
     }
-    MORDOR_ASSERT(it != m_segments.end());
-    for (; it != m_segments.end(); ++it) {
-        size_t todo = (std::min)(length, it->readAvailable() - pos);
-        memcpy(next, (char *)it->readBuffer().start() + pos, todo);
+    MORDOR_ASSERT(it != m_segments.size());
+    for (; it != m_segments.size(); ++it) {
+        const Segment &segment = m_segments[it];
+        size_t todo = (std::min)(length, segment.readAvailable() - pos);
+        memcpy(next, (char *)segment.readBuffer().start() + pos, todo);
         next += todo;
         length -= todo;
         pos = 0;
@@ -695,10 +1273,10 @@ Buffer::find(char delimiter, size_t length) const
     size_t totalLength = 0;
     bool success = false;
 
-    std::list<Segment>::const_iterator it;
-    for (it = m_segments.begin(); it != m_segments.end(); ++it) {
-        const void *start = it->readBuffer().start();
-        size_t toscan = (std::min)(length, it->readAvailable());
+    for (size_t i = 0; i < m_segments.size(); ++i) {
+        const Segment &segment = m_segments[i];
+        const void *start = segment.readBuffer().start();
+        size_t toscan = (std::min)(length, segment.readAvailable());
         const void *point = memchr(start, delimiter, toscan);
         if (point != NULL) {
             success = true;
@@ -722,55 +1300,58 @@ Buffer::find(const std::string &string, size_t length) const
         length = readAvailable();
     MORDOR_ASSERT(length <= readAvailable());
     MORDOR_ASSERT(!string.empty());
+    if (string.size() == 1)
+        return find(string[0], length);
 
-    size_t totalLength = 0;
-    size_t foundSoFar = 0;
-
-    std::list<Segment>::const_iterator it;
-    for (it = m_segments.begin(); it != m_segments.end(); ++it) {
-        const void *start = it->readBuffer().start();
-        size_t toscan = (std::min)(length, it->readAvailable());
-        while (toscan > 0) {
-            if (foundSoFar == 0) {
-                const void *point = memchr(start, string[0], toscan);
-                if (point != NULL) {
-                    foundSoFar = 1;
-                    size_t found = (unsigned char*)point -
-                        (unsigned char*)start;
-                    toscan -= found + 1;
-                    length -= found + 1;
-                    totalLength += found;
-                    start = (unsigned char*)point + 1;
-                } else {
-                    totalLength += toscan;
-                    length -= toscan;
-                    toscan = 0;
-                    continue;
-                }
-            }
-            MORDOR_ASSERT(foundSoFar != 0);
-            size_t tocompare = (std::min)(toscan, string.size() - foundSoFar);
-            if (memcmp(start, string.c_str() + foundSoFar, tocompare) == 0) {
-                foundSoFar += tocompare;
-                toscan -= tocompare;
-                length -= tocompare;
-                if (foundSoFar == string.size())
-                    break;
-            } else {
-                totalLength += foundSoFar;
-                foundSoFar = 0;
-            }
+    static const SearchFunction search = chooseSearch();
+    const unsigned char *needle = (const unsigned char *)string.c_str();
+    size_t size = string.size();
+    size_t offset = 0;
+    for (size_t i = 0; i < m_segments.size() && offset + size <= length;
+        ++i) {
+        const unsigned char *start =
+            (const unsigned char *)m_segments[i].m_data.start();
+        size_t toscan = (std::min)(length - offset,
+            m_segments[i].readAvailable());
+        // Occurrences entirely within this segment come before any that
+        // start in it, but run over into the next
+        if (toscan >= size) {
+            ptrdiff_t found = search(start, toscan, needle, size);
+            if (found != -1)
+                return offset + found;
         }
-        if (foundSoFar == string.size())
-            break;
-        if (length == 0)
+        if (toscan == length - offset)
             break;
+        size_t candidate = toscan >= size ? toscan - size + 1 : 0;
+        for (; candidate < toscan; ++candidate) {
+            if (start[candidate] == needle[0] &&
+                matchesAt(i, candidate, needle, size, length - offset))
+                return offset + candidate;
+        }
+        offset += toscan;
     }
-    if (foundSoFar == string.size())
-        return totalLength;
     return -1;
 }
 
+bool
+Buffer::matchesAt(size_t segment, size_t pos, const unsigned char *needle,
+    size_t size, size_t length) const
+{
+    if (size > length - pos)
+        return false;
+    for (; segment < m_segments.size() && size > 0; ++segment) {
+        const Segment &current = m_segments[segment];
+        size_t tocompare = (std::min)(current.readAvailable() - pos, size);
+        if (memcmp((const unsigned char *)current.m_data.start() + pos,
+            needle, tocompare) != 0)
+            return false;
+        needle += tocompare;
+        size -= tocompare;
+        pos = 0;
+    }
+    return size == 0;
+}
+
 std::string
 Buffer::toString() const
 {
@@ -830,16 +1411,171 @@ Buffer::visit(std::function<void (const void *, size_t)> dg, size_t length) cons
         length = readAvailable();
     MORDOR_ASSERT(length <= readAvailable());
 
-    std::list<Segment>::const_iterator it;
-    for (it = m_segments.begin(); it != m_segments.end() && length > 0; ++it) {
-        size_t todo = (std::min)(length, it->readAvailable());
+    for (size_t i = 0; i < m_segments.size() && length > 0; ++i) {
+        const Segment &segment = m_segments[i];
+        size_t todo = (std::min)(length, segment.readAvailable());
         MORDOR_ASSERT(todo != 0);
-        dg(it->readBuffer().start(), todo);
+        dg(segment.readBuffer().start(), todo);
         length -= todo;
     }
     MORDOR_ASSERT(length == 0);
 }
 
+Buffer::Record::Record()
+    : m_buffer(NULL),
+      m_segment(0),
+      m_offset(0),
+      m_length(0)
+{}
+
+const char *
+Buffer::Record::contiguous() const
+{
+    if (!m_buffer)
+        return NULL;
+    const Segment &segment = m_buffer->m_segments[m_segment];
+    if (m_offset + m_length > segment.readAvailable())
+        return NULL;
+    return (const char *)segment.readBuffer().start() + m_offset;
+}
+
+size_t
+Buffer::Record::readBuffers(iovec *iovs, size_t count) const
+{
+    size_t filled = 0;
+    size_t offset = m_offset, length = m_length;
+    for (size_t i = m_segment; length > 0 && filled < count; ++i) {
+        const Segment &segment = m_buffer->m_segments[i];
+        size_t todo = (std::min)(length, segment.readAvailable() - offset);
+        iovs[filled].iov_base = (char *)segment.readBuffer().start() + offset;
+        iovs[filled].iov_len = todo;
+        ++filled;
+        length -= todo;
+        offset = 0;
+    }
+    return filled;
+}
+
+void
+Buffer::Record::copyOut(void *buffer, size_t length) const
+{
+    if (length == (size_t)~0)
+        length = m_length;
+    MORDOR_ASSERT(length <= m_length);
+    unsigned char *next = (unsigned char *)buffer;
+    size_t offset = m_offset;
+    for (size_t i = m_segment; length > 0; ++i) {
+        const Segment &segment = m_buffer->m_segments[i];
+        size_t todo = (std::min)(length, segment.readAvailable() - offset);
+        memcpy(next, (const unsigned char *)segment.readBuffer().start() +
+            offset, todo);
+        next += todo;
+        length -= todo;
+        offset = 0;
+    }
+}
+
+std::string
+Buffer::Record::toString() const
+{
+    std::string result;
+    result.resize(m_length);
+    if (m_length > 0)
+        copyOut(&result[0]);
+    return result;
+}
+
+bool
+Buffer::Record::operator ==(const char *str) const
+{
+    size_t length = strlen(str);
+    if (length != m_length)
+        return false;
+    size_t offset = m_offset;
+    for (size_t i = m_segment; length > 0; ++i) {
+        const Segment &segment = m_buffer->m_segments[i];
+        size_t todo = (std::min)(length, segment.readAvailable() - offset);
+        if (memcmp(str, (const unsigned char *)segment.readBuffer().start() +
+            offset, todo) != 0)
+            return false;
+        str += todo;
+        length -= todo;
+        offset = 0;
+    }
+    return true;
+}
+
+Buffer::RecordIterator::RecordIterator(const Buffer &buffer, char delimiter)
+    : m_buffer(buffer),
+      m_delimiter(delimiter),
+      m_segment(0),
+      m_offset(0),
+      m_consumed(0),
+      m_scanSegment(0),
+      m_scanOffset(0),
+      m_scanned(0)
+{}
+
+bool
+Buffer::RecordIterator::next(Record &record)
+{
+    const SegmentList &segments = m_buffer.m_segments;
+    size_t length = m_scanned;
+    for (size_t i = m_scanSegment, offset = m_scanOffset; i < segments.size();
+        ++i, offset = 0) {
+        const Segment &segment = segments[i];
+        size_t available = segment.readAvailable();
+        if (available == 0)
+            break;
+        const char *start = (const char *)segment.readBuffer().start();
+        const char *point = (const char *)memchr(start + offset, m_delimiter,
+            available - offset);
+        if (!point) {
+            length += available - offset;
+            // Don't look at any of this again if more is appended
+            m_scanSegment = i;
+            m_scanOffset = available;
+            m_scanned = length;
+            continue;
+        }
+        length += point - (start + offset);
+        record.m_buffer = &m_buffer;
+        record.m_segment = m_segment;
+        record.m_offset = m_offset;
+        record.m_length = length;
+        m_consumed += length + 1;
+        // Resume just after the delimiter
+        m_segment = i;
+        m_offset = point - start + 1;
+        if (m_offset == available) {
+            ++m_segment;
+            m_offset = 0;
+        }
+        m_scanSegment = m_segment;
+        m_scanOffset = m_offset;
+        m_scanned = 0;
+        return true;
+    }
+    return false;
+}
+
+bool
+Buffer::RecordIterator::remainder(Record &record)
+{
+    size_t length = m_buffer.readAvailable() - m_consumed;
+    if (length == 0)
+        return false;
+    record.m_buffer = &m_buffer;
+    record.m_segment = m_segment;
+    record.m_offset = m_offset;
+    record.m_length = length;
+    m_consumed += length;
+    m_segment = m_scanSegment = m_buffer.m_segments.size();
+    m_offset = m_scanOffset = 0;
+    m_scanned = 0;
+    return true;
+}
+
 bool
 Buffer::operator == (const Buffer &rhs) const
 {
@@ -893,31 +1629,33 @@ Buffer::operator!= (const char *string) const
 int
 Buffer::opCmp(const Buffer &rhs) const
 {
-    std::list<Segment>::const_iterator leftIt, rightIt;
+    size_t leftIt, rightIt;
     int lengthResult = (int)((ptrdiff_t)readAvailable() - (ptrdiff_t)rhs.readAvailable());
-    leftIt = m_segments.begin(); rightIt = rhs.m_segments.begin();
+    leftIt = 0; rightIt = 0;
     size_t leftOffset = 0, rightOffset = 0;
-    while (leftIt != m_segments.end() && rightIt != rhs.m_segments.end())
+    while (leftIt != m_segments.size() && rightIt != rhs.m_segments.size())
     {
-        MORDOR_ASSERT(leftOffset <= leftIt->readAvailable());
-        MORDOR_ASSERT(rightOffset <= rightIt->readAvailable());
-        size_t tocompare = (std::min)(leftIt->readAvailable() - leftOffset,
-            rightIt->readAvailable() - rightOffset);
+        const Segment &left = m_segments[leftIt];
+        const Segment &right = rhs.m_segments[rightIt];
+        MORDOR_ASSERT(leftOffset <= left.readAvailable());
+        MORDOR_ASSERT(rightOffset <= right.readAvailable());
+        size_t tocompare = (std::min)(left.readAvailable() - leftOffset,
+            right.readAvailable() - rightOffset);
         if (tocompare == 0)
             break;
         int result = memcmp(
-            (const unsigned char *)leftIt->readBuffer().start() + leftOffset,
-            (const unsigned char *)rightIt->readBuffer().start() + rightOffset,
+            (const unsigned char *)left.readBuffer().start() + leftOffset,
+            (const unsigned char *)right.readBuffer().start() + rightOffset,
             tocompare);
         if (result != 0)
             return result;
         leftOffset += tocompare;
         rightOffset += tocompare;
-        if (leftOffset == leftIt->readAvailable()) {
+        if (leftOffset == left.readAvailable()) {
             leftOffset = 0;
             ++leftIt;
         }
-        if (rightOffset == rightIt->readAvailable()) {
+        if (rightOffset == right.readAvailable()) {
             rightOffset = 0;
             ++rightIt;
         }
@@ -929,13 +1667,13 @@ int
 Buffer::opCmp(const char *string, size_t length) const
 {
     size_t offset = 0;
-    std::list<Segment>::const_iterator it;
     int lengthResult = (int)((ptrdiff_t)readAvailable() - (ptrdiff_t)length);
     if (lengthResult > 0)
         length = readAvailable();
-    for (it = m_segments.begin(); it != m_segments.end(); ++it) {
-        size_t tocompare = (std::min)(it->readAvailable(), length);
-        int result = memcmp(it->readBuffer().start(), string + offset, tocompare);
+    for (size_t i = 0; i < m_segments.size(); ++i) {
+        const Segment &segment = m_segments[i];
+        size_t tocompare = (std::min)(segment.readAvailable(), length);
+        int result = memcmp(segment.readBuffer().start(), string + offset, tocompare);
         if (result != 0)
             return result;
         length -= tocompare;
@@ -953,9 +1691,8 @@ Buffer::invariant() const
     size_t read = 0;
     size_t write = 0;
     bool seenWrite = false;
-    std::list<Segment>::const_iterator it;
-    for (it = m_segments.begin(); it != m_segments.end(); ++it) {
-        const Segment &segment = *it;
+    for (size_t it = 0; it < m_segments.size(); ++it) {
+        const Segment &segment = m_segments[it];
         // Strict ordering
         MORDOR_ASSERT(!seenWrite || (seenWrite && segment.readAvailable() == 0));
         read += segment.readAvailable();
@@ -965,26 +1702,24 @@ Buffer::invariant() const
             MORDOR_ASSERT(m_writeIt == it);
         }
         // We should keep segments optimally merged together
-        std::list<Segment>::const_iterator nextIt = it;
-        ++nextIt;
-        if (nextIt != m_segments.end()) {
-            const Segment& next = *nextIt;
+        if (it + 1 < m_segments.size()) {
+            const Segment& next = m_segments[it + 1];
             if (segment.writeAvailable() == 0 &&
                 next.readAvailable() != 0) {
                 MORDOR_ASSERT((const unsigned char*)segment.readBuffer().start() +
                     segment.readAvailable() != next.readBuffer().start() ||
-                    segment.m_data.m_array.get() != next.m_data.m_array.get());
+                    segment.m_data.m_block != next.m_data.m_block);
             } else if (segment.writeAvailable() != 0 &&
                 next.readAvailable() == 0) {
                 MORDOR_ASSERT((const unsigned char*)segment.writeBuffer().start() +
                     segment.writeAvailable() != next.writeBuffer().start() ||
-                    segment.m_data.m_array.get() != next.m_data.m_array.get());
+                    segment.m_data.m_block != next.m_data.m_block);
             }
         }
     }
     MORDOR_ASSERT(read == m_readAvailable);
     MORDOR_ASSERT(write == m_writeAvailable);
-    MORDOR_ASSERT(write != 0 || (write == 0 && m_writeIt == m_segments.end()));
+    MORDOR_ASSERT(write != 0 || (write == 0 && m_writeIt == m_segments.size()));
 #endif
 }
 
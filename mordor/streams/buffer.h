@@ -1,7 +1,7 @@
 #ifndef __MORDOR_BUFFER_H__
 #define __MORDOR_BUFFER_H__
 
-#include <list>
+#include <type_traits>
 #include <vector>
 
 #include <stddef.h>
@@ -10,6 +10,10 @@
 
 namespace Mordor {
 
+namespace Detail {
+struct BufferBlock;
+}
+
 struct Buffer
 {
 private:
@@ -18,8 +22,19 @@ private:
         friend struct Buffer;
     public:
         SegmentData();
+        /// Allocates from the calling thread's pool when length falls in one
+        /// of its size classes
         SegmentData(size_t length);
         SegmentData(void *buffer, size_t length);
+        /// Refers to memory that stays valid as long as owner does
+        SegmentData(const void *buffer, size_t length,
+            std::shared_ptr<const void> owner);
+        SegmentData(const SegmentData &copy);
+        SegmentData(SegmentData &&move);
+        ~SegmentData();
+
+        SegmentData &operator =(const SegmentData &copy);
+        SegmentData &operator =(SegmentData &&move);
 
         SegmentData slice(size_t start, size_t length = ~0);
         const SegmentData slice(size_t start, size_t length = ~0) const;
@@ -36,7 +51,8 @@ private:
         void *m_start;
         size_t m_length;
     private:
-        std::shared_ptr<unsigned char> m_array;
+        // Intrusively refcounted; shared by every slice of the same memory
+        Detail::BufferBlock *m_block;
     };
 
     struct Segment
@@ -65,6 +81,59 @@ private:
         void invariant() const;
     };
 
+    /// Double ended sequence of Segments
+
+    /// Segments are kept in a ring, so adding and removing at either end does
+    /// not move the others.  The first few live inside the Buffer itself, and
+    /// beyond that they spill over into one contiguous heap array (never a
+    /// node per Segment).  Elements are addressed by their index from the
+    /// front, which is what Buffer keeps m_writeIt as.
+    class SegmentList
+    {
+    public:
+        SegmentList();
+        ~SegmentList();
+
+        size_t size() const { return m_size; }
+        bool empty() const { return m_size == 0; }
+
+        Segment &operator[](size_t index)
+        { return slots()[(m_head + index) & (m_capacity - 1)]; }
+        const Segment &operator[](size_t index) const
+        { return slots()[(m_head + index) & (m_capacity - 1)]; }
+        Segment &front() { return (*this)[0]; }
+        const Segment &front() const { return (*this)[0]; }
+        Segment &back() { return (*this)[m_size - 1]; }
+
+        void push_front(Segment segment);
+        void push_back(Segment segment);
+        void pop_front();
+        void pop_back();
+        /// Insert before index; elements at and after index move back one
+        void insert(size_t index, Segment segment);
+        /// Remove [first, last); elements after last move forward
+        void erase(size_t first, size_t last);
+        void clear();
+
+    private:
+        SegmentList(const SegmentList &);
+        SegmentList &operator =(const SegmentList &);
+
+        Segment *slots() { return m_heap ? m_heap : (Segment *)m_inline; }
+        const Segment *slots() const
+        { return m_heap ? m_heap : (const Segment *)m_inline; }
+        void grow();
+
+    private:
+        // Must be a power of two
+        static const size_t INLINE_SEGMENTS = 4;
+        std::aligned_storage<sizeof(Segment),
+            std::alignment_of<Segment>::value>::type
+            m_inline[INLINE_SEGMENTS];
+        Segment *m_heap;
+        size_t m_head, m_size, m_capacity;
+    };
+
 public:
     Buffer();
     Buffer(const Buffer &copy);
@@ -80,6 +149,15 @@ public:
     size_t segments() const;
 
     void adopt(void *buffer, size_t length);
+    /// Append length bytes of read-only memory (such as part of a file
+    /// mapping) as readable data, without copying it
+
+    /// mapping is kept alive until no Buffer refers to any of the memory.
+    /// Adjacent ranges of the same mapping are merged into one segment.
+    /// @warning The iovecs from readBuffers() point at this memory, and
+    /// must not be written through
+    void adoptMapping(const void *buffer, size_t length,
+        std::shared_ptr<const void> mapping);
     void reserve(size_t length);
     void compact();
     void clear(bool clearWriteAvailableAsWell = true);
@@ -92,6 +170,19 @@ public:
     std::vector<iovec> writeBuffers(size_t length = ~0);
     iovec writeBuffer(size_t length, bool reallocate);
 
+    /// A reasonable size for an iovec array on the stack, to pass to the
+    /// non-allocating readBuffers() and writeBuffers()
+    static const size_t STACK_IOVECS = 64;
+    /// Describe (up to) the first length readable bytes in iovs, without
+    /// allocating
+    /// @return The number of iovecs filled in; if the data is in more than
+    /// count pieces, only the first count are described
+    size_t readBuffers(iovec *iovs, size_t count, size_t length = ~0) const;
+    /// Reserve length bytes, and describe them in iovs
+    /// @return The number of iovecs filled in; if the space is in more than
+    /// count pieces, only the first count are described
+    size_t writeBuffers(iovec *iovs, size_t count, size_t length = ~0);
+
     void copyIn(const Buffer& buf, size_t length = ~0, size_t pos = 0);
     void copyIn(const char* string);
     void copyIn(const std::string &string);
@@ -111,6 +202,72 @@ public:
         bool eofIsDelimiter = true, bool includeDelimiter = true);
     void visit(std::function<void (const void *, size_t)> dg, size_t length = ~0) const;
 
+    class RecordIterator;
+
+    /// A non-owning view of one delimited record in a Buffer
+
+    /// The record may span Segments; nothing is copied until toString() or
+    /// copyOut() is called.  A Record is only valid until the Buffer it
+    /// came from is next modified (including consume()).
+    class Record
+    {
+        friend class RecordIterator;
+    public:
+        Record();
+
+        /// Excludes the delimiter
+        size_t length() const { return m_length; }
+        bool empty() const { return m_length == 0; }
+        /// The record's bytes, if they are all in one Segment; NULL otherwise
+        const char *contiguous() const;
+        /// Describe the record in iovs, without allocating
+        /// @return The number of iovecs filled in; if the record is in more
+        /// than count pieces, only the first count are described
+        size_t readBuffers(iovec *iovs, size_t count) const;
+        void copyOut(void *buffer, size_t length = ~0) const;
+        std::string toString() const;
+
+        bool operator== (const char *str) const;
+        bool operator!= (const char *str) const { return !(*this == str); }
+
+    private:
+        const Buffer *m_buffer;
+        size_t m_segment, m_offset, m_length;
+    };
+
+    /// Walks the complete records in a Buffer without consuming them
+
+    /// Each call to next() resumes scanning where the previous record ended,
+    /// so iterating over n records of a Buffer is linear in its size.  Once
+    /// done, pass consumed() to Buffer::consume() to discard every record
+    /// returned, in one go.  Data after the last delimiter (a partial record)
+    /// is never returned.  The Buffer may be appended to (but not consumed
+    /// from) while iterating; next() then only scans what was added for the
+    /// end of the partial record.
+    class RecordIterator
+    {
+    public:
+        RecordIterator(const Buffer &buffer, char delimiter = '\n');
+
+        /// @return false if there are no more complete records
+        bool next(Record &record);
+        /// The data after the last complete record, for when the end of the
+        /// data stands in for a final delimiter
+        /// @return false if there is none
+        bool remainder(Record &record);
+        /// Bytes taken up by the records returned so far, including their
+        /// delimiters
+        size_t consumed() const { return m_consumed; }
+
+    private:
+        const Buffer &m_buffer;
+        char m_delimiter;
+        size_t m_segment, m_offset, m_consumed;
+        // How far the partial record has already been searched for a
+        // delimiter
+        size_t m_scanSegment, m_scanOffset, m_scanned;
+    };
+
     bool operator== (const Buffer &rhs) const;
     bool operator!= (const Buffer &rhs) const;
     bool operator== (const std::string &str) const;
@@ -119,11 +276,15 @@ public:
     bool operator!= (const char *str) const;
 
 private:
-    std::list<Segment> m_segments;
+    SegmentList m_segments;
     size_t m_readAvailable;
     size_t m_writeAvailable;
-    std::list<Segment>::iterator m_writeIt;
+    // Index of the first Segment with writeAvailable(); m_segments.size() if
+    // there is none
+    size_t m_writeIt;
 
+    bool matchesAt(size_t segment, size_t pos, const unsigned char *needle,
+        size_t size, size_t length) const;
     int opCmp(const Buffer &rhs) const;
     int opCmp(const char *string, size_t length) const;
 
@@ -18,10 +18,38 @@ BufferedStream::BufferedStream(Stream::ptr parent, bool own)
 : FilterStream(parent, own)
 {
     m_bufferSize = g_defaultBufferSize->val();
+    m_minBufferSize = m_maxBufferSize = 0;
     m_allowPartialReads = false;
     m_flushMultiplesOfBuffer = false;
 }
 
+void
+BufferedStream::adaptiveBufferSize(size_t minimum, size_t maximum)
+{
+    MORDOR_ASSERT(minimum > 0);
+    MORDOR_ASSERT(minimum <= maximum);
+    m_minBufferSize = minimum;
+    m_maxBufferSize = maximum;
+    m_bufferSize = (std::max)(minimum, (std::min)(maximum, m_bufferSize));
+}
+
+void
+BufferedStream::adapt(size_t requested, size_t result)
+{
+    if (m_maxBufferSize == 0 || result == 0)
+        return;
+    size_t bufferSize = m_bufferSize;
+    if (result >= requested)
+        bufferSize = (std::min)(m_maxBufferSize, m_bufferSize * 2);
+    else if (result < requested / 4)
+        bufferSize = (std::max)(m_minBufferSize, m_bufferSize / 2);
+    if (bufferSize != m_bufferSize) {
+        MORDOR_LOG_DEBUG(g_log) << this << " bufferSize(" << bufferSize
+            << ")";
+        m_bufferSize = bufferSize;
+    }
+}
+
 void
 BufferedStream::close(CloseType type)
 {
@@ -79,19 +107,28 @@ BufferedStream::readInternal(T &buffer, size_t length)
     MORDOR_LOG_VERBOSE(g_log) << this << " read(" << length << "): "
         << buffered << " read from buffer";
 
-    if (remaining == 0)
+    if (remaining == 0) {
+        if (m_maxBufferSize && m_readBuffer.readAvailable() == 0)
+            m_readBuffer.clear();
         return length;
+    }
 
     if (buffered == 0 || !m_allowPartialReads) {
         size_t result;
         do {
-            // Read enough to satisfy this request, plus up to a multiple of
-            // the buffer size
-            size_t todo = ((remaining - 1) / m_bufferSize + 1) * m_bufferSize;
+            // Our buffer is empty by now, so in adaptive mode whole
+            // buffer-fuls are read straight into the caller's buffer instead
+            // of going through it
+            bool direct = m_maxBufferSize && remaining >= m_bufferSize;
+            // Otherwise read enough to satisfy this request, plus up to a
+            // multiple of the buffer size
+            size_t todo = direct ? remaining / m_bufferSize * m_bufferSize :
+                ((remaining - 1) / m_bufferSize + 1) * m_bufferSize;
             try {
                 MORDOR_LOG_TRACE(g_log) << this << " parent()->read(" << todo
                     << ")";
-                result = parent()->read(m_readBuffer, todo);
+                result = direct ? parent()->read(buffer, todo) :
+                    parent()->read(m_readBuffer, todo);
                 MORDOR_LOG_DEBUG(g_log) << this << " parent()->read(" << todo
                     << "): " << result;
             } catch (...) {
@@ -105,6 +142,12 @@ BufferedStream::readInternal(T &buffer, size_t length)
                 }
             }
 
+            adapt(todo, result);
+            if (direct) {
+                advance(buffer, result);
+                remaining -= result;
+                continue;
+            }
             buffered = (std::min)(m_readBuffer.readAvailable(), remaining);
             m_readBuffer.copyOut(buffer, buffered);
             m_readBuffer.consume(buffered);
@@ -113,6 +156,8 @@ BufferedStream::readInternal(T &buffer, size_t length)
         } while (remaining > 0 && !m_allowPartialReads && result != 0);
     }
 
+    if (m_maxBufferSize && m_readBuffer.readAvailable() == 0)
+        m_readBuffer.clear();
     return length - remaining;
 }
 
@@ -179,6 +224,8 @@ BufferedStream::flushWrite(size_t length)
             }
         }
     }
+    if (m_maxBufferSize && m_writeBuffer.readAvailable() == 0)
+        m_writeBuffer.clear();
     return length;
 }
 
@@ -272,6 +319,8 @@ BufferedStream::flush(bool flushParent)
         MORDOR_ASSERT(result > 0);
         m_writeBuffer.consume(result);
     }
+    if (m_maxBufferSize)
+        m_writeBuffer.clear();
     if (flushParent)
         parent()->flush();
 }
@@ -304,6 +353,7 @@ BufferedStream::find(char delim, size_t sanitySize, bool throwIfNotFound)
         size_t result = parent()->read(m_readBuffer, m_bufferSize);
         MORDOR_LOG_DEBUG(g_log) << this << " parent()->read(" << m_bufferSize
             << "): " << result;
+        adapt(m_bufferSize, result);
         if (result == 0) {
             // EOF
             if (throwIfNotFound)
@@ -341,6 +391,7 @@ BufferedStream::find(const std::string &str, size_t sanitySize, bool throwIfNotF
         size_t result = parent()->read(m_readBuffer, m_bufferSize);
         MORDOR_LOG_DEBUG(g_log) << this << " parent()->read(" << m_bufferSize
             << "): " << result;
+        adapt(m_bufferSize, result);
         if (result == 0) {
             // EOF
             if (throwIfNotFound)
@@ -350,6 +401,60 @@ BufferedStream::find(const std::string &str, size_t sanitySize, bool throwIfNotF
     }
 }
 
+size_t
+BufferedStream::readRecords(
+    const std::function<void (const Buffer::Record &)> &dg, char delim,
+    size_t sanitySize, bool eofIsDelimiter)
+{
+    if (supportsSeek())
+        flush(false);
+    if (sanitySize == (size_t)~0)
+        sanitySize = 2 * m_bufferSize;
+    // Kept across reads from the parent, so that a long record isn't
+    // rescanned from its start each time more of it arrives
+    Buffer::RecordIterator it(m_readBuffer, delim);
+    Buffer::Record record;
+    size_t records = 0, done = 0;
+    while (true) {
+        try {
+            while (it.next(record)) {
+                dg(record);
+                done = it.consumed();
+                ++records;
+            }
+            if (records == 0) {
+                size_t readAvailable = m_readBuffer.readAvailable();
+                if (readAvailable > sanitySize)
+                    MORDOR_THROW_EXCEPTION(BufferOverflowException());
+
+                MORDOR_LOG_TRACE(g_log) << this << " parent()->read("
+                    << m_bufferSize << ")";
+                size_t result = parent()->read(m_readBuffer, m_bufferSize);
+                MORDOR_LOG_DEBUG(g_log) << this << " parent()->read("
+                    << m_bufferSize << "): " << result;
+                adapt(m_bufferSize, result);
+                if (result != 0)
+                    continue;
+                // EOF
+                if (readAvailable == 0)
+                    return 0;
+                if (!eofIsDelimiter)
+                    MORDOR_THROW_EXCEPTION(UnexpectedEofException());
+                MORDOR_VERIFY(it.remainder(record));
+                dg(record);
+                done = it.consumed();
+                ++records;
+            }
+        } catch (...) {
+            m_readBuffer.consume(done);
+            throw;
+        }
+        MORDOR_LOG_TRACE(g_log) << this << " readRecords(): " << records;
+        m_readBuffer.consume(done);
+        return records;
+    }
+}
+
 void
 BufferedStream::unread(const Buffer &b, size_t len)
 {
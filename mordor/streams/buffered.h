@@ -26,7 +26,20 @@ public:
     BufferedStream(Stream::ptr parent, bool own = true);
 
     size_t bufferSize() { return m_bufferSize; }
-    void bufferSize(size_t bufferSize) { m_bufferSize = bufferSize; }
+    /// Also turns off adaptiveBufferSize()
+    void bufferSize(size_t bufferSize)
+    { m_bufferSize = bufferSize; m_minBufferSize = m_maxBufferSize = 0; }
+
+    /// Let bufferSize() adapt to how the stream is used
+
+    /// The buffer size doubles (up to maximum) each time a read from the
+    /// parent comes back full, and halves (down to minimum) each time one
+    /// comes back less than a quarter full.  Buffers are also released as
+    /// soon as they are emptied, instead of keeping their memory for the
+    /// next read or write, so idle streams hold on to nothing, and reads of
+    /// at least a buffer-ful go straight into the caller's buffer.
+    void adaptiveBufferSize(size_t minimum, size_t maximum);
+    bool adaptiveBufferSize() { return m_maxBufferSize != 0; }
 
     bool allowPartialReads() { return m_allowPartialReads; }
     void allowPartialReads(bool allowPartialReads) { m_allowPartialReads = allowPartialReads; }
@@ -50,12 +63,28 @@ public:
     ptrdiff_t find(const std::string &str, size_t sanitySize = ~0, bool throwIfNotFound = true);
     void unread(const Buffer &b, size_t len = ~0);
 
+    /// Pass each complete record already buffered to dg, reading from the
+    /// parent first if there are none yet, then consume them all at once
+
+    /// Unlike getDelimited(), nothing is copied; the Records refer directly
+    /// to the read buffer, and are only valid until dg returns.  If dg
+    /// throws, the records before the one it threw on are still consumed.
+    /// @param sanitySize As for find(), the most that will be buffered
+    /// looking for a delimiter
+    /// @param eofIsDelimiter Pass any data after the last delimiter to dg as
+    /// a final record at EOF, instead of throwing UnexpectedEofException
+    /// @return The number of records passed to dg; 0 only at EOF
+    size_t readRecords(const std::function<void (const Buffer::Record &)> &dg,
+        char delim = '\n', size_t sanitySize = ~0,
+        bool eofIsDelimiter = false);
+
 private:
     template <class T> size_t readInternal(T &buffer, size_t length);
     size_t flushWrite(size_t length);
+    void adapt(size_t requested, size_t result);
 
 private:
-    size_t m_bufferSize;
+    size_t m_bufferSize, m_minBufferSize, m_maxBufferSize;
     bool m_allowPartialReads, m_flushMultiplesOfBuffer;
     Buffer m_readBuffer, m_writeBuffer;
 };
@@ -0,0 +1,332 @@
+// Copyright (c) 2011 - Mozy, Inc.
+
+#include "chunked_crypto.h"
+
+#include <string.h>
+
+#include <openssl/err.h>
+
+#include "random.h"
+#include "ssl_check.h"
+#include "mordor/assert.h"
+#include "mordor/endian.h"
+#include "mordor/log.h"
+
+namespace Mordor {
+
+static Logger::ptr g_log = Log::lookup("mordor:streams:chunked_crypto");
+
+// Beyond this, a header is more likely garbage than a real chunk size
+static const size_t MAX_CHUNK_SIZE = 64 * 1024 * 1024;
+static const size_t NONCE_SIZE = 12;
+
+ChunkedCryptoStream::ChunkedCryptoStream(Stream::ptr parent,
+    Scheduler &scheduler, const EVP_CIPHER *cipher, const std::string &key,
+    size_t chunkSize, size_t maxInFlight, CryptoStream::Direction direction,
+    bool own)
+: MutatingFilterStream(parent, own),
+  m_cipher(cipher),
+  m_key(key),
+  m_chunkSize(chunkSize),
+  m_direction(direction),
+  m_headerDone(false),
+  m_index(0),
+  m_origin(0),
+  m_position(0),
+  m_skip(0),
+  m_finished(false),
+  m_chunks(scheduler, maxInFlight)
+{
+    if (m_direction == CryptoStream::INFER) {
+        MORDOR_ASSERT(parent->supportsRead() ^ parent->supportsWrite());
+        m_direction = parent->supportsWrite() ? CryptoStream::WRITE :
+            CryptoStream::READ;
+    }
+    if (!(EVP_CIPHER_flags(cipher) & EVP_CIPH_FLAG_AEAD_CIPHER) ||
+        EVP_CIPHER_iv_length(cipher) != (int)NONCE_SIZE)
+        MORDOR_THROW_EXCEPTION(OpenSSLException(
+            "cipher must be an AEAD with a 12 byte nonce"));
+    if (static_cast<size_t>(EVP_CIPHER_key_length(cipher)) != key.size())
+        MORDOR_THROW_EXCEPTION(OpenSSLException("incorrect key length"));
+
+    if (m_direction == CryptoStream::WRITE) {
+        MORDOR_ASSERT(m_chunkSize > 0 && m_chunkSize <= MAX_CHUNK_SIZE);
+        uint32_t size = byteswapOnLittleEndian((uint32_t)m_chunkSize);
+        m_header.assign((const char *)&size, sizeof(uint32_t));
+        Buffer nonce;
+        RandomStream random;
+        random.read(nonce, NONCE_SIZE);
+        MORDOR_ASSERT(nonce.readAvailable() == NONCE_SIZE);
+        m_header.append(nonce.toString());
+    }
+}
+
+void
+ChunkedCryptoStream::close(CloseType type)
+{
+    try {
+        if (m_direction == CryptoStream::WRITE && (type & WRITE) &&
+            !m_finished) {
+            writeOut(m_chunks.maxInFlight() - 1);
+            // Always shorter than chunkSize(), since full chunks are
+            // dispatched as soon as they fill up
+            Chunk::ptr chunk(new Chunk());
+            chunk->final = true;
+            chunk->input.copyIn(m_buffer);
+            m_buffer.clear();
+            dispatch(chunk);
+            m_finished = true;
+            writeOut(0);
+        }
+    } catch (...) {
+        if (ownsParent())
+            parent()->close(type);
+        throw;
+    }
+    if (ownsParent())
+        parent()->close(type);
+}
+
+size_t
+ChunkedCryptoStream::read(Buffer &buffer, size_t length)
+{
+    MORDOR_ASSERT(m_direction == CryptoStream::READ);
+    while (m_buffer.readAvailable() == 0) {
+        readAhead();
+        Chunk::ptr chunk = m_chunks.pop();
+        if (!chunk)
+            return 0;
+        m_buffer.copyIn(chunk->output);
+        if (m_skip > 0) {
+            // Only short if seek() went beyond the end
+            if (m_skip > m_buffer.readAvailable())
+                MORDOR_THROW_EXCEPTION(UnexpectedEofException());
+            m_buffer.consume(m_skip);
+            m_skip = 0;
+        }
+    }
+    size_t result = (std::min)(length, m_buffer.readAvailable());
+    buffer.copyIn(m_buffer, result);
+    m_buffer.consume(result);
+    m_position += result;
+    return result;
+}
+
+size_t
+ChunkedCryptoStream::write(const Buffer &buffer, size_t length)
+{
+    MORDOR_ASSERT(m_direction == CryptoStream::WRITE);
+    MORDOR_ASSERT(!m_finished);
+    size_t result = (std::min)(length, m_chunkSize - m_buffer.readAvailable());
+    m_buffer.copyIn(buffer, result);
+    if (m_buffer.readAvailable() == m_chunkSize) {
+        writeOut(m_chunks.maxInFlight() - 1);
+        Chunk::ptr chunk(new Chunk());
+        chunk->input.copyIn(m_buffer);
+        m_buffer.clear();
+        dispatch(chunk);
+    }
+    return result;
+}
+
+void
+ChunkedCryptoStream::flush(bool flushParent)
+{
+    if (m_direction != CryptoStream::WRITE)
+        return;
+    writeOut(0);
+    if (flushParent)
+        parent()->flush();
+}
+
+long long
+ChunkedCryptoStream::seek(long long offset, Anchor anchor)
+{
+    MORDOR_ASSERT(supportsSeek());
+    switch (anchor) {
+        case CURRENT:
+            offset += m_position;
+            break;
+        case END:
+            offset += size();
+            break;
+        default:
+            break;
+    }
+    if (offset < 0)
+        MORDOR_THROW_EXCEPTION(std::invalid_argument(
+            "resulting offset is negative"));
+    if (offset == m_position)
+        return offset;
+
+    if (!m_headerDone)
+        readHeader();
+    m_chunks.clear();
+    m_buffer.clear();
+    m_index = (unsigned long long)offset / m_chunkSize;
+    m_skip = (size_t)((unsigned long long)offset % m_chunkSize);
+    m_finished = false;
+    parent()->seek(m_origin + HEADER_SIZE +
+        m_index * (m_chunkSize + TAG_SIZE));
+    m_position = offset;
+    MORDOR_LOG_DEBUG(g_log) << this << " seek(" << offset << "): chunk "
+        << m_index << " + " << m_skip;
+    return offset;
+}
+
+long long
+ChunkedCryptoStream::size()
+{
+    MORDOR_ASSERT(supportsSize());
+    if (!m_headerDone)
+        readHeader();
+    long long ciphertext = parent()->size() - m_origin - HEADER_SIZE;
+    long long record = m_chunkSize + TAG_SIZE;
+    long long last = ciphertext % record;
+    // The last chunk is always there, if only as its tag
+    if (ciphertext < 0 || last < (long long)TAG_SIZE)
+        MORDOR_THROW_EXCEPTION(UnexpectedEofException());
+    return ciphertext / record * m_chunkSize + last - TAG_SIZE;
+}
+
+void
+ChunkedCryptoStream::dispatch(Chunk::ptr chunk)
+{
+    chunk->index = m_index++;
+    MORDOR_LOG_TRACE(g_log) << this << " dispatching chunk " << chunk->index
+        << " (" << chunk->input.readAvailable() << " bytes"
+        << (chunk->final ? ", final)" : ")");
+    m_chunks.push(chunk, std::bind(&ChunkedCryptoStream::seal, this,
+        std::placeholders::_1));
+}
+
+// Encrypts or decrypts (and authenticates) chunk.input into chunk.output,
+// on the scheduler's threads
+void
+ChunkedCryptoStream::seal(Chunk &chunk)
+{
+    bool encrypt = m_direction == CryptoStream::WRITE;
+    size_t length = chunk.input.readAvailable();
+    if (!encrypt) {
+        if (length < TAG_SIZE)
+            MORDOR_THROW_EXCEPTION(UnexpectedEofException());
+        length -= TAG_SIZE;
+    }
+
+    unsigned char nonce[NONCE_SIZE];
+    unsigned char aad[HEADER_SIZE + sizeof(uint64_t) + 1];
+    memcpy(nonce, m_header.c_str() + sizeof(uint32_t), NONCE_SIZE);
+    memcpy(aad, m_header.c_str(), HEADER_SIZE);
+    for (size_t i = 0; i < sizeof(uint64_t); ++i) {
+        unsigned char byte = (unsigned char)(chunk.index >> (56 - 8 * i));
+        nonce[NONCE_SIZE - sizeof(uint64_t) + i] ^= byte;
+        aad[HEADER_SIZE + i] = byte;
+    }
+    aad[sizeof(aad) - 1] = chunk.final ? 1 : 0;
+
+    std::shared_ptr<EVP_CIPHER_CTX> ctx(EVP_CIPHER_CTX_new(),
+        &EVP_CIPHER_CTX_free);
+    if (!ctx)
+        throw std::bad_alloc();
+    SSL_CHECK( EVP_CipherInit_ex(ctx.get(), m_cipher, NULL,
+        (const unsigned char *)m_key.c_str(), nonce, encrypt ? 1 : 0) );
+    int outlen = 0;
+    SSL_CHECK( EVP_CipherUpdate(ctx.get(), NULL, &outlen, aad,
+        (int)sizeof(aad)) );
+
+    const unsigned char *in = NULL;
+    if (chunk.input.readAvailable() > 0)
+        in = (const unsigned char *)chunk.input.readBuffer(
+            chunk.input.readAvailable(), true).iov_base;
+    unsigned char *out = (unsigned char *)chunk.output.writeBuffer(
+        length + TAG_SIZE, true).iov_base;
+    if (length > 0) {
+        SSL_CHECK( EVP_CipherUpdate(ctx.get(), out, &outlen, in,
+            (int)length) );
+        MORDOR_ASSERT((size_t)outlen == length);
+    }
+    if (!encrypt) {
+        SSL_CHECK( EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_GCM_SET_TAG,
+            (int)TAG_SIZE, (void *)(in + length)) );
+    }
+    if (EVP_CipherFinal_ex(ctx.get(), out + length, &outlen) <= 0) {
+        if (encrypt)
+            MORDOR_THROW_EXCEPTION(OpenSSLException());
+        ERR_clear_error();
+        MORDOR_LOG_ERROR(g_log) << this << " chunk " << chunk.index
+            << " failed authentication";
+        MORDOR_THROW_EXCEPTION(CorruptedChunkedCryptoStreamException());
+    }
+    if (encrypt) {
+        SSL_CHECK( EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_GCM_GET_TAG,
+            (int)TAG_SIZE, out + length) );
+        chunk.output.produce(length + TAG_SIZE);
+    } else {
+        chunk.output.produce(length);
+    }
+    chunk.input.clear();
+}
+
+void
+ChunkedCryptoStream::writeOut(size_t keep)
+{
+    if (!m_headerDone) {
+        Buffer header(m_header);
+        while (header.readAvailable() > 0)
+            header.consume(parent()->write(header, header.readAvailable()));
+        m_headerDone = true;
+    }
+    while (Chunk::ptr chunk = m_chunks.pop(keep)) {
+        while (chunk->output.readAvailable() > 0)
+            chunk->output.consume(parent()->write(chunk->output,
+                chunk->output.readAvailable()));
+    }
+}
+
+void
+ChunkedCryptoStream::readHeader()
+{
+    MORDOR_ASSERT(!m_headerDone);
+    if (parent()->supportsTell())
+        m_origin = parent()->tell();
+    Buffer header;
+    while (header.readAvailable() < HEADER_SIZE) {
+        if (parent()->read(header, HEADER_SIZE - header.readAvailable()) == 0)
+            MORDOR_THROW_EXCEPTION(UnexpectedEofException());
+    }
+    m_header = header.toString();
+    uint32_t size;
+    memcpy(&size, m_header.c_str(), sizeof(uint32_t));
+    m_chunkSize = byteswapOnLittleEndian(size);
+    if (m_chunkSize == 0 || m_chunkSize > MAX_CHUNK_SIZE)
+        MORDOR_THROW_EXCEPTION(CorruptedChunkedCryptoStreamException());
+    m_headerDone = true;
+}
+
+void
+ChunkedCryptoStream::readAhead()
+{
+    if (!m_headerDone)
+        readHeader();
+    size_t record = m_chunkSize + TAG_SIZE;
+    while (!m_finished && m_chunks.size() < m_chunks.maxInFlight()) {
+        Chunk::ptr chunk(new Chunk());
+        while (chunk->input.readAvailable() < record) {
+            if (parent()->read(chunk->input,
+                record - chunk->input.readAvailable()) == 0)
+                break;
+        }
+        // Only the last chunk is short; a missing last chunk (or a
+        // truncated one) fails in seal()
+        if (chunk->input.readAvailable() < record) {
+            chunk->final = true;
+            m_finished = true;
+        }
+        dispatch(chunk);
+    }
+}
+
+}
+
+#include "mordor/error_info.cpp"
+template struct Mordor::ErrorInfo<Mordor::CorruptedChunkedCryptoStreamException>;
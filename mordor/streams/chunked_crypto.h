@@ -0,0 +1,130 @@
+#ifndef __MORDOR_CHUNKED_CRYPTO_STREAM_H__
+#define __MORDOR_CHUNKED_CRYPTO_STREAM_H__
+// Copyright (c) 2011 - Mozy, Inc.
+
+#include <openssl/evp.h>
+
+#include "buffer.h"
+#include "crypto.h"
+#include "filter.h"
+#include "mordor/parallel.h"
+
+namespace Mordor {
+
+class Scheduler;
+
+/// A chunk failed authentication (wrong key, or the ciphertext was modified,
+/// reordered or spliced from another stream), or the header is invalid
+struct CorruptedChunkedCryptoStreamException : virtual StreamException {};
+
+/// Authenticated encryption, a fixed-size chunk at a time
+
+/// The ciphertext is a 16 byte header (the chunk size, 4 bytes big-endian,
+/// and a random 12 byte nonce base), then each chunk of plaintext sealed
+/// on its own with an AEAD cipher (EVP_aes_256_gcm(),
+/// EVP_chacha20_poly1305(), ...), followed by its 16 byte tag.  Chunk n's
+/// nonce is the nonce base with n XORed into its last 8 bytes, and its
+/// additional data is the header, n, and whether it is the last chunk.
+/// Every chunk but the last is exactly chunkSize() bytes of plaintext; the
+/// last is shorter (possibly empty), so dropping whole chunks off the end
+/// is detected, as is reordering them.
+///
+/// Since chunks are independent, they are encrypted (or decrypted) on
+/// scheduler's threads concurrently, at most maxInFlight() at a time, and
+/// reading can seek to any chunk.
+///
+/// Like CryptoStream, an instance either encrypts what is written to it, or
+/// decrypts what is read from it.  Nothing read is returned before its
+/// chunk has been authenticated.  The stream is only complete once close()
+/// has been called; flush() can't write out a partial chunk.
+class ChunkedCryptoStream : public MutatingFilterStream
+{
+public:
+    typedef std::shared_ptr<ChunkedCryptoStream> ptr;
+
+    static const size_t HEADER_SIZE = 16;
+    static const size_t TAG_SIZE = 16;
+
+public:
+    /// @param key Binary, and the correct length for cipher
+    /// @param chunkSize Only used when encrypting; when decrypting, it comes
+    /// from the header
+    /// @param maxInFlight As for OrderedWorkQueue
+    ChunkedCryptoStream(Stream::ptr parent, Scheduler &scheduler,
+        const EVP_CIPHER *cipher, const std::string &key,
+        size_t chunkSize = 65536, size_t maxInFlight = 0,
+        CryptoStream::Direction direction = CryptoStream::INFER,
+        bool own = true);
+
+    bool supportsRead() { return m_direction == CryptoStream::READ; }
+    bool supportsWrite() { return m_direction == CryptoStream::WRITE; }
+    bool supportsSeek()
+    { return supportsRead() && parent()->supportsSeek(); }
+    bool supportsSize()
+    { return supportsRead() && parent()->supportsSize(); }
+
+    size_t chunkSize() const { return m_chunkSize; }
+    size_t maxInFlight() const { return m_chunks.maxInFlight(); }
+
+    void close(CloseType type = BOTH);
+    using MutatingFilterStream::read;
+    size_t read(Buffer &buffer, size_t length);
+    using MutatingFilterStream::write;
+    size_t write(const Buffer &buffer, size_t length);
+    /// Waits for all complete chunks to be written; the partial one stays
+    /// until more is written, or close()
+    void flush(bool flushParent = true);
+    /// Seeking to the end, or anywhere else within the plaintext, is fine;
+    /// reading after seeking beyond the end fails with UnexpectedEofException
+    long long seek(long long offset, Anchor anchor = BEGIN);
+    /// Plaintext size, from the parent's size
+    long long size();
+
+private:
+    struct Chunk
+    {
+        typedef std::shared_ptr<Chunk> ptr;
+
+        Chunk() : index(0), final(false) {}
+
+        unsigned long long index;
+        bool final;
+        Buffer input, output;
+    };
+
+private:
+    void dispatch(Chunk::ptr chunk);
+    void seal(Chunk &chunk);
+    void writeOut(size_t keep);
+    void readHeader();
+    void readAhead();
+
+private:
+    const EVP_CIPHER *m_cipher;
+    std::string m_key;
+    size_t m_chunkSize;
+    CryptoStream::Direction m_direction;
+    std::string m_header;
+    bool m_headerDone;
+    // Index of the next chunk to be dispatched
+    unsigned long long m_index;
+    // Where the header starts in the parent (reading only)
+    long long m_origin;
+    // Plaintext position (reading only)
+    long long m_position;
+    // Plaintext still to be dropped from the front of the next chunk read,
+    // after seeking into its middle
+    size_t m_skip;
+    // Reading: the last chunk has been dispatched; writing: close()d
+    bool m_finished;
+    Buffer m_buffer;
+    // Last, so that chunks still being sealed are waited for before anything
+    // they use goes away
+    OrderedWorkQueue<Chunk> m_chunks;
+};
+
+}
+
+extern template struct Mordor::ErrorInfo<Mordor::CorruptedChunkedCryptoStreamException>;
+
+#endif
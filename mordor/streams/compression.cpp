@@ -0,0 +1,174 @@
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include "compression.h"
+
+#include "mordor/assert.h"
+#include "mordor/exception.h"
+#include "mordor/log.h"
+
+namespace Mordor {
+
+static Logger::ptr g_log = Log::lookup("mordor:streams:compression");
+
+CompressionStream::CompressionStream(Stream::ptr parent, bool invert,
+    bool own)
+: MutatingFilterStream(parent, own),
+  m_invert(invert),
+  m_concatenated(false),
+  m_parentEof(false),
+  m_readEnd(false),
+  m_readBoundary(false),
+  m_writeEnd(false),
+  m_bufferSize(65536)
+{}
+
+void
+CompressionStream::close(CloseType type)
+{
+    try {
+        if ((type & WRITE) && parent()->supportsWrite()) {
+            if (!m_writeEnd)
+                pump(NULL, 0, FINISH);
+            flushBuffer();
+        }
+    } catch (...) {
+        if (ownsParent())
+            parent()->close(type);
+        throw;
+    }
+    if (ownsParent())
+        parent()->close(type);
+}
+
+size_t
+CompressionStream::read(Buffer &buffer, size_t length)
+{
+    if (m_readEnd || length == 0)
+        return 0;
+    iovec out = buffer.writeBuffer((std::min)(length, m_bufferSize), false);
+    while (true) {
+        // Between two concatenated streams, only more input decides if
+        // there's another one
+        if (m_readBoundary && m_readBuffer.readAvailable() == 0) {
+            if (m_parentEof) {
+                m_readEnd = true;
+                return 0;
+            }
+            readParent();
+            continue;
+        }
+        m_readBoundary = false;
+        // Give the codec a chance to produce output it is already holding
+        // before waiting on the parent for more input
+        iovec in = m_readBuffer.readBuffer(~0, false);
+        size_t inLength = in.iov_len, outLength = out.iov_len;
+        bool end = process(READ, in.iov_base, inLength, out.iov_base,
+            outLength, m_parentEof ? FINISH : RUN);
+        m_readBuffer.consume(inLength);
+        if (end) {
+            MORDOR_LOG_DEBUG(g_log) << this << " end of stream";
+            if (m_concatenated && !compressing(READ)) {
+                restart(READ);
+                m_readBoundary = true;
+            } else {
+                m_readEnd = true;
+                m_readBuffer.clear();
+            }
+        }
+        if (outLength > 0 || m_readEnd) {
+            buffer.produce(outLength);
+            return outLength;
+        }
+        if (inLength > 0 || m_readBoundary)
+            continue;
+        // No progress, and nothing more is coming
+        if (m_parentEof)
+            MORDOR_THROW_EXCEPTION(UnexpectedEofException());
+        MORDOR_ASSERT(m_readBuffer.readAvailable() == 0);
+        readParent();
+    }
+}
+
+size_t
+CompressionStream::write(const Buffer &buffer, size_t length)
+{
+    if (m_writeEnd)
+        MORDOR_THROW_EXCEPTION(WriteBeyondEofException());
+    iovec iovs[Buffer::STACK_IOVECS];
+    size_t count = buffer.readBuffers(iovs, Buffer::STACK_IOVECS, length);
+    size_t result = 0;
+    for (size_t i = 0; i < count && !m_writeEnd; ++i) {
+        size_t consumed = pump(iovs[i].iov_base, iovs[i].iov_len, RUN);
+        result += consumed;
+        if (consumed < iovs[i].iov_len)
+            break;
+    }
+    return result;
+}
+
+void
+CompressionStream::flush(bool flushParent)
+{
+    if (!m_writeEnd && compressing(WRITE))
+        pump(NULL, 0, FLUSH);
+    flushBuffer();
+    if (flushParent)
+        parent()->flush();
+}
+
+size_t
+CompressionStream::pump(const void *in, size_t length, Action action)
+{
+    size_t result = 0;
+    while (true) {
+        iovec out = m_writeBuffer.writeBuffer(m_bufferSize, false);
+        size_t inLength = length, outLength = out.iov_len;
+        bool end = process(WRITE, in, inLength, out.iov_base, outLength,
+            action);
+        m_writeBuffer.produce(outLength);
+        in = (const char *)in + inLength;
+        length -= inLength;
+        result += inLength;
+        if (m_writeBuffer.readAvailable() >= m_bufferSize)
+            flushBuffer();
+        if (end) {
+            MORDOR_LOG_DEBUG(g_log) << this << " end of stream";
+            m_writeEnd = true;
+            return result;
+        }
+        // The codec only stops short of filling the output once it has done
+        // all it can with the input
+        if (length == 0 && outLength < out.iov_len && action != FINISH)
+            return result;
+        if (inLength == 0 && outLength == 0) {
+            // Decompressing, and the compressed stream was cut short
+            if (action == FINISH)
+                MORDOR_THROW_EXCEPTION(UnexpectedEofException());
+            return result;
+        }
+    }
+}
+
+void
+CompressionStream::readParent()
+{
+    size_t result = parent()->read(m_readBuffer, m_bufferSize);
+    MORDOR_LOG_TRACE(g_log) << this << " parent()->read(" << m_bufferSize
+        << "): " << result;
+    if (result == 0)
+        m_parentEof = true;
+}
+
+void
+CompressionStream::flushBuffer()
+{
+    while (m_writeBuffer.readAvailable() > 0) {
+        size_t result = parent()->write(m_writeBuffer,
+            m_writeBuffer.readAvailable());
+        MORDOR_LOG_TRACE(g_log) << this << " parent()->write("
+            << m_writeBuffer.readAvailable() << "): " << result;
+        m_writeBuffer.consume(result);
+    }
+}
+
+}
@@ -0,0 +1,95 @@
+#ifndef __MORDOR_COMPRESSION_STREAM_H__
+#define __MORDOR_COMPRESSION_STREAM_H__
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include "buffer.h"
+#include "filter.h"
+
+namespace Mordor {
+
+/// Common plumbing for streaming (de)compressors
+
+/// By default, data written is compressed before being written to the
+/// parent, and data read from the parent is decompressed.  Each direction
+/// the parent supports gets its own codec state, so a duplex parent can carry
+/// a compressed stream each way.
+///
+/// Neither direction copies the caller's data: write() hands the codec the
+/// caller's Buffer segments as is, and read() has the codec produce straight
+/// into the caller's Buffer.  Compressed output is collected in bufferSize()
+/// chunks before being written to the parent.
+///
+/// close() (of the write side) finishes the compressed stream; flush() pushes
+/// out everything written so far, so that it can be decompressed on the
+/// other end without waiting for more.
+class CompressionStream : public MutatingFilterStream
+{
+public:
+    typedef std::shared_ptr<CompressionStream> ptr;
+
+public:
+    /// How much compressed data is read from, or buffered for, the parent at
+    /// a time
+    size_t bufferSize() const { return m_bufferSize; }
+    void bufferSize(size_t size) { m_bufferSize = size; }
+    /// If the data read may be several compressed streams back to back (as
+    /// written by ParallelCompressionStream, or by cat a.gz b.gz), and all
+    /// of them should be decompressed, instead of stopping at the end of the
+    /// first
+    bool concatenated() const { return m_concatenated; }
+    void concatenated(bool concatenated) { m_concatenated = concatenated; }
+
+    void close(CloseType type = BOTH);
+    using MutatingFilterStream::read;
+    size_t read(Buffer &buffer, size_t length);
+    using MutatingFilterStream::write;
+    size_t write(const Buffer &buffer, size_t length);
+    void flush(bool flushParent = true);
+
+protected:
+    enum Action
+    {
+        /// Process as much as possible
+        RUN,
+        /// Compressing: produce everything that has been consumed so far
+        FLUSH,
+        /// Compressing: there is no more input; write the end of the stream
+        FINISH
+    };
+
+protected:
+    /// @param invert Compress data read and decompress data written, instead
+    /// of the other way around
+    CompressionStream(Stream::ptr parent, bool invert, bool own);
+
+    /// If data going in direction (READ or WRITE) is compressed (as opposed
+    /// to decompressed)
+    bool compressing(CloseType direction) const
+    { return (direction == WRITE) != m_invert; }
+
+    /// Run the codec for direction
+    /// @param inLength In: the input available; out: how much was consumed
+    /// @param outLength In: the space available; out: how much was produced
+    /// @param action Ignored when decompressing
+    /// @return If the end of the compressed stream was reached (when
+    /// decompressing) or written (when compressing with FINISH)
+    virtual bool process(CloseType direction, const void *in,
+        size_t &inLength, void *out, size_t &outLength, Action action) = 0;
+    /// Make the decompressor for direction ready for a new compressed stream
+    virtual void restart(CloseType direction) = 0;
+
+private:
+    void readParent();
+    size_t pump(const void *in, size_t length, Action action);
+    void flushBuffer();
+
+private:
+    bool m_invert, m_concatenated, m_parentEof, m_readEnd, m_readBoundary,
+        m_writeEnd;
+    size_t m_bufferSize;
+    Buffer m_readBuffer, m_writeBuffer;
+};
+
+}
+
+#endif
@@ -1,12 +1,10 @@
 #include "crypto.h"
-#include "ssl.h" // for OpenSSLException
+#include "ssl_check.h"
 #include "mordor/assert.h"
 #include "mordor/streams/random.h"
 
 namespace Mordor {
 
-#define SSL_CHECK(x) if (!(x)) MORDOR_THROW_EXCEPTION(OpenSSLException()); else (void)0
-
 const std::string CryptoStream::RANDOM_IV;
 
 CryptoStream::CryptoStream(Stream::ptr p, const EVP_CIPHER *cipher, const std::string &key,
@@ -0,0 +1,27 @@
+#ifndef __MORDOR_DEFLATE_STREAM_H__
+#define __MORDOR_DEFLATE_STREAM_H__
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include "zlib.h"
+
+namespace Mordor {
+
+/// ZlibStream producing and consuming raw deflate (RFC 1951) data, without
+/// any header or trailer
+class DeflateStream : public ZlibStream
+{
+public:
+    typedef std::shared_ptr<DeflateStream> ptr;
+
+public:
+    DeflateStream(Stream::ptr parent, int level = Z_DEFAULT_COMPRESSION,
+        int windowBits = 15, int memLevel = 8, Strategy strategy = DEFAULT,
+        bool invert = false, bool own = true)
+        : ZlibStream(parent, DEFLATE, level, windowBits, memLevel, strategy,
+            invert, own)
+    {}
+};
+
+}
+
+#endif
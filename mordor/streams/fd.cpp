@@ -81,14 +81,15 @@ FDStream::read(Buffer &buffer, size_t length)
     MORDOR_ASSERT(m_fd >= 0);
     if (length > 0xfffffffe)
         length = 0xfffffffe;
-    std::vector<iovec> iovs = buffer.writeBuffers(length);
-    int rc = readv(m_fd, &iovs[0], iovs.size());
+    iovec iovs[Buffer::STACK_IOVECS];
+    int count = (int)buffer.writeBuffers(iovs, Buffer::STACK_IOVECS, length);
+    int rc = readv(m_fd, iovs, count);
     while (rc < 0 && errno == EAGAIN && m_ioManager) {
         MORDOR_LOG_TRACE(g_log) << this << " readv(" << m_fd << ", " << length
             << "): " << rc << " (EAGAIN)";
         m_ioManager->registerEvent(m_fd, IOManager::READ);
         Scheduler::yieldTo();
-        rc = readv(m_fd, &iovs[0], iovs.size());
+        rc = readv(m_fd, iovs, count);
     }
     error_t error = lastError();
     MORDOR_LOG_LEVEL(g_log, rc < 0 ? Log::ERROR : Log::DBG) << this
@@ -130,10 +131,11 @@ FDStream::write(const Buffer &buffer, size_t length)
     SchedulerSwitcher switcher(m_ioManager ? NULL : m_scheduler);
     MORDOR_ASSERT(m_fd >= 0);
     length = std::min(length, (size_t)std::numeric_limits<ssize_t>::max());
-    const std::vector<iovec> iovs = buffer.readBuffers(length);
+    iovec iovs[Buffer::STACK_IOVECS];
+    const int count = (int)buffer.readBuffers(iovs, Buffer::STACK_IOVECS,
+        length);
     ssize_t rc = 0;
-    const int count = std::min(iovs.size(), (size_t)IOV_MAX);
-    while ((rc = writev(m_fd, &iovs[0], count)) < 0 &&
+    while ((rc = writev(m_fd, iovs, count)) < 0 &&
            errno == EAGAIN && m_ioManager) {
         MORDOR_LOG_TRACE(g_log) << this << " writev(" << m_fd << ", " << length
             << "): " << rc << " (EAGAIN)";
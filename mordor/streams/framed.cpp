@@ -0,0 +1,264 @@
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include "framed.h"
+
+#include <string.h>
+
+#include "hash.h"
+#include "mordor/assert.h"
+#include "mordor/endian.h"
+#include "mordor/log.h"
+
+namespace Mordor {
+
+static Logger::ptr g_log = Log::lookup("mordor:streams:framed");
+
+// How much to ask the parent for at a time, beyond what a frame still needs
+static const size_t READ_SIZE = 65536;
+// Payloads smaller than this are copied in next to their header, instead of
+// sharing the caller's segments, so that a run of small frames goes out as
+// one contiguous write
+static const size_t COPY_THRESHOLD = 1024;
+// Longest valid encoding of a 64-bit varint
+static const size_t MAX_VARINT = 10;
+
+static void
+updateCrc(unsigned int &crc, const void *buffer, size_t length)
+{
+    crc = CRC32Stream::crc32(buffer, length, crc, CRC32Stream::CASTAGNOLI);
+}
+
+static void
+appendBytes(Buffer &buffer, const void *data, size_t length)
+{
+    buffer.copyIn(data, length);
+}
+
+FramedStream::FramedStream(Stream::ptr parent, HeaderFormat header,
+    bool checksum, bool own)
+: MutatingFilterStream(parent, own),
+  m_header(header),
+  m_checksum(checksum),
+  m_maxFrameSize(16 * 1024 * 1024),
+  m_flushThreshold(65536)
+{}
+
+void
+FramedStream::close(CloseType type)
+{
+    if (type & READ) {
+        m_readBuffer.clear();
+        m_frame.clear();
+    }
+    try {
+        if ((type & WRITE) && m_writeBuffer.readAvailable())
+            flush(false);
+    } catch (...) {
+        if (ownsParent())
+            parent()->close(type);
+        throw;
+    }
+    if (ownsParent())
+        parent()->close(type);
+}
+
+size_t
+FramedStream::read(Buffer &buffer, size_t length)
+{
+    while (m_frame.readAvailable() == 0) {
+        if (!readFrame(m_frame))
+            return 0;
+    }
+    size_t result = (std::min)(length, m_frame.readAvailable());
+    buffer.copyIn(m_frame, result);
+    m_frame.consume(result);
+    return result;
+}
+
+size_t
+FramedStream::write(const Buffer &buffer, size_t length)
+{
+    writeFrame(buffer, length);
+    return length;
+}
+
+void
+FramedStream::flush(bool flushParent)
+{
+    flushFrames(0);
+    if (flushParent)
+        parent()->flush();
+}
+
+bool
+FramedStream::readFrame(Buffer &frame)
+{
+    size_t length;
+    if (!readHeader(length))
+        return false;
+    size_t total = length + (m_checksum ? 4 : 0);
+    if (!fill(total))
+        MORDOR_THROW_EXCEPTION(UnexpectedEofException());
+    if (m_checksum) {
+        unsigned int crc = 0;
+        m_readBuffer.visit(std::bind(&updateCrc, std::ref(crc),
+            std::placeholders::_1, std::placeholders::_2), length);
+        uint32_t expected;
+        m_readBuffer.copyOut(&expected, 4, length);
+        if (byteswapOnLittleEndian(expected) != crc) {
+            MORDOR_LOG_ERROR(g_log) << this << " checksum mismatch on "
+                << length << " byte frame";
+            MORDOR_THROW_EXCEPTION(FrameChecksumException());
+        }
+    }
+    frame.copyIn(m_readBuffer, length);
+    m_readBuffer.consume(total);
+    MORDOR_LOG_DEBUG(g_log) << this << " readFrame(): " << length;
+    return true;
+}
+
+void
+FramedStream::writeFrame(const Buffer &frame, size_t length)
+{
+    if (length == (size_t)~0)
+        length = frame.readAvailable();
+    MORDOR_ASSERT(length <= frame.readAvailable());
+    if (length > m_maxFrameSize ||
+        (m_header == FIXED32 && (unsigned long long)length > 0xffffffffull))
+        MORDOR_THROW_EXCEPTION(BufferOverflowException());
+
+    unsigned char header[MAX_VARINT];
+    size_t headerSize = 0;
+    switch (m_header) {
+        case FIXED32:
+        {
+            uint32_t value = byteswapOnLittleEndian((uint32_t)length);
+            memcpy(header, &value, 4);
+            headerSize = 4;
+            break;
+        }
+        case VARINT:
+        {
+            unsigned long long value = length;
+            do {
+                header[headerSize] = (unsigned char)(value & 0x7f);
+                value >>= 7;
+                if (value)
+                    header[headerSize] |= 0x80;
+                ++headerSize;
+            } while (value);
+            break;
+        }
+        default:
+            MORDOR_NOTREACHED();
+    }
+    m_writeBuffer.copyIn(header, headerSize);
+    if (length < COPY_THRESHOLD)
+        frame.visit(std::bind(&appendBytes, std::ref(m_writeBuffer),
+            std::placeholders::_1, std::placeholders::_2), length);
+    else
+        m_writeBuffer.copyIn(frame, length);
+    if (m_checksum) {
+        unsigned int crc = 0;
+        frame.visit(std::bind(&updateCrc, std::ref(crc),
+            std::placeholders::_1, std::placeholders::_2), length);
+        uint32_t value = byteswapOnLittleEndian((uint32_t)crc);
+        m_writeBuffer.copyIn(&value, 4);
+    }
+    MORDOR_LOG_DEBUG(g_log) << this << " writeFrame(" << length << ")";
+    flushFrames(m_flushThreshold);
+}
+
+bool
+FramedStream::fill(size_t length)
+{
+    while (m_readBuffer.readAvailable() < length) {
+        size_t toRead = (std::max)(READ_SIZE,
+            length - m_readBuffer.readAvailable());
+        MORDOR_LOG_TRACE(g_log) << this << " parent()->read(" << toRead
+            << ")";
+        size_t result = parent()->read(m_readBuffer, toRead);
+        MORDOR_LOG_DEBUG(g_log) << this << " parent()->read(" << toRead
+            << "): " << result;
+        if (result == 0)
+            return false;
+    }
+    return true;
+}
+
+bool
+FramedStream::readHeader(size_t &length)
+{
+    switch (m_header) {
+        case FIXED32:
+        {
+            if (!fill(4)) {
+                if (m_readBuffer.readAvailable() == 0)
+                    return false;
+                MORDOR_THROW_EXCEPTION(UnexpectedEofException());
+            }
+            uint32_t value;
+            m_readBuffer.copyOut(&value, 4);
+            m_readBuffer.consume(4);
+            length = byteswapOnLittleEndian(value);
+            break;
+        }
+        case VARINT:
+        {
+            unsigned char header[MAX_VARINT];
+            unsigned long long value = 0;
+            size_t i = 0;
+            while (true) {
+                if (m_readBuffer.readAvailable() <= i && !fill(i + 1)) {
+                    if (i == 0)
+                        return false;
+                    MORDOR_THROW_EXCEPTION(UnexpectedEofException());
+                }
+                size_t available = (std::min)(m_readBuffer.readAvailable(),
+                    MAX_VARINT);
+                m_readBuffer.copyOut(header, available);
+                for (; i < available; ++i) {
+                    value |= (unsigned long long)(header[i] & 0x7f) << (7 * i);
+                    if (!(header[i] & 0x80))
+                        break;
+                }
+                if (i < available)
+                    break;
+                if (i == MAX_VARINT)
+                    MORDOR_THROW_EXCEPTION(BufferOverflowException());
+            }
+            m_readBuffer.consume(i + 1);
+            if (value > (unsigned long long)m_maxFrameSize)
+                MORDOR_THROW_EXCEPTION(BufferOverflowException());
+            length = (size_t)value;
+            break;
+        }
+        default:
+            MORDOR_NOTREACHED();
+    }
+    if (length > m_maxFrameSize)
+        MORDOR_THROW_EXCEPTION(BufferOverflowException());
+    return true;
+}
+
+void
+FramedStream::flushFrames(size_t threshold)
+{
+    if (m_writeBuffer.readAvailable() <= threshold)
+        return;
+    while (m_writeBuffer.readAvailable()) {
+        MORDOR_LOG_TRACE(g_log) << this << " parent()->write("
+            << m_writeBuffer.readAvailable() << ")";
+        size_t result = parent()->write(m_writeBuffer,
+            m_writeBuffer.readAvailable());
+        MORDOR_LOG_DEBUG(g_log) << this << " parent()->write("
+            << m_writeBuffer.readAvailable() << "): " << result;
+        MORDOR_ASSERT(result > 0);
+        m_writeBuffer.consume(result);
+    }
+}
+
+}
+
+#include "mordor/error_info.cpp"
+template struct Mordor::ErrorInfo<Mordor::FrameChecksumException>;
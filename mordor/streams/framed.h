@@ -0,0 +1,88 @@
+#ifndef __MORDOR_FRAMED_STREAM_H__
+#define __MORDOR_FRAMED_STREAM_H__
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include "buffer.h"
+#include "filter.h"
+
+namespace Mordor {
+
+/// A frame's checksum did not match its payload
+struct FrameChecksumException : virtual StreamException {};
+
+/// Splits a stream into length-prefixed frames
+
+/// Each frame is a length header (either a fixed 4 byte big-endian integer,
+/// or an unsigned LEB128 varint), the payload, and optionally a big-endian
+/// CRC-32C of the payload.
+///
+/// readFrame() returns a whole frame at a time, sharing the memory it was
+/// read into instead of copying it.  writeFrame() only queues frames; they
+/// are sent together, in as few writes to the parent as possible, by
+/// flush() (or as soon as more than flushThreshold() bytes are queued).
+///
+/// Through the plain Stream interface, each write() is one frame, and a
+/// read() never returns data from more than one frame.
+class FramedStream : public MutatingFilterStream
+{
+public:
+    typedef std::shared_ptr<FramedStream> ptr;
+
+    enum HeaderFormat
+    {
+        /// 4 byte big-endian length
+        FIXED32,
+        /// Unsigned LEB128 length; 1 byte for frames under 128 bytes
+        VARINT
+    };
+
+public:
+    FramedStream(Stream::ptr parent, HeaderFormat header = VARINT,
+        bool checksum = false, bool own = true);
+
+    HeaderFormat header() const { return m_header; }
+    bool checksum() const { return m_checksum; }
+
+    /// Largest frame that will be read or written; larger ones throw
+    /// BufferOverflowException
+    size_t maxFrameSize() const { return m_maxFrameSize; }
+    void maxFrameSize(size_t size) { m_maxFrameSize = size; }
+    /// How much may be queued by writeFrame() before it is sent without
+    /// waiting for flush()
+    size_t flushThreshold() const { return m_flushThreshold; }
+    void flushThreshold(size_t threshold) { m_flushThreshold = threshold; }
+
+    void close(CloseType type = BOTH);
+    using MutatingFilterStream::read;
+    size_t read(Buffer &buffer, size_t length);
+    using MutatingFilterStream::write;
+    size_t write(const Buffer &buffer, size_t length);
+    void flush(bool flushParent = true);
+
+    /// Append the next whole frame to frame
+    /// @return false at EOF (if EOF falls between frames)
+    /// @exception UnexpectedEofException EOF in the middle of a frame
+    /// @exception FrameChecksumException The frame is corrupt
+    bool readFrame(Buffer &frame);
+    /// Queue the first length bytes of frame as one frame
+    void writeFrame(const Buffer &frame, size_t length = ~0);
+
+private:
+    bool fill(size_t length);
+    bool readHeader(size_t &length);
+    void flushFrames(size_t threshold);
+
+private:
+    HeaderFormat m_header;
+    bool m_checksum;
+    size_t m_maxFrameSize, m_flushThreshold;
+    Buffer m_readBuffer, m_writeBuffer;
+    // What's left of the frame being returned through read()
+    Buffer m_frame;
+};
+
+}
+
+extern template struct Mordor::ErrorInfo<Mordor::FrameChecksumException>;
+
+#endif
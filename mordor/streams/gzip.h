@@ -0,0 +1,26 @@
+#ifndef __MORDOR_GZIP_STREAM_H__
+#define __MORDOR_GZIP_STREAM_H__
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include "zlib.h"
+
+namespace Mordor {
+
+/// ZlibStream with gzip (RFC 1952) framing
+class GzipStream : public ZlibStream
+{
+public:
+    typedef std::shared_ptr<GzipStream> ptr;
+
+public:
+    GzipStream(Stream::ptr parent, int level = Z_DEFAULT_COMPRESSION,
+        int windowBits = 15, int memLevel = 8, Strategy strategy = DEFAULT,
+        bool invert = false, bool own = true)
+        : ZlibStream(parent, GZIP, level, windowBits, memLevel, strategy,
+            invert, own)
+    {}
+};
+
+}
+
+#endif
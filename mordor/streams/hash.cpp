@@ -2,6 +2,22 @@
 
 #include "hash.h"
 
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MORDOR_CRC32_SSE42
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#include <smmintrin.h>
+#endif
+
+// For the state layouts, in dumpContext()
+#define XXH_STATIC_LINKING_ONLY
+#include <xxhash.h>
+#ifdef HAVE_XXH_X86DISPATCH
+#include <xxh_x86dispatch.h>
+#endif
+
 #include "buffer.h"
 #include "mordor/assert.h"
 #include "mordor/endian.h"
@@ -227,16 +243,35 @@ static unsigned int koopmanTable[] =
     0xc0522c72u
 };
 
+// Slicing-by-8: table k (at k * 256) is the CRC of a byte followed by k zero
+// bytes, so eight bytes can be folded in with eight independent lookups
+static const size_t SLICES = 8;
+
+static std::vector<unsigned int> slice(const unsigned int *table)
+{
+    std::vector<unsigned int> result(table, table + 256);
+    result.resize(256 * SLICES);
+    for (size_t k = 1; k < SLICES; ++k) {
+        for (size_t i = 0; i < 256; ++i) {
+            unsigned int crc = result[(k - 1) * 256 + i];
+            result[k * 256 + i] = (crc >> 8) ^ table[crc & 0xff];
+        }
+    }
+    return result;
+}
+
 static const unsigned int *selectPrecomputedTable(unsigned int polynomial,
     const std::vector<unsigned int> &myTable)
 {
+    static const std::vector<unsigned int> ieee = slice(ieeeTable),
+        castagnoli = slice(castagnoliTable), koopman = slice(koopmanTable);
     switch (polynomial) {
         case CRC32Stream::IEEE:
-            return ieeeTable;
+            return &ieee[0];
         case CRC32Stream::CASTAGNOLI:
-            return castagnoliTable;
+            return &castagnoli[0];
         case CRC32Stream::KOOPMAN:
-            return koopmanTable;
+            return &koopman[0];
         default:
             return &myTable[0];
     }
@@ -251,22 +286,174 @@ static std::vector<unsigned int> precomputeTableSkip(unsigned int polynomial)
         case CRC32Stream::KOOPMAN:
             return result;
         default:
-            return CRC32Stream::precomputeTable(polynomial);
+            return slice(&CRC32Stream::precomputeTable(polynomial)[0]);
     }
 }
 
+// crc is the raw register (not inverted); tables from slice()
+static unsigned int
+updateSliced(unsigned int crc, const unsigned char *bytes, size_t length,
+    const unsigned int *tables)
+{
+    for (; length >= 8; bytes += 8, length -= 8) {
+        unsigned int lo = crc ^ (bytes[0] | (bytes[1] << 8) |
+            (bytes[2] << 16) | ((unsigned int)bytes[3] << 24));
+        crc = tables[7 * 256 + (lo & 0xff)] ^
+            tables[6 * 256 + ((lo >> 8) & 0xff)] ^
+            tables[5 * 256 + ((lo >> 16) & 0xff)] ^
+            tables[4 * 256 + (lo >> 24)] ^
+            tables[3 * 256 + bytes[4]] ^
+            tables[2 * 256 + bytes[5]] ^
+            tables[1 * 256 + bytes[6]] ^
+            tables[bytes[7]];
+    }
+    while (length-- > 0)
+        crc = (crc >> 8) ^ tables[(crc ^ *bytes++) & 0xff];
+    return crc;
+}
+
+#ifdef MORDOR_CRC32_SSE42
+// The crc32 instruction is CRC-32C, bit-reflected, exactly as castagnoliTable
+__attribute__((target("sse4.2")))
+static unsigned int
+updateSSE42(unsigned int crc, const unsigned char *bytes, size_t length,
+    const unsigned int *tables)
+{
+#ifdef __x86_64__
+    unsigned long long crc64 = crc;
+    for (; length >= 8; bytes += 8, length -= 8) {
+        unsigned long long word;
+        memcpy(&word, bytes, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = (unsigned int)crc64;
+#endif
+    for (; length >= 4; bytes += 4, length -= 4) {
+        unsigned int word;
+        memcpy(&word, bytes, 4);
+        crc = _mm_crc32_u32(crc, word);
+    }
+    while (length-- > 0)
+        crc = _mm_crc32_u8(crc, *bytes++);
+    return crc;
+}
+
+// Folding with carry-less multiplication, from Gopal et al., "Fast CRC
+// Computation for Generic Polynomials Using PCLMULQDQ Instruction"; the
+// constants are for CRC-32-IEEE only, and length must be a multiple of 16,
+// and at least 64
+__attribute__((target("pclmul,sse4.1")))
+static unsigned int
+foldPCLMUL(unsigned int crc, const unsigned char *bytes, size_t length)
+{
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596ll, 0x0154442bd4ll);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009ell, 0x01751997d0ll);
+    const __m128i k5 = _mm_set_epi64x(0, 0x0163cd6124ll);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641ll, 0x01db710641ll);
+    const __m128i low32 = _mm_setr_epi32(~0, 0, ~0, 0);
+
+    __m128i x1 = _mm_loadu_si128((const __m128i *)(bytes + 0x00));
+    __m128i x2 = _mm_loadu_si128((const __m128i *)(bytes + 0x10));
+    __m128i x3 = _mm_loadu_si128((const __m128i *)(bytes + 0x20));
+    __m128i x4 = _mm_loadu_si128((const __m128i *)(bytes + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+    bytes += 64;
+    length -= 64;
+
+    // Four 128 bit lanes at a time
+    for (; length >= 64; bytes += 64, length -= 64) {
+        __m128i x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+        __m128i x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+        __m128i x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+        __m128i x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+            _mm_loadu_si128((const __m128i *)(bytes + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+            _mm_loadu_si128((const __m128i *)(bytes + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+            _mm_loadu_si128((const __m128i *)(bytes + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+            _mm_loadu_si128((const __m128i *)(bytes + 0x30)));
+    }
+
+    // Fold the four lanes into one, then any remaining 16 byte blocks
+    __m128i lanes[3] = { x2, x3, x4 };
+    for (size_t i = 0; i < 3; ++i) {
+        __m128i x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, lanes[i]), x5);
+    }
+    for (; length >= 16; bytes += 16, length -= 16) {
+        __m128i x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1,
+            _mm_loadu_si128((const __m128i *)bytes)), x5);
+    }
+
+    // 128 bits down to 64
+    x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, low32);
+    x1 = _mm_xor_si128(_mm_clmulepi64_si128(x1, k5, 0x00), x2);
+
+    // Barrett reduction to 32
+    x2 = _mm_and_si128(x1, low32);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+    x2 = _mm_and_si128(x2, low32);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return (unsigned int)_mm_extract_epi32(x1, 1);
+}
+
+static unsigned int
+updatePCLMUL(unsigned int crc, const unsigned char *bytes, size_t length,
+    const unsigned int *tables)
+{
+    if (length >= 64) {
+        size_t folded = length & ~(size_t)15;
+        crc = foldPCLMUL(crc, bytes, folded);
+        bytes += folded;
+        length -= folded;
+    }
+    return updateSliced(crc, bytes, length, tables);
+}
+#endif
+
+static CRC32Stream::UpdateFunction
+chooseUpdate(unsigned int polynomial)
+{
+#ifdef MORDOR_CRC32_SSE42
+    __builtin_cpu_init();
+    if (polynomial == CRC32Stream::CASTAGNOLI &&
+        __builtin_cpu_supports("sse4.2"))
+        return &updateSSE42;
+    if (polynomial == CRC32Stream::IEEE && __builtin_cpu_supports("pclmul") &&
+        __builtin_cpu_supports("sse4.1"))
+        return &updatePCLMUL;
+#endif
+    return &updateSliced;
+}
+
 CRC32Stream::CRC32Stream(Stream::ptr parent, unsigned int polynomial, bool own)
 : HashStream(parent, own),
   m_crc(~0u),
   m_tableStorage(precomputeTableSkip(polynomial)),
-  m_table(selectPrecomputedTable(polynomial, m_tableStorage))
+  m_table(selectPrecomputedTable(polynomial, m_tableStorage)),
+  m_update(chooseUpdate(polynomial))
 {}
 
 CRC32Stream::CRC32Stream(Stream::ptr parent,
     const unsigned int *precomputedTable, bool own)
 : HashStream(parent, own),
   m_crc(~0u),
-  m_table(precomputedTable)
+  m_tableStorage(slice(precomputedTable)),
+  m_table(&m_tableStorage[0]),
+  m_update(&updateSliced)
 {}
 
 static unsigned int reflect(unsigned int b)
@@ -298,6 +485,50 @@ CRC32Stream::precomputeTable(unsigned int polynomial)
     return result;
 }
 
+unsigned int
+CRC32Stream::crc32(const void *buffer, size_t length, unsigned int crc,
+    WellknownPolynomial polynomial)
+{
+    static const std::vector<unsigned int> none;
+    static const UpdateFunction ieee = chooseUpdate(IEEE),
+        castagnoli = chooseUpdate(CASTAGNOLI), koopman = chooseUpdate(KOOPMAN);
+    const unsigned int *table = selectPrecomputedTable(polynomial, none);
+    UpdateFunction update = polynomial == IEEE ? ieee :
+        polynomial == CASTAGNOLI ? castagnoli : koopman;
+    return ~update(~crc, (const unsigned char *)buffer, length, table);
+}
+
+// a * b modulo the (reflected) polynomial
+static unsigned int
+multiplyModP(unsigned int a, unsigned int b, unsigned int polynomial)
+{
+    unsigned int product = 0;
+    for (unsigned int m = 1u << 31; m != 0 && a != 0; m >>= 1) {
+        if (a & m) {
+            product ^= b;
+            a ^= m;
+        }
+        b = (b & 1) ? (b >> 1) ^ polynomial : b >> 1;
+    }
+    return product;
+}
+
+unsigned int
+CRC32Stream::crc32Combine(unsigned int crc1, unsigned int crc2,
+    unsigned long long length2, unsigned int polynomial)
+{
+    // Appending length2 bytes multiplies crc1 by x^(8 * length2); get there
+    // by repeated squaring, starting from x^8 (x^0 is the top bit)
+    polynomial = reflect(polynomial);
+    unsigned int shift = 1u << 31, square = 1u << (31 - 8);
+    for (; length2 != 0; length2 >>= 1) {
+        if (length2 & 1)
+            shift = multiplyModP(square, shift, polynomial);
+        square = multiplyModP(square, square, polynomial);
+    }
+    return multiplyModP(shift, crc1, polynomial) ^ crc2;
+}
+
 size_t
 CRC32Stream::hashSize() const
 {
@@ -320,10 +551,155 @@ CRC32Stream::reset()
 void
 CRC32Stream::updateHash(const void *buffer, size_t length)
 {
-    const unsigned char *bytes = (const unsigned char *)buffer;
-    const unsigned char *end = bytes + length;
-    while (bytes < end)
-        m_crc = (m_crc >> 8) ^ m_table[(m_crc ^ *bytes++) & 0xff];
+    m_crc = m_update(m_crc, (const unsigned char *)buffer, length, m_table);
+}
+
+template <class State>
+static Buffer
+dumpState(unsigned long long seed, const State *state)
+{
+    Buffer buffer;
+    buffer.copyIn(&seed, sizeof(seed));
+    buffer.copyIn(state, sizeof(State));
+    return buffer;
+}
+
+template <class State>
+static void
+loadState(const Buffer &context, unsigned long long &seed, State *state)
+{
+    MORDOR_ASSERT(context.readAvailable() == sizeof(seed) + sizeof(State));
+    Buffer copy(context);
+    copy.copyOut(&seed, sizeof(seed));
+    copy.consume(sizeof(seed));
+    copy.copyOut(state, sizeof(State));
+}
+
+// XXH3_state_t is plain data except for extSecret, which points at the
+// library's default secret (or is NULL when seeded); that address is only
+// good in the process that dumped it, so take it from a fresh reset instead
+static void
+loadState(const Buffer &context, unsigned long long &seed,
+    XXH3_state_t *state)
+{
+    MORDOR_ASSERT(context.readAvailable() >= sizeof(seed));
+    context.copyOut(&seed, sizeof(seed));
+    XXH3_64bits_reset_withSeed(state, seed);
+    const unsigned char *extSecret = state->extSecret;
+    loadState<XXH3_state_t>(context, seed, state);
+    state->extSecret = extSecret;
+}
+
+static void
+canonical(XXH64_hash_t hash, void *result, size_t length)
+{
+    MORDOR_ASSERT(length == sizeof(XXH64_canonical_t));
+    XXH64_canonicalFromHash((XXH64_canonical_t *)result, hash);
+}
+
+XXH64Stream::XXH64Stream(Stream::ptr parent, unsigned long long seed,
+    bool own)
+: HashStream(parent, own),
+  m_seed(seed),
+  m_state(XXH64_createState())
+{
+    if (!m_state)
+        throw std::bad_alloc();
+    reset();
+}
+
+XXH64Stream::XXH64Stream(Stream::ptr parent, const Buffer &context,
+    bool own)
+: HashStream(parent, own),
+  m_seed(0),
+  m_state(XXH64_createState())
+{
+    if (!m_state)
+        throw std::bad_alloc();
+    loadState(context, m_seed, m_state);
+}
+
+XXH64Stream::~XXH64Stream()
+{
+    XXH64_freeState(m_state);
+}
+
+void
+XXH64Stream::hash(void *result, size_t length) const
+{
+    canonical(XXH64_digest(m_state), result, length);
+}
+
+Buffer
+XXH64Stream::dumpContext() const
+{
+    return dumpState(m_seed, m_state);
+}
+
+void
+XXH64Stream::reset()
+{
+    XXH64_reset(m_state, m_seed);
+}
+
+void
+XXH64Stream::updateHash(const void *buffer, size_t length)
+{
+    XXH64_update(m_state, buffer, length);
+}
+
+XXH3Stream::XXH3Stream(Stream::ptr parent, unsigned long long seed,
+    bool own)
+: HashStream(parent, own),
+  m_seed(seed),
+  m_state(XXH3_createState())
+{
+    if (!m_state)
+        throw std::bad_alloc();
+    reset();
+}
+
+XXH3Stream::XXH3Stream(Stream::ptr parent, const Buffer &context, bool own)
+: HashStream(parent, own),
+  m_seed(0),
+  m_state(XXH3_createState())
+{
+    if (!m_state)
+        throw std::bad_alloc();
+    loadState(context, m_seed, m_state);
+}
+
+XXH3Stream::~XXH3Stream()
+{
+    XXH3_freeState(m_state);
+}
+
+void
+XXH3Stream::hash(void *result, size_t length) const
+{
+    canonical(XXH3_64bits_digest(m_state), result, length);
+}
+
+Buffer
+XXH3Stream::dumpContext() const
+{
+    return dumpState(m_seed, m_state);
+}
+
+void
+XXH3Stream::reset()
+{
+    XXH3_64bits_reset_withSeed(m_state, m_seed);
+}
+
+void
+XXH3Stream::updateHash(const void *buffer, size_t length)
+{
+#ifdef HAVE_XXH_X86DISPATCH
+    XXH3_64bits_update_dispatch(m_state, buffer, length);
+#else
+    XXH3_64bits_update(m_state, buffer, length);
+#endif
 }
 
 }
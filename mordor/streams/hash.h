@@ -6,6 +6,7 @@
 
 #include <openssl/sha.h>
 #include <openssl/md5.h>
+#include <xxhash.h>
 
 #include "assert.h"
 #include "filter.h"
@@ -45,6 +46,9 @@ public:
 
 protected:
     virtual void updateHash(const void *buffer, size_t length) = 0;
+
+    // Feeds data to several HashStreams directly
+    friend class MultiHashStream;
 };
 
 template<HASH_TYPE H> struct HashOps {};
@@ -111,6 +115,36 @@ struct HashOps<SHA256>
 };
 #endif
 
+#ifndef OPENSSL_NO_SHA512
+template<>
+struct HashOps<SHA384>
+{
+    typedef SHA512_CTX ctx_type;
+
+    static int init(ctx_type *ctx)
+    { return SHA384_Init(ctx); }
+    static int update(ctx_type *ctx, const void *data, size_t len)
+    { return SHA384_Update(ctx, data, len); }
+    static int final(unsigned char *md, ctx_type *ctx)
+    { return SHA384_Final(md, ctx); }
+    static size_t digestLength() { return SHA384_DIGEST_LENGTH; }
+};
+
+template<>
+struct HashOps<SHA512>
+{
+    typedef SHA512_CTX ctx_type;
+
+    static int init(ctx_type *ctx)
+    { return SHA512_Init(ctx); }
+    static int update(ctx_type *ctx, const void *data, size_t len)
+    { return SHA512_Update(ctx, data, len); }
+    static int final(unsigned char *md, ctx_type *ctx)
+    { return SHA512_Final(md, ctx); }
+    static size_t digestLength() { return SHA512_DIGEST_LENGTH; }
+};
+#endif
+
 template<>
 struct HashOps<MD5>
 {
@@ -185,6 +219,10 @@ typedef _HashStream<SHA1>   SHA1Stream;
 typedef _HashStream<SHA224> SHA224Stream;
 typedef _HashStream<SHA256> SHA256Stream;
 #endif
+#ifndef OPENSSL_NO_SHA512
+typedef _HashStream<SHA384> SHA384Stream;
+typedef _HashStream<SHA512> SHA512Stream;
+#endif
 typedef _HashStream<MD5>    MD5Stream;
 
 class CRC32Stream : public HashStream
@@ -200,13 +238,32 @@ public:
         /// CRC-32K
         KOOPMAN = 0x741B8CD7
     };
+    /// Updates a raw (non-inverted) CRC register over length bytes; tables
+    /// are the 8 slicing tables for the polynomial
+    typedef unsigned int (*UpdateFunction)(unsigned int crc,
+        const unsigned char *bytes, size_t length, const unsigned int *tables);
+
 public:
+    /// CASTAGNOLI uses the SSE4.2 crc32 instruction, and IEEE carry-less
+    /// multiplication (PCLMULQDQ), when the CPU supports them; anything else
+    /// uses slicing-by-8 tables
     CRC32Stream(Stream::ptr parent, unsigned int polynomial = IEEE,
         bool own = true);
+    /// precomputedTable (as from precomputeTable()) is copied, and expanded
+    /// into slicing tables
     CRC32Stream(Stream::ptr parent, const unsigned int *precomputedTable,
         bool own = true);
 
     static std::vector<unsigned int> precomputeTable(unsigned int polynomial);
+    /// Compute the CRC of buffer without a Stream, continuing from crc (the
+    /// result of a previous call over the preceding data, or 0 to start)
+    static unsigned int crc32(const void *buffer, size_t length,
+        unsigned int crc = 0, WellknownPolynomial polynomial = IEEE);
+    /// Given crc1 of some data, and crc2 of the length2 bytes that follow
+    /// it (each computed from 0), returns the CRC of the whole; so chunks
+    /// can be CRCed in parallel and merged
+    static unsigned int crc32Combine(unsigned int crc1, unsigned int crc2,
+        unsigned long long length2, unsigned int polynomial = IEEE);
 
     size_t hashSize() const;
     using HashStream::hash;
@@ -221,6 +278,71 @@ private:
     unsigned int m_crc;
     const std::vector<unsigned int> m_tableStorage;
     const unsigned int *m_table;
+    UpdateFunction m_update;
+};
+
+/// xxHash's XXH64: non-cryptographic, but runs near memory bandwidth.  The
+/// hash is the 8 byte big-endian canonical form.
+class XXH64Stream : public HashStream
+{
+public:
+    typedef std::shared_ptr<XXH64Stream> ptr;
+
+public:
+    XXH64Stream(Stream::ptr parent, unsigned long long seed = 0,
+        bool own = true);
+    /// Resume from a dumpContext()
+    XXH64Stream(Stream::ptr parent, const Buffer &context, bool own = true);
+    ~XXH64Stream();
+
+    size_t hashSize() const { return 8; }
+    using HashStream::hash;
+    void hash(void *result, size_t length) const;
+    /// The seed and the library's state; only valid with the same version
+    /// of libxxhash
+    Buffer dumpContext() const;
+    void reset();
+
+protected:
+    void updateHash(const void *buffer, size_t length);
+
+private:
+    unsigned long long m_seed;
+    XXH64_state_t *m_state;
+};
+
+/// xxHash's XXH3 (64 bit variant), which is SIMD throughout; faster than
+/// XXH64 for all but tiny inputs.  The hash is the 8 byte big-endian
+/// canonical form.
+class XXH3Stream : public HashStream
+{
+public:
+    typedef std::shared_ptr<XXH3Stream> ptr;
+
+public:
+    XXH3Stream(Stream::ptr parent, unsigned long long seed = 0,
+        bool own = true);
+    /// Resume from a dumpContext()
+    XXH3Stream(Stream::ptr parent, const Buffer &context, bool own = true);
+    ~XXH3Stream();
+
+    size_t hashSize() const { return 8; }
+    using HashStream::hash;
+    void hash(void *result, size_t length) const;
+    /// The seed and the library's state.  It can be resumed in another
+    /// process (the state's pointer to the library's secret is redone on
+    /// load), but only with a libxxhash whose XXH3_state_t has the same
+    /// layout
+    Buffer dumpContext() const;
+    void reset();
+
+protected:
+    void updateHash(const void *buffer, size_t length);
+
+private:
+    unsigned long long m_seed;
+    // Needs 64 byte alignment, so it's allocated by the library
+    XXH3_state_t *m_state;
 };
 
 }
@@ -33,10 +33,16 @@ namespace Mordor {
 #ifndef OPENSSL_NO_SHA256
     typedef _HashStream<SHA224> SHA224Stream;
     typedef _HashStream<SHA256> SHA256Stream;
+#endif
+#ifndef OPENSSL_NO_SHA512
+    typedef _HashStream<SHA384> SHA384Stream;
+    typedef _HashStream<SHA512> SHA512Stream;
 #endif
     typedef _HashStream<MD5>    MD5Stream;
 
     class CRC32Stream;
+    class XXH64Stream;
+    class XXH3Stream;
 }
 
 #endif
@@ -0,0 +1,200 @@
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include "lz4.h"
+
+#include <string.h>
+
+#include "mordor/assert.h"
+#include "mordor/exception.h"
+
+namespace Mordor {
+
+static size_t
+blockBytes(LZ4F_blockSizeID_t blockSize)
+{
+    switch (blockSize) {
+        case LZ4F_max256KB:
+            return 256 * 1024;
+        case LZ4F_max1MB:
+            return 1024 * 1024;
+        case LZ4F_max4MB:
+            return 4 * 1024 * 1024;
+        default:
+            return 64 * 1024;
+    }
+}
+
+LZ4Stream::LZ4Stream(Stream::ptr parent, int level,
+    const std::string &dictionary, LZ4F_blockSizeID_t blockSize,
+    bool invert, bool own)
+: CompressionStream(parent, invert, own),
+  m_dictionary(dictionary),
+  m_cdict(NULL)
+{
+    memset(&m_preferences, 0, sizeof(LZ4F_preferences_t));
+    m_preferences.frameInfo.blockSizeID = blockSize;
+    m_preferences.frameInfo.blockMode = LZ4F_blockLinked;
+    m_preferences.frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+    m_preferences.compressionLevel = level;
+    // Room for a whole compressed block, so that output usually goes
+    // straight into the Buffer instead of through Context::pending
+    bufferSize(LZ4F_compressBound(blockBytes(blockSize), &m_preferences));
+    try {
+        if (!m_dictionary.empty() &&
+            ((parent->supportsRead() && compressing(READ)) ||
+            (parent->supportsWrite() && compressing(WRITE)))) {
+            m_cdict = LZ4F_createCDict(m_dictionary.c_str(),
+                m_dictionary.size());
+            if (!m_cdict)
+                throw std::bad_alloc();
+        }
+        if (parent->supportsRead())
+            init(m_read, READ);
+        if (parent->supportsWrite())
+            init(m_write, WRITE);
+    } catch (...) {
+        release(m_read);
+        release(m_write);
+        LZ4F_freeCDict(m_cdict);
+        throw;
+    }
+}
+
+LZ4Stream::~LZ4Stream()
+{
+    release(m_read);
+    release(m_write);
+    LZ4F_freeCDict(m_cdict);
+}
+
+void
+LZ4Stream::init(Context &context, CloseType direction)
+{
+    LZ4F_errorCode_t rc;
+    if (compressing(direction))
+        rc = LZ4F_createCompressionContext(&context.cctx, LZ4F_VERSION);
+    else
+        rc = LZ4F_createDecompressionContext(&context.dctx, LZ4F_VERSION);
+    if (LZ4F_isError(rc))
+        throw std::bad_alloc();
+}
+
+void
+LZ4Stream::release(Context &context)
+{
+    if (context.cctx)
+        LZ4F_freeCompressionContext(context.cctx);
+    if (context.dctx)
+        LZ4F_freeDecompressionContext(context.dctx);
+    context.cctx = NULL;
+    context.dctx = NULL;
+}
+
+bool
+LZ4Stream::process(CloseType direction, const void *in, size_t &inLength,
+    void *out, size_t &outLength, Action action)
+{
+    Context &context = direction == READ ? m_read : m_write;
+    if (compressing(direction))
+        return compress(context, in, inLength, out, outLength, action);
+
+    MORDOR_ASSERT(context.dctx);
+    size_t rc;
+    if (m_dictionary.empty())
+        rc = LZ4F_decompress(context.dctx, out, &outLength, in, &inLength,
+            NULL);
+    else
+        rc = LZ4F_decompress_usingDict(context.dctx, out, &outLength, in,
+            &inLength, m_dictionary.c_str(), m_dictionary.size(), NULL);
+    if (LZ4F_isError(rc))
+        MORDOR_THROW_EXCEPTION(CorruptedLZ4StreamException());
+    // 0 means the frame has been completely decoded
+    return rc == 0;
+}
+
+bool
+LZ4Stream::compress(Context &context, const void *in, size_t &inLength,
+    void *out, size_t &outLength, Action action)
+{
+    MORDOR_ASSERT(context.cctx);
+    size_t available = inLength, space = outLength;
+    inLength = outLength = 0;
+    bool flushed = false;
+    while (true) {
+        // Hand over what a previous step could not fit first
+        if (context.pending.readAvailable() > 0) {
+            size_t copy = (std::min)(context.pending.readAvailable(),
+                space - outLength);
+            context.pending.copyOut((char *)out + outLength, copy);
+            context.pending.consume(copy);
+            outLength += copy;
+            if (context.pending.readAvailable() > 0)
+                return false;
+        }
+        if (context.ended)
+            return true;
+        if (flushed)
+            return false;
+
+        // LZ4F refuses to start a step unless there's room for its worst
+        // case, so anything short of that is staged in pending
+        size_t bound, chunk = 0;
+        if (!context.begun) {
+            bound = LZ4F_HEADER_SIZE_MAX;
+        } else if (inLength < available) {
+            chunk = (std::min)(available - inLength,
+                blockBytes(m_preferences.frameInfo.blockSizeID));
+            bound = LZ4F_compressBound(chunk, &m_preferences);
+        } else if (action == RUN) {
+            return false;
+        } else {
+            bound = LZ4F_compressBound(0, &m_preferences);
+        }
+        bool direct = space - outLength >= bound;
+        void *target = (char *)out + outLength;
+        if (!direct)
+            target = context.pending.writeBuffer(bound, true).iov_base;
+
+        size_t rc;
+        if (!context.begun) {
+            if (m_cdict)
+                rc = LZ4F_compressBegin_usingCDict(context.cctx, target,
+                    bound, m_cdict, &m_preferences);
+            else
+                rc = LZ4F_compressBegin(context.cctx, target, bound,
+                    &m_preferences);
+            context.begun = true;
+        } else if (chunk > 0) {
+            rc = LZ4F_compressUpdate(context.cctx, target, bound,
+                (const char *)in + inLength, chunk, NULL);
+            inLength += chunk;
+        } else if (action == FLUSH) {
+            rc = LZ4F_flush(context.cctx, target, bound, NULL);
+            flushed = true;
+        } else {
+            rc = LZ4F_compressEnd(context.cctx, target, bound, NULL);
+            context.ended = true;
+        }
+        if (LZ4F_isError(rc))
+            MORDOR_THROW_EXCEPTION(LZ4Exception());
+        if (direct)
+            outLength += rc;
+        else
+            context.pending.produce(rc);
+    }
+}
+
+void
+LZ4Stream::restart(CloseType direction)
+{
+    MORDOR_ASSERT(!compressing(direction));
+    LZ4F_resetDecompressionContext(
+        (direction == READ ? m_read : m_write).dctx);
+}
+
+}
+
+#include "mordor/error_info.cpp"
+
+template struct Mordor::ErrorInfo<Mordor::LZ4Exception>;
+template struct Mordor::ErrorInfo<Mordor::CorruptedLZ4StreamException>;
@@ -0,0 +1,71 @@
+#ifndef __MORDOR_LZ4_STREAM_H__
+#define __MORDOR_LZ4_STREAM_H__
+// Copyright (c) 2009 - Mozy, Inc.
+
+#define LZ4F_STATIC_LINKING_ONLY
+#include <lz4frame.h>
+
+#include "compression.h"
+
+namespace Mordor {
+
+struct LZ4Exception : virtual StreamException {};
+/// The compressed data is invalid
+struct CorruptedLZ4StreamException : virtual LZ4Exception {};
+
+/// Compresses data written, and decompresses data read, as an LZ4 frame
+class LZ4Stream : public CompressionStream
+{
+public:
+    typedef std::shared_ptr<LZ4Stream> ptr;
+
+public:
+    /// @param level 0 for the fast compressor; 3 to 12 for LZ4HC
+    /// @param dictionary Raw content to prime the window with; both ends must
+    /// use the same one
+    /// @param blockSize Independent unit of compression; larger blocks give
+    /// better ratios, and need that much more memory on both ends
+    /// @param invert Compress data read and decompress data written
+    LZ4Stream(Stream::ptr parent, int level = 0,
+        const std::string &dictionary = std::string(),
+        LZ4F_blockSizeID_t blockSize = LZ4F_max64KB, bool invert = false,
+        bool own = true);
+    ~LZ4Stream();
+
+protected:
+    bool process(CloseType direction, const void *in, size_t &inLength,
+        void *out, size_t &outLength, Action action);
+    void restart(CloseType direction);
+
+private:
+    struct Context
+    {
+        Context() : cctx(NULL), dctx(NULL), begun(false), ended(false) {}
+
+        LZ4F_cctx *cctx;
+        LZ4F_dctx *dctx;
+        bool begun, ended;
+        // Compressed output that did not fit in the caller's space; LZ4F
+        // only writes whole blocks
+        Buffer pending;
+    };
+
+private:
+    void init(Context &context, CloseType direction);
+    bool compress(Context &context, const void *in, size_t &inLength,
+        void *out, size_t &outLength, Action action);
+    static void release(Context &context);
+
+private:
+    LZ4F_preferences_t m_preferences;
+    std::string m_dictionary;
+    LZ4F_CDict *m_cdict;
+    Context m_read, m_write;
+};
+
+}
+
+extern template struct Mordor::ErrorInfo<Mordor::LZ4Exception>;
+extern template struct Mordor::ErrorInfo<Mordor::CorruptedLZ4StreamException>;
+
+#endif
@@ -0,0 +1,122 @@
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include "lzma2.h"
+
+#include "mordor/assert.h"
+#include "mordor/exception.h"
+
+namespace Mordor {
+
+static void
+throwLZMAError(lzma_ret rc)
+{
+    switch (rc) {
+        case LZMA_MEM_ERROR:
+            throw std::bad_alloc();
+        case LZMA_FORMAT_ERROR:
+            MORDOR_THROW_EXCEPTION(UnknownLZMAFormatException());
+        case LZMA_DATA_ERROR:
+            MORDOR_THROW_EXCEPTION(CorruptedLZMAStreamException());
+        case LZMA_OPTIONS_ERROR:
+        case LZMA_UNSUPPORTED_CHECK:
+            MORDOR_THROW_EXCEPTION(UnsupportedLZMAOptionsException());
+        default:
+            MORDOR_THROW_EXCEPTION(LZMAException());
+    }
+}
+
+LZMAStream::LZMAStream(Stream::ptr parent, unsigned int preset,
+    unsigned int dictionarySize, lzma_check check, bool invert, bool own)
+: CompressionStream(parent, invert, own)
+{
+    lzma_stream init = LZMA_STREAM_INIT;
+    m_readStream = m_writeStream = init;
+    if (parent->supportsRead())
+        this->init(m_readStream, READ, preset, dictionarySize, check);
+    try {
+        if (parent->supportsWrite())
+            this->init(m_writeStream, WRITE, preset, dictionarySize, check);
+    } catch (...) {
+        lzma_end(&m_readStream);
+        throw;
+    }
+}
+
+LZMAStream::~LZMAStream()
+{
+    // lzma_end is a no-op on a stream that was never initialized
+    lzma_end(&m_readStream);
+    lzma_end(&m_writeStream);
+}
+
+void
+LZMAStream::init(lzma_stream &strm, CloseType direction, unsigned int preset,
+    unsigned int dictionarySize, lzma_check check)
+{
+    lzma_ret rc;
+    if (compressing(direction)) {
+        lzma_options_lzma options;
+        if (lzma_lzma_preset(&options, preset))
+            MORDOR_THROW_EXCEPTION(UnsupportedLZMAOptionsException());
+        if (dictionarySize != 0)
+            options.dict_size = dictionarySize;
+        lzma_filter filters[] = {
+            { LZMA_FILTER_LZMA2, &options },
+            { LZMA_VLI_UNKNOWN, NULL }
+        };
+        rc = lzma_stream_encoder(&strm, filters, check);
+    } else {
+        rc = lzma_stream_decoder(&strm, UINT64_MAX, 0);
+    }
+    if (rc != LZMA_OK)
+        throwLZMAError(rc);
+}
+
+bool
+LZMAStream::process(CloseType direction, const void *in, size_t &inLength,
+    void *out, size_t &outLength, Action action)
+{
+    lzma_stream &strm = direction == READ ? m_readStream : m_writeStream;
+    strm.next_in = (const uint8_t *)in;
+    strm.avail_in = inLength;
+    strm.next_out = (uint8_t *)out;
+    strm.avail_out = outLength;
+    lzma_ret rc;
+    if (compressing(direction))
+        rc = lzma_code(&strm, action == FINISH ? LZMA_FINISH :
+            action == FLUSH ? LZMA_SYNC_FLUSH : LZMA_RUN);
+    else
+        rc = lzma_code(&strm, LZMA_RUN);
+    inLength -= strm.avail_in;
+    outLength -= strm.avail_out;
+    switch (rc) {
+        case LZMA_OK:
+        // No progress was possible; the caller will notice
+        case LZMA_BUF_ERROR:
+            return false;
+        case LZMA_STREAM_END:
+            // LZMA_SYNC_FLUSH also reports completion this way
+            return action != FLUSH || !compressing(direction);
+        default:
+            throwLZMAError(rc);
+            MORDOR_NOTREACHED();
+    }
+}
+
+void
+LZMAStream::restart(CloseType direction)
+{
+    MORDOR_ASSERT(!compressing(direction));
+    // Re-initializing reuses the decoder's memory
+    init(direction == READ ? m_readStream : m_writeStream, direction, 0, 0,
+        LZMA_CHECK_NONE);
+}
+
+}
+
+#include "mordor/error_info.cpp"
+
+template struct Mordor::ErrorInfo<Mordor::LZMAException>;
+template struct Mordor::ErrorInfo<Mordor::UnknownLZMAFormatException>;
+template struct Mordor::ErrorInfo<Mordor::CorruptedLZMAStreamException>;
+template struct Mordor::ErrorInfo<Mordor::UnsupportedLZMAOptionsException>;
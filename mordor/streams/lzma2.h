@@ -0,0 +1,56 @@
+#ifndef __MORDOR_LZMA2_STREAM_H__
+#define __MORDOR_LZMA2_STREAM_H__
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include <lzma.h>
+
+#include "compression.h"
+
+namespace Mordor {
+
+struct LZMAException : virtual StreamException {};
+/// The data is not in the .xz format
+struct UnknownLZMAFormatException : virtual LZMAException {};
+/// The .xz headers are valid, but the compressed data is not
+struct CorruptedLZMAStreamException : virtual LZMAException {};
+/// The stream uses a filter or check this build of liblzma does not support
+struct UnsupportedLZMAOptionsException : virtual LZMAException {};
+
+/// Compresses data written, and decompresses data read, in the .xz format
+/// (LZMA2)
+class LZMAStream : public CompressionStream
+{
+public:
+    typedef std::shared_ptr<LZMAStream> ptr;
+
+public:
+    /// @param preset 0 (fastest) to 9 (best), optionally or'ed with
+    /// LZMA_PRESET_EXTREME
+    /// @param dictionarySize Window size in bytes; 0 means the preset's
+    /// @param invert Compress data read and decompress data written
+    LZMAStream(Stream::ptr parent, unsigned int preset = LZMA_PRESET_DEFAULT,
+        unsigned int dictionarySize = 0, lzma_check check = LZMA_CHECK_CRC64,
+        bool invert = false, bool own = true);
+    ~LZMAStream();
+
+protected:
+    bool process(CloseType direction, const void *in, size_t &inLength,
+        void *out, size_t &outLength, Action action);
+    void restart(CloseType direction);
+
+private:
+    void init(lzma_stream &strm, CloseType direction, unsigned int preset,
+        unsigned int dictionarySize, lzma_check check);
+
+private:
+    lzma_stream m_readStream, m_writeStream;
+};
+
+}
+
+extern template struct Mordor::ErrorInfo<Mordor::LZMAException>;
+extern template struct Mordor::ErrorInfo<Mordor::UnknownLZMAFormatException>;
+extern template struct Mordor::ErrorInfo<Mordor::CorruptedLZMAStreamException>;
+extern template struct Mordor::ErrorInfo<Mordor::UnsupportedLZMAOptionsException>;
+
+#endif
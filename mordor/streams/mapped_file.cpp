@@ -0,0 +1,233 @@
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include "mapped_file.h"
+
+#include <string.h>
+
+#ifndef WINDOWS
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "buffer.h"
+#include "mordor/assert.h"
+#include "mordor/exception.h"
+#include "mordor/log.h"
+#include "mordor/string.h"
+
+namespace Mordor {
+
+static Logger::ptr g_log = Log::lookup("mordor:streams:mappedfile");
+
+struct MappedFileStream::Mapping
+{
+    Mapping(void *base, size_t length) : base(base), length(length) {}
+    ~Mapping();
+
+    void *base;
+    size_t length;
+};
+
+MappedFileStream::Mapping::~Mapping()
+{
+#ifdef WINDOWS
+    if (!UnmapViewOfFile(base)) {
+        MORDOR_LOG_ERROR(g_log) << this << " UnmapViewOfFile(" << base
+            << "): (" << lastError() << ")";
+#else
+    if (munmap(base, length)) {
+        MORDOR_LOG_ERROR(g_log) << this << " munmap(" << base << ", "
+            << length << "): (" << lastError() << ")";
+#endif
+    } else {
+        MORDOR_LOG_VERBOSE(g_log) << this << " unmapped " << base;
+    }
+}
+
+MappedFileStream::MappedFileStream(const std::string &path, Advice advice)
+: m_path(path),
+  m_data(NULL),
+  m_size(0),
+  m_offset(0)
+{
+#ifdef WINDOWS
+    DWORD flags = 0;
+    if (advice == SEQUENTIAL)
+        flags = FILE_FLAG_SEQUENTIAL_SCAN;
+    else if (advice == RANDOM)
+        flags = FILE_FLAG_RANDOM_ACCESS;
+    HANDLE file = CreateFileW(toUtf16(path).c_str(), GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, flags, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("CreateFileW");
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size)) {
+        error_t error = lastError();
+        CloseHandle(file);
+        MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, "GetFileSizeEx");
+    }
+    m_size = size.QuadPart;
+    if (m_size > 0) {
+        HANDLE mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0,
+            NULL);
+        error_t error = lastError();
+        CloseHandle(file);
+        if (!mapping)
+            MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, "CreateFileMappingW");
+        void *base = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        error = lastError();
+        // The view keeps the mapping object alive
+        CloseHandle(mapping);
+        if (!base)
+            MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, "MapViewOfFile");
+        m_mapping.reset(new Mapping(base, (size_t)m_size));
+    } else {
+        CloseHandle(file);
+    }
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    error_t error = lastError();
+    MORDOR_LOG_VERBOSE(g_log) << "open(" << path << ", O_RDONLY): " << fd
+        << " (" << error << ")";
+    if (fd < 0)
+        MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, "open");
+    struct stat st;
+    if (fstat(fd, &st)) {
+        error = lastError();
+        ::close(fd);
+        MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, "fstat");
+    }
+    m_size = st.st_size;
+    if (m_size > 0) {
+        if (m_size > (size_t)~0) {
+            ::close(fd);
+            MORDOR_THROW_EXCEPTION(std::invalid_argument(
+                "File is larger than the virtual address space"));
+        }
+        void *base = mmap(NULL, (size_t)m_size, PROT_READ, MAP_SHARED, fd, 0);
+        error = lastError();
+        // The mapping keeps the file open
+        ::close(fd);
+        MORDOR_LOG_LEVEL(g_log, base == MAP_FAILED ? Log::ERROR : Log::VERBOSE)
+            << this << " mmap(" << path << ", " << m_size << "): " << base
+            << " (" << error << ")";
+        if (base == MAP_FAILED)
+            MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, "mmap");
+        m_mapping.reset(new Mapping(base, (size_t)m_size));
+    } else {
+        ::close(fd);
+    }
+#endif
+    if (m_mapping) {
+        m_data = (const unsigned char *)m_mapping->base;
+#ifndef WINDOWS
+        advise(advice);
+#endif
+    }
+}
+
+void
+MappedFileStream::close(CloseType type)
+{
+    if (type & READ) {
+        m_mapping.reset();
+        m_data = NULL;
+    }
+}
+
+size_t
+MappedFileStream::read(Buffer &buffer, size_t length)
+{
+    if (m_offset >= m_size)
+        return 0;
+    if (!m_mapping)
+        MORDOR_THROW_EXCEPTION(std::logic_error("read after close()"));
+    size_t todo = (size_t)std::min<unsigned long long>(length,
+        m_size - m_offset);
+    buffer.adoptMapping(m_data + m_offset, todo, m_mapping);
+    m_offset += todo;
+    return todo;
+}
+
+size_t
+MappedFileStream::read(void *buffer, size_t length)
+{
+    if (m_offset >= m_size)
+        return 0;
+    if (!m_mapping)
+        MORDOR_THROW_EXCEPTION(std::logic_error("read after close()"));
+    size_t todo = (size_t)std::min<unsigned long long>(length,
+        m_size - m_offset);
+    memcpy(buffer, m_data + m_offset, todo);
+    m_offset += todo;
+    return todo;
+}
+
+long long
+MappedFileStream::seek(long long offset, Anchor anchor)
+{
+    switch (anchor) {
+        case BEGIN:
+            break;
+        case CURRENT:
+            offset += (long long)m_offset;
+            break;
+        case END:
+            offset += (long long)m_size;
+            break;
+        default:
+            MORDOR_NOTREACHED();
+    }
+    if (offset < 0)
+        MORDOR_THROW_EXCEPTION(std::invalid_argument("resulting offset is negative"));
+    m_offset = (unsigned long long)offset;
+    return offset;
+}
+
+void
+MappedFileStream::advise(Advice advice)
+{
+#ifndef WINDOWS
+    if (!m_mapping)
+        return;
+    int native;
+    switch (advice) {
+        case SEQUENTIAL:
+            native = MADV_SEQUENTIAL;
+            break;
+        case RANDOM:
+            native = MADV_RANDOM;
+            break;
+        default:
+            native = MADV_NORMAL;
+            break;
+    }
+    // Only a hint; failure doesn't affect correctness
+    if (madvise(m_mapping->base, m_mapping->length, native))
+        MORDOR_LOG_WARNING(g_log) << this << " madvise(" << m_mapping->base
+            << ", " << m_mapping->length << ", " << native << "): ("
+            << lastError() << ")";
+#endif
+}
+
+void
+MappedFileStream::willNeed(long long offset, size_t length)
+{
+    // Nothing to do on Windows before PrefetchVirtualMemory (Windows 8)
+    if (!m_mapping || offset < 0 || (unsigned long long)offset >= m_size)
+        return;
+    length = (size_t)std::min<unsigned long long>(length, m_size - offset);
+#ifndef WINDOWS
+    // madvise wants a page aligned address
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    size_t aligned = (size_t)offset & ~(pageSize - 1);
+    if (madvise((void *)(m_data + aligned), length + (size_t)offset - aligned,
+        MADV_WILLNEED))
+        MORDOR_LOG_WARNING(g_log) << this << " madvise(" << offset << ", "
+            << length << ", MADV_WILLNEED): (" << lastError() << ")";
+#endif
+}
+
+}
@@ -0,0 +1,59 @@
+#ifndef __MORDOR_MAPPED_FILE_STREAM_H__
+#define __MORDOR_MAPPED_FILE_STREAM_H__
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include "stream.h"
+
+namespace Mordor {
+
+/// Read-only Stream over a memory-mapped file
+
+/// read(Buffer &) does not copy; the returned segments are slices of the
+/// mapping (see Buffer::adoptMapping), which stays mapped until neither the
+/// stream nor any Buffer refers to it.  Intended for large, immutable files;
+/// the file must not be truncated while it is mapped.
+class MappedFileStream : public Stream
+{
+public:
+    typedef std::shared_ptr<MappedFileStream> ptr;
+
+    /// How the file is expected to be accessed, passed on to the kernel
+    enum Advice {
+        NORMAL,
+        SEQUENTIAL,
+        RANDOM
+    };
+
+public:
+    MappedFileStream(const std::string &path, Advice advice = SEQUENTIAL);
+
+    bool supportsRead() { return true; }
+    bool supportsSeek() { return true; }
+    bool supportsSize() { return true; }
+
+    void close(CloseType type = BOTH);
+    size_t read(Buffer &buffer, size_t length);
+    size_t read(void *buffer, size_t length);
+    long long seek(long long offset, Anchor anchor = BEGIN);
+    long long size() { return (long long)m_size; }
+
+    /// Change the access pattern hint for the whole file
+    void advise(Advice advice);
+    /// Hint that [offset, offset + length) will be read soon
+    void willNeed(long long offset, size_t length);
+
+    std::string path() const { return m_path; }
+
+private:
+    struct Mapping;
+
+private:
+    std::string m_path;
+    std::shared_ptr<Mapping> m_mapping;
+    const unsigned char *m_data;
+    unsigned long long m_size, m_offset;
+};
+
+}
+
+#endif
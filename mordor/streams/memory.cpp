@@ -156,13 +156,16 @@ MemoryStream::truncate(long long size)
     } else {
         size_t needed = (size_t)size - currentSize;
         m_original.reserve(needed);
-        std::vector<iovec> iovs = m_original.writeBuffers(needed);
-        for (std::vector<iovec>::iterator it(iovs.begin());
-            it != iovs.end();
-            ++it) {
-            memset(it->iov_base, 0, it->iov_len);
+        while (needed > 0) {
+            iovec iovs[Buffer::STACK_IOVECS];
+            size_t count = m_original.writeBuffers(iovs, Buffer::STACK_IOVECS,
+                needed);
+            for (size_t i = 0; i < count; ++i) {
+                memset(iovs[i].iov_base, 0, iovs[i].iov_len);
+                m_original.produce(iovs[i].iov_len);
+                needed -= iovs[i].iov_len;
+            }
         }
-        m_original.produce(needed);
         // Reset the read buf so we're referencing the same memory
         m_read.clear();
         m_read.copyIn(m_original);
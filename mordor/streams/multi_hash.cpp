@@ -0,0 +1,188 @@
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include "multi_hash.h"
+
+#include "buffer.h"
+#include "null.h"
+#include "mordor/assert.h"
+#include "mordor/parallel.h"
+#include "mordor/scheduler.h"
+
+namespace Mordor {
+
+MultiHashStream::MultiHashStream(Stream::ptr parent,
+    size_t parallelThreshold, bool own)
+: FilterStream(parent, own),
+  m_parallelThreshold(parallelThreshold)
+{}
+
+size_t
+MultiHashStream::add(HASH_TYPE type)
+{
+    Stream::ptr null = NullStream::get_ptr();
+    switch (type) {
+        case MD5:
+            return add(HashStream::ptr(new MD5Stream(null)));
+#ifndef OPENSSL_NO_SHA0
+        case SHA0:
+            return add(HashStream::ptr(new SHA0Stream(null)));
+#endif
+#ifndef OPENSSL_NO_SHA1
+        case SHA1:
+            return add(HashStream::ptr(new SHA1Stream(null)));
+#endif
+#ifndef OPENSSL_NO_SHA256
+        case SHA224:
+            return add(HashStream::ptr(new SHA224Stream(null)));
+        case SHA256:
+            return add(HashStream::ptr(new SHA256Stream(null)));
+#endif
+#ifndef OPENSSL_NO_SHA512
+        case SHA384:
+            return add(HashStream::ptr(new SHA384Stream(null)));
+        case SHA512:
+            return add(HashStream::ptr(new SHA512Stream(null)));
+#endif
+        default:
+            MORDOR_NOTREACHED();
+    }
+}
+
+size_t
+MultiHashStream::addCRC32(unsigned int polynomial)
+{
+    return add(HashStream::ptr(new CRC32Stream(NullStream::get_ptr(),
+        polynomial)));
+}
+
+size_t
+MultiHashStream::add(HashStream::ptr hashStream)
+{
+    m_hashes.push_back(hashStream);
+    return m_hashes.size() - 1;
+}
+
+std::string
+MultiHashStream::hash(size_t index) const
+{
+    MORDOR_ASSERT(index < m_hashes.size());
+    return m_hashes[index]->hash();
+}
+
+HashStream::ptr
+MultiHashStream::hashStream(size_t index) const
+{
+    MORDOR_ASSERT(index < m_hashes.size());
+    return m_hashes[index];
+}
+
+void
+MultiHashStream::reset()
+{
+    for (size_t i = 0; i < m_hashes.size(); ++i)
+        m_hashes[i]->reset();
+}
+
+size_t
+MultiHashStream::read(Buffer &buffer, size_t length)
+{
+    Buffer temp;
+    size_t result = parent()->read(temp, length);
+    updateHashes(temp, result);
+    buffer.copyIn(temp);
+    return result;
+}
+
+size_t
+MultiHashStream::read(void *buffer, size_t length)
+{
+    size_t result = parent()->read(buffer, length);
+    iovec iov;
+    iov.iov_base = buffer;
+    iov.iov_len = result;
+    updateHashes(&iov, 1, result);
+    return result;
+}
+
+size_t
+MultiHashStream::write(const Buffer &buffer, size_t length)
+{
+    size_t result = parent()->write(buffer, length);
+    updateHashes(buffer, result);
+    return result;
+}
+
+size_t
+MultiHashStream::write(const void *buffer, size_t length)
+{
+    size_t result = parent()->write(buffer, length);
+    iovec iov;
+    iov.iov_base = (void *)buffer;
+    iov.iov_len = result;
+    updateHashes(&iov, 1, result);
+    return result;
+}
+
+long long
+MultiHashStream::seek(long long offset, Anchor anchor)
+{
+    MORDOR_NOTREACHED();
+}
+
+void
+MultiHashStream::updateHashes(const Buffer &buffer, size_t length)
+{
+    iovec iovs[Buffer::STACK_IOVECS];
+    size_t count = buffer.readBuffers(iovs, Buffer::STACK_IOVECS, length);
+    if (count < Buffer::STACK_IOVECS) {
+        updateHashes(iovs, count, length);
+        return;
+    }
+    // It may not all have fit; go through (a shared copy of) it a batch at a
+    // time
+    Buffer remaining;
+    remaining.copyIn(buffer, length);
+    while (remaining.readAvailable() > 0) {
+        count = remaining.readBuffers(iovs, Buffer::STACK_IOVECS);
+        size_t batch = 0;
+        for (size_t i = 0; i < count; ++i)
+            batch += iovs[i].iov_len;
+        updateHashes(iovs, count, batch);
+        remaining.consume(batch);
+    }
+}
+
+void
+MultiHashStream::updateHashes(const iovec *iovs, size_t count, size_t length)
+{
+    if (m_parallelThreshold != 0 && length >= m_parallelThreshold &&
+        m_hashes.size() > 1 && Scheduler::getThis()) {
+        std::vector<std::function<void ()> > dgs;
+        for (size_t i = 0; i < m_hashes.size(); ++i)
+            dgs.push_back(std::bind(&MultiHashStream::updateHash,
+                m_hashes[i].get(), iovs, count));
+        parallel_do(dgs);
+        return;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        const unsigned char *data = (const unsigned char *)iovs[i].iov_base;
+        size_t remaining = iovs[i].iov_len;
+        while (remaining > 0) {
+            size_t block = (std::min)(remaining, BLOCK_SIZE);
+            for (size_t j = 0; j < m_hashes.size(); ++j)
+                m_hashes[j]->updateHash(data, block);
+            data += block;
+            remaining -= block;
+        }
+    }
+}
+
+void
+MultiHashStream::updateHash(HashStream *hashStream, const iovec *iovs,
+    size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+        hashStream->updateHash(iovs[i].iov_base, iovs[i].iov_len);
+}
+
+}
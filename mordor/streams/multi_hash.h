@@ -0,0 +1,71 @@
+#ifndef __MORDOR_MULTI_HASH_STREAM_H__
+#define __MORDOR_MULTI_HASH_STREAM_H__
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include <vector>
+
+#include "filter.h"
+#include "hash.h"
+
+namespace Mordor {
+
+/// Computes several digests of what is read or written, in one pass
+
+/// Stacking MD5Stream, SHA1Stream and SHA256Stream goes through three
+/// filters, and over the data three times, by which point it has long
+/// left the cache.  MultiHashStream instead runs each BLOCK_SIZE piece of
+/// every Buffer segment through all of its hashes while it is still in L1.
+///
+/// With a parallelThreshold, reads and writes at least that large have
+/// each hash computed in its own fiber on the current Scheduler (using
+/// parallel_do), so a multi-threaded Scheduler spreads them across cores.
+class MultiHashStream : public FilterStream
+{
+public:
+    typedef std::shared_ptr<MultiHashStream> ptr;
+
+    static const size_t BLOCK_SIZE = 16384;
+
+public:
+    /// @param parallelThreshold 0 to always hash inline
+    MultiHashStream(Stream::ptr parent, size_t parallelThreshold = 0,
+        bool own = true);
+
+    bool supportsSeek() { return false; }
+    bool supportsTruncate() { return false; }
+    bool supportsUnread() { return false; }
+
+    /// Add a digest; all of them have to be added before any data
+    /// @return The index for hash() and hashStream()
+    size_t add(HASH_TYPE type);
+    size_t addCRC32(unsigned int polynomial = CRC32Stream::IEEE);
+    /// Any other kind of HashStream; its parent is never used
+    size_t add(HashStream::ptr hashStream);
+
+    size_t hashes() const { return m_hashes.size(); }
+    /// In binary, as from HashStream::hash()
+    std::string hash(size_t index) const;
+    /// For dumpContext(), or a digest in a different form
+    HashStream::ptr hashStream(size_t index) const;
+    void reset();
+
+    size_t read(Buffer &buffer, size_t length);
+    size_t read(void *buffer, size_t length);
+    size_t write(const Buffer &buffer, size_t length);
+    size_t write(const void *buffer, size_t length);
+    long long seek(long long offset, Anchor anchor = BEGIN);
+
+private:
+    void updateHashes(const Buffer &buffer, size_t length);
+    void updateHashes(const iovec *iovs, size_t count, size_t length);
+    static void updateHash(HashStream *hashStream, const iovec *iovs,
+        size_t count);
+
+private:
+    size_t m_parallelThreshold;
+    std::vector<HashStream::ptr> m_hashes;
+};
+
+}
+
+#endif
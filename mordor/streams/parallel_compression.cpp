@@ -0,0 +1,104 @@
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include "parallel_compression.h"
+
+#include "memory.h"
+#include "singleplex.h"
+#include "mordor/assert.h"
+#include "mordor/log.h"
+#include "mordor/scheduler.h"
+
+namespace Mordor {
+
+static Logger::ptr g_log = Log::lookup("mordor:streams:parallel_compression");
+
+ParallelCompressionStream::ParallelCompressionStream(Stream::ptr parent,
+    Scheduler &scheduler, const Compressor &compressor, size_t blockSize,
+    size_t maxInFlight, bool own)
+: MutatingFilterStream(parent, own),
+  m_compressor(compressor),
+  m_blockSize(blockSize),
+  m_dispatched(0),
+  m_blocks(scheduler, maxInFlight)
+{
+    MORDOR_ASSERT(m_blockSize > 0);
+}
+
+void
+ParallelCompressionStream::close(CloseType type)
+{
+    try {
+        if (type & WRITE) {
+            // Even no data at all is one (empty) compressed stream
+            if (m_block.readAvailable() > 0 || m_dispatched == 0)
+                dispatch();
+            writeOut(0);
+        }
+    } catch (...) {
+        if (ownsParent())
+            parent()->close(type);
+        throw;
+    }
+    if (ownsParent())
+        parent()->close(type);
+}
+
+size_t
+ParallelCompressionStream::write(const Buffer &buffer, size_t length)
+{
+    size_t result = (std::min)(length, m_blockSize - m_block.readAvailable());
+    m_block.copyIn(buffer, result);
+    if (m_block.readAvailable() == m_blockSize)
+        dispatch();
+    return result;
+}
+
+void
+ParallelCompressionStream::flush(bool flushParent)
+{
+    if (m_block.readAvailable() > 0)
+        dispatch();
+    writeOut(0);
+    if (flushParent)
+        parent()->flush();
+}
+
+void
+ParallelCompressionStream::dispatch()
+{
+    writeOut(m_blocks.maxInFlight() - 1);
+    std::shared_ptr<Block> block(new Block());
+    block->input.copyIn(m_block);
+    m_block.clear();
+    MORDOR_LOG_TRACE(g_log) << this << " dispatching block " << m_dispatched
+        << " (" << block->input.readAvailable() << " bytes)";
+    ++m_dispatched;
+    m_blocks.push(block, std::bind(&ParallelCompressionStream::compress,
+        this, std::placeholders::_1));
+}
+
+void
+ParallelCompressionStream::compress(Block &block)
+{
+    std::shared_ptr<MemoryStream> output(new MemoryStream());
+    Stream::ptr stream = m_compressor(Stream::ptr(
+        new SingleplexStream(output, SingleplexStream::WRITE)));
+    while (block.input.readAvailable() > 0)
+        block.input.consume(stream->write(block.input,
+            block.input.readAvailable()));
+    stream->close();
+    block.input.clear();
+    block.output.copyIn(output->buffer());
+}
+
+void
+ParallelCompressionStream::writeOut(size_t keep)
+{
+    while (std::shared_ptr<Block> block = m_blocks.pop(keep)) {
+        while (block->output.readAvailable() > 0)
+            block->output.consume(parent()->write(block->output,
+                block->output.readAvailable()));
+    }
+}
+
+}
@@ -0,0 +1,78 @@
+#ifndef __MORDOR_PARALLEL_COMPRESSION_STREAM_H__
+#define __MORDOR_PARALLEL_COMPRESSION_STREAM_H__
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include "buffer.h"
+#include "filter.h"
+#include "mordor/parallel.h"
+
+namespace Mordor {
+
+class Scheduler;
+
+/// Compresses what is written a block at a time, on several threads
+
+/// In the style of pigz: what is written is cut into blockSize() blocks,
+/// each block is compressed independently, by its own Stream from
+/// compressor, on scheduler (typically a WorkerPool), and the results are
+/// written to the parent in order.  The output is therefore a concatenation
+/// of complete compressed streams, one per block, which gunzip, zstd -d,
+/// xz -d and lz4 -d all accept, as does a CompressionStream with
+/// concatenated() set.  Since blocks don't share a window, the ratio is a
+/// little worse than a single stream's, more so the smaller the blocks.
+///
+/// At most maxInFlight() blocks are queued or being compressed at once;
+/// beyond that, write() waits for the oldest to be written out, so memory
+/// use stays around (maxInFlight() + 1) * blockSize().
+///
+/// Must be used from a Fiber running on a Scheduler (which may be scheduler
+/// itself).  compressor is called on scheduler's threads concurrently.
+class ParallelCompressionStream : public MutatingFilterStream
+{
+public:
+    typedef std::shared_ptr<ParallelCompressionStream> ptr;
+    /// Creates a Stream that compresses what is written to it into parent,
+    /// and finishes the compressed stream on close()
+    typedef std::function<Stream::ptr (Stream::ptr parent)> Compressor;
+
+public:
+    /// @param maxInFlight As for OrderedWorkQueue
+    ParallelCompressionStream(Stream::ptr parent, Scheduler &scheduler,
+        const Compressor &compressor, size_t blockSize = 1024 * 1024,
+        size_t maxInFlight = 0, bool own = true);
+
+    bool supportsRead() { return false; }
+
+    size_t blockSize() const { return m_blockSize; }
+    size_t maxInFlight() const { return m_blocks.maxInFlight(); }
+
+    void close(CloseType type = BOTH);
+    using MutatingFilterStream::write;
+    size_t write(const Buffer &buffer, size_t length);
+    /// Compresses the partial block, and waits for all blocks to be written
+    void flush(bool flushParent = true);
+
+private:
+    struct Block
+    {
+        Buffer input, output;
+    };
+
+private:
+    void dispatch();
+    void compress(Block &block);
+    void writeOut(size_t keep);
+
+private:
+    Compressor m_compressor;
+    size_t m_blockSize;
+    unsigned long long m_dispatched;
+    Buffer m_block;
+    // Last, so that it waits for blocks still being compressed before
+    // anything they use goes away
+    OrderedWorkQueue<Block> m_blocks;
+};
+
+}
+
+#endif
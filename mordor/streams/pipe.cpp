@@ -6,6 +6,7 @@
 
 #include "buffer.h"
 #include "mordor/assert.h"
+#include "mordor/atomic.h"
 #include "mordor/fiber.h"
 #include "mordor/scheduler.h"
 #include "stream.h"
@@ -331,4 +332,300 @@ Signal11::ConnectionRef PipeStream::onRemoteClose(
     return m_onRemoteClose.connect(slot);
 }
 
+namespace {
+
+// A fiber blocked on a LockFreePipeStream
+struct Waiter
+{
+    Waiter() : waiting(0), scheduler(NULL) {}
+
+    volatile int waiting;
+    Scheduler *scheduler;
+    std::shared_ptr<Fiber> fiber;
+};
+
+// One direction of a LockFreePipeStream
+struct Ring
+{
+    Ring(size_t capacity)
+        : capacity(capacity),
+          bytes(0),
+          head(0),
+          tail(0),
+          writeClosed(0),
+          readClosed(0),
+          abandoned(0),
+          cancelledRead(0),
+          cancelledWrite(0)
+    {}
+
+    // Must be a power of two
+    static const size_t SLOTS = 64;
+
+    const size_t capacity;
+    volatile size_t bytes;
+    // Only the consumer advances head, and only the producer advances tail;
+    // slots in [head, tail) belong to the consumer, and the rest to the
+    // producer.  Keep them on separate cache lines.
+    volatile size_t head;
+    char pad[64];
+    volatile size_t tail;
+    volatile int writeClosed, readClosed, abandoned, cancelledRead,
+        cancelledWrite;
+    Waiter reader, writer;
+    Buffer slots[SLOTS];
+};
+
+}
+
+static void
+park(Waiter &waiter)
+{
+    waiter.scheduler = Scheduler::getThis();
+    waiter.fiber = Fiber::getThis();
+    // Full barrier; the waker must see scheduler and fiber, and the caller's
+    // re-check of its condition must not happen before this
+    atomicCompareAndSwap(waiter.waiting, 1, 0);
+}
+
+// Take back an unneeded park(); returns false if a wake() got there first,
+// in which case the fiber still has to yield to absorb being scheduled
+static bool
+unpark(Waiter &waiter)
+{
+    if (atomicSwap(waiter.waiting, 0) == 0)
+        return false;
+    waiter.fiber.reset();
+    waiter.scheduler = NULL;
+    return true;
+}
+
+static void
+wake(Waiter &waiter)
+{
+    if (!waiter.waiting || atomicSwap(waiter.waiting, 0) == 0)
+        return;
+    Scheduler *scheduler = waiter.scheduler;
+    std::shared_ptr<Fiber> fiber;
+    fiber.swap(waiter.fiber);
+    waiter.scheduler = NULL;
+    scheduler->schedule(fiber);
+}
+
+static void
+block(Waiter &waiter, bool ready)
+{
+    if (ready) {
+        if (!unpark(waiter))
+            Scheduler::yieldTo();
+        return;
+    }
+    try {
+        Scheduler::yieldTo();
+    } catch (...) {
+        unpark(waiter);
+        throw;
+    }
+}
+
+class LockFreePipeStream : public Stream
+{
+    friend std::pair<Stream::ptr, Stream::ptr> lockFreePipeStream(size_t);
+public:
+    typedef std::shared_ptr<LockFreePipeStream> ptr;
+    typedef std::weak_ptr<LockFreePipeStream> weak_ptr;
+
+public:
+    LockFreePipeStream(std::shared_ptr<Ring> in, std::shared_ptr<Ring> out);
+    ~LockFreePipeStream();
+
+    bool supportsHalfClose() { return true; }
+    bool supportsRead() { return true; }
+    bool supportsWrite() { return true; }
+
+    void close(CloseType type = BOTH);
+    using Stream::read;
+    size_t read(Buffer &b, size_t len);
+    void cancelRead();
+    using Stream::write;
+    size_t write(const Buffer &b, size_t len);
+    void cancelWrite();
+    void flush(bool flushParent = true);
+
+    Signal11::ConnectionRef onRemoteClose(
+        const Signal11::Signal<void()>::CallbackFunction &slot);
+
+private:
+    LockFreePipeStream::weak_ptr m_otherStream;
+    std::shared_ptr<Ring> m_in, m_out;
+    Signal11::Signal<void ()> m_onRemoteClose;
+};
+
+std::pair<Stream::ptr, Stream::ptr> lockFreePipeStream(size_t bufferSize)
+{
+    if (bufferSize == (size_t)~0)
+        bufferSize = 65536;
+    std::shared_ptr<Ring> forward(new Ring(bufferSize));
+    std::shared_ptr<Ring> backward(new Ring(bufferSize));
+    std::pair<LockFreePipeStream::ptr, LockFreePipeStream::ptr> result;
+    result.first.reset(new LockFreePipeStream(backward, forward));
+    result.second.reset(new LockFreePipeStream(forward, backward));
+    MORDOR_LOG_VERBOSE(g_log) << "lockFreePipeStream(" << bufferSize
+        << "): {" << result.first << ", " << result.second << "}";
+    result.first->m_otherStream = result.second;
+    result.second->m_otherStream = result.first;
+    return result;
+}
+
+LockFreePipeStream::LockFreePipeStream(std::shared_ptr<Ring> in,
+    std::shared_ptr<Ring> out)
+: m_in(in),
+  m_out(out)
+{}
+
+LockFreePipeStream::~LockFreePipeStream()
+{
+    MORDOR_LOG_VERBOSE(g_log) << this << " destructing";
+    LockFreePipeStream::ptr otherStream = m_otherStream.lock();
+    if (!m_out->writeClosed)
+        atomicSwap(m_out->abandoned, 1);
+    atomicSwap(m_in->readClosed, 1);
+    wake(m_out->reader);
+    wake(m_in->writer);
+    if (otherStream)
+        otherStream->m_onRemoteClose.emit();
+}
+
+void
+LockFreePipeStream::close(CloseType type)
+{
+    if ((type & READ) && atomicSwap(m_in->readClosed, 1) == 0)
+        wake(m_in->writer);
+    if ((type & WRITE) && atomicSwap(m_out->writeClosed, 1) == 0) {
+        wake(m_out->reader);
+        LockFreePipeStream::ptr otherStream = m_otherStream.lock();
+        if (otherStream)
+            otherStream->m_onRemoteClose.emit();
+    }
+}
+
+size_t
+LockFreePipeStream::read(Buffer &b, size_t len)
+{
+    MORDOR_ASSERT(len != 0);
+    Ring &ring = *m_in;
+    while (true) {
+        if (ring.readClosed)
+            MORDOR_THROW_EXCEPTION(BrokenPipeException());
+        size_t head = ring.head, tail = ring.tail;
+        if (head != tail) {
+            // Take as many whole slots as fit, sharing their segments
+            size_t result = 0;
+            while (head != tail && result < len) {
+                Buffer &slot = ring.slots[head & (Ring::SLOTS - 1)];
+                size_t todo = (std::min)(len - result, slot.readAvailable());
+                b.copyIn(slot, todo);
+                result += todo;
+                if (todo < slot.readAvailable()) {
+                    slot.consume(todo);
+                    break;
+                }
+                slot.clear();
+                ++head;
+            }
+            if (head != ring.head)
+                atomicAdd(ring.head, head - ring.head);
+            size_t bytes = atomicAdd(ring.bytes, (size_t)0 - result);
+            if (bytes * 2 <= ring.capacity &&
+                (ring.tail - head) * 2 <= Ring::SLOTS)
+                wake(ring.writer);
+            MORDOR_LOG_TRACE(g_log) << this << " read(" << len << "): "
+                << result;
+            return result;
+        }
+        if (ring.writeClosed) {
+            MORDOR_LOG_TRACE(g_log) << this << " read(" << len << "): 0";
+            return 0;
+        }
+        if (ring.abandoned)
+            MORDOR_THROW_EXCEPTION(BrokenPipeException());
+        if (ring.cancelledRead)
+            MORDOR_THROW_EXCEPTION(OperationAbortedException());
+
+        MORDOR_LOG_DEBUG(g_log) << this << " waiting to read";
+        park(ring.reader);
+        block(ring.reader, ring.head != ring.tail || ring.writeClosed ||
+            ring.abandoned || ring.cancelledRead || ring.readClosed);
+    }
+}
+
+void
+LockFreePipeStream::cancelRead()
+{
+    atomicSwap(m_in->cancelledRead, 1);
+    wake(m_in->reader);
+}
+
+size_t
+LockFreePipeStream::write(const Buffer &b, size_t len)
+{
+    MORDOR_ASSERT(len != 0);
+    Ring &ring = *m_out;
+    while (true) {
+        if (ring.writeClosed || ring.readClosed)
+            MORDOR_THROW_EXCEPTION(BrokenPipeException());
+        size_t tail = ring.tail, bytes = ring.bytes;
+        if (tail - ring.head < Ring::SLOTS && bytes < ring.capacity) {
+            size_t todo = (std::min)(len, ring.capacity - bytes);
+            ring.slots[tail & (Ring::SLOTS - 1)].copyIn(b, todo);
+            atomicAdd(ring.bytes, todo);
+            atomicIncrement(ring.tail);
+            wake(ring.reader);
+            MORDOR_LOG_TRACE(g_log) << this << " write(" << len << "): "
+                << todo;
+            return todo;
+        }
+        if (ring.cancelledWrite)
+            MORDOR_THROW_EXCEPTION(OperationAbortedException());
+
+        MORDOR_LOG_DEBUG(g_log) << this << " waiting to write";
+        park(ring.writer);
+        block(ring.writer, (ring.tail - ring.head < Ring::SLOTS &&
+            ring.bytes < ring.capacity) || ring.readClosed ||
+            ring.cancelledWrite);
+    }
+}
+
+void
+LockFreePipeStream::cancelWrite()
+{
+    atomicSwap(m_out->cancelledWrite, 1);
+    wake(m_out->writer);
+}
+
+void
+LockFreePipeStream::flush(bool flushParent)
+{
+    Ring &ring = *m_out;
+    while (true) {
+        if (ring.cancelledWrite)
+            MORDOR_THROW_EXCEPTION(OperationAbortedException());
+        if (ring.head == ring.tail)
+            return;
+        if (ring.readClosed)
+            MORDOR_THROW_EXCEPTION(BrokenPipeException());
+
+        MORDOR_LOG_DEBUG(g_log) << this << " waiting to flush";
+        park(ring.writer);
+        block(ring.writer, ring.head == ring.tail || ring.readClosed ||
+            ring.cancelledWrite);
+    }
+}
+
+Signal11::ConnectionRef LockFreePipeStream::onRemoteClose(
+        const Signal11::Signal<void()>::CallbackFunction &slot)
+{
+    return m_onRemoteClose.connect(slot);
+}
+
 }
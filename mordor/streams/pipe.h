@@ -11,6 +11,20 @@ class Stream;
 std::pair<std::shared_ptr<Stream>, std::shared_ptr<Stream> >
     pipeStream(size_t bufferSize = ~0);
 
+/// Create a pipe where each direction is a lock-free single producer,
+/// single consumer ring
+
+/// Reads and writes never take a lock.  Written Buffers are handed to the
+/// reader by sharing their segments instead of copying them.  A waiting
+/// reader is only woken when the ring goes from empty to not empty, and a
+/// waiting writer only once the ring is no more than half full, so fibers
+/// on different threads do not ping-pong on every operation.
+/// @param bufferSize Most data that may be in flight in each direction
+/// @note At most one fiber may read from, and one fiber write to, each end
+/// at a time
+std::pair<std::shared_ptr<Stream>, std::shared_ptr<Stream> >
+    lockFreePipeStream(size_t bufferSize = ~0);
+
 }
 
 #endif
@@ -2,10 +2,16 @@
 #define __MORDOR_SOCKET_STREAM_H__
 // Copyright (c) 2009 - Mozy, Inc.
 
+#include <exception>
+#include <list>
+#include <mutex>
+
 #include "stream.h"
 
 namespace Mordor {
 
+class Fiber;
+class Scheduler;
 class Socket;
 
 class SocketStream : public Stream
@@ -35,9 +41,43 @@ public:
 
     std::shared_ptr<Socket> socket() { return m_socket; }
 
+    /// @see Socket::park
+    void park(std::function<void ()> dg);
+    /// @see Socket::unpark
+    bool unpark();
+
+    /// If concurrent writes should be group committed
+
+    /// When enabled, writes from several Fibers are queued, and whichever
+    /// writer finds no flush in progress sends everything pending with a
+    /// single scatter/gather send (hinting MSG_MORE while more is queued).
+    /// Each write still returns only once all of its bytes have been sent,
+    /// so write() is never partial in this mode.  The statistics
+    /// socketstream.coalesced.writes and socketstream.coalesced.sends count
+    /// the writes, and the sends they took.
+    bool coalesceWrites() const { return m_coalesceWrites; }
+    void coalesceWrites(bool coalesce) { m_coalesceWrites = coalesce; }
+
+private:
+    struct PendingWrite
+    {
+        Buffer *buffer;
+        Scheduler *scheduler;
+        std::shared_ptr<Fiber> fiber;
+        std::exception_ptr exception;
+        bool leader;
+    };
+
+private:
+    size_t coalescedWrite(Buffer &buffer);
+    void flushWrites(std::unique_lock<std::mutex> &lock);
+
 private:
     std::shared_ptr<Socket> m_socket;
-    bool m_own;
+    bool m_own, m_coalesceWrites;
+    std::mutex m_writeMutex;
+    std::list<PendingWrite *> m_writeQueue;
+    bool m_flushing;
 };
 
 }
@@ -4,13 +4,25 @@
 
 #include "buffer.h"
 #include "mordor/assert.h"
+#include "mordor/fiber.h"
+#include "mordor/scheduler.h"
 #include "mordor/socket.h"
+#include "mordor/statistics.h"
 
 namespace Mordor {
 
+static CountStatistic<unsigned long long> &g_statCoalescedWrites =
+    Statistics::registerStatistic("socketstream.coalesced.writes",
+    CountStatistic<unsigned long long>());
+static CountStatistic<unsigned long long> &g_statCoalescedSends =
+    Statistics::registerStatistic("socketstream.coalesced.sends",
+    CountStatistic<unsigned long long>());
+
 SocketStream::SocketStream(Socket::ptr socket, bool own)
 : m_socket(socket),
-  m_own(own)
+  m_own(own),
+  m_coalesceWrites(false),
+  m_flushing(false)
 {
     MORDOR_ASSERT(socket);
 }
@@ -38,8 +50,9 @@ SocketStream::close(CloseType type)
 size_t
 SocketStream::read(Buffer &buffer, size_t length)
 {
-    std::vector<iovec> iovs = buffer.writeBuffers(length);
-    size_t result = m_socket->receive(&iovs[0], iovs.size());
+    iovec iovs[Buffer::STACK_IOVECS];
+    size_t count = buffer.writeBuffers(iovs, Buffer::STACK_IOVECS, length);
+    size_t result = m_socket->receive(iovs, count);
     buffer.produce(result);
     return result;
 }
@@ -59,8 +72,14 @@ SocketStream::cancelRead()
 size_t
 SocketStream::write(const Buffer &buffer, size_t length)
 {
-    const std::vector<iovec> iovs = buffer.readBuffers(length);
-    size_t result = m_socket->send(&iovs[0], iovs.size());
+    if (m_coalesceWrites) {
+        Buffer copy;
+        copy.copyIn(buffer, length);
+        return coalescedWrite(copy);
+    }
+    iovec iovs[Buffer::STACK_IOVECS];
+    size_t count = buffer.readBuffers(iovs, Buffer::STACK_IOVECS, length);
+    size_t result = m_socket->send(iovs, count);
     MORDOR_ASSERT(result > 0);
     return result;
 }
@@ -68,15 +87,135 @@ SocketStream::write(const Buffer &buffer, size_t length)
 size_t
 SocketStream::write(const void *buffer, size_t length)
 {
+    if (m_coalesceWrites) {
+        // The caller's memory stays valid until we return, and we don't
+        // return until it has been sent, so there's no need to copy it
+        Buffer wrapper;
+        wrapper.adopt((void *)buffer, length);
+        wrapper.produce(length);
+        return coalescedWrite(wrapper);
+    }
     return m_socket->send(buffer, length);
 }
 
+size_t
+SocketStream::coalescedWrite(Buffer &buffer)
+{
+    size_t length = buffer.readAvailable();
+    g_statCoalescedWrites.increment();
+    PendingWrite pending;
+    pending.buffer = &buffer;
+    pending.leader = false;
+    std::unique_lock<std::mutex> lock(m_writeMutex);
+    m_writeQueue.push_back(&pending);
+    if (m_flushing) {
+        pending.scheduler = Scheduler::getThis();
+        pending.fiber = Fiber::getThis();
+        lock.unlock();
+        Scheduler::yieldTo();
+        // Either a flush has sent (or failed) our bytes, or the previous
+        // leader has handed the queue to us
+        if (!pending.leader) {
+            if (pending.exception)
+                Mordor::rethrow_exception(pending.exception);
+            return length;
+        }
+        // We're running now; flushWrites() mustn't schedule us again
+        pending.scheduler = NULL;
+        pending.fiber.reset();
+        lock.lock();
+    }
+    m_flushing = true;
+    flushWrites(lock);
+    if (pending.exception)
+        Mordor::rethrow_exception(pending.exception);
+    return length;
+}
+
+void
+SocketStream::flushWrites(std::unique_lock<std::mutex> &lock)
+{
+    std::list<PendingWrite *> batch;
+    batch.swap(m_writeQueue);
+    lock.unlock();
+
+    // Bigger batches just take more than one send
+    iovec iovs[Buffer::STACK_IOVECS];
+    std::list<PendingWrite *>::iterator it = batch.begin();
+    while (it != batch.end() && (*it)->buffer->readAvailable() == 0)
+        ++it;
+    try {
+        while (it != batch.end()) {
+            size_t count = 0;
+            for (std::list<PendingWrite *>::iterator next = it;
+                next != batch.end() && count < Buffer::STACK_IOVECS; ++next)
+                count += (*next)->buffer->readBuffers(&iovs[count],
+                    Buffer::STACK_IOVECS - count);
+            int flags = 0;
+#ifdef MSG_MORE
+            size_t total = 0;
+            for (size_t i = 0; i < count; ++i)
+                total += iovs[i].iov_len;
+            size_t pending = 0;
+            for (std::list<PendingWrite *>::iterator next = it;
+                next != batch.end(); ++next)
+                pending += (*next)->buffer->readAvailable();
+            if (pending > total)
+                flags |= MSG_MORE;
+#endif
+            size_t sent = m_socket->send(iovs, count, flags);
+            g_statCoalescedSends.increment();
+            MORDOR_ASSERT(sent > 0);
+            while (sent > 0) {
+                size_t toConsume = std::min(sent,
+                    (*it)->buffer->readAvailable());
+                (*it)->buffer->consume(toConsume);
+                sent -= toConsume;
+                if ((*it)->buffer->readAvailable() == 0)
+                    ++it;
+            }
+            // Skip over empty writes
+            while (it != batch.end() && (*it)->buffer->readAvailable() == 0)
+                ++it;
+        }
+    } catch (...) {
+        for (; it != batch.end(); ++it)
+            (*it)->exception = std::current_exception();
+    }
+
+    lock.lock();
+    for (it = batch.begin(); it != batch.end(); ++it)
+        if ((*it)->fiber)
+            (*it)->scheduler->schedule((*it)->fiber);
+    if (m_writeQueue.empty()) {
+        m_flushing = false;
+    } else {
+        // Hand off to someone who queued while we were sending, so that we
+        // don't hold up our own caller with other fibers' writes
+        PendingWrite *next = m_writeQueue.front();
+        next->leader = true;
+        next->scheduler->schedule(next->fiber);
+    }
+}
+
 void
 SocketStream::cancelWrite()
 {
     m_socket->cancelSend();
 }
 
+void
+SocketStream::park(std::function<void ()> dg)
+{
+    m_socket->park(dg);
+}
+
+bool
+SocketStream::unpark()
+{
+    return m_socket->unpark();
+}
+
 Signal11::ConnectionRef SocketStream::onRemoteClose(
         const Signal11::Signal<void()>::CallbackFunction &slot)
 {
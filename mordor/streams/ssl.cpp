@@ -7,8 +7,12 @@
 #include <openssl/err.h>
 #include <openssl/x509v3.h>
 
+#include "socket.h"
 #include "mordor/assert.h"
 #include "mordor/log.h"
+#include "mordor/scheduler.h"
+#include "mordor/socket.h"
+#include "mordor/statistics.h"
 #include "mordor/util.h"
 
 #ifdef MSVC
@@ -16,10 +20,30 @@
 #pragma comment(lib, "ssleay32")
 #endif
 
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+// BIO became opaque in 1.1.0
+static void *BIO_get_data(BIO *bio) { return bio->ptr; }
+static void BIO_set_data(BIO *bio, void *ptr) { bio->ptr = ptr; }
+static void BIO_set_init(BIO *bio, int init) { bio->init = init; }
+#endif
+
 namespace Mordor {
 
 static Logger::ptr g_log = Log::lookup("mordor:streams:ssl");
 
+static CountStatistic<unsigned long long> &g_statClientHandshakes =
+    Statistics::registerStatistic("ssl.client.handshakes",
+    CountStatistic<unsigned long long>());
+static CountStatistic<unsigned long long> &g_statClientResumed =
+    Statistics::registerStatistic("ssl.client.resumed",
+    CountStatistic<unsigned long long>());
+static CountStatistic<unsigned long long> &g_statServerHandshakes =
+    Statistics::registerStatistic("ssl.server.handshakes",
+    CountStatistic<unsigned long long>());
+static CountStatistic<unsigned long long> &g_statServerResumed =
+    Statistics::registerStatistic("ssl.server.resumed",
+    CountStatistic<unsigned long long>());
+
 namespace {
 
 static struct SSLInitializer {
@@ -70,6 +94,20 @@ static std::string getOpenSSLErrorMessage()
     return os.str();
 }
 
+// OpenSSL's error queue and errno are per thread, so when a handshake step
+// fails they have to be collected before its SchedulerSwitcher (possibly)
+// moves back to another thread
+static void captureHandshakeError(int result, unsigned long error,
+    std::string &message, error_t &nativeError)
+{
+    if (result > 0 ||
+        (error != SSL_ERROR_SYSCALL && error != SSL_ERROR_SSL))
+        return;
+    nativeError = lastError();
+    if (hasOpenSSLError())
+        message = getOpenSSLErrorMessage();
+}
+
 OpenSSLException::OpenSSLException() :
     std::runtime_error(getOpenSSLErrorMessage())
 {
@@ -81,6 +119,72 @@ CertificateVerificationException::constructMessage(long verifyResult)
     return X509_verify_cert_error_string(verifyResult);
 }
 
+SSLSessionCache::SSLSessionCache(size_t maxSize)
+    : m_maxSize(maxSize)
+{
+    MORDOR_ASSERT(m_maxSize > 0);
+}
+
+size_t
+SSLSessionCache::size()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_sessions.size();
+}
+
+std::shared_ptr<SSL_SESSION>
+SSLSessionCache::get(const Address &address)
+{
+    Address::ptr key(const_cast<Address *>(&address), &nop<Address *>);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    SessionMap::iterator it = m_sessions.find(key);
+    if (it == m_sessions.end())
+        return std::shared_ptr<SSL_SESSION>();
+    return it->second.session;
+}
+
+void
+SSLSessionCache::put(const Address &address, SSL_SESSION *session)
+{
+    std::shared_ptr<SSL_SESSION> ptr(session, &SSL_SESSION_free);
+    Address::ptr key(const_cast<Address *>(&address), &nop<Address *>);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    SessionMap::iterator it = m_sessions.find(key);
+    if (it != m_sessions.end()) {
+        m_lru.splice(m_lru.end(), m_lru, it->second.lru);
+        it->second.session = ptr;
+        return;
+    }
+    key = Address::create(address.name(), address.nameLen());
+    Entry &entry = m_sessions[key];
+    entry.session = ptr;
+    entry.lru = m_lru.insert(m_lru.end(), key);
+    while (m_sessions.size() > m_maxSize) {
+        m_sessions.erase(m_lru.front());
+        m_lru.pop_front();
+    }
+}
+
+void
+SSLSessionCache::erase(const Address &address)
+{
+    Address::ptr key(const_cast<Address *>(&address), &nop<Address *>);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    SessionMap::iterator it = m_sessions.find(key);
+    if (it == m_sessions.end())
+        return;
+    m_lru.erase(it->second.lru);
+    m_sessions.erase(it);
+}
+
+void
+SSLSessionCache::clear()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_sessions.clear();
+    m_lru.clear();
+}
+
 // Adapted from https://www.codeblog.org/viewsrc/openssl-fips-1.1.1/demos/x509/mkcert.c
 static void add_ext(X509 *cert, int nid, const char *value);
 
@@ -162,29 +266,15 @@ void add_ext(X509 *cert, int nid, const char *value)
 
 
 SSLStream::SSLStream(Stream::ptr parent, bool client, bool own, SSL_CTX *ctx)
-: MutatingFilterStream(parent, own)
+: MutatingFilterStream(parent, own),
+  m_handshakeScheduler(NULL)
 {
     MORDOR_ASSERT(parent);
     clearSSLError();
     if (ctx)
         m_ctx.reset(ctx, &nop<SSL_CTX *>);
     else
-        m_ctx.reset(SSL_CTX_new(client ? SSLv23_client_method() :
-            SSLv23_server_method()), &SSL_CTX_free);
-    if (!m_ctx) {
-        MORDOR_ASSERT(hasOpenSSLError());
-        MORDOR_THROW_EXCEPTION(OpenSSLException(getOpenSSLErrorMessage()))
-           // << boost::errinfo_api_function("SSL_CTX_new");
-        ;
-    }
-    // Auto-generate self-signed server cert
-    if (!ctx && !client) {
-        std::shared_ptr<X509> cert;
-        std::shared_ptr<EVP_PKEY> pkey;
-        mkcert(cert, pkey, 1024, rand(), 365);
-        SSL_CTX_use_certificate(m_ctx.get(), cert.get());
-        SSL_CTX_use_PrivateKey(m_ctx.get(), pkey.get());
-    }
+        m_ctx = defaultContext(client);
     m_ssl.reset(SSL_new(m_ctx.get()), &SSL_free);
     if (!m_ssl) {
         MORDOR_ASSERT(hasOpenSSLError());
@@ -192,19 +282,86 @@ SSLStream::SSLStream(Stream::ptr parent, bool client, bool own, SSL_CTX *ctx)
           //  << boost::errinfo_api_function("SSL_CTX_new");
         ;
     }
-    m_readBio = BIO_new(BIO_s_mem());
-    m_writeBio = BIO_new(BIO_s_mem());
-    if (!m_readBio || !m_writeBio) {
-        if (m_readBio) BIO_free(m_readBio);
-        if (m_writeBio) BIO_free(m_writeBio);
+    BIO *bio = BIO_new(bioMethod());
+    if (!bio) {
         MORDOR_ASSERT(hasOpenSSLError());
         MORDOR_THROW_EXCEPTION(OpenSSLException(getOpenSSLErrorMessage()))
           //  << boost::errinfo_api_function("BIO_new");
         ;
     }
-    BIO_set_mem_eof_return(m_readBio, -1);
+    BIO_set_data(bio, this);
+    BIO_set_init(bio, 1);
+    m_readEof = false;
+
+    // The same BIO both ways; m_ssl takes over the one reference
+    SSL_set_bio(m_ssl.get(), bio, bio);
+    SSL_set_app_data(m_ssl.get(), this);
+}
+
+std::shared_ptr<SSL_CTX>
+SSLStream::defaultContext(bool client)
+{
+    static std::mutex mutex;
+    static std::shared_ptr<SSL_CTX> clientContext, serverContext;
+    std::lock_guard<std::mutex> lock(mutex);
+    std::shared_ptr<SSL_CTX> &result = client ? clientContext : serverContext;
+    if (result)
+        return result;
+    std::shared_ptr<SSL_CTX> ctx(SSL_CTX_new(client ? SSLv23_client_method() :
+        SSLv23_server_method()), &SSL_CTX_free);
+    if (!ctx) {
+        MORDOR_ASSERT(hasOpenSSLError());
+        MORDOR_THROW_EXCEPTION(OpenSSLException(getOpenSSLErrorMessage()))
+           // << boost::errinfo_api_function("SSL_CTX_new");
+        ;
+    }
+    // Auto-generate self-signed server cert
+    if (!client) {
+        std::shared_ptr<X509> cert;
+        std::shared_ptr<EVP_PKEY> pkey;
+        mkcert(cert, pkey, 1024, rand(), 365);
+        SSL_CTX_use_certificate(ctx.get(), cert.get());
+        SSL_CTX_use_PrivateKey(ctx.get(), pkey.get());
+        enableSessionCache(ctx.get());
+    } else {
+        enableClientSessionCache(ctx.get());
+    }
+    result = ctx;
+    return result;
+}
+
+void
+SSLStream::enableSessionCache(SSL_CTX *ctx, long cacheSize, long timeout,
+    const std::string &ticketKeys)
+{
+    static const unsigned char sessionIdContext[] = "mordor";
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, cacheSize);
+    SSL_CTX_set_timeout(ctx, timeout);
+    // Required to resume sessions with client certificates
+    SSL_CTX_set_session_id_context(ctx, sessionIdContext,
+        sizeof(sessionIdContext) - 1);
+    SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+    if (!ticketKeys.empty()) {
+        MORDOR_ASSERT(ticketKeys.size() == 80);
+        if (SSL_CTX_set_tlsext_ticket_keys(ctx, (void *)ticketKeys.c_str(),
+            (long)ticketKeys.size()) <= 0) {
+            MORDOR_THROW_EXCEPTION(OpenSSLException(getOpenSSLErrorMessage()))
+              //  << boost::errinfo_api_function("SSL_CTX_set_tlsext_ticket_keys");
+            ;
+        }
+    }
+}
 
-    SSL_set_bio(m_ssl.get(), m_readBio, m_writeBio);
+void
+SSLStream::enableClientSessionCache(SSL_CTX *ctx)
+{
+    // Sessions only reach newSession if OpenSSL isn't keeping them itself;
+    // with TLS 1.3 they arrive after the handshake.  Streams without a
+    // sessionCache() just let them go.
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT |
+        SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, &SSLStream::newSession);
 }
 
 void
@@ -492,27 +649,26 @@ SSLStream::write(const void *buffer, size_t length)
 void
 SSLStream::flush(bool flushParent)
 {
-    static const int WRITE_BUF_LENGTH = 4096;
-    char writeBuf[WRITE_BUF_LENGTH];
-    int toWrite = 0;
-    do {
-        toWrite = BIO_read(m_writeBio, (void *)writeBuf, WRITE_BUF_LENGTH);
-        if (toWrite > 0) {
-            m_writeBuffer.copyIn((const void *)writeBuf, toWrite);
-        }
-    } while (toWrite > 0);
+    // Take what OpenSSL has written so far (sharing, not copying, the
+    // segments), so the lock isn't held while writing to the parent
+    Buffer writeBuffer;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        writeBuffer.copyIn(m_writeBuffer);
+        m_writeBuffer.clear();
+    }
 
-    if (m_writeBuffer.readAvailable() == 0)
+    if (writeBuffer.readAvailable() == 0)
         return;
 
-    while (m_writeBuffer.readAvailable()) {
+    while (writeBuffer.readAvailable()) {
         MORDOR_LOG_TRACE(g_log) << this << " parent()->write("
-            << m_writeBuffer.readAvailable() << ")";
-        size_t written = parent()->write(m_writeBuffer,
-            m_writeBuffer.readAvailable());
+            << writeBuffer.readAvailable() << ")";
+        size_t written = parent()->write(writeBuffer,
+            writeBuffer.readAvailable());
         MORDOR_LOG_TRACE(g_log) << this << " parent()->write("
-            << m_writeBuffer.readAvailable() << "): " << written;
-        m_writeBuffer.consume(written);
+            << writeBuffer.readAvailable() << "): " << written;
+        writeBuffer.consume(written);
     }
 
     if (flushParent)
@@ -524,16 +680,23 @@ SSLStream::accept()
 {
     while (true) {
         unsigned long error = SSL_ERROR_NONE;
-        const int result = sslCallWithLock(std::bind(SSL_accept, m_ssl.get()), &error);
+        int result;
+        std::string message;
+        error_t nativeError = 0;
+        {
+            SchedulerSwitcher switcher(m_handshakeScheduler);
+            result = sslCallWithLock(std::bind(SSL_accept, m_ssl.get()), &error);
+            captureHandshakeError(result, error, message, nativeError);
+        }
         if (result > 0) {
-            flush(false);
+            handshakeComplete(false);
             return;
         }
         MORDOR_LOG_DEBUG(g_log) << this << " SSL_accept(" << m_ssl.get()
             << "): " << result << " (" << error << ")";
         switch (error) {
             case SSL_ERROR_NONE:
-                flush(false);
+                handshakeComplete(false);
                 return;
             case SSL_ERROR_ZERO_RETURN:
                 // Received close_notify message
@@ -548,8 +711,7 @@ SSLStream::accept()
             case SSL_ERROR_WANT_X509_LOOKUP:
                 MORDOR_NOTREACHED();
             case SSL_ERROR_SYSCALL:
-                if (hasOpenSSLError()) {
-                    std::string message = getOpenSSLErrorMessage();
+                if (!message.empty()) {
                     MORDOR_LOG_ERROR(g_log) << this << " SSL_accept("
                         << m_ssl.get() << "): " << result << " (" << error
                         << ", " << message << ")";
@@ -563,11 +725,10 @@ SSLStream::accept()
                 if (result == 0) {
                     MORDOR_THROW_EXCEPTION(UnexpectedEofException());
                 }
-                MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("SSL_accept");
+                MORDOR_THROW_EXCEPTION_FROM_ERROR_API(nativeError, "SSL_accept");
             case SSL_ERROR_SSL:
                 {
-                    MORDOR_ASSERT(hasOpenSSLError());
-                    std::string message = getOpenSSLErrorMessage();
+                    MORDOR_ASSERT(!message.empty());
                     MORDOR_LOG_ERROR(g_log) << this << " SSL_accept("
                         << m_ssl.get() << "): " << result << " (" << error
                         << ", " << message << ")";
@@ -584,18 +745,26 @@ SSLStream::accept()
 void
 SSLStream::connect()
 {
+    resumeSession();
     while (true) {
         unsigned long error = SSL_ERROR_NONE;
-        const int result = sslCallWithLock(std::bind(SSL_connect, m_ssl.get()), &error);
+        int result;
+        std::string message;
+        error_t nativeError = 0;
+        {
+            SchedulerSwitcher switcher(m_handshakeScheduler);
+            result = sslCallWithLock(std::bind(SSL_connect, m_ssl.get()), &error);
+            captureHandshakeError(result, error, message, nativeError);
+        }
         MORDOR_LOG_DEBUG(g_log) << this << " SSL_connect(" << m_ssl.get()
             << "): " << result << " (" << error << ")";
         if (result > 0) {
-            flush(false);
+            handshakeComplete(true);
             return;
         }
         switch (error) {
             case SSL_ERROR_NONE:
-                flush(false);
+                handshakeComplete(true);
                 return;
             case SSL_ERROR_ZERO_RETURN:
                 // Received close_notify message
@@ -610,8 +779,7 @@ SSLStream::connect()
             case SSL_ERROR_WANT_X509_LOOKUP:
                 MORDOR_NOTREACHED();
             case SSL_ERROR_SYSCALL:
-                if (hasOpenSSLError()) {
-                    std::string message = getOpenSSLErrorMessage();
+                if (!message.empty()) {
                     MORDOR_LOG_ERROR(g_log) << this << " SSL_connect("
                         << m_ssl.get() << "): " << result << " (" << error
                         << ", " << message << ")";
@@ -625,11 +793,10 @@ SSLStream::connect()
                 if (result == 0) {
                     MORDOR_THROW_EXCEPTION(UnexpectedEofException());
                 }
-                MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("SSL_connect");
+                MORDOR_THROW_EXCEPTION_FROM_ERROR_API(nativeError, "SSL_connect");
             case SSL_ERROR_SSL:
                 {
-                    MORDOR_ASSERT(hasOpenSSLError());
-                    std::string message = getOpenSSLErrorMessage();
+                    MORDOR_ASSERT(!message.empty());
                     MORDOR_LOG_ERROR(g_log) << this << " SSL_connect("
                         << m_ssl.get() << "): " << result << " (" << error
                         << ", " << message << ")";
@@ -662,6 +829,84 @@ SSLStream::serverNameIndication(const std::string &hostname)
 #endif
 }
 
+void
+SSLStream::sessionCache(SSLSessionCache::ptr cache, Address::ptr address)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_sessionCache = cache;
+    m_sessionAddress = address;
+}
+
+bool
+SSLStream::sessionReused()
+{
+    return sslCallWithLock(std::bind(SSL_session_reused, m_ssl.get()),
+        NULL) != 0;
+}
+
+void
+SSLStream::resumeSession()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_sessionCache)
+        return;
+    if (!m_sessionAddress) {
+        Stream::ptr stream = parent();
+        while (stream) {
+            if (SocketStream *socketStream =
+                dynamic_cast<SocketStream *>(stream.get())) {
+                m_sessionAddress = socketStream->socket()->remoteAddress();
+                break;
+            }
+            FilterStream *filter = dynamic_cast<FilterStream *>(stream.get());
+            stream = filter ? filter->parent() : Stream::ptr();
+        }
+        if (!m_sessionAddress) {
+            MORDOR_LOG_WARNING(g_log) << this
+                << " no address to resume sessions by";
+            m_sessionCache.reset();
+            return;
+        }
+    }
+    std::shared_ptr<SSL_SESSION> session =
+        m_sessionCache->get(*m_sessionAddress);
+    MORDOR_LOG_DEBUG(g_log) << this << " resuming session with "
+        << *m_sessionAddress << ": " << session.get();
+    if (session)
+        SSL_set_session(m_ssl.get(), session.get());
+}
+
+void
+SSLStream::handshakeComplete(bool client)
+{
+    bool reused = sessionReused();
+    MORDOR_LOG_DEBUG(g_log) << this << " handshake complete (" << m_ssl.get()
+        << "), session " << (reused ? "resumed" : "new");
+    if (client) {
+        g_statClientHandshakes.increment();
+        if (reused)
+            g_statClientResumed.increment();
+    } else {
+        g_statServerHandshakes.increment();
+        if (reused)
+            g_statServerResumed.increment();
+    }
+    flush(false);
+}
+
+int
+SSLStream::newSession(SSL *ssl, SSL_SESSION *session)
+{
+    // Called from within OpenSSL, so m_mutex is already held
+    SSLStream *self = (SSLStream *)SSL_get_app_data(ssl);
+    if (!self || !self->m_sessionCache || !self->m_sessionAddress)
+        return 0;
+    MORDOR_LOG_DEBUG(g_log) << self << " new session with "
+        << *self->m_sessionAddress << ": " << session;
+    self->m_sessionCache->put(*self->m_sessionAddress, session);
+    return 1;
+}
+
 void
 SSLStream::verifyPeerCertificate()
 {
@@ -743,24 +988,17 @@ SSLStream::verifyPeerCertificate(const std::string &hostname)
 void
 SSLStream::wantRead()
 {
-    if (m_readBuffer.readAvailable() == 0) {
-        MORDOR_LOG_TRACE(g_log) << this << " parent()->read(32768)";
-        const size_t result = parent()->read(m_readBuffer, 32768);
-        MORDOR_LOG_TRACE(g_log) << this << " parent()->read(32768): " << result;
-        if (result == 0) {
-            BIO_set_mem_eof_return(m_readBio, 0);
-            return;
-        }
-    }
-    MORDOR_ASSERT(m_readBuffer.readAvailable());
-    const iovec iov = m_readBuffer.readBuffer(~0, false);
-    MORDOR_ASSERT(iov.iov_len > 0);
-    const int written = BIO_write(m_readBio, (char *)iov.iov_base, iov.iov_len);
-    MORDOR_ASSERT(written > 0);
-    if (written > 0) {
-        m_readBuffer.consume(written);
-    }
-    MORDOR_LOG_DEBUG(g_log) << this << " wantRead(): " << written;
+    // OpenSSL only asks for more once it has drained m_readBuffer
+    Buffer readBuffer;
+    MORDOR_LOG_TRACE(g_log) << this << " parent()->read(32768)";
+    const size_t result = parent()->read(readBuffer, 32768);
+    MORDOR_LOG_TRACE(g_log) << this << " parent()->read(32768): " << result;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (result == 0)
+        m_readEof = true;
+    else
+        m_readBuffer.copyIn(readBuffer);
+    MORDOR_LOG_DEBUG(g_log) << this << " wantRead(): " << result;
 }
 
 int
@@ -783,6 +1021,87 @@ SSLStream::sslCallWithLock(std::function<int ()> dg, unsigned long *error)
     return result;
 }
 
+BIO_METHOD *
+SSLStream::bioMethod()
+{
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    static std::mutex mutex;
+    static BIO_METHOD *method = NULL;
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!method) {
+        method = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK,
+            "Mordor::Buffer");
+        if (!method)
+            throw std::bad_alloc();
+        BIO_meth_set_read(method, &SSLStream::bioRead);
+        BIO_meth_set_write(method, &SSLStream::bioWrite);
+        BIO_meth_set_ctrl(method, &SSLStream::bioCtrl);
+    }
+    return method;
+#else
+    static BIO_METHOD method = {
+        BIO_TYPE_SOURCE_SINK | 0x7f,
+        "Mordor::Buffer",
+        &SSLStream::bioWrite,
+        &SSLStream::bioRead,
+        NULL, // puts
+        NULL, // gets
+        &SSLStream::bioCtrl,
+        NULL, // create
+        NULL, // destroy
+        NULL, // callback_ctrl
+    };
+    return &method;
+#endif
+}
+
+int
+SSLStream::bioRead(BIO *bio, char *data, int length)
+{
+    SSLStream *self = (SSLStream *)BIO_get_data(bio);
+    BIO_clear_retry_flags(bio);
+    size_t available = self->m_readBuffer.readAvailable();
+    if (available == 0) {
+        if (self->m_readEof)
+            return 0;
+        // SSL_ERROR_WANT_READ; wantRead() will refill m_readBuffer
+        BIO_set_retry_read(bio);
+        return -1;
+    }
+    size_t toRead = (std::min)(available, (size_t)length);
+    self->m_readBuffer.copyOut(data, toRead);
+    self->m_readBuffer.consume(toRead);
+    return (int)toRead;
+}
+
+int
+SSLStream::bioWrite(BIO *bio, const char *data, int length)
+{
+    SSLStream *self = (SSLStream *)BIO_get_data(bio);
+    BIO_clear_retry_flags(bio);
+    self->m_writeBuffer.copyIn(data, length);
+    return length;
+}
+
+long
+SSLStream::bioCtrl(BIO *bio, int cmd, long num, void *ptr)
+{
+    SSLStream *self = (SSLStream *)BIO_get_data(bio);
+    switch (cmd) {
+        case BIO_CTRL_FLUSH:
+            // flush() does the real work, outside of OpenSSL
+            return 1;
+        case BIO_CTRL_EOF:
+            return self->m_readEof && self->m_readBuffer.readAvailable() == 0;
+        case BIO_CTRL_PENDING:
+            return (long)self->m_readBuffer.readAvailable();
+        case BIO_CTRL_WPENDING:
+            return (long)self->m_writeBuffer.readAvailable();
+        default:
+            return 0;
+    }
+}
+
 }
 
 #include "mordor/error_info.cpp"
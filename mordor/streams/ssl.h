@@ -4,15 +4,20 @@
 
 #include "filter.h"
 
+#include <list>
+#include <map>
 #include <mutex>
 #include <vector>
 
 #include <openssl/ssl.h>
 
 #include "buffer.h"
+#include "mordor/socket.h"
 
 namespace Mordor {
 
+class Scheduler;
+
 class OpenSSLException : public std::runtime_error
 {
 public:
@@ -45,14 +50,80 @@ private:
     long m_verifyResult;
 };
 
+/// Client side sessions, keyed by the Address they were established with
+
+/// Connecting again to the same Address with a session from here resumes
+/// it, skipping the full handshake and its public key operations.  Can be
+/// shared by any number of SSLStreams, on any thread; beyond maxSize(), the
+/// least recently stored sessions are dropped.
+class SSLSessionCache : Mordor::noncopyable
+{
+public:
+    typedef std::shared_ptr<SSLSessionCache> ptr;
+
+public:
+    SSLSessionCache(size_t maxSize = 1024);
+
+    size_t maxSize() const { return m_maxSize; }
+    size_t size();
+
+    /// @return NULL if there is no session for address
+    std::shared_ptr<SSL_SESSION> get(const Address &address);
+    /// Takes over the reference to session
+    void put(const Address &address, SSL_SESSION *session);
+    void erase(const Address &address);
+    void clear();
+
+private:
+    struct AddressLess
+    {
+        bool operator()(const Address::ptr &lhs, const Address::ptr &rhs) const
+        { return *lhs < *rhs; }
+    };
+
+    struct Entry
+    {
+        std::shared_ptr<SSL_SESSION> session;
+        std::list<Address::ptr>::iterator lru;
+    };
+
+    typedef std::map<Address::ptr, Entry, AddressLess> SessionMap;
+
+private:
+    std::mutex m_mutex;
+    size_t m_maxSize;
+    SessionMap m_sessions;
+    // Most recently stored at the back
+    std::list<Address::ptr> m_lru;
+};
+
 class SSLStream : public MutatingFilterStream
 {
 public:
     typedef std::shared_ptr<SSLStream> ptr;
 
 public:
+    /// @param ctx If NULL, a context shared by all SSLStreams for the same
+    /// side is used; the server one has a self-signed certificate, and
+    /// session resumption enabled
     SSLStream(Stream::ptr parent, bool client = true, bool own = true, SSL_CTX *ctx = NULL);
 
+    /// Keeps a server side session cache in ctx, shared by all SSLStreams
+    /// (on all threads) using it, and has it issue session tickets
+    /// @param cacheSize Maximum number of sessions; 0 means unlimited
+    /// @param timeout How long sessions can be resumed for, in seconds
+    /// @param ticketKeys 80 bytes to protect tickets with, so that servers
+    /// sharing them accept each other's tickets; if empty, ctx's own random
+    /// keys are used
+    static void enableSessionCache(SSL_CTX *ctx, long cacheSize = 20480,
+        long timeout = 300, const std::string &ticketKeys = std::string());
+    /// Has new sessions on ctx, a client context, handed to the
+    /// SSLSessionCache of the SSLStream they're for (see sessionCache());
+    /// the default client context already does.  Call it before ctx is
+    /// used, since it changes ctx for every SSLStream (on every thread)
+    /// sharing it.
+    static void enableClientSessionCache(SSL_CTX *ctx);
+
     bool supportsHalfClose() { return false; }
 
     void close(CloseType type = BOTH);
@@ -65,8 +136,29 @@ public:
     void accept();
     void connect();
 
+    /// Where accept() and connect() run OpenSSL's handshake steps (and so
+    /// their public key operations); if NULL, in the calling Fiber's
+    /// Scheduler.  A WorkerPool here keeps a full handshake, which can take
+    /// milliseconds of CPU, from holding up the other Fibers on an
+    /// IOManager thread.  Reading and writing the parent still happens on
+    /// the caller's Scheduler.
+    Scheduler *handshakeScheduler() const { return m_handshakeScheduler; }
+    void handshakeScheduler(Scheduler *scheduler)
+    { m_handshakeScheduler = scheduler; }
+
     void serverNameIndication(const std::string &hostname);
 
+    /// Resume a session from cache in connect(), and store new sessions
+    /// from the server in it
+    /// @param address What to key sessions by; if NULL, the remote address
+    /// of the SocketStream this is (eventually) filtering is used
+    /// @note Call before connect(); if the SSLStream was given its own ctx,
+    /// it needs enableClientSessionCache() for new sessions to be stored
+    void sessionCache(SSLSessionCache::ptr cache,
+        Address::ptr address = Address::ptr());
+    /// If the handshake resumed a previous session
+    bool sessionReused();
+
     void verifyPeerCertificate();
     void verifyPeerCertificate(const std::string &hostname);
     void clearSSLError();
@@ -74,13 +166,29 @@ public:
 private:
     void wantRead();
     int sslCallWithLock(std::function<int ()> dg, unsigned long *error);
+    void resumeSession();
+    void handshakeComplete(bool client);
+
+    static std::shared_ptr<SSL_CTX> defaultContext(bool client);
+    static int newSession(SSL *ssl, SSL_SESSION *session);
+
+    // OpenSSL reads ciphertext straight out of m_readBuffer, and writes it
+    // straight into m_writeBuffer, through a BIO of this type; these are
+    // only called with m_mutex held
+    static BIO_METHOD *bioMethod();
+    static int bioRead(BIO *bio, char *data, int length);
+    static int bioWrite(BIO *bio, const char *data, int length);
+    static long bioCtrl(BIO *bio, int cmd, long num, void *ptr);
 
 private:
     std::mutex m_mutex;
     std::shared_ptr<SSL_CTX> m_ctx;
     std::shared_ptr<SSL> m_ssl;
     Buffer m_readBuffer, m_writeBuffer;
-    BIO *m_readBio, *m_writeBio;
+    bool m_readEof;
+    SSLSessionCache::ptr m_sessionCache;
+    Address::ptr m_sessionAddress;
+    Scheduler *m_handshakeScheduler;
 };
 
 }
@@ -0,0 +1,16 @@
+#ifndef __MORDOR_SSL_CHECK_H__
+#define __MORDOR_SSL_CHECK_H__
+// Copyright (c) 2009 - Mozy, Inc.
+
+// Private to the streams built directly on libcrypto; not part of the API
+
+#include "ssl.h" // for OpenSSLException
+#include "mordor/exception.h"
+
+/// Throws an OpenSSLException describing the thread's OpenSSL error queue if
+/// x is false
+/// @note Expands to an if/else, so an if around it still needs braces to
+/// avoid -Wdangling-else
+#define SSL_CHECK(x) if (!(x)) MORDOR_THROW_EXCEPTION(Mordor::OpenSSLException()); else (void)0
+
+#endif
@@ -20,20 +20,20 @@ Stream::read(void *buffer, size_t length)
     MORDOR_ASSERT(internalBuffer.readAvailable() == result);
     if (result == 0u)
         return 0;
-    std::vector<iovec> iovs = internalBuffer.readBuffers(result);
-    MORDOR_ASSERT(!iovs.empty());
+    iovec iovs[Buffer::STACK_IOVECS];
+    size_t count = internalBuffer.readBuffers(iovs, Buffer::STACK_IOVECS,
+        result);
+    MORDOR_ASSERT(count > 0);
     // It wrote directly into our buffer
-    if (iovs.front().iov_base == buffer && iovs.front().iov_len == result)
+    if (iovs[0].iov_base == buffer && iovs[0].iov_len == result)
         return result;
-    bool overlapping = false;
-    for (std::vector<iovec>::iterator it = iovs.begin();
-        it != iovs.end();
-        ++it) {
-        if (it->iov_base >= buffer || it->iov_base <=
-            (unsigned char *)buffer + length) {
+    // If there are more pieces than we looked at, assume the worst
+    bool overlapping = count == Buffer::STACK_IOVECS;
+    for (size_t i = 0; i < count && !overlapping; ++i) {
+        if (iovs[i].iov_base < (unsigned char *)buffer + length &&
+            (unsigned char *)iovs[i].iov_base + iovs[i].iov_len >
+            (unsigned char *)buffer)
             overlapping = true;
-            break;
-        }
     }
     // It didn't touch our buffer at all; it's safe to just copyOut
     if (!overlapping) {
@@ -0,0 +1,256 @@
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include "tree_hash.h"
+
+#include <string.h>
+
+#include "mapped_file.h"
+#include "mordor/assert.h"
+#include "mordor/exception.h"
+#include "mordor/log.h"
+#include "mordor/parallel.h"
+#include "mordor/scheduler.h"
+
+namespace Mordor {
+
+static Logger::ptr g_log = Log::lookup("mordor:streams:tree_hash");
+
+static const unsigned char LEAF_PREFIX = 0x00;
+static const unsigned char NODE_PREFIX = 0x01;
+
+TreeHashStream::TreeHashStream(Stream::ptr parent, Scheduler &scheduler,
+    size_t leafSize, size_t maxInFlight, bool own)
+: HashStream(parent, own),
+  m_leafSize(leafSize),
+  m_anyLeaves(false),
+  m_leaves(scheduler, maxInFlight)
+{
+    MORDOR_ASSERT(m_leafSize > 0);
+}
+
+size_t
+TreeHashStream::read(Buffer &buffer, size_t length)
+{
+    Buffer temp;
+    size_t result = parent()->read(temp, length);
+    append(temp, result);
+    buffer.copyIn(temp);
+    return result;
+}
+
+size_t
+TreeHashStream::write(const Buffer &buffer, size_t length)
+{
+    size_t result = parent()->write(buffer, length);
+    append(buffer, result);
+    return result;
+}
+
+void
+TreeHashStream::updateHash(const void *buffer, size_t length)
+{
+    const unsigned char *data = (const unsigned char *)buffer;
+    // Only copy what has to outlive the call: the start of the data, if it
+    // finishes a partial leaf...
+    if (m_leaf.readAvailable() > 0) {
+        size_t toCopy = (std::min)(length,
+            m_leafSize - m_leaf.readAvailable());
+        m_leaf.copyIn(data, toCopy);
+        data += toCopy;
+        length -= toCopy;
+        if (m_leaf.readAvailable() == m_leafSize)
+            dispatch();
+    }
+    // ...whole leaves just refer to the caller's memory, so they have to be
+    // hashed before returning...
+    if (length >= m_leafSize) {
+        while (length >= m_leafSize) {
+            Buffer leaf;
+            leaf.adopt((void *)data, m_leafSize);
+            leaf.produce(m_leafSize);
+            m_leaf.copyIn(leaf);
+            dispatch();
+            data += m_leafSize;
+            length -= m_leafSize;
+        }
+        collect(0);
+    }
+    // ...and the end, which starts the next partial leaf
+    m_leaf.copyIn(data, length);
+}
+
+// Shares buffer's segments, instead of hashing them as they go by
+void
+TreeHashStream::append(const Buffer &buffer, size_t length)
+{
+    Buffer copy;
+    copy.copyIn(buffer, length);
+    while (copy.readAvailable() > 0) {
+        size_t toCopy = (std::min)(copy.readAvailable(),
+            m_leafSize - m_leaf.readAvailable());
+        m_leaf.copyIn(copy, toCopy);
+        copy.consume(toCopy);
+        if (m_leaf.readAvailable() == m_leafSize)
+            dispatch();
+    }
+}
+
+void
+TreeHashStream::dispatch()
+{
+    collect(m_leaves.maxInFlight() - 1);
+    Leaf::ptr leaf(new Leaf());
+    leaf->input.copyIn(m_leaf);
+    m_leaf.clear();
+    m_anyLeaves = true;
+    m_leaves.push(leaf, &TreeHashStream::hashLeaf);
+}
+
+// Moves finished leaves, in order, into the tree, until at most keep are
+// still being hashed
+void
+TreeHashStream::collect(size_t keep)
+{
+    while (Leaf::ptr leaf = m_leaves.pop(keep))
+        push(m_stack, leaf->digest);
+}
+
+void
+TreeHashStream::hash(void *result, size_t length) const
+{
+    MORDOR_ASSERT(length == SHA256_DIGEST_LENGTH);
+    // const, so the leaves in flight are folded into a copy of the tree
+    std::vector<Node> stack(m_stack);
+    m_leaves.visit(std::bind(&TreeHashStream::pushLeaf, std::ref(stack),
+        std::placeholders::_1));
+    if (m_leaf.readAvailable() > 0 || !m_anyLeaves)
+        push(stack, leafHash(m_leaf));
+    std::string digest = root(stack);
+    memcpy(result, digest.c_str(), SHA256_DIGEST_LENGTH);
+}
+
+Buffer
+TreeHashStream::dumpContext() const
+{
+    MORDOR_THROW_EXCEPTION(std::logic_error(
+        "TreeHashStream can't dump its context"));
+}
+
+void
+TreeHashStream::reset()
+{
+    m_leaves.clear();
+    m_stack.clear();
+    m_leaf.clear();
+    m_anyLeaves = false;
+}
+
+void
+TreeHashStream::hashLeaf(Leaf &leaf)
+{
+    leaf.digest = leafHash(leaf.input);
+    leaf.input.clear();
+}
+
+void
+TreeHashStream::pushLeaf(std::vector<Node> &stack, const Leaf &leaf)
+{
+    push(stack, leaf.digest);
+}
+
+static void
+updateSHA256(SHA256_CTX *ctx, const void *buffer, size_t length)
+{
+    SHA256_Update(ctx, buffer, length);
+}
+
+std::string
+TreeHashStream::leafHash(const Buffer &leaf)
+{
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, &LEAF_PREFIX, 1);
+    leaf.visit(std::bind(&updateSHA256, &ctx, std::placeholders::_1,
+        std::placeholders::_2));
+    std::string result(SHA256_DIGEST_LENGTH, '\0');
+    SHA256_Final((unsigned char *)&result[0], &ctx);
+    return result;
+}
+
+static std::string
+nodeHash(const std::string &left, const std::string &right)
+{
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, &NODE_PREFIX, 1);
+    SHA256_Update(&ctx, left.c_str(), left.size());
+    SHA256_Update(&ctx, right.c_str(), right.size());
+    std::string result(SHA256_DIGEST_LENGTH, '\0');
+    SHA256_Final((unsigned char *)&result[0], &ctx);
+    return result;
+}
+
+// Like incrementing a binary counter: a new leaf merges with every complete
+// subtree of the same size to its left
+void
+TreeHashStream::push(std::vector<Node> &stack, const std::string &digest)
+{
+    Node node;
+    node.digest = digest;
+    node.height = 0;
+    while (!stack.empty() && stack.back().height == node.height) {
+        node.digest = nodeHash(stack.back().digest, node.digest);
+        ++node.height;
+        stack.pop_back();
+    }
+    stack.push_back(node);
+}
+
+// Whatever complete subtrees are left join up right to left, which is
+// exactly RFC 6962's largest-power-of-two split
+std::string
+TreeHashStream::root(const std::vector<Node> &stack)
+{
+    MORDOR_ASSERT(!stack.empty());
+    std::string result = stack.back().digest;
+    for (size_t i = stack.size() - 1; i > 0; --i)
+        result = nodeHash(stack[i - 1].digest, result);
+    return result;
+}
+
+std::string
+TreeHashStream::hashFile(const std::string &path, size_t leafSize,
+    int parallelism)
+{
+    MORDOR_ASSERT(leafSize > 0);
+    // Several leaves are read at once, each sequentially
+    MappedFileStream file(path, MappedFileStream::NORMAL);
+    // Only slices of the mapping; nothing is read until a leaf is hashed
+    std::vector<Leaf> leaves;
+    leaves.reserve((size_t)(file.size() / leafSize) + 1);
+    while (true) {
+        Leaf leaf;
+        while (leaf.input.readAvailable() < leafSize &&
+            file.read(leaf.input, leafSize - leaf.input.readAvailable()) > 0);
+        if (leaf.input.readAvailable() == 0 && !leaves.empty())
+            break;
+        leaves.push_back(leaf);
+        if (leaf.input.readAvailable() < leafSize)
+            break;
+    }
+
+    Scheduler *scheduler = Scheduler::getThis();
+    if (parallelism == -1)
+        parallelism = scheduler ? (int)scheduler->threadCount() : 1;
+    MORDOR_LOG_DEBUG(g_log) << "hashFile(" << path << "): " << leaves.size()
+        << " leaves, parallelism " << parallelism;
+    parallel_foreach(leaves.begin(), leaves.end(),
+        &TreeHashStream::hashLeaf, parallelism);
+
+    std::vector<Node> stack;
+    for (size_t i = 0; i < leaves.size(); ++i)
+        push(stack, leaves[i].digest);
+    return root(stack);
+}
+
+}
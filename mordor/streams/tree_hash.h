@@ -0,0 +1,105 @@
+#ifndef __MORDOR_TREE_HASH_STREAM_H__
+#define __MORDOR_TREE_HASH_STREAM_H__
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include "hash.h"
+#include "mordor/parallel.h"
+
+namespace Mordor {
+
+class Scheduler;
+
+/// SHA-256 Merkle tree hash, with the leaves hashed in parallel
+
+/// The data is split into leafSize() leaves; only the last can be shorter,
+/// and there is always at least one (so no data is one empty leaf).  As in
+/// RFC 6962, a leaf hashes to SHA-256(0x00 || leaf), and a node to
+/// SHA-256(0x01 || left || right), where the left subtree holds the
+/// largest power of two number of leaves that is less than the whole.
+///
+/// The root is not SHA-256 of the data; but full leaves are independent,
+/// so they are hashed on scheduler's threads concurrently, at most
+/// maxInFlight() at a time.  hashFile() gives the same result for a file,
+/// reading it from several places at once.
+class TreeHashStream : public HashStream
+{
+public:
+    typedef std::shared_ptr<TreeHashStream> ptr;
+
+    static const size_t DEFAULT_LEAF_SIZE = 1024 * 1024;
+
+public:
+    /// @param maxInFlight As for OrderedWorkQueue
+    TreeHashStream(Stream::ptr parent, Scheduler &scheduler,
+        size_t leafSize = DEFAULT_LEAF_SIZE, size_t maxInFlight = 0,
+        bool own = true);
+
+    /// The root hash of a whole file, hashing its leaves with
+    /// parallel_foreach on the current Scheduler, straight from a memory
+    /// mapping
+    /// @param parallelism -1 means one per thread of the current Scheduler
+    static std::string hashFile(const std::string &path,
+        size_t leafSize = DEFAULT_LEAF_SIZE, int parallelism = -1);
+
+    size_t leafSize() const { return m_leafSize; }
+    size_t maxInFlight() const { return m_leaves.maxInFlight(); }
+
+    size_t read(Buffer &buffer, size_t length);
+    using HashStream::read;
+    size_t write(const Buffer &buffer, size_t length);
+    using HashStream::write;
+
+    size_t hashSize() const { return SHA256_DIGEST_LENGTH; }
+    using HashStream::hash;
+    /// Waits for any leaves still being hashed
+    void hash(void *result, size_t length) const;
+    /// Not supported: there's no single digest context to resume from
+    /// @throws std::logic_error
+    Buffer dumpContext() const;
+    void reset();
+
+protected:
+    void updateHash(const void *buffer, size_t length);
+
+private:
+    struct Leaf
+    {
+        typedef std::shared_ptr<Leaf> ptr;
+
+        Buffer input;
+        std::string digest;
+    };
+
+    // A complete subtree of 2^height leaves
+    struct Node
+    {
+        std::string digest;
+        unsigned int height;
+    };
+
+private:
+    void append(const Buffer &buffer, size_t length);
+    void dispatch();
+    void collect(size_t keep);
+
+    static void hashLeaf(Leaf &leaf);
+    static void pushLeaf(std::vector<Node> &stack, const Leaf &leaf);
+    static std::string leafHash(const Buffer &leaf);
+    static void push(std::vector<Node> &stack, const std::string &digest);
+    static std::string root(const std::vector<Node> &stack);
+
+private:
+    size_t m_leafSize;
+    // The partial leaf
+    Buffer m_leaf;
+    // Complete subtrees of the leaves hashed so far, in order; heights are
+    // strictly decreasing
+    std::vector<Node> m_stack;
+    bool m_anyLeaves;
+    // Last, so that leaves still being hashed are waited for first
+    OrderedWorkQueue<Leaf> m_leaves;
+};
+
+}
+
+#endif
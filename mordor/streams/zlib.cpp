@@ -0,0 +1,136 @@
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include "zlib.h"
+
+#include <limits.h>
+
+#include "mordor/assert.h"
+#include "mordor/exception.h"
+
+namespace Mordor {
+
+ZlibStream::ZlibStream(Stream::ptr parent, int level, int windowBits,
+    int memLevel, Strategy strategy, bool invert, bool own)
+: ZlibStream(parent, ZLIB, level, windowBits, memLevel, strategy, invert, own)
+{}
+
+ZlibStream::ZlibStream(Stream::ptr parent, Type type, int level,
+    int windowBits, int memLevel, Strategy strategy, bool invert, bool own)
+: CompressionStream(parent, invert, own),
+  m_type(type),
+  m_readInit(false),
+  m_writeInit(false)
+{
+    if (parent->supportsRead())
+        init(m_readStream, READ, level, windowBits, memLevel, strategy);
+    try {
+        if (parent->supportsWrite())
+            init(m_writeStream, WRITE, level, windowBits, memLevel, strategy);
+    } catch (...) {
+        if (m_readInit)
+            end(m_readStream, READ);
+        throw;
+    }
+}
+
+ZlibStream::~ZlibStream()
+{
+    if (m_readInit)
+        end(m_readStream, READ);
+    if (m_writeInit)
+        end(m_writeStream, WRITE);
+}
+
+void
+ZlibStream::init(z_stream &strm, CloseType direction, int level,
+    int windowBits, int memLevel, Strategy strategy)
+{
+    switch (m_type) {
+        case DEFLATE:
+            windowBits = -windowBits;
+            break;
+        case GZIP:
+            windowBits += 16;
+            break;
+        default:
+            break;
+    }
+    memset(&strm, 0, sizeof(z_stream));
+    int rc;
+    if (compressing(direction))
+        rc = deflateInit2(&strm, level, Z_DEFLATED, windowBits, memLevel,
+            (int)strategy);
+    else
+        rc = inflateInit2(&strm, windowBits);
+    switch (rc) {
+        case Z_OK:
+            break;
+        case Z_MEM_ERROR:
+            throw std::bad_alloc();
+        default:
+            MORDOR_THROW_EXCEPTION(ZlibException());
+    }
+    (direction == READ ? m_readInit : m_writeInit) = true;
+}
+
+void
+ZlibStream::end(z_stream &strm, CloseType direction)
+{
+    if (compressing(direction))
+        deflateEnd(&strm);
+    else
+        inflateEnd(&strm);
+}
+
+bool
+ZlibStream::process(CloseType direction, const void *in, size_t &inLength,
+    void *out, size_t &outLength, Action action)
+{
+    z_stream &strm = direction == READ ? m_readStream : m_writeStream;
+    MORDOR_ASSERT(direction == READ ? m_readInit : m_writeInit);
+    uInt availIn = (uInt)(std::min<size_t>)(inLength, UINT_MAX);
+    uInt availOut = (uInt)(std::min<size_t>)(outLength, UINT_MAX);
+    strm.next_in = (Bytef *)in;
+    strm.avail_in = availIn;
+    strm.next_out = (Bytef *)out;
+    strm.avail_out = availOut;
+    int rc;
+    if (compressing(direction))
+        rc = deflate(&strm, action == FINISH ? Z_FINISH :
+            action == FLUSH ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+    else
+        rc = inflate(&strm, Z_NO_FLUSH);
+    inLength = availIn - strm.avail_in;
+    outLength = availOut - strm.avail_out;
+    switch (rc) {
+        case Z_OK:
+        // No progress was possible; the caller will notice
+        case Z_BUF_ERROR:
+            return false;
+        case Z_STREAM_END:
+            return true;
+        case Z_NEED_DICT:
+            MORDOR_THROW_EXCEPTION(NeedPresetDictionaryException());
+        case Z_DATA_ERROR:
+            MORDOR_THROW_EXCEPTION(CorruptedZlibStreamException());
+        case Z_MEM_ERROR:
+            throw std::bad_alloc();
+        default:
+            MORDOR_THROW_EXCEPTION(ZlibException());
+    }
+}
+
+void
+ZlibStream::restart(CloseType direction)
+{
+    MORDOR_ASSERT(!compressing(direction));
+    inflateReset(direction == READ ? &m_readStream : &m_writeStream);
+}
+
+}
+
+#include "mordor/error_info.cpp"
+
+template struct Mordor::ErrorInfo<Mordor::ZlibException>;
+template struct Mordor::ErrorInfo<Mordor::CorruptedZlibStreamException>;
+template struct Mordor::ErrorInfo<Mordor::NeedPresetDictionaryException>;
@@ -0,0 +1,79 @@
+#ifndef __MORDOR_ZLIB_STREAM_H__
+#define __MORDOR_ZLIB_STREAM_H__
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include <zlib.h>
+
+#include "compression.h"
+
+namespace Mordor {
+
+struct ZlibException : virtual StreamException {};
+/// The compressed data is invalid
+struct CorruptedZlibStreamException : virtual ZlibException {};
+/// The compressed stream was made with a preset dictionary
+struct NeedPresetDictionaryException : virtual ZlibException {};
+
+/// Compresses data written, and decompresses data read, with zlib
+/// (RFC 1950), raw deflate (RFC 1951) or gzip (RFC 1952) framing
+class ZlibStream : public CompressionStream
+{
+public:
+    typedef std::shared_ptr<ZlibStream> ptr;
+
+    enum Type
+    {
+        ZLIB,
+        DEFLATE,
+        GZIP
+    };
+
+    enum Strategy
+    {
+        DEFAULT = Z_DEFAULT_STRATEGY,
+        FILTERED = Z_FILTERED,
+        HUFFMAN_ONLY = Z_HUFFMAN_ONLY,
+        RLE = Z_RLE,
+        FIXED = Z_FIXED
+    };
+
+protected:
+    ZlibStream(Stream::ptr parent, Type type, int level, int windowBits,
+        int memLevel, Strategy strategy, bool invert, bool own);
+
+public:
+    /// @param level 0 (no compression) to 9 (best), or Z_DEFAULT_COMPRESSION
+    /// @param windowBits Base two logarithm of the window size, 8 to 15;
+    /// decompressing needs at least the window that was compressed with
+    /// @param memLevel 1 to 9; how much memory to use for compression state
+    /// @param invert Compress data read and decompress data written
+    ZlibStream(Stream::ptr parent, int level = Z_DEFAULT_COMPRESSION,
+        int windowBits = 15, int memLevel = 8, Strategy strategy = DEFAULT,
+        bool invert = false, bool own = true);
+    ~ZlibStream();
+
+    Type type() const { return m_type; }
+
+protected:
+    bool process(CloseType direction, const void *in, size_t &inLength,
+        void *out, size_t &outLength, Action action);
+    void restart(CloseType direction);
+
+private:
+    void init(z_stream &strm, CloseType direction, int level, int windowBits,
+        int memLevel, Strategy strategy);
+    void end(z_stream &strm, CloseType direction);
+
+private:
+    Type m_type;
+    z_stream m_readStream, m_writeStream;
+    bool m_readInit, m_writeInit;
+};
+
+}
+
+extern template struct Mordor::ErrorInfo<Mordor::ZlibException>;
+extern template struct Mordor::ErrorInfo<Mordor::CorruptedZlibStreamException>;
+extern template struct Mordor::ErrorInfo<Mordor::NeedPresetDictionaryException>;
+
+#endif
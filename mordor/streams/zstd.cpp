@@ -0,0 +1,130 @@
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include "zstd.h"
+
+#include <zstd_errors.h>
+
+#include "mordor/assert.h"
+#include "mordor/exception.h"
+
+namespace Mordor {
+
+static size_t
+check(size_t rc, bool decompressing)
+{
+    if (!ZSTD_isError(rc))
+        return rc;
+    switch (ZSTD_getErrorCode(rc)) {
+        case ZSTD_error_memory_allocation:
+            throw std::bad_alloc();
+        default:
+            if (decompressing)
+                MORDOR_THROW_EXCEPTION(CorruptedZstdStreamException());
+            MORDOR_THROW_EXCEPTION(ZstdException());
+    }
+}
+
+ZstdStream::ZstdStream(Stream::ptr parent, int level,
+    const std::string &dictionary, int windowLog, bool invert, bool own)
+: CompressionStream(parent, invert, own)
+{
+    try {
+        if (parent->supportsRead())
+            init(m_read, READ, level, dictionary, windowLog);
+        if (parent->supportsWrite())
+            init(m_write, WRITE, level, dictionary, windowLog);
+    } catch (...) {
+        release(m_read);
+        release(m_write);
+        throw;
+    }
+}
+
+ZstdStream::~ZstdStream()
+{
+    release(m_read);
+    release(m_write);
+}
+
+void
+ZstdStream::init(Context &context, CloseType direction, int level,
+    const std::string &dictionary, int windowLog)
+{
+    if (compressing(direction)) {
+        context.cctx = ZSTD_createCCtx();
+        if (!context.cctx)
+            throw std::bad_alloc();
+        check(ZSTD_CCtx_setParameter(context.cctx, ZSTD_c_compressionLevel,
+            level), false);
+        check(ZSTD_CCtx_setParameter(context.cctx, ZSTD_c_checksumFlag, 1),
+            false);
+        if (windowLog != 0)
+            check(ZSTD_CCtx_setParameter(context.cctx, ZSTD_c_windowLog,
+                windowLog), false);
+        if (!dictionary.empty())
+            check(ZSTD_CCtx_loadDictionary(context.cctx, dictionary.c_str(),
+                dictionary.size()), false);
+    } else {
+        context.dctx = ZSTD_createDCtx();
+        if (!context.dctx)
+            throw std::bad_alloc();
+        if (windowLog != 0)
+            check(ZSTD_DCtx_setParameter(context.dctx, ZSTD_d_windowLogMax,
+                windowLog), false);
+        if (!dictionary.empty())
+            check(ZSTD_DCtx_loadDictionary(context.dctx, dictionary.c_str(),
+                dictionary.size()), false);
+    }
+}
+
+void
+ZstdStream::release(Context &context)
+{
+    ZSTD_freeCCtx(context.cctx);
+    ZSTD_freeDCtx(context.dctx);
+    context.cctx = NULL;
+    context.dctx = NULL;
+}
+
+bool
+ZstdStream::process(CloseType direction, const void *in, size_t &inLength,
+    void *out, size_t &outLength, Action action)
+{
+    Context &context = direction == READ ? m_read : m_write;
+    ZSTD_inBuffer input = { in, inLength, 0 };
+    ZSTD_outBuffer output = { out, outLength, 0 };
+    size_t rc;
+    if (compressing(direction)) {
+        MORDOR_ASSERT(context.cctx);
+        rc = check(ZSTD_compressStream2(context.cctx, &output, &input,
+            action == FINISH ? ZSTD_e_end :
+            action == FLUSH ? ZSTD_e_flush : ZSTD_e_continue), false);
+    } else {
+        MORDOR_ASSERT(context.dctx);
+        rc = check(ZSTD_decompressStream(context.dctx, &output, &input),
+            true);
+    }
+    inLength = input.pos;
+    outLength = output.pos;
+    // Decompressing, 0 means the frame is complete and fully flushed; when
+    // finishing, that the epilogue has been completely written
+    if (compressing(direction))
+        return action == FINISH && rc == 0;
+    return rc == 0;
+}
+
+void
+ZstdStream::restart(CloseType direction)
+{
+    MORDOR_ASSERT(!compressing(direction));
+    Context &context = direction == READ ? m_read : m_write;
+    // Keeps the parameters and dictionary
+    check(ZSTD_DCtx_reset(context.dctx, ZSTD_reset_session_only), true);
+}
+
+}
+
+#include "mordor/error_info.cpp"
+
+template struct Mordor::ErrorInfo<Mordor::ZstdException>;
+template struct Mordor::ErrorInfo<Mordor::CorruptedZstdStreamException>;
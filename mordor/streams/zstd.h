@@ -0,0 +1,64 @@
+#ifndef __MORDOR_ZSTD_STREAM_H__
+#define __MORDOR_ZSTD_STREAM_H__
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include <zstd.h>
+
+#include "compression.h"
+
+namespace Mordor {
+
+struct ZstdException : virtual StreamException {};
+/// The compressed data is invalid, or needs a different dictionary
+struct CorruptedZstdStreamException : virtual ZstdException {};
+
+/// Compresses data written, and decompresses data read, as a Zstandard frame
+/// (with a content checksum)
+class ZstdStream : public CompressionStream
+{
+public:
+    typedef std::shared_ptr<ZstdStream> ptr;
+
+public:
+    /// @param level 1 (fastest) to ZSTD_maxCLevel(); negative levels trade
+    /// even more ratio for speed
+    /// @param dictionary Raw content or a trained dictionary; both ends must
+    /// use the same one
+    /// @param windowLog Base two logarithm of the window size; 0 means the
+    /// level's default.  When decompressing, the largest window accepted.
+    /// @param invert Compress data read and decompress data written
+    ZstdStream(Stream::ptr parent, int level = ZSTD_CLEVEL_DEFAULT,
+        const std::string &dictionary = std::string(), int windowLog = 0,
+        bool invert = false, bool own = true);
+    ~ZstdStream();
+
+protected:
+    bool process(CloseType direction, const void *in, size_t &inLength,
+        void *out, size_t &outLength, Action action);
+    void restart(CloseType direction);
+
+private:
+    // Only one of the two is used, depending on compressing(direction)
+    struct Context
+    {
+        Context() : cctx(NULL), dctx(NULL) {}
+
+        ZSTD_CCtx *cctx;
+        ZSTD_DCtx *dctx;
+    };
+
+private:
+    void init(Context &context, CloseType direction, int level,
+        const std::string &dictionary, int windowLog);
+    static void release(Context &context);
+
+private:
+    Context m_read, m_write;
+};
+
+}
+
+extern template struct Mordor::ErrorInfo<Mordor::ZstdException>;
+extern template struct Mordor::ErrorInfo<Mordor::CorruptedZstdStreamException>;
+
+#endif
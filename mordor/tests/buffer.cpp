@@ -1,7 +1,9 @@
 // Copyright (c) 2009 - Mozy, Inc.
 
+#include "mordor/statistics.h"
 #include "mordor/streams/buffer.h"
 #include "mordor/test/test.h"
+#include "mordor/thread.h"
 
 using namespace Mordor;
 using namespace Mordor::Test;
@@ -279,7 +281,7 @@ MORDOR_UNITTEST(Buffer, truncateAtWriteSegments)
     buf.copyIn("world");
     buf.truncate(8);
     MORDOR_TEST_ASSERT(buf == "hellowor");
-    MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(buf.writeAvailable(), 10u);
+    MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(buf.writeAvailable(), 5u);
 }
 
 MORDOR_UNITTEST(Buffer, compareEmpty)
@@ -429,22 +431,20 @@ MORDOR_UNITTEST(Buffer, reserveWithWriteAvailable)
 {
     Buffer buf1;
     buf1.reserve(5);
-    // Internal knowledge that reserve doubles the reservation
-    MORDOR_TEST_ASSERT_EQUAL(buf1.writeAvailable(), 10u);
+    MORDOR_TEST_ASSERT_EQUAL(buf1.writeAvailable(), 5u);
     buf1.reserve(11);
-    MORDOR_TEST_ASSERT_EQUAL(buf1.writeAvailable(), 22u);
+    MORDOR_TEST_ASSERT_EQUAL(buf1.writeAvailable(), 11u);
 }
 
 MORDOR_UNITTEST(Buffer, reserveWithReadAndWriteAvailable)
 {
     Buffer buf1("hello");
     buf1.reserve(5);
-    // Internal knowledge that reserve doubles the reservation
     MORDOR_TEST_ASSERT_EQUAL(buf1.readAvailable(), 5u);
-    MORDOR_TEST_ASSERT_EQUAL(buf1.writeAvailable(), 10u);
+    MORDOR_TEST_ASSERT_EQUAL(buf1.writeAvailable(), 5u);
     buf1.reserve(11);
     MORDOR_TEST_ASSERT_EQUAL(buf1.readAvailable(), 5u);
-    MORDOR_TEST_ASSERT_EQUAL(buf1.writeAvailable(), 22u);
+    MORDOR_TEST_ASSERT_EQUAL(buf1.writeAvailable(), 11u);
 }
 
 static void
@@ -836,3 +836,183 @@ MORDOR_UNITTEST(Buffer, clearReadPortionOnly)
     MORDOR_TEST_ASSERT_EQUAL(b.readAvailable(), 0u);
     MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(b.writeAvailable(), 5u);
 }
+
+MORDOR_UNITTEST(Buffer, pooledSegmentsAreRecycled)
+{
+    CountStatistic<unsigned long long> *hits =
+        Statistics::lookup<CountStatistic<unsigned long long> >(
+            "buffer.pool.hits");
+    MORDOR_TEST_ASSERT(hits);
+    void *first;
+    {
+        Buffer b;
+        first = b.writeBuffer(10000, true).iov_base;
+        b.produce(10000);
+    }
+    unsigned long long before = hits->count;
+    Buffer b;
+    MORDOR_TEST_ASSERT_EQUAL(b.writeBuffer(10000, true).iov_base, first);
+    MORDOR_TEST_ASSERT_EQUAL(hits->count, before + 1);
+
+    // Small segments are allocated exactly, and not pooled
+    Buffer small("hello");
+    MORDOR_TEST_ASSERT_EQUAL(hits->count, before + 1);
+}
+
+static void
+reserveAndFree(size_t length, CountStatistic<long long> *cached,
+    long long &result)
+{
+    Buffer *b = new Buffer();
+    b->reserve(length);
+    MORDOR_TEST_ASSERT_EQUAL(b->writeAvailable(), length);
+    long long before = cached->count;
+    delete b;
+    result = cached->count - before;
+}
+
+// How big a block a reservation of length really takes; found by freeing it
+// into a pool that's otherwise empty, on a thread of its own
+static long long
+pooledCapacity(size_t length)
+{
+    CountStatistic<long long> *cached =
+        Statistics::lookup<CountStatistic<long long> >("buffer.pool.cached");
+    MORDOR_TEST_ASSERT(cached);
+    long long result = 0;
+    Thread thread(std::bind(&reserveAndFree, length, cached,
+        std::ref(result)));
+    thread.join();
+    return result;
+}
+
+MORDOR_UNITTEST(Buffer, reserveCapacity)
+{
+    // A BufferedStream's 64K read gets a 64K block, not 128K or 256K
+    MORDOR_TEST_ASSERT_EQUAL(pooledCapacity(65536), 65536ll);
+    // Only just past a class rounds up to the next one
+    MORDOR_TEST_ASSERT_EQUAL(pooledCapacity(16385), 32768ll);
+    MORDOR_TEST_ASSERT_EQUAL(pooledCapacity(4096), 4096ll);
+    // Too small to pool
+    MORDOR_TEST_ASSERT_EQUAL(pooledCapacity(1024), 0ll);
+}
+
+MORDOR_UNITTEST(Buffer, readBuffersIntoArray)
+{
+    Buffer b;
+    b.copyIn("hello");
+    b.copyIn(Buffer("world"));
+    b.copyIn(Buffer("!"));
+    MORDOR_TEST_ASSERT_EQUAL(b.segments(), 3u);
+    iovec iovs[2];
+    MORDOR_TEST_ASSERT_EQUAL(b.readBuffers(iovs, 2), 2u);
+    MORDOR_TEST_ASSERT_EQUAL(iovs[0].iov_len, 5u);
+    MORDOR_TEST_ASSERT_EQUAL(iovs[1].iov_len, 5u);
+    MORDOR_TEST_ASSERT_EQUAL(b.readBuffers(iovs, 2, 7), 2u);
+    MORDOR_TEST_ASSERT_EQUAL(iovs[1].iov_len, 2u);
+    MORDOR_TEST_ASSERT_EQUAL(b.readBuffers(iovs, 2, 3), 1u);
+    MORDOR_TEST_ASSERT_EQUAL(iovs[0].iov_len, 3u);
+    MORDOR_TEST_ASSERT_EQUAL(b.readBuffers(iovs, 2, 0), 0u);
+}
+
+MORDOR_UNITTEST(Buffer, writeBuffersIntoArray)
+{
+    Buffer b;
+    iovec iovs[Buffer::STACK_IOVECS];
+    size_t count = b.writeBuffers(iovs, Buffer::STACK_IOVECS, 10);
+    MORDOR_TEST_ASSERT_EQUAL(count, 1u);
+    MORDOR_TEST_ASSERT_EQUAL(iovs[0].iov_len, 10u);
+    MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(b.writeAvailable(), 10u);
+    memcpy(iovs[0].iov_base, "helloworld", 10);
+    b.produce(10);
+    MORDOR_TEST_ASSERT(b == "helloworld");
+}
+
+MORDOR_UNITTEST(Buffer, findStringLargeMultiSegment)
+{
+    // Long enough for the vectorized search, with near misses (matching
+    // first and last bytes) everywhere, and the real thing straddling a
+    // segment boundary
+    std::string chunk;
+    for (size_t i = 0; i < 1000; ++i)
+        chunk.append("\r\r\r\n");
+    Buffer b(chunk);
+    b.copyIn(Buffer(chunk + "x\r\n\r"));
+    b.copyIn(Buffer("\n" + chunk));
+    MORDOR_TEST_ASSERT_EQUAL(b.segments(), 3u);
+    MORDOR_TEST_ASSERT_EQUAL(b.find("\r\n\r\n"), (ptrdiff_t)chunk.size() * 2 + 1);
+    MORDOR_TEST_ASSERT_EQUAL(b.find("\r\n\r\n", chunk.size() * 2 + 4), -1);
+    MORDOR_TEST_ASSERT_EQUAL(b.find("\r\n\r\n", chunk.size() * 2 + 5),
+        (ptrdiff_t)chunk.size() * 2 + 1);
+
+    // And entirely within a segment, at every alignment
+    for (size_t i = 0; i < 64; ++i) {
+        std::string data(200, 'a');
+        data.replace(i, 3, "abc");
+        data[i + 3] = 'c';
+        Buffer c(data);
+        MORDOR_TEST_ASSERT_EQUAL(c.find("abcc"), (ptrdiff_t)i);
+        MORDOR_TEST_ASSERT_EQUAL(c.find("abcd"), -1);
+    }
+}
+
+MORDOR_UNITTEST(Buffer, recordIterator)
+{
+    Buffer b("one\ntw");
+    b.copyIn(Buffer("o\n\nthree\nfo"));
+    MORDOR_TEST_ASSERT_EQUAL(b.segments(), 2u);
+
+    Buffer::RecordIterator it(b);
+    Buffer::Record record;
+    MORDOR_TEST_ASSERT(it.next(record));
+    MORDOR_TEST_ASSERT(record == "one");
+    MORDOR_TEST_ASSERT(record.contiguous() != NULL);
+    MORDOR_TEST_ASSERT(it.next(record));
+    // Spans both segments
+    MORDOR_TEST_ASSERT(record == "two");
+    MORDOR_TEST_ASSERT(record.contiguous() == NULL);
+    iovec iovs[2];
+    MORDOR_TEST_ASSERT_EQUAL(record.readBuffers(iovs, 2), 2u);
+    MORDOR_TEST_ASSERT_EQUAL(iovs[0].iov_len, 2u);
+    MORDOR_TEST_ASSERT_EQUAL(iovs[1].iov_len, 1u);
+    MORDOR_TEST_ASSERT_EQUAL(record.toString(), "two");
+    MORDOR_TEST_ASSERT(it.next(record));
+    MORDOR_TEST_ASSERT(record.empty());
+    MORDOR_TEST_ASSERT(it.next(record));
+    MORDOR_TEST_ASSERT_EQUAL(record.toString(), "three");
+    MORDOR_TEST_ASSERT(!it.next(record));
+    MORDOR_TEST_ASSERT_EQUAL(it.consumed(), 15u);
+    // Nothing is consumed until asked
+    MORDOR_TEST_ASSERT_EQUAL(b.readAvailable(), 17u);
+    MORDOR_TEST_ASSERT(it.remainder(record));
+    MORDOR_TEST_ASSERT(record == "fo");
+    MORDOR_TEST_ASSERT(!it.remainder(record));
+
+    b.consume(15);
+    MORDOR_TEST_ASSERT(b == "fo");
+}
+
+MORDOR_UNITTEST(Buffer, recordIteratorAppended)
+{
+    Buffer b;
+    b.reserve(64);
+    b.copyIn("one\npar");
+    Buffer::RecordIterator it(b);
+    Buffer::Record record;
+    MORDOR_TEST_ASSERT(it.next(record));
+    MORDOR_TEST_ASSERT(record == "one");
+    MORDOR_TEST_ASSERT(!it.next(record));
+
+    // Into the same segment the partial record was found in
+    b.copyIn("ti");
+    MORDOR_TEST_ASSERT_EQUAL(b.segments(), 1u);
+    MORDOR_TEST_ASSERT(!it.next(record));
+    // And into a new one
+    b.copyIn(Buffer("al\nrest"));
+    MORDOR_TEST_ASSERT(it.next(record));
+    MORDOR_TEST_ASSERT_EQUAL(record.toString(), "partial");
+    MORDOR_TEST_ASSERT(!it.next(record));
+    MORDOR_TEST_ASSERT_EQUAL(it.consumed(), 12u);
+    MORDOR_TEST_ASSERT(it.remainder(record));
+    MORDOR_TEST_ASSERT(record == "rest");
+}
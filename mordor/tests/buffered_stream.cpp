@@ -116,6 +116,80 @@ MORDOR_UNITTEST(BufferedStream, partialReadRawPointer)
     MORDOR_TEST_ASSERT_EQUAL(bufferedStream->tell(), 5);
 }
 
+MORDOR_UNITTEST(BufferedStream, largeReadBypassesBuffer)
+{
+    MemoryStream::ptr baseStream(new MemoryStream(Buffer(std::string(100, 'a'))));
+    BufferedStream::ptr bufferedStream(new BufferedStream(baseStream));
+    // Only in adaptive mode; a fixed size keeps it from changing
+    bufferedStream->adaptiveBufferSize(10, 10);
+
+    Buffer output;
+    // The first two buffer-fuls go directly into output; only the last 5
+    // bytes come through the buffer (which reads ahead as usual)
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->read(output, 25), 25u);
+    MORDOR_TEST_ASSERT_EQUAL(baseStream->tell(), 30);
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->read(output, 5), 5u);
+    MORDOR_TEST_ASSERT_EQUAL(baseStream->tell(), 30);
+    char raw[20];
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->read(raw, 20), 20u);
+    MORDOR_TEST_ASSERT_EQUAL(baseStream->tell(), 50);
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->tell(), 50);
+}
+
+MORDOR_UNITTEST(BufferedStream, adaptiveBufferSize)
+{
+    MemoryStream::ptr baseStream(new MemoryStream(Buffer(std::string(1000, 'a'))));
+    TestStream::ptr testStream(new TestStream(baseStream));
+    BufferedStream::ptr bufferedStream(new BufferedStream(testStream));
+    bufferedStream->bufferSize(8);
+    bufferedStream->adaptiveBufferSize(4, 32);
+    MORDOR_TEST_ASSERT(bufferedStream->adaptiveBufferSize());
+
+    Buffer output;
+    // Full reads from the parent grow the buffer, up to the maximum
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->read(output, 1), 1u);
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->bufferSize(), 16u);
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->read(output, 7), 7u);
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->read(output, 1), 1u);
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->bufferSize(), 32u);
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->read(output, 15), 15u);
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->read(output, 1), 1u);
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->bufferSize(), 32u);
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->read(output, 31), 31u);
+
+    // Short ones shrink it, down to the minimum
+    testStream->maxReadSize(1);
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->read(output, 1), 1u);
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->bufferSize(), 16u);
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->read(output, 1), 1u);
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->bufferSize(), 8u);
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->read(output, 1), 1u);
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->bufferSize(), 4u);
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->read(output, 1), 1u);
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->bufferSize(), 4u);
+
+    bufferedStream->bufferSize(64);
+    MORDOR_TEST_ASSERT(!bufferedStream->adaptiveBufferSize());
+}
+
+MORDOR_UNITTEST(BufferedStream, adaptiveLargeReads)
+{
+    MemoryStream::ptr baseStream(new MemoryStream(Buffer(std::string(1000, 'a'))));
+    BufferedStream::ptr bufferedStream(new BufferedStream(baseStream));
+    bufferedStream->bufferSize(8);
+    bufferedStream->adaptiveBufferSize(4, 32);
+
+    Buffer output;
+    // Reads that bypass the buffer still count towards growing it
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->read(output, 16), 16u);
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->bufferSize(), 16u);
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->read(output, 32), 32u);
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->bufferSize(), 32u);
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->read(output, 64), 64u);
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->bufferSize(), 32u);
+    MORDOR_TEST_ASSERT_EQUAL(baseStream->tell(), 112);
+}
+
 MORDOR_UNITTEST(BufferedStream, write)
 {
     MemoryStream::ptr baseStream(new MemoryStream());
@@ -247,6 +321,72 @@ MORDOR_UNITTEST(BufferedStream, findSanityChecks)
     MORDOR_TEST_ASSERT_EQUAL(bufferedStream->find("\r\n", 20, false), -21);
 }
 
+static void
+collectRecord(std::vector<std::string> &records, const Buffer::Record &record)
+{
+    records.push_back(record.toString());
+}
+
+MORDOR_UNITTEST(BufferedStream, readRecords)
+{
+    Stream::ptr baseStream(new SingleplexStream(Stream::ptr(new MemoryStream(
+        Buffer("one\ntwo\nthree\n\nfour"))), SingleplexStream::READ));
+    BufferedStream::ptr bufferedStream(new BufferedStream(baseStream));
+    bufferedStream->bufferSize(5);
+    std::vector<std::string> records;
+    std::function<void (const Buffer::Record &)> dg =
+        std::bind(&collectRecord, std::ref(records), std::placeholders::_1);
+
+    // Only what is already buffered is returned
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->readRecords(dg), 1u);
+    MORDOR_TEST_ASSERT_EQUAL(records.back(), "one");
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->getDelimited(), "two\n");
+    Buffer b("thr");
+    bufferedStream->unread(b);
+    // Both records came in with the same read from the parent
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->readRecords(dg), 2u);
+    MORDOR_TEST_ASSERT_EQUAL(records[1], "thrthree");
+    MORDOR_TEST_ASSERT_EQUAL(records[2], "");
+    MORDOR_TEST_ASSERT_EXCEPTION(bufferedStream->readRecords(dg),
+        UnexpectedEofException);
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->readRecords(dg, '\n', ~0, true),
+        1u);
+    MORDOR_TEST_ASSERT_EQUAL(records.back(), "four");
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->readRecords(dg), 0u);
+    MORDOR_TEST_ASSERT_EQUAL(records.size(), 4u);
+}
+
+MORDOR_UNITTEST(BufferedStream, readRecordsAcrossReads)
+{
+    // Each read from the parent brings in a little more of a long record
+    std::string longRecord(1000, 'x');
+    Stream::ptr baseStream(new SingleplexStream(Stream::ptr(new MemoryStream(
+        Buffer(longRecord + "\nshort\n"))), SingleplexStream::READ));
+    BufferedStream::ptr bufferedStream(new BufferedStream(baseStream));
+    bufferedStream->bufferSize(7);
+    std::vector<std::string> records;
+    std::function<void (const Buffer::Record &)> dg =
+        std::bind(&collectRecord, std::ref(records), std::placeholders::_1);
+
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->readRecords(dg, '\n', 2000), 1u);
+    MORDOR_TEST_ASSERT_EQUAL(records.back(), longRecord);
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->readRecords(dg), 1u);
+    MORDOR_TEST_ASSERT_EQUAL(records.back(), "short");
+    MORDOR_TEST_ASSERT_EQUAL(bufferedStream->readRecords(dg), 0u);
+}
+
+MORDOR_UNITTEST(BufferedStream, readRecordsSanityCheck)
+{
+    MemoryStream::ptr baseStream(new MemoryStream(Buffer("01234567890123456789")));
+    BufferedStream::ptr bufferedStream(new BufferedStream(baseStream));
+    bufferedStream->bufferSize(5);
+    std::vector<std::string> records;
+    MORDOR_TEST_ASSERT_EXCEPTION(bufferedStream->readRecords(
+        std::bind(&collectRecord, std::ref(records), std::placeholders::_1)),
+        BufferOverflowException);
+    MORDOR_TEST_ASSERT(records.empty());
+}
+
 MORDOR_UNITTEST(BufferedStream, testEmptyBuffer)
 {
     MemoryStream::ptr baseStream(new MemoryStream(Buffer()));
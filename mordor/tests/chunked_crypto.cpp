@@ -0,0 +1,192 @@
+// Copyright (c) 2011 - Mozy, Inc.
+
+#include <openssl/evp.h>
+
+#include "mordor/streams/chunked_crypto.h"
+#include "mordor/streams/memory.h"
+#include "mordor/streams/singleplex.h"
+#include "mordor/test/test.h"
+#include "mordor/workerpool.h"
+
+using namespace Mordor;
+using namespace Mordor::Test;
+
+static const std::string g_key("0123456789abcdef0123456789abcdef");
+
+static std::string
+plaintext(size_t size)
+{
+    std::string result;
+    result.reserve(size);
+    for (size_t i = 0; i < size; ++i)
+        result.push_back((char)(i * 7 + i / 251));
+    return result;
+}
+
+static Buffer
+encrypt(Scheduler &scheduler, const std::string &data, size_t chunkSize,
+    size_t maxInFlight = 0, const EVP_CIPHER *cipher = EVP_aes_256_gcm())
+{
+    std::shared_ptr<MemoryStream> output(new MemoryStream());
+    ChunkedCryptoStream stream(Stream::ptr(new SingleplexStream(output,
+        SingleplexStream::WRITE)), scheduler, cipher, g_key, chunkSize,
+        maxInFlight);
+    Buffer buffer(data);
+    while (buffer.readAvailable() > 0)
+        buffer.consume(stream.write(buffer, buffer.readAvailable()));
+    stream.close();
+    return output->buffer();
+}
+
+static ChunkedCryptoStream::ptr
+decryptor(Scheduler &scheduler, const Buffer &ciphertext,
+    const EVP_CIPHER *cipher = EVP_aes_256_gcm(),
+    const std::string &key = g_key)
+{
+    return ChunkedCryptoStream::ptr(new ChunkedCryptoStream(
+        Stream::ptr(new SingleplexStream(
+            Stream::ptr(new MemoryStream(ciphertext)),
+            SingleplexStream::READ)), scheduler, cipher, key));
+}
+
+static std::string
+decrypt(Scheduler &scheduler, const Buffer &ciphertext,
+    const EVP_CIPHER *cipher = EVP_aes_256_gcm())
+{
+    ChunkedCryptoStream::ptr stream = decryptor(scheduler, ciphertext, cipher);
+    Buffer result;
+    while (stream->read(result, 65536) > 0);
+    return result.toString();
+}
+
+MORDOR_UNITTEST(ChunkedCryptoStream, roundTrip)
+{
+    // Just the calling thread, so chunks are processed one at a time
+    WorkerPool pool(1);
+    const size_t sizes[] = { 0, 1, 999, 1000, 1001, 3005 };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        std::string data = plaintext(sizes[i]);
+        Buffer ciphertext = encrypt(pool, data, 1000);
+        // A header, and a tag per chunk, including the (short) last one
+        MORDOR_TEST_ASSERT_EQUAL(ciphertext.readAvailable(),
+            ChunkedCryptoStream::HEADER_SIZE + sizes[i] +
+            (sizes[i] / 1000 + 1) * ChunkedCryptoStream::TAG_SIZE);
+        MORDOR_TEST_ASSERT(decrypt(pool, ciphertext) == data);
+    }
+}
+
+MORDOR_UNITTEST(ChunkedCryptoStream, parallel)
+{
+    WorkerPool pool(4), serial(1, false);
+    std::string data = plaintext(1000000);
+    Buffer ciphertext = encrypt(pool, data, 4096, 3);
+    MORDOR_TEST_ASSERT(decrypt(pool, ciphertext) == data);
+    // Parallel or not makes no difference to the format
+    MORDOR_TEST_ASSERT(decrypt(serial, ciphertext) == data);
+}
+
+#ifndef OPENSSL_NO_CHACHA
+MORDOR_UNITTEST(ChunkedCryptoStream, chacha20Poly1305)
+{
+    WorkerPool pool(2);
+    std::string data = plaintext(10000);
+    Buffer ciphertext = encrypt(pool, data, 4096, 0,
+        EVP_chacha20_poly1305());
+    MORDOR_TEST_ASSERT(decrypt(pool, ciphertext, EVP_chacha20_poly1305()) ==
+        data);
+}
+#endif
+
+MORDOR_UNITTEST(ChunkedCryptoStream, tampered)
+{
+    WorkerPool pool(1);
+    std::string data = plaintext(5000);
+    std::string ciphertext = encrypt(pool, data, 1000).toString();
+    // Somewhere in the third chunk
+    ciphertext[ChunkedCryptoStream::HEADER_SIZE + 2 * 1016 + 10] ^= 1;
+    ChunkedCryptoStream::ptr stream = decryptor(pool, Buffer(ciphertext));
+    Buffer result;
+    // The first two chunks are fine
+    MORDOR_TEST_ASSERT_EQUAL(stream->read(result, 1000), 1000u);
+    MORDOR_TEST_ASSERT_EQUAL(stream->read(result, 1000), 1000u);
+    MORDOR_TEST_ASSERT_EXCEPTION(stream->read(result, 1000),
+        CorruptedChunkedCryptoStreamException);
+}
+
+MORDOR_UNITTEST(ChunkedCryptoStream, reordered)
+{
+    WorkerPool pool(1);
+    std::string data = plaintext(5000);
+    std::string ciphertext = encrypt(pool, data, 1000).toString();
+    size_t first = ChunkedCryptoStream::HEADER_SIZE;
+    std::string chunk = ciphertext.substr(first, 1016);
+    ciphertext.replace(first, 1016, ciphertext.substr(first + 1016, 1016));
+    ciphertext.replace(first + 1016, 1016, chunk);
+    MORDOR_TEST_ASSERT_EXCEPTION(decrypt(pool, Buffer(ciphertext)),
+        CorruptedChunkedCryptoStreamException);
+}
+
+MORDOR_UNITTEST(ChunkedCryptoStream, truncated)
+{
+    WorkerPool pool(1);
+    std::string data = plaintext(5000);
+    std::string ciphertext = encrypt(pool, data, 1000).toString();
+    // Without the (empty) last chunk, it's a valid looking 5000 bytes
+    MORDOR_TEST_ASSERT_EXCEPTION(decrypt(pool, Buffer(ciphertext.substr(0,
+        ciphertext.size() - ChunkedCryptoStream::TAG_SIZE))),
+        UnexpectedEofException);
+    // Without the last two, it still isn't the end
+    MORDOR_TEST_ASSERT_EXCEPTION(decrypt(pool, Buffer(ciphertext.substr(0,
+        ciphertext.size() - ChunkedCryptoStream::TAG_SIZE - 1016))),
+        UnexpectedEofException);
+    // Cut in the middle of a chunk, it looks like a last chunk, but isn't
+    MORDOR_TEST_ASSERT_EXCEPTION(decrypt(pool, Buffer(ciphertext.substr(0,
+        ciphertext.size() - 100))),
+        CorruptedChunkedCryptoStreamException);
+}
+
+MORDOR_UNITTEST(ChunkedCryptoStream, wrongKey)
+{
+    WorkerPool pool(1);
+    Buffer ciphertext = encrypt(pool, plaintext(100), 1000);
+    ChunkedCryptoStream::ptr stream = decryptor(pool, ciphertext,
+        EVP_aes_256_gcm(), "fedcba9876543210fedcba9876543210");
+    Buffer result;
+    MORDOR_TEST_ASSERT_EXCEPTION(stream->read(result, 100),
+        CorruptedChunkedCryptoStreamException);
+}
+
+MORDOR_UNITTEST(ChunkedCryptoStream, seek)
+{
+    WorkerPool pool(2);
+    std::string data = plaintext(10500);
+    Buffer ciphertext = encrypt(pool, data, 1000);
+    ChunkedCryptoStream::ptr stream = decryptor(pool, ciphertext);
+    MORDOR_TEST_ASSERT(stream->supportsSeek());
+    MORDOR_TEST_ASSERT_EQUAL(stream->size(), 10500);
+
+    Buffer result;
+    MORDOR_TEST_ASSERT_EQUAL(stream->seek(5017), 5017);
+    MORDOR_TEST_ASSERT_EQUAL(stream->read(result, 100), 100u);
+    MORDOR_TEST_ASSERT(result.toString() == data.substr(5017, 100));
+    MORDOR_TEST_ASSERT_EQUAL(stream->tell(), 5117);
+
+    // Backwards, across chunks
+    result.clear();
+    MORDOR_TEST_ASSERT_EQUAL(stream->seek(-4000, Stream::CURRENT), 1117);
+    while (result.readAvailable() < 2000)
+        stream->read(result, 2000 - result.readAvailable());
+    MORDOR_TEST_ASSERT(result.toString() == data.substr(1117, 2000));
+
+    // Into the last chunk, and to the very end
+    result.clear();
+    MORDOR_TEST_ASSERT_EQUAL(stream->seek(-200, Stream::END), 10300);
+    while (stream->read(result, 1000) > 0);
+    MORDOR_TEST_ASSERT(result.toString() == data.substr(10300));
+    MORDOR_TEST_ASSERT_EQUAL(stream->seek(10500), 10500);
+    MORDOR_TEST_ASSERT_EQUAL(stream->read(result, 1000), 0u);
+
+    MORDOR_TEST_ASSERT_EQUAL(stream->seek(10600), 10600);
+    MORDOR_TEST_ASSERT_EXCEPTION(stream->read(result, 1000),
+        UnexpectedEofException);
+}
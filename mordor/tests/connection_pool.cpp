@@ -0,0 +1,206 @@
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include "mordor/connectionpool.h"
+#include "mordor/iomanager.h"
+#include "mordor/sleep.h"
+#include "mordor/socket.h"
+#include "mordor/test/test.h"
+
+using namespace Mordor;
+using namespace Mordor::Test;
+
+namespace {
+struct Server
+{
+    Socket::ptr listen;
+    std::vector<Socket::ptr> accepted;
+    IPAddress::ptr address;
+};
+}
+
+static Server
+listenOnLoopback(IOManager &ioManager)
+{
+    Server result;
+    result.address = IPAddress::create("127.0.0.1");
+    result.listen = result.address->createSocket(ioManager, SOCK_STREAM);
+    unsigned int opt = 1;
+    result.listen->setOption(SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    while (true) {
+        try {
+            // Random port > 1000
+            result.address->port(rand() % 50000 + 1000);
+            result.listen->bind(result.address);
+            break;
+        } catch (AddressInUseException &) {
+        }
+    }
+    result.listen->listen();
+    return result;
+}
+
+static void acceptOne(Server &server)
+{
+    server.accepted.push_back(server.listen->accept());
+}
+
+MORDOR_SUITE_INVARIANT(ConnectionPool)
+{
+    MORDOR_TEST_ASSERT(!Scheduler::getThis());
+}
+
+MORDOR_UNITTEST(ConnectionPool, reuse)
+{
+    IOManager ioManager;
+    Server server = listenOnLoopback(ioManager);
+    ConnectionPool::ptr pool(new ConnectionPool(ioManager));
+
+    ioManager.schedule(std::bind(&acceptOne, std::ref(server)));
+    Socket::ptr first = pool->checkout(server.address);
+    ioManager.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(server.accepted.size(), 1u);
+    MORDOR_TEST_ASSERT_EQUAL(pool->active(server.address), 1u);
+    pool->checkin(first);
+    MORDOR_TEST_ASSERT_EQUAL(pool->idle(), 1u);
+    MORDOR_TEST_ASSERT_EQUAL(pool->active(server.address), 0u);
+
+    Socket::ptr second = pool->checkout(server.address);
+    MORDOR_TEST_ASSERT(first == second);
+    MORDOR_TEST_ASSERT_EQUAL(pool->idle(), 0u);
+    pool->discard(second);
+    MORDOR_TEST_ASSERT_EQUAL(pool->idle(), 0u);
+    MORDOR_TEST_ASSERT_EQUAL(pool->active(server.address), 0u);
+}
+
+MORDOR_UNITTEST(ConnectionPool, forgetsEmptyHosts)
+{
+    IOManager ioManager;
+    IPAddress::ptr address;
+    {
+        // Nothing listens there once it's closed
+        Server server = listenOnLoopback(ioManager);
+        address = server.address;
+    }
+    ConnectionPool::ptr pool(new ConnectionPool(ioManager));
+    MORDOR_TEST_ASSERT_EXCEPTION(pool->checkout(address),
+        ConnectionRefusedException);
+    MORDOR_TEST_ASSERT_EQUAL(pool->active(address), 0u);
+    MORDOR_TEST_ASSERT_EQUAL(pool->hosts(), 0u);
+
+    // Nor when a connection is checked in to a pool that keeps none idle
+    Server server = listenOnLoopback(ioManager);
+    pool->maxIdle(0);
+    ioManager.schedule(std::bind(&acceptOne, std::ref(server)));
+    Socket::ptr socket = pool->checkout(server.address);
+    ioManager.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(pool->hosts(), 1u);
+    pool->checkin(socket);
+    MORDOR_TEST_ASSERT_EQUAL(pool->idle(), 0u);
+    MORDOR_TEST_ASSERT_EQUAL(pool->hosts(), 0u);
+}
+
+MORDOR_UNITTEST(ConnectionPool, remoteCloseEvicts)
+{
+    IOManager ioManager;
+    Server server = listenOnLoopback(ioManager);
+    ConnectionPool::ptr pool(new ConnectionPool(ioManager));
+
+    ioManager.schedule(std::bind(&acceptOne, std::ref(server)));
+    Socket::ptr socket = pool->checkout(server.address);
+    ioManager.dispatch();
+    pool->checkin(socket);
+    socket.reset();
+    MORDOR_TEST_ASSERT_EQUAL(pool->idle(server.address), 1u);
+
+    server.accepted.clear();
+    unsigned long long start = TimerManager::now();
+    while (pool->idle() != 0u && TimerManager::now() - start < 2000000ull)
+        sleep(ioManager, 10000);
+    MORDOR_TEST_ASSERT_EQUAL(pool->idle(), 0u);
+}
+
+MORDOR_UNITTEST(ConnectionPool, idleTimeout)
+{
+    IOManager ioManager;
+    Server server = listenOnLoopback(ioManager);
+    ConnectionPool::ptr pool(new ConnectionPool(ioManager));
+    pool->idleTimeout(50000);
+
+    ioManager.schedule(std::bind(&acceptOne, std::ref(server)));
+    Socket::ptr socket = pool->checkout(server.address);
+    ioManager.dispatch();
+    pool->checkin(socket);
+    MORDOR_TEST_ASSERT_EQUAL(pool->idle(), 1u);
+    sleep(ioManager, 200000);
+    MORDOR_TEST_ASSERT_EQUAL(pool->idle(), 0u);
+}
+
+MORDOR_UNITTEST(ConnectionPool, maxIdle)
+{
+    IOManager ioManager;
+    Server server = listenOnLoopback(ioManager);
+    ConnectionPool::ptr pool(new ConnectionPool(ioManager));
+    pool->maxIdle(1);
+
+    ioManager.schedule(std::bind(&acceptOne, std::ref(server)));
+    ioManager.schedule(std::bind(&acceptOne, std::ref(server)));
+    Socket::ptr first = pool->checkout(server.address);
+    Socket::ptr second = pool->checkout(server.address);
+    ioManager.dispatch();
+    MORDOR_TEST_ASSERT(first != second);
+    pool->checkin(first);
+    pool->checkin(second);
+    MORDOR_TEST_ASSERT_EQUAL(pool->idle(), 1u);
+    // The oldest idle connection is the one evicted
+    MORDOR_TEST_ASSERT(pool->checkout(server.address) == second);
+}
+
+static void checkoutInFiber(ConnectionPool::ptr pool, Address::ptr address,
+    Socket::ptr &result)
+{
+    result = pool->checkout(address);
+}
+
+MORDOR_UNITTEST(ConnectionPool, maxPerHost)
+{
+    IOManager ioManager;
+    Server server = listenOnLoopback(ioManager);
+    ConnectionPool::ptr pool(new ConnectionPool(ioManager));
+    pool->maxPerHost(1);
+
+    ioManager.schedule(std::bind(&acceptOne, std::ref(server)));
+    Socket::ptr first = pool->checkout(server.address);
+    ioManager.dispatch();
+
+    Socket::ptr second;
+    ioManager.schedule(std::bind(&checkoutInFiber, pool,
+        Address::ptr(server.address), std::ref(second)));
+    ioManager.dispatch();
+    MORDOR_TEST_ASSERT(!second);
+    pool->checkin(first);
+    ioManager.dispatch();
+    MORDOR_TEST_ASSERT(second == first);
+    MORDOR_TEST_ASSERT_EQUAL(server.accepted.size(), 1u);
+}
+
+MORDOR_UNITTEST(ConnectionPool, healthCheckOnCheckout)
+{
+    IOManager ioManager;
+    Server server = listenOnLoopback(ioManager);
+    ConnectionPool::ptr pool(new ConnectionPool(ioManager));
+
+    ioManager.schedule(std::bind(&acceptOne, std::ref(server)));
+    Socket::ptr first = pool->checkout(server.address);
+    ioManager.dispatch();
+    pool->checkin(first);
+    // Unsolicited data means the connection is out of sync; it must not be
+    // handed out again
+    server.accepted.front()->send("x", 1);
+    sleep(ioManager, 10000);
+
+    ioManager.schedule(std::bind(&acceptOne, std::ref(server)));
+    Socket::ptr second = pool->checkout(server.address);
+    ioManager.dispatch();
+    MORDOR_TEST_ASSERT(first != second);
+    MORDOR_TEST_ASSERT_EQUAL(server.accepted.size(), 2u);
+}
@@ -2,7 +2,9 @@
 
 #include "mordor/pch.h"
 
+#include "mordor/streams/buffer.h"
 #include "mordor/streams/file.h"
+#include "mordor/streams/mapped_file.h"
 #include "mordor/test/test.h"
 
 using namespace Mordor;
@@ -133,4 +135,68 @@ MORDOR_UNITTEST(FileStream, openSymlinkToNothing)
     }
     unlink(sym.c_str());
 }
+
+MORDOR_UNITTEST(MappedFileStream, readIsZeroCopy)
+{
+    std::string path = tempfilename();
+    {
+        FileStream file(path, FileStream::WRITE, FileStream::CREATE);
+        Stream &stream(file);
+        stream.write("hello world", 11);
+    }
+    Buffer buffer;
+    try {
+        MappedFileStream::ptr stream(new MappedFileStream(path));
+        MORDOR_TEST_ASSERT_EQUAL(stream->size(), 11);
+        MORDOR_TEST_ASSERT_EQUAL(stream->read(buffer, 5), 5u);
+        MORDOR_TEST_ASSERT_EQUAL(stream->read(buffer, 100), 6u);
+        MORDOR_TEST_ASSERT_EQUAL(stream->read(buffer, 100), 0u);
+        // Consecutive reads extend the same segment
+        MORDOR_TEST_ASSERT_EQUAL(buffer.segments(), 1u);
+
+        char data[5];
+        MORDOR_TEST_ASSERT_EQUAL(stream->seek(-5, Stream::END), 6);
+        MORDOR_TEST_ASSERT_EQUAL(stream->read(data, 5), 5u);
+        MORDOR_TEST_ASSERT(memcmp(data, "world", 5) == 0);
+        stream->willNeed(0, 11);
+        stream->advise(MappedFileStream::RANDOM);
+    } catch (...) {
+        unlink(path.c_str());
+        throw;
+    }
+    unlink(path.c_str());
+    // The Buffer keeps the mapping alive after the stream (and the file) are
+    // gone
+    MORDOR_TEST_ASSERT(buffer == "hello world");
+}
+
+MORDOR_UNITTEST(MappedFileStream, emptyFile)
+{
+    std::string path = tempfilename();
+    {
+        FileStream file(path, FileStream::WRITE, FileStream::CREATE);
+    }
+    MappedFileStream stream(path);
+    unlink(path.c_str());
+    Buffer buffer;
+    MORDOR_TEST_ASSERT_EQUAL(stream.size(), 0);
+    MORDOR_TEST_ASSERT_EQUAL(stream.read(buffer, 10), 0u);
+}
+
+MORDOR_UNITTEST(MappedFileStream, readAfterClose)
+{
+    std::string path = tempfilename();
+    {
+        FileStream file(path, FileStream::WRITE, FileStream::CREATE);
+        Stream &stream(file);
+        stream.write("hello world", 11);
+    }
+    MappedFileStream stream(path);
+    unlink(path.c_str());
+    stream.close(Stream::READ);
+    Buffer buffer;
+    char data[5];
+    MORDOR_TEST_ASSERT_EXCEPTION(stream.read(buffer, 5), std::logic_error);
+    MORDOR_TEST_ASSERT_EXCEPTION(stream.read(data, 5), std::logic_error);
+}
 #endif
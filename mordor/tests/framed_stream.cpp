@@ -0,0 +1,136 @@
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include "mordor/streams/framed.h"
+#include "mordor/streams/memory.h"
+#include "mordor/test/test.h"
+
+using namespace Mordor;
+using namespace Mordor::Test;
+
+static void
+roundTrip(FramedStream::HeaderFormat header, bool checksum)
+{
+    MemoryStream::ptr memory(new MemoryStream());
+    FramedStream framed(memory, header, checksum);
+    const size_t sizes[] = { 0, 1, 127, 128, 300, 16383, 16384, 70000 };
+    const size_t count = sizeof(sizes) / sizeof(sizes[0]);
+    for (size_t i = 0; i < count; ++i)
+        framed.writeFrame(Buffer(std::string(sizes[i], (char)('a' + i))));
+    framed.flush();
+
+    memory->seek(0);
+    for (size_t i = 0; i < count; ++i) {
+        Buffer frame;
+        MORDOR_TEST_ASSERT(framed.readFrame(frame));
+        MORDOR_TEST_ASSERT(frame == std::string(sizes[i], (char)('a' + i)));
+    }
+    Buffer frame;
+    MORDOR_TEST_ASSERT(!framed.readFrame(frame));
+}
+
+MORDOR_UNITTEST(FramedStream, roundTripVarint)
+{
+    roundTrip(FramedStream::VARINT, false);
+}
+
+MORDOR_UNITTEST(FramedStream, roundTripFixed32)
+{
+    roundTrip(FramedStream::FIXED32, false);
+}
+
+MORDOR_UNITTEST(FramedStream, roundTripChecksum)
+{
+    roundTrip(FramedStream::VARINT, true);
+    roundTrip(FramedStream::FIXED32, true);
+}
+
+MORDOR_UNITTEST(FramedStream, headerEncoding)
+{
+    MemoryStream::ptr memory(new MemoryStream());
+    FramedStream framed(memory);
+    framed.writeFrame(Buffer(std::string(300, 'x')));
+    framed.flush();
+    // 300 = 0b10_0101100
+    MORDOR_TEST_ASSERT_EQUAL(memory->size(), 302);
+    unsigned char header[2];
+    memory->buffer().copyOut(header, 2);
+    MORDOR_TEST_ASSERT_EQUAL(header[0], 0xacu);
+    MORDOR_TEST_ASSERT_EQUAL(header[1], 0x02u);
+}
+
+MORDOR_UNITTEST(FramedStream, smallFramesAreBatched)
+{
+    MemoryStream::ptr memory(new MemoryStream());
+    FramedStream framed(memory);
+    framed.writeFrame(Buffer("one"));
+    framed.writeFrame(Buffer("two"));
+    framed.writeFrame(Buffer("three"));
+    MORDOR_TEST_ASSERT_EQUAL(memory->size(), 0);
+    framed.flush();
+    MORDOR_TEST_ASSERT(memory->buffer() == "\x03one\x03two\x05three");
+
+    framed.flushThreshold(4);
+    framed.writeFrame(Buffer("four"));
+    MORDOR_TEST_ASSERT_EQUAL(memory->size(), 19);
+}
+
+MORDOR_UNITTEST(FramedStream, readStopsAtFrameBoundary)
+{
+    MemoryStream::ptr memory(new MemoryStream(Buffer("\x03one\x00\x05three",
+        11)));
+    FramedStream framed(memory);
+    Buffer buffer;
+    MORDOR_TEST_ASSERT_EQUAL(framed.read(buffer, 100), 3u);
+    MORDOR_TEST_ASSERT(buffer == "one");
+    buffer.clear();
+    // The empty frame is skipped, rather than looking like EOF
+    MORDOR_TEST_ASSERT_EQUAL(framed.read(buffer, 2), 2u);
+    MORDOR_TEST_ASSERT_EQUAL(framed.read(buffer, 100), 3u);
+    MORDOR_TEST_ASSERT(buffer == "three");
+    MORDOR_TEST_ASSERT_EQUAL(framed.read(buffer, 100), 0u);
+}
+
+MORDOR_UNITTEST(FramedStream, corruptFrame)
+{
+    MemoryStream::ptr memory(new MemoryStream());
+    FramedStream framed(memory, FramedStream::VARINT, true);
+    framed.writeFrame(Buffer("hello"));
+    framed.flush();
+    MORDOR_TEST_ASSERT_EQUAL(memory->size(), 10);
+
+    // Flip the first byte of the payload
+    Buffer data;
+    data.copyIn(memory->buffer(), 1);
+    data.copyIn("j");
+    data.copyIn(memory->buffer(), 8, 2);
+    FramedStream corrupted(Stream::ptr(new MemoryStream(data)),
+        FramedStream::VARINT, true);
+    Buffer frame;
+    MORDOR_TEST_ASSERT_EXCEPTION(corrupted.readFrame(frame),
+        FrameChecksumException);
+}
+
+MORDOR_UNITTEST(FramedStream, truncatedFrame)
+{
+    FramedStream truncatedPayload(Stream::ptr(new MemoryStream(
+        Buffer("\x05hel"))));
+    Buffer frame;
+    MORDOR_TEST_ASSERT_EXCEPTION(truncatedPayload.readFrame(frame),
+        UnexpectedEofException);
+    FramedStream truncatedHeader(Stream::ptr(new MemoryStream(
+        Buffer("\x85"))));
+    MORDOR_TEST_ASSERT_EXCEPTION(truncatedHeader.readFrame(frame),
+        UnexpectedEofException);
+}
+
+MORDOR_UNITTEST(FramedStream, maxFrameSize)
+{
+    MemoryStream::ptr memory(new MemoryStream(Buffer("\x05hello")));
+    FramedStream framed(memory);
+    framed.maxFrameSize(4);
+    Buffer frame;
+    MORDOR_TEST_ASSERT_EXCEPTION(framed.readFrame(frame),
+        BufferOverflowException);
+    MORDOR_TEST_ASSERT_EXCEPTION(framed.writeFrame(Buffer("hello")),
+        BufferOverflowException);
+}
@@ -1,9 +1,16 @@
+#include <stddef.h>
+
+#include "mordor/endian.h"
 #include "mordor/streams/buffer.h"
 #include "mordor/streams/hash.h"
 #include "mordor/streams/null.h"
 #include "mordor/string.h"
 #include "mordor/test/test.h"
 
+// For XXH3_state_t's layout
+#define XXH_STATIC_LINKING_ONLY
+#include <xxhash.h>
+
 using namespace Mordor;
 using namespace Mordor::Test;
 
@@ -140,3 +147,223 @@ MORDOR_UNITTEST(SHA256Stream, dumpContextAndResume)
 }
 
 #endif
+
+static unsigned int
+crc32Bytewise(const std::string &data, unsigned int polynomial)
+{
+    std::vector<unsigned int> table = CRC32Stream::precomputeTable(polynomial);
+    unsigned int crc = ~0u;
+    for (size_t i = 0; i < data.size(); ++i)
+        crc = (crc >> 8) ^ table[(crc ^ (unsigned char)data[i]) & 0xff];
+    return ~crc;
+}
+
+static std::string
+crcData(size_t size)
+{
+    std::string result;
+    unsigned int x = 12345;
+    for (size_t i = 0; i < size; ++i) {
+        x = x * 1103515245 + 12345;
+        result.push_back((char)(x >> 16));
+    }
+    return result;
+}
+
+MORDOR_UNITTEST(CRC32Stream, knownCRC32)
+{
+    MORDOR_TEST_ASSERT_EQUAL(CRC32Stream::crc32("123456789", 9),
+        0xcbf43926u);
+    MORDOR_TEST_ASSERT_EQUAL(CRC32Stream::crc32("123456789", 9, 0,
+        CRC32Stream::CASTAGNOLI), 0xe3069283u);
+
+    HashStream::ptr hashStream(new CRC32Stream(NullStream::get_ptr()));
+    std::string data("The quick brown fox jumps over the lazy dog");
+    hashStream->write(data, data.size());
+    MORDOR_TEST_ASSERT_EQUAL(hexstringFromData(hashStream->hash()),
+        std::string("414fa339"));
+}
+
+MORDOR_UNITTEST(CRC32Stream, allPolynomialsAndLengths)
+{
+    // Covers every tail length, and both sides of the SIMD thresholds
+    std::string data = crcData(1100);
+    const unsigned int polynomials[] = { CRC32Stream::IEEE,
+        CRC32Stream::CASTAGNOLI, CRC32Stream::KOOPMAN, 0x814141abu };
+    for (size_t p = 0; p < 4; ++p) {
+        std::vector<unsigned int> table =
+            CRC32Stream::precomputeTable(polynomials[p]);
+        for (size_t length = 0; length < 300;
+            length += (length < 140 ? 1 : 37)) {
+            for (size_t offset = 0; offset < 8; offset += 3) {
+                std::string chunk = data.substr(offset, length);
+                unsigned int expected = crc32Bytewise(chunk, polynomials[p]);
+                if (p < 3)
+                    MORDOR_TEST_ASSERT_EQUAL(CRC32Stream::crc32(chunk.c_str(),
+                        length, 0,
+                        (CRC32Stream::WellknownPolynomial)polynomials[p]),
+                        expected);
+                CRC32Stream fromPolynomial(NullStream::get_ptr(),
+                    polynomials[p]);
+                CRC32Stream fromTable(NullStream::get_ptr(), &table[0]);
+                fromPolynomial.write(chunk.c_str(), length);
+                fromTable.write(chunk.c_str(), length);
+                expected = byteswapOnLittleEndian(expected);
+                MORDOR_TEST_ASSERT(fromPolynomial.hash() ==
+                    std::string((const char *)&expected, 4));
+                MORDOR_TEST_ASSERT(fromTable.hash() ==
+                    std::string((const char *)&expected, 4));
+            }
+        }
+    }
+}
+
+MORDOR_UNITTEST(CRC32Stream, incremental)
+{
+    std::string data = crcData(10000);
+    unsigned int whole = CRC32Stream::crc32(data.c_str(), data.size(), 0,
+        CRC32Stream::CASTAGNOLI);
+    unsigned int crc = 0;
+    for (size_t offset = 0; offset < data.size(); offset += 999)
+        crc = CRC32Stream::crc32(data.c_str() + offset,
+            (std::min)((size_t)999, data.size() - offset), crc,
+            CRC32Stream::CASTAGNOLI);
+    MORDOR_TEST_ASSERT_EQUAL(crc, whole);
+}
+
+MORDOR_UNITTEST(CRC32Stream, combine)
+{
+    std::string data = crcData(5000);
+    const unsigned int polynomials[] = { CRC32Stream::IEEE,
+        CRC32Stream::CASTAGNOLI, CRC32Stream::KOOPMAN };
+    const size_t splits[] = { 0, 1, 17, 2500, 4999, 5000 };
+    for (size_t p = 0; p < 3; ++p) {
+        CRC32Stream::WellknownPolynomial polynomial =
+            (CRC32Stream::WellknownPolynomial)polynomials[p];
+        unsigned int whole = CRC32Stream::crc32(data.c_str(), data.size(), 0,
+            polynomial);
+        for (size_t s = 0; s < 6; ++s) {
+            unsigned int crc1 = CRC32Stream::crc32(data.c_str(), splits[s],
+                0, polynomial);
+            unsigned int crc2 = CRC32Stream::crc32(data.c_str() + splits[s],
+                data.size() - splits[s], 0, polynomial);
+            MORDOR_TEST_ASSERT_EQUAL(CRC32Stream::crc32Combine(crc1, crc2,
+                data.size() - splits[s], polynomial), whole);
+        }
+    }
+}
+
+MORDOR_UNITTEST(XXH64Stream, empty)
+{
+    HashStream::ptr hashStream(new XXH64Stream(NullStream::get_ptr()));
+    MORDOR_TEST_ASSERT_EQUAL(hashStream->hashSize(), 8u);
+    MORDOR_TEST_ASSERT_EQUAL(hexstringFromData(hashStream->hash()),
+        std::string("ef46db3751d8e999"));
+}
+
+MORDOR_UNITTEST(XXH64Stream, knownXXH64)
+{
+    HashStream::ptr hashStream(new XXH64Stream(NullStream::get_ptr()));
+    std::string data("The quick brown fox jumps over the lazy dog");
+    hashStream->write(data, data.size());
+    MORDOR_TEST_ASSERT_EQUAL(hexstringFromData(hashStream->hash()),
+        std::string("0b242d361fda71bc"));
+
+    hashStream.reset(new XXH64Stream(NullStream::get_ptr(), 42));
+    hashStream->write(data, data.size());
+    MORDOR_TEST_ASSERT_EQUAL(hexstringFromData(hashStream->hash()),
+        std::string("aa9f288a8baa3d3f"));
+}
+
+MORDOR_UNITTEST(XXH64Stream, dumpContextAndResume)
+{
+    HashStream::ptr tempStream(new XXH64Stream(NullStream::get_ptr(), 42));
+    std::string data("The quick brown fox jumps over the lazy dog");
+    tempStream->write(data, data.size());
+    Buffer buffer = tempStream->dumpContext();
+    tempStream.reset();
+
+    HashStream::ptr hashStream(new XXH64Stream(NullStream::get_ptr(),
+        buffer));
+    // The seed comes along with the context
+    MORDOR_TEST_ASSERT_EQUAL(hexstringFromData(hashStream->hash()),
+        std::string("aa9f288a8baa3d3f"));
+    hashStream->reset();
+    hashStream->write(data, data.size());
+    MORDOR_TEST_ASSERT_EQUAL(hexstringFromData(hashStream->hash()),
+        std::string("aa9f288a8baa3d3f"));
+}
+
+MORDOR_UNITTEST(XXH3Stream, empty)
+{
+    HashStream::ptr hashStream(new XXH3Stream(NullStream::get_ptr()));
+    MORDOR_TEST_ASSERT_EQUAL(hashStream->hashSize(), 8u);
+    MORDOR_TEST_ASSERT_EQUAL(hexstringFromData(hashStream->hash()),
+        std::string("2d06800538d394c2"));
+}
+
+MORDOR_UNITTEST(XXH3Stream, knownXXH3)
+{
+    HashStream::ptr hashStream(new XXH3Stream(NullStream::get_ptr()));
+    std::string data("The quick brown fox jumps over the lazy dog");
+    hashStream->write(data, data.size());
+    MORDOR_TEST_ASSERT_EQUAL(hexstringFromData(hashStream->hash()),
+        std::string("ce7d19a5418fb365"));
+
+    hashStream.reset(new XXH3Stream(NullStream::get_ptr(), 42));
+    hashStream->write(data, data.size());
+    MORDOR_TEST_ASSERT_EQUAL(hexstringFromData(hashStream->hash()),
+        std::string("b4a3f3c36b3c7d26"));
+}
+
+MORDOR_UNITTEST(XXH3Stream, incremental)
+{
+    // Crosses XXH3's internal 256 byte stripe buffer and 1K blocks unevenly
+    std::string data = crcData(100000);
+    XXH3Stream whole(NullStream::get_ptr(), 7);
+    whole.write(data.c_str(), data.size());
+    XXH3Stream pieces(NullStream::get_ptr(), 7);
+    for (size_t offset = 0; offset < data.size(); offset += 333)
+        pieces.write(data.c_str() + offset,
+            (std::min)((size_t)333, data.size() - offset));
+    MORDOR_TEST_ASSERT(whole.hash() == pieces.hash());
+}
+
+MORDOR_UNITTEST(XXH3Stream, dumpContextAndResume)
+{
+    HashStream::ptr tempStream(new XXH3Stream(NullStream::get_ptr()));
+    std::string data("The quick brown fox jumps over the lazy dog");
+    tempStream->write(data, data.size());
+    Buffer buffer = tempStream->dumpContext();
+    tempStream.reset();
+
+    HashStream::ptr hashStream(new XXH3Stream(NullStream::get_ptr(), buffer));
+    hashStream->write(".", 1);
+    MORDOR_TEST_ASSERT_EQUAL(hexstringFromData(hashStream->hash()),
+        std::string("b614e0225d51db19"));
+}
+
+MORDOR_UNITTEST(XXH3Stream, resumeInAnotherProcess)
+{
+    HashStream::ptr tempStream(new XXH3Stream(NullStream::get_ptr()));
+    std::string data("The quick brown fox jumps over the lazy dog");
+    tempStream->write(data, data.size());
+    std::string context = tempStream->dumpContext().toString();
+    tempStream.reset();
+
+    // Another process has libxxhash's default secret somewhere else; point
+    // the dumped state at something that isn't the secret at all
+    std::string bogus(XXH3_SECRET_DEFAULT_SIZE, 'x');
+    const unsigned char *extSecret = (const unsigned char *)bogus.c_str();
+    size_t offset = sizeof(unsigned long long) +
+        offsetof(XXH3_state_t, extSecret);
+    MORDOR_TEST_ASSERT_LESS_THAN_OR_EQUAL(offset + sizeof(extSecret),
+        context.size());
+    memcpy(&context[offset], &extSecret, sizeof(extSecret));
+
+    HashStream::ptr hashStream(new XXH3Stream(NullStream::get_ptr(),
+        Buffer(context)));
+    hashStream->write(".", 1);
+    MORDOR_TEST_ASSERT_EQUAL(hexstringFromData(hashStream->hash()),
+        std::string("b614e0225d51db19"));
+}
@@ -0,0 +1,154 @@
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include "mordor/streams/memory.h"
+#include "mordor/streams/multi_hash.h"
+#include "mordor/streams/null.h"
+#include "mordor/string.h"
+#include "mordor/test/test.h"
+#include "mordor/workerpool.h"
+
+using namespace Mordor;
+using namespace Mordor::Test;
+
+#if !defined(OPENSSL_NO_SHA1) && !defined(OPENSSL_NO_SHA256) && \
+    !defined(OPENSSL_NO_SHA512)
+
+static Buffer
+data(size_t size)
+{
+    // Several segments, of uneven sizes
+    Buffer result;
+    unsigned int seed = 12345;
+    while (result.readAvailable() < size) {
+        std::string segment((std::min)((size_t)(seed % 40000 + 1),
+            size - result.readAvailable()), '\0');
+        for (size_t i = 0; i < segment.size(); ++i) {
+            seed = seed * 1103515245 + 12345;
+            segment[i] = (char)(seed >> 16);
+        }
+        result.copyIn(segment);
+    }
+    return result;
+}
+
+static std::vector<HashStream::ptr>
+individually(const Buffer &buffer)
+{
+    std::vector<HashStream::ptr> result;
+    Stream::ptr null = NullStream::get_ptr();
+    result.push_back(HashStream::ptr(new MD5Stream(null)));
+    result.push_back(HashStream::ptr(new SHA1Stream(null)));
+    result.push_back(HashStream::ptr(new SHA256Stream(null)));
+    result.push_back(HashStream::ptr(new SHA512Stream(null)));
+    result.push_back(HashStream::ptr(new CRC32Stream(null,
+        CRC32Stream::CASTAGNOLI)));
+    result.push_back(HashStream::ptr(new XXH3Stream(null)));
+    for (size_t i = 0; i < result.size(); ++i)
+        result[i]->write(buffer, buffer.readAvailable());
+    return result;
+}
+
+static void
+addAll(MultiHashStream &stream)
+{
+    MORDOR_TEST_ASSERT_EQUAL(stream.add(Mordor::MD5), 0u);
+    MORDOR_TEST_ASSERT_EQUAL(stream.add(Mordor::SHA1), 1u);
+    MORDOR_TEST_ASSERT_EQUAL(stream.add(Mordor::SHA256), 2u);
+    MORDOR_TEST_ASSERT_EQUAL(stream.add(Mordor::SHA512), 3u);
+    MORDOR_TEST_ASSERT_EQUAL(stream.addCRC32(CRC32Stream::CASTAGNOLI), 4u);
+    MORDOR_TEST_ASSERT_EQUAL(stream.add(HashStream::ptr(
+        new XXH3Stream(NullStream::get_ptr()))), 5u);
+}
+
+static void
+assertSameHashes(const MultiHashStream &stream, const Buffer &buffer)
+{
+    std::vector<HashStream::ptr> expected = individually(buffer);
+    MORDOR_TEST_ASSERT_EQUAL(stream.hashes(), expected.size());
+    for (size_t i = 0; i < expected.size(); ++i)
+        MORDOR_TEST_ASSERT_EQUAL(hexstringFromData(stream.hash(i)),
+            hexstringFromData(expected[i]->hash()));
+}
+
+MORDOR_UNITTEST(MultiHashStream, known)
+{
+    MultiHashStream stream(NullStream::get_ptr());
+    stream.add(Mordor::MD5);
+    stream.add(Mordor::SHA1);
+    stream.addCRC32();
+    std::string data("The quick brown fox jumps over the lazy dog");
+    stream.write(data.c_str(), data.size());
+    MORDOR_TEST_ASSERT_EQUAL(hexstringFromData(stream.hash(0)),
+        std::string("9e107d9d372bb6826bd81d3542a419d6"));
+    MORDOR_TEST_ASSERT_EQUAL(hexstringFromData(stream.hash(1)),
+        std::string("2fd4e1c67a2d28fced849ee1bb76e7391b93eb12"));
+    MORDOR_TEST_ASSERT_EQUAL(hexstringFromData(stream.hash(2)),
+        std::string("414fa339"));
+}
+
+MORDOR_UNITTEST(MultiHashStream, write)
+{
+    Buffer buffer = data(300000);
+    MultiHashStream stream(NullStream::get_ptr());
+    addAll(stream);
+    Buffer copy(buffer);
+    while (copy.readAvailable() > 0)
+        copy.consume(stream.write(copy, (std::min)((size_t)70000,
+            copy.readAvailable())));
+    assertSameHashes(stream, buffer);
+
+    stream.reset();
+    stream.write(buffer, buffer.readAvailable());
+    assertSameHashes(stream, buffer);
+}
+
+MORDOR_UNITTEST(MultiHashStream, read)
+{
+    Buffer buffer = data(300000);
+    MultiHashStream stream(Stream::ptr(new MemoryStream(buffer)));
+    addAll(stream);
+    Buffer result;
+    while (stream.read(result, 65536) > 0);
+    MORDOR_TEST_ASSERT(result == buffer);
+    assertSameHashes(stream, buffer);
+}
+
+MORDOR_UNITTEST(MultiHashStream, manySegments)
+{
+    // More pieces than Buffer::STACK_IOVECS describes at once
+    Buffer buffer;
+    Buffer source = data(100000);
+    while (source.readAvailable() > 0) {
+        Buffer segment(source.toString().substr(0, 300));
+        source.consume(segment.readAvailable());
+        buffer.copyIn(segment);
+    }
+    MORDOR_TEST_ASSERT_GREATER_THAN(buffer.segments(), Buffer::STACK_IOVECS);
+    MultiHashStream stream(NullStream::get_ptr());
+    addAll(stream);
+    stream.write(buffer, buffer.readAvailable());
+    assertSameHashes(stream, buffer);
+
+    MultiHashStream reader(Stream::ptr(new MemoryStream(buffer)));
+    addAll(reader);
+    Buffer result;
+    while (reader.read(result, buffer.readAvailable()) > 0);
+    MORDOR_TEST_ASSERT(result == buffer);
+    assertSameHashes(reader, buffer);
+}
+
+MORDOR_UNITTEST(MultiHashStream, parallel)
+{
+    WorkerPool pool(4);
+    Buffer buffer = data(1000000);
+    MultiHashStream stream(NullStream::get_ptr(), 100000);
+    addAll(stream);
+    Buffer copy(buffer);
+    // Both below and above the threshold
+    copy.consume(stream.write(copy, 1000));
+    while (copy.readAvailable() > 0)
+        copy.consume(stream.write(copy, copy.readAvailable()));
+    assertSameHashes(stream, buffer);
+}
+
+#endif
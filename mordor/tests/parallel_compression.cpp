@@ -0,0 +1,182 @@
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include "mordor/atomic.h"
+#include "mordor/streams/gzip.h"
+#include "mordor/streams/lz4.h"
+#include "mordor/streams/memory.h"
+#include "mordor/streams/parallel_compression.h"
+#include "mordor/streams/singleplex.h"
+#include "mordor/streams/zstd.h"
+#include "mordor/test/test.h"
+#include "mordor/workerpool.h"
+
+using namespace Mordor;
+using namespace Mordor::Test;
+
+struct TooMuchCompressionException : virtual StreamException {};
+
+#include "mordor/error_info.cpp"
+template struct Mordor::ErrorInfo<TooMuchCompressionException>;
+
+template <class T>
+static Stream::ptr
+createCompressor(Stream::ptr parent)
+{
+    return Stream::ptr(new T(parent));
+}
+
+static Buffer
+corpus(size_t size)
+{
+    std::ostringstream os;
+    for (unsigned int i = 0; (size_t)os.tellp() < size; ++i)
+        os << "line " << i << " of " << size << "\n";
+    return Buffer(os.str().substr(0, size));
+}
+
+template <class T>
+static Buffer
+decompress(const Buffer &compressed, bool concatenated = true)
+{
+    T stream(Stream::ptr(new SingleplexStream(
+        Stream::ptr(new MemoryStream(compressed)), SingleplexStream::READ)));
+    stream.concatenated(concatenated);
+    Buffer result;
+    while (stream.read(result, 65536) > 0);
+    return result;
+}
+
+template <class T>
+static void
+roundTrip(size_t size, size_t blockSize, size_t maxInFlight)
+{
+    WorkerPool pool(4);
+    Buffer data = corpus(size);
+    std::shared_ptr<MemoryStream> compressed(new MemoryStream());
+    ParallelCompressionStream stream(Stream::ptr(new SingleplexStream(
+        compressed, SingleplexStream::WRITE)), pool, &createCompressor<T>,
+        blockSize, maxInFlight);
+    Buffer copy(data);
+    while (copy.readAvailable() > 0)
+        copy.consume(stream.write(copy, copy.readAvailable()));
+    stream.close();
+    MORDOR_TEST_ASSERT(decompress<T>(compressed->buffer()) == data);
+}
+
+MORDOR_UNITTEST(ParallelCompressionStream, gzip)
+{
+    roundTrip<GzipStream>(1000000, 65536, 3);
+}
+
+MORDOR_UNITTEST(ParallelCompressionStream, zstd)
+{
+    roundTrip<ZstdStream>(1000000, 100000, 0);
+}
+
+MORDOR_UNITTEST(ParallelCompressionStream, lz4)
+{
+    roundTrip<LZ4Stream>(1000000, 12345, 1);
+}
+
+MORDOR_UNITTEST(ParallelCompressionStream, empty)
+{
+    roundTrip<ZstdStream>(0, 65536, 0);
+}
+
+MORDOR_UNITTEST(ParallelCompressionStream, independentBlocks)
+{
+    WorkerPool pool(2);
+    Buffer data = corpus(200000);
+    std::shared_ptr<MemoryStream> compressed(new MemoryStream());
+    ParallelCompressionStream stream(Stream::ptr(new SingleplexStream(
+        compressed, SingleplexStream::WRITE)), pool,
+        &createCompressor<GzipStream>, 65536);
+    MORDOR_TEST_ASSERT_EQUAL(stream.write(data, data.readAvailable()),
+        65536u);
+    data.consume(65536);
+    MORDOR_TEST_ASSERT_EQUAL(stream.write(data, 100), 100u);
+    data.consume(100);
+    // flush() writes out the partial block, so everything so far can be
+    // decompressed
+    stream.flush();
+    MORDOR_TEST_ASSERT(decompress<GzipStream>(compressed->buffer()) ==
+        corpus(200000).toString().substr(0, 65636));
+    while (data.readAvailable() > 0)
+        data.consume(stream.write(data, data.readAvailable()));
+    stream.close();
+    MORDOR_TEST_ASSERT(decompress<GzipStream>(compressed->buffer()) ==
+        corpus(200000));
+
+    // Without concatenated(), only the first block is read
+    Buffer first = decompress<GzipStream>(compressed->buffer(), false);
+    MORDOR_TEST_ASSERT_EQUAL(first.readAvailable(), 65536u);
+}
+
+static int g_active, g_maxActive;
+
+namespace {
+class SlowStream : public FilterStream
+{
+public:
+    SlowStream(Stream::ptr parent)
+        : FilterStream(parent)
+    {
+        int active = atomicIncrement(g_active);
+        int max = g_maxActive;
+        while (active > max && atomicCompareAndSwap(g_maxActive, active, max)
+            != max)
+            max = g_maxActive;
+    }
+
+    size_t write(const Buffer &buffer, size_t length)
+    {
+        Scheduler::yield();
+        return parent()->write(buffer, length);
+    }
+
+    void close(CloseType type = BOTH)
+    {
+        atomicDecrement(g_active);
+        parent()->close(type);
+    }
+};
+}
+
+static Stream::ptr
+createSlowCompressor(Stream::ptr parent)
+{
+    return Stream::ptr(new SlowStream(parent));
+}
+
+MORDOR_UNITTEST(ParallelCompressionStream, boundedInFlight)
+{
+    g_active = g_maxActive = 0;
+    WorkerPool pool(4);
+    Buffer data = corpus(100000);
+    std::shared_ptr<MemoryStream> output(new MemoryStream());
+    ParallelCompressionStream stream(Stream::ptr(new SingleplexStream(
+        output, SingleplexStream::WRITE)), pool, &createSlowCompressor, 1000,
+        3);
+    while (data.readAvailable() > 0)
+        data.consume(stream.write(data, data.readAvailable()));
+    stream.close();
+    MORDOR_TEST_ASSERT_LESS_THAN_OR_EQUAL(g_maxActive, 3);
+    // The identity "compressor" shows the blocks are reassembled in order
+    MORDOR_TEST_ASSERT(output->buffer() == corpus(100000));
+}
+
+static Stream::ptr
+createFailingCompressor(Stream::ptr parent)
+{
+    MORDOR_THROW_EXCEPTION(TooMuchCompressionException());
+}
+
+MORDOR_UNITTEST(ParallelCompressionStream, compressorFails)
+{
+    WorkerPool pool(2);
+    std::shared_ptr<MemoryStream> output(new MemoryStream());
+    ParallelCompressionStream stream(Stream::ptr(new SingleplexStream(
+        output, SingleplexStream::WRITE)), pool, &createFailingCompressor);
+    stream.write("hello", 5);
+    MORDOR_TEST_ASSERT_EXCEPTION(stream.close(), TooMuchCompressionException);
+}
@@ -403,3 +403,121 @@ MORDOR_UNITTEST(PipeStream, eventOnRemoteReset)
     pipe.second.reset();
     MORDOR_TEST_ASSERT(remoteClosed);
 }
+
+MORDOR_UNITTEST(PipeStream, lockFreeBasic)
+{
+    std::pair<Stream::ptr, Stream::ptr> pipe = lockFreePipeStream();
+
+    Buffer read;
+    MORDOR_TEST_ASSERT_EQUAL(pipe.first->write("a"), 1u);
+    MORDOR_TEST_ASSERT_EQUAL(pipe.first->write("bc"), 2u);
+    // Both writes come out of a single read
+    MORDOR_TEST_ASSERT_EQUAL(pipe.second->read(read, 10), 3u);
+    MORDOR_TEST_ASSERT(read == "abc");
+    MORDOR_TEST_ASSERT_EQUAL(pipe.second->write("d"), 1u);
+    MORDOR_TEST_ASSERT_EQUAL(pipe.first->read(read, 10), 1u);
+    MORDOR_TEST_ASSERT(read == "abcd");
+    pipe.first->close();
+    MORDOR_TEST_ASSERT_EQUAL(pipe.second->read(read, 10), 0u);
+}
+
+MORDOR_UNITTEST(PipeStream, lockFreeZeroCopy)
+{
+    std::pair<Stream::ptr, Stream::ptr> pipe = lockFreePipeStream();
+
+    Buffer written(std::string(4096, 'a'));
+    const void *start = written.readBuffer(4096, false).iov_base;
+    MORDOR_TEST_ASSERT_EQUAL(pipe.first->write(written, 4096), 4096u);
+    Buffer read;
+    MORDOR_TEST_ASSERT_EQUAL(pipe.second->read(read, 1000), 1000u);
+    MORDOR_TEST_ASSERT_EQUAL(pipe.second->read(read, 8192), 3096u);
+    MORDOR_TEST_ASSERT_EQUAL(read.segments(), 1u);
+    MORDOR_TEST_ASSERT(read.readBuffer(4096, false).iov_base == start);
+}
+
+MORDOR_UNITTEST(PipeStream, lockFreeBlockingRead)
+{
+    std::pair<Stream::ptr, Stream::ptr> pipe = lockFreePipeStream(5);
+    WorkerPool pool;
+    int sequence = 1;
+
+    pool.schedule(Fiber::ptr(new Fiber(std::bind(&blockingRead, pipe.second,
+        std::ref(sequence)))));
+
+    Buffer output;
+    MORDOR_TEST_ASSERT_EQUAL(pipe.first->read(output, 10), 5u);
+    MORDOR_TEST_ASSERT_EQUAL(++sequence, 4);
+    MORDOR_TEST_ASSERT(output == "hello");
+}
+
+MORDOR_UNITTEST(PipeStream, lockFreeBlockingWrite)
+{
+    std::pair<Stream::ptr, Stream::ptr> pipe = lockFreePipeStream(5);
+    WorkerPool pool;
+    int sequence = 1;
+
+    pool.schedule(Fiber::ptr(new Fiber(std::bind(&blockingWrite, pipe.second,
+        std::ref(sequence)))));
+
+    MORDOR_TEST_ASSERT_EQUAL(pipe.first->write("hello"), 5u);
+    MORDOR_TEST_ASSERT_EQUAL(++sequence, 2);
+    MORDOR_TEST_ASSERT_EQUAL(pipe.first->write("world"), 5u);
+    MORDOR_TEST_ASSERT_EQUAL(++sequence, 4);
+    Buffer output;
+    MORDOR_TEST_ASSERT_EQUAL(pipe.second->read(output, 10), 5u);
+    MORDOR_TEST_ASSERT_EQUAL(++sequence, 5);
+    MORDOR_TEST_ASSERT(output == "world");
+}
+
+MORDOR_UNITTEST(PipeStream, lockFreeCloseOnBlockingReader)
+{
+    std::pair<Stream::ptr, Stream::ptr> pipe = lockFreePipeStream();
+    WorkerPool pool;
+    int sequence = 1;
+
+    pool.schedule(Fiber::ptr(new Fiber(std::bind(&closeOnBlockingReader,
+        pipe.first, std::ref(sequence)))));
+
+    Buffer output;
+    MORDOR_TEST_ASSERT_EQUAL(pipe.second->read(output, 10), 0u);
+    MORDOR_TEST_ASSERT_EQUAL(++sequence, 4);
+}
+
+MORDOR_UNITTEST(PipeStream, lockFreeCancelOnBlockingReader)
+{
+    std::pair<Stream::ptr, Stream::ptr> pipe = lockFreePipeStream();
+    WorkerPool pool;
+    int sequence = 1;
+
+    pool.schedule(Fiber::ptr(new Fiber(std::bind(&cancelOnBlockingReader,
+        pipe.first, std::ref(sequence)))));
+
+    Buffer output;
+    MORDOR_TEST_ASSERT_EXCEPTION(pipe.first->read(output, 10), OperationAbortedException);
+    MORDOR_TEST_ASSERT_EQUAL(++sequence, 4);
+}
+
+MORDOR_UNITTEST(PipeStream, lockFreeGone)
+{
+    std::pair<Stream::ptr, Stream::ptr> pipe = lockFreePipeStream();
+
+    bool remoteClosed = false;
+    pipe.second->onRemoteClose(std::bind(&closed, std::ref(remoteClosed)));
+    MORDOR_TEST_ASSERT_EQUAL(pipe.first->write("a"), 1u);
+    pipe.first.reset();
+    MORDOR_TEST_ASSERT(remoteClosed);
+    // What was written before is still there, but then the pipe is broken
+    Buffer read;
+    MORDOR_TEST_ASSERT_EQUAL(pipe.second->read(read, 10), 1u);
+    MORDOR_TEST_ASSERT_EXCEPTION(pipe.second->read(read, 10), BrokenPipeException);
+    MORDOR_TEST_ASSERT_EXCEPTION(pipe.second->write("a"), BrokenPipeException);
+}
+
+MORDOR_UNITTEST(PipeStream, lockFreeThreadStress)
+{
+    std::pair<Stream::ptr, Stream::ptr> pipe = lockFreePipeStream();
+    WorkerPool pool(2);
+
+    pool.schedule(Fiber::ptr(new Fiber(std::bind(&threadStress, pipe.first))));
+    threadStress(pipe.second);
+}
@@ -299,6 +299,53 @@ MORDOR_UNITTEST(Scheduler, parallelForEachLessThanParallelism)
     MORDOR_TEST_ASSERT_EQUAL(sequence, 3);
 }
 
+static void square(int &x)
+{
+    if (x == 3)
+        MORDOR_THROW_EXCEPTION(OperationAbortedException());
+    x *= x;
+}
+
+MORDOR_UNITTEST(Scheduler, orderedWorkQueue)
+{
+    WorkerPool pool(4u);
+    OrderedWorkQueue<int> queue(pool);
+    MORDOR_TEST_ASSERT_EQUAL(queue.maxInFlight(), 8u);
+    for (int i = 1; i <= 5; ++i)
+        queue.push(std::shared_ptr<int>(new int(i)), &square);
+    MORDOR_TEST_ASSERT_EQUAL(queue.size(), 5u);
+    // In the order pushed, whatever order they finished in
+    MORDOR_TEST_ASSERT_EQUAL(*queue.pop(), 1);
+    MORDOR_TEST_ASSERT_EQUAL(*queue.pop(), 4);
+    MORDOR_TEST_ASSERT_EXCEPTION(queue.pop(), OperationAbortedException);
+    MORDOR_TEST_ASSERT_EQUAL(*queue.pop(), 16);
+    MORDOR_TEST_ASSERT_EQUAL(*queue.pop(), 25);
+    MORDOR_TEST_ASSERT(!queue.pop());
+}
+
+static void waitFor(FiberEvent &event, int &)
+{
+    event.wait();
+}
+
+MORDOR_UNITTEST(Scheduler, orderedWorkQueueKeep)
+{
+    WorkerPool pool(2u);
+    FiberEvent event(false);
+    OrderedWorkQueue<int> queue(pool, 2);
+    queue.push(std::shared_ptr<int>(new int(1)), std::bind(&waitFor,
+        std::ref(event), std::placeholders::_1));
+    queue.push(std::shared_ptr<int>(new int(2)), &square);
+    // Neither over the limit, nor done yet
+    MORDOR_TEST_ASSERT(!queue.pop(2));
+    event.set();
+    queue.wait();
+    MORDOR_TEST_ASSERT_EQUAL(*queue.pop(2), 1);
+    MORDOR_TEST_ASSERT_EQUAL(queue.size(), 1u);
+    queue.clear();
+    MORDOR_TEST_ASSERT_EQUAL(queue.size(), 0u);
+}
+
 static void checkEqualStop5(int x, int &sequence, bool expectOrdered)
 {
     if (expectOrdered)
@@ -2,12 +2,17 @@
 
 #include <iostream>
 #include <limits.h>
+#include <set>
 // #include <boost/lexical_cast.hpp>
 
 #include "mordor/exception.h"
 #include "mordor/fiber.h"
 #include "mordor/iomanager.h"
+#include "mordor/sleep.h"
 #include "mordor/socket.h"
+#include "mordor/statistics.h"
+#include "mordor/streams/buffer.h"
+#include "mordor/streams/socket.h"
 #include "mordor/test/test.h"
 
 using namespace Mordor;
@@ -538,3 +543,327 @@ MORDOR_UNITTEST(Socket, eventOnRemoteReset)
     ioManager.dispatch();
     MORDOR_TEST_ASSERT(remoteClosed);
 }
+
+MORDOR_UNITTEST(Socket, connectFirstSkipsBlackhole)
+{
+    IOManager ioManager;
+    Connection conns = establishConn(ioManager);
+    ioManager.schedule(std::bind(&acceptOne, std::ref(conns)));
+
+    std::vector<Address::ptr> addresses;
+    // TEST-NET-1; nothing answers there, so the attempt either hangs or
+    // fails quickly, depending on the routing table
+    addresses.push_back(IPAddress::create("192.0.2.1", conns.address->port()));
+    addresses.push_back(conns.address);
+    unsigned long long start = TimerManager::now();
+    Socket::ptr socket = connectFirst(ioManager, addresses, SOCK_STREAM, 0,
+        100000, 5000000);
+    MORDOR_TEST_ASSERT_LESS_THAN(TimerManager::now() - start, 1000000ull);
+    MORDOR_TEST_ASSERT(*socket->remoteAddress() == *conns.address);
+    ioManager.dispatch();
+    MORDOR_TEST_ASSERT(conns.accept);
+}
+
+MORDOR_UNITTEST(Socket, connectFirstPrefersFirst)
+{
+    IOManager ioManager;
+    Connection conns = establishConn(ioManager);
+    ioManager.schedule(std::bind(&acceptOne, std::ref(conns)));
+
+    std::vector<Address::ptr> addresses;
+    addresses.push_back(conns.address);
+    addresses.push_back(IPAddress::create("192.0.2.1", conns.address->port()));
+    Socket::ptr socket = connectFirst(ioManager, addresses, SOCK_STREAM, 0,
+        1000000, 5000000);
+    MORDOR_TEST_ASSERT(*socket->remoteAddress() == *conns.address);
+    // The connect timeout doesn't carry over to sends
+    MORDOR_TEST_ASSERT_EQUAL(socket->sendTimeout(), ~0ull);
+}
+
+MORDOR_UNITTEST(Socket, connectFirstAllFail)
+{
+    IOManager ioManager;
+    Connection conns = establishConn(ioManager);
+    // Nobody is listening on these
+    IPAddress::ptr first = conns.address->clone();
+    first->port(conns.address->port() + 1);
+    IPAddress::ptr second = conns.address->clone();
+    second->port(conns.address->port() + 2);
+
+    std::vector<Address::ptr> addresses;
+    addresses.push_back(first);
+    addresses.push_back(second);
+    MORDOR_TEST_ASSERT_EXCEPTION(connectFirst(ioManager, addresses),
+        ConnectionRefusedException);
+}
+
+MORDOR_UNITTEST(Socket, fastOpen)
+{
+    IOManager ioManager;
+    Connection conns = establishConn(ioManager);
+    // establishConn already listens; listening again just (re)configures the
+    // Fast Open queue
+    conns.listen->listen(SOMAXCONN, 16);
+
+    // The first connection can only obtain a cookie; later ones may carry
+    // data in the SYN if the kernel has client side Fast Open enabled
+    for (int i = 0; i < 2; ++i) {
+        ioManager.schedule(std::bind(&acceptOne, std::ref(conns)));
+        Socket::ptr connect = conns.address->createSocket(ioManager,
+            SOCK_STREAM);
+        Buffer buffer("hello");
+        size_t sent = connect->connect(conns.address, buffer);
+        MORDOR_TEST_ASSERT_LESS_THAN_OR_EQUAL(sent, 5u);
+        buffer.consume(sent);
+        while (buffer.readAvailable() > 0) {
+            std::vector<iovec> iovs = buffer.readBuffers();
+            buffer.consume(connect->send(&iovs[0], iovs.size()));
+        }
+        ioManager.dispatch();
+
+        char receivebuf[6];
+        memset(receivebuf, 0, 6);
+        size_t received = 0;
+        while (received < 5)
+            received += conns.accept->receive(receivebuf + received,
+                5 - received);
+        MORDOR_TEST_ASSERT_EQUAL(std::string(receivebuf), "hello");
+    }
+}
+
+static void writeMessage(SocketStream::ptr stream, char c)
+{
+    std::string message(100, c);
+    MORDOR_TEST_ASSERT_EQUAL(stream->write(message.c_str(), message.size()),
+        message.size());
+}
+
+MORDOR_UNITTEST(Socket, coalesceWrites)
+{
+    IOManager ioManager;
+    Connection conns = establishConn(ioManager);
+    ioManager.schedule(std::bind(&acceptOne, std::ref(conns)));
+    conns.connect->connect(conns.address);
+    ioManager.dispatch();
+
+    SocketStream::ptr stream(new SocketStream(conns.connect));
+    stream->coalesceWrites(true);
+    for (char c = 'a'; c < 'k'; ++c)
+        ioManager.schedule(std::bind(&writeMessage, stream, c));
+    ioManager.dispatch();
+
+    // Every message must arrive whole, even though they were sent together
+    std::string received(1000, '\0');
+    size_t offset = 0;
+    while (offset < received.size())
+        offset += conns.accept->receive(&received[offset],
+            received.size() - offset);
+    std::set<char> seen;
+    for (size_t i = 0; i < received.size(); i += 100) {
+        MORDOR_TEST_ASSERT_EQUAL(received.substr(i, 100),
+            std::string(100, received[i]));
+        seen.insert(received[i]);
+    }
+    MORDOR_TEST_ASSERT_EQUAL(seen.size(), 10u);
+}
+
+static const size_t CONTENDED_MESSAGE_SIZE = 65536;
+
+static void writeAndSleep(SocketStream::ptr stream, IOManager &ioManager,
+    char c, bool &sleptEnough)
+{
+    std::string message(CONTENDED_MESSAGE_SIZE, c);
+    MORDOR_TEST_ASSERT_EQUAL(stream->write(message.c_str(), message.size()),
+        message.size());
+    // A writer that led a flush must not be left scheduled, which would
+    // wake it from here early
+    unsigned long long start = TimerManager::now();
+    sleep(ioManager, 50000);
+    sleptEnough = TimerManager::now() - start >= 50000;
+}
+
+static void slowReader(Socket::ptr socket, std::string &received,
+    size_t length)
+{
+    char buffer[4096];
+    while (received.size() < length) {
+        size_t result = socket->receive(buffer, sizeof(buffer));
+        MORDOR_ASSERT(result > 0);
+        received.append(buffer, result);
+        Scheduler::yield();
+    }
+}
+
+MORDOR_UNITTEST(Socket, coalesceWritesContended)
+{
+    IOManager ioManager;
+    Connection conns = establishConn(ioManager);
+    ioManager.schedule(std::bind(&acceptOne, std::ref(conns)));
+    conns.connect->setOption(SOL_SOCKET, SO_SNDBUF, 4096);
+    conns.connect->connect(conns.address);
+    ioManager.dispatch();
+    conns.accept->setOption(SOL_SOCKET, SO_RCVBUF, 4096);
+
+    // The first writer blocks in send(), so the rest queue behind it, and
+    // the second is handed the queue once the first is done
+    SocketStream::ptr stream(new SocketStream(conns.connect));
+    stream->coalesceWrites(true);
+    bool sleptEnough[5];
+    for (int i = 0; i < 5; ++i)
+        ioManager.schedule(std::bind(&writeAndSleep, stream,
+            std::ref(ioManager), (char)('a' + i), std::ref(sleptEnough[i])));
+    std::string received;
+    ioManager.schedule(std::bind(&slowReader, conns.accept,
+        std::ref(received), 5 * CONTENDED_MESSAGE_SIZE));
+    ioManager.dispatch();
+
+    MORDOR_TEST_ASSERT_EQUAL(received.size(), 5 * CONTENDED_MESSAGE_SIZE);
+    for (int i = 0; i < 5; ++i) {
+        // In the order they were written, and each whole
+        MORDOR_TEST_ASSERT(received.substr(i * CONTENDED_MESSAGE_SIZE,
+            CONTENDED_MESSAGE_SIZE) ==
+            std::string(CONTENDED_MESSAGE_SIZE, (char)('a' + i)));
+        MORDOR_TEST_ASSERT(sleptEnough[i]);
+    }
+}
+
+static unsigned long long coalescedSends()
+{
+    CountStatistic<unsigned long long> *sends =
+        Statistics::lookup<CountStatistic<unsigned long long> >(
+            "socketstream.coalesced.sends");
+    MORDOR_TEST_ASSERT(sends);
+    return sends->count;
+}
+
+static void writeAndCount(SocketStream::ptr stream, const std::string &message,
+    unsigned long long &sends)
+{
+    MORDOR_TEST_ASSERT_EQUAL(stream->write(message.c_str(), message.size()),
+        message.size());
+    // Whoever takes over the queue hasn't run yet
+    sends = coalescedSends();
+}
+
+MORDOR_UNITTEST(Socket, coalesceWritesBatches)
+{
+    IOManager ioManager;
+    Connection conns = establishConn(ioManager);
+    ioManager.schedule(std::bind(&acceptOne, std::ref(conns)));
+    conns.connect->setOption(SOL_SOCKET, SO_SNDBUF, 4096);
+    conns.connect->connect(conns.address);
+    ioManager.dispatch();
+    conns.accept->setOption(SOL_SOCKET, SO_RCVBUF, 4096);
+
+    // The first write fills the socket buffer, so the small ones all queue
+    // up behind it
+    SocketStream::ptr stream(new SocketStream(conns.connect));
+    stream->coalesceWrites(true);
+    std::string big(CONTENDED_MESSAGE_SIZE, 'a');
+    unsigned long long afterBig = 0, unused;
+    ioManager.schedule(std::bind(&writeAndCount, stream, std::cref(big),
+        std::ref(afterBig)));
+    std::string small(100, 'b');
+    for (int i = 0; i < 9; ++i)
+        ioManager.schedule(std::bind(&writeAndCount, stream,
+            std::cref(small), std::ref(unused)));
+    std::string received;
+    ioManager.schedule(std::bind(&slowReader, conns.accept,
+        std::ref(received), CONTENDED_MESSAGE_SIZE + 900));
+    ioManager.dispatch();
+
+    MORDOR_TEST_ASSERT(received == big + std::string(900, 'b'));
+    // Nine writes, far fewer sends
+    MORDOR_TEST_ASSERT_GREATER_THAN(afterBig, 0ull);
+    MORDOR_TEST_ASSERT_LESS_THAN_OR_EQUAL(coalescedSends() - afterBig, 2ull);
+}
+
+static void parkedRead(Socket::ptr socket, std::string &received)
+{
+    char buffer[6];
+    size_t length = socket->receive(buffer, sizeof(buffer));
+    received.append(buffer, length);
+}
+
+static void sendHello(Socket::ptr socket)
+{
+    socket->send("hello", 5);
+}
+
+MORDOR_UNITTEST(Socket, park)
+{
+    IOManager ioManager;
+    Connection conns = establishConn(ioManager);
+    ioManager.schedule(std::bind(&acceptOne, std::ref(conns)));
+    conns.connect->connect(conns.address);
+    ioManager.dispatch();
+
+    std::string received;
+    conns.accept->park(std::bind(&parkedRead, conns.accept,
+        std::ref(received)));
+    MORDOR_TEST_ASSERT(received.empty());
+    ioManager.schedule(std::bind(&sendHello, conns.connect));
+    ioManager.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(received, "hello");
+}
+
+#ifndef WINDOWS
+MORDOR_UNITTEST(Socket, unpark)
+{
+    IOManager ioManager;
+    Connection conns = establishConn(ioManager);
+    ioManager.schedule(std::bind(&acceptOne, std::ref(conns)));
+    conns.connect->connect(conns.address);
+    ioManager.dispatch();
+
+    std::string received;
+    conns.accept->park(std::bind(&parkedRead, conns.accept,
+        std::ref(received)));
+    MORDOR_TEST_ASSERT(conns.accept->unpark());
+    MORDOR_TEST_ASSERT(!conns.accept->unpark());
+    conns.connect->send("hello", 5);
+    ioManager.dispatch();
+    MORDOR_TEST_ASSERT(received.empty());
+}
+
+static void parkedReadAll(Socket::ptr socket, std::string &received)
+{
+    char buffer[5];
+    while (received.size() < 5) {
+        size_t length = socket->receive(buffer, 5 - received.size());
+        if (length == 0)
+            break;
+        received.append(buffer, length);
+    }
+}
+
+static void unparkWhileReceiving(Connection &conns, IOManager &ioManager,
+    std::string &received, bool &unparked)
+{
+    conns.connect->send("h", 1);
+    while (received.empty())
+        sleep(ioManager, 1000);
+    // dg is now waiting in its own receive(), which unpark() must leave be
+    unparked = conns.accept->unpark();
+    conns.connect->send("ello", 4);
+}
+
+MORDOR_UNITTEST(Socket, unparkAfterReady)
+{
+    IOManager ioManager;
+    Connection conns = establishConn(ioManager);
+    ioManager.schedule(std::bind(&acceptOne, std::ref(conns)));
+    conns.connect->connect(conns.address);
+    ioManager.dispatch();
+
+    std::string received;
+    bool unparked = true;
+    conns.accept->park(std::bind(&parkedReadAll, conns.accept,
+        std::ref(received)));
+    ioManager.schedule(std::bind(&unparkWhileReceiving, std::ref(conns),
+        std::ref(ioManager), std::ref(received), std::ref(unparked)));
+    ioManager.dispatch();
+    MORDOR_TEST_ASSERT(!unparked);
+    MORDOR_TEST_ASSERT_EQUAL(received, "hello");
+}
+#endif
@@ -11,6 +11,7 @@
 #include "mordor/streams/ssl.h"
 #include "mordor/streams/transfer.h"
 #include "mordor/test/test.h"
+#include "mordor/thread.h"
 #include "mordor/workerpool.h"
 
 using namespace Mordor;
@@ -139,3 +140,244 @@ MORDOR_UNITTEST(SSLStream, forceDuplex)
     pool.dispatch();
     MORDOR_TEST_ASSERT_EQUAL(++sequence, 4);
 }
+
+static void readUntilClosed(Stream::ptr stream)
+{
+    char buf[6];
+    MORDOR_TEST_ASSERT_EQUAL(stream->read(buf, 5), 5u);
+    MORDOR_TEST_ASSERT_EQUAL(stream->read(buf, 5), 0u);
+    stream->close();
+}
+
+MORDOR_UNITTEST(SSLStream, closeNotify)
+{
+    WorkerPool pool;
+    std::pair<Stream::ptr, Stream::ptr> pipes = pipeStream();
+
+    SSLStream::ptr sslserver(new SSLStream(pipes.first, false));
+    SSLStream::ptr sslclient(new SSLStream(pipes.second, true));
+
+    pool.schedule(std::bind(&accept_func, sslserver));
+    sslclient->connect();
+    pool.dispatch();
+
+    // close_notify goes both ways over the BIO before the pipes close
+    pool.schedule(std::bind(&readUntilClosed, sslserver));
+    sslclient->write("hello", 5);
+    sslclient->close();
+    pool.dispatch();
+}
+
+static void exchangeHello(SSLStream::ptr client, SSLStream::ptr server,
+    WorkerPool &pool)
+{
+    pool.schedule(std::bind(&accept_func, server));
+    client->connect();
+    pool.dispatch();
+
+    // With TLS 1.3 the server sends tickets after the handshake, so the
+    // client only sees them once it reads
+    char buf[6];
+    buf[5] = '\0';
+    client->write("hello", 5);
+    client->flush(false);
+    MORDOR_TEST_ASSERT_EQUAL(server->read(buf, 5), 5u);
+    server->write("world", 5);
+    server->flush(false);
+    MORDOR_TEST_ASSERT_EQUAL(client->read(buf, 5), 5u);
+    MORDOR_TEST_ASSERT_EQUAL((const char *)buf, "world");
+}
+
+static void closeBoth(SSLStream::ptr client, SSLStream::ptr server,
+    WorkerPool &pool)
+{
+    // OpenSSL won't resume a session from a connection that wasn't shut
+    // down cleanly
+    pool.schedule(std::bind(&SSLStream::close, server, Stream::BOTH));
+    client->close();
+    pool.dispatch();
+}
+
+MORDOR_UNITTEST(SSLStream, resumeSession)
+{
+    WorkerPool pool;
+    SSLSessionCache::ptr cache(new SSLSessionCache());
+    Address::ptr address = IPAddress::create("127.0.0.1", 443);
+    Address::ptr otherAddress = IPAddress::create("127.0.0.1", 444);
+
+    std::pair<Stream::ptr, Stream::ptr> pipes = pipeStream();
+    SSLStream::ptr server(new SSLStream(pipes.first, false));
+    SSLStream::ptr client(new SSLStream(pipes.second, true));
+    client->sessionCache(cache, address);
+    exchangeHello(client, server, pool);
+    MORDOR_TEST_ASSERT(!client->sessionReused());
+    MORDOR_TEST_ASSERT(!server->sessionReused());
+    MORDOR_TEST_ASSERT_EQUAL(cache->size(), 1u);
+    MORDOR_TEST_ASSERT(cache->get(*address));
+    closeBoth(client, server, pool);
+
+    // The default server context is shared, so a new server resumes it
+    pipes = pipeStream();
+    server.reset(new SSLStream(pipes.first, false));
+    client.reset(new SSLStream(pipes.second, true));
+    client->sessionCache(cache, address);
+    exchangeHello(client, server, pool);
+    MORDOR_TEST_ASSERT(client->sessionReused());
+    MORDOR_TEST_ASSERT(server->sessionReused());
+    closeBoth(client, server, pool);
+
+    // Sessions are only offered to the same address
+    pipes = pipeStream();
+    server.reset(new SSLStream(pipes.first, false));
+    client.reset(new SSLStream(pipes.second, true));
+    client->sessionCache(cache, otherAddress);
+    exchangeHello(client, server, pool);
+    MORDOR_TEST_ASSERT(!client->sessionReused());
+    MORDOR_TEST_ASSERT_EQUAL(cache->size(), 2u);
+}
+
+MORDOR_UNITTEST(SSLStream, resumeSessionOwnContext)
+{
+    WorkerPool pool;
+    SSLSessionCache::ptr cache(new SSLSessionCache());
+    Address::ptr address = IPAddress::create("127.0.0.1", 443);
+    std::shared_ptr<SSL_CTX> ctx(SSL_CTX_new(SSLv23_client_method()),
+        &SSL_CTX_free);
+    long mode = SSL_CTX_get_session_cache_mode(ctx.get());
+
+    // sessionCache() leaves a context that may be shared alone...
+    std::pair<Stream::ptr, Stream::ptr> pipes = pipeStream();
+    SSLStream::ptr server(new SSLStream(pipes.first, false));
+    SSLStream::ptr client(new SSLStream(pipes.second, true, true,
+        ctx.get()));
+    client->sessionCache(cache, address);
+    MORDOR_TEST_ASSERT_EQUAL(SSL_CTX_get_session_cache_mode(ctx.get()),
+        mode);
+    exchangeHello(client, server, pool);
+    MORDOR_TEST_ASSERT_EQUAL(cache->size(), 0u);
+    closeBoth(client, server, pool);
+
+    // ... until it's been set up for it
+    SSLStream::enableClientSessionCache(ctx.get());
+    pipes = pipeStream();
+    server.reset(new SSLStream(pipes.first, false));
+    client.reset(new SSLStream(pipes.second, true, true, ctx.get()));
+    client->sessionCache(cache, address);
+    exchangeHello(client, server, pool);
+    MORDOR_TEST_ASSERT_EQUAL(cache->size(), 1u);
+    closeBoth(client, server, pool);
+
+    pipes = pipeStream();
+    server.reset(new SSLStream(pipes.first, false));
+    client.reset(new SSLStream(pipes.second, true, true, ctx.get()));
+    client->sessionCache(cache, address);
+    exchangeHello(client, server, pool);
+    MORDOR_TEST_ASSERT(client->sessionReused());
+}
+
+MORDOR_UNITTEST(SSLSessionCache, evictsLeastRecentlyStored)
+{
+    SSLSessionCache cache(2);
+    Address::ptr a = IPAddress::create("127.0.0.1", 1);
+    Address::ptr b = IPAddress::create("127.0.0.1", 2);
+    Address::ptr c = IPAddress::create("127.0.0.1", 3);
+    cache.put(*a, SSL_SESSION_new());
+    cache.put(*b, SSL_SESSION_new());
+    // Replacing a's session makes b the oldest
+    cache.put(*a, SSL_SESSION_new());
+    cache.put(*c, SSL_SESSION_new());
+    MORDOR_TEST_ASSERT_EQUAL(cache.size(), 2u);
+    MORDOR_TEST_ASSERT(cache.get(*a));
+    MORDOR_TEST_ASSERT(!cache.get(*b));
+    MORDOR_TEST_ASSERT(cache.get(*c));
+    cache.erase(*a);
+    MORDOR_TEST_ASSERT(!cache.get(*a));
+    MORDOR_TEST_ASSERT_EQUAL(cache.size(), 1u);
+}
+
+static tid_t g_handshakeTid;
+
+static void recordHandshakeThread(const SSL *ssl, int where, int ret)
+{
+    if (where & SSL_CB_LOOP)
+        g_handshakeTid = gettid();
+}
+
+MORDOR_UNITTEST(SSLStream, handshakeScheduler)
+{
+    WorkerPool pool, crypto(1, false);
+    std::pair<Stream::ptr, Stream::ptr> pipes = pipeStream();
+    std::shared_ptr<SSL_CTX> ctx(SSL_CTX_new(SSLv23_client_method()),
+        &SSL_CTX_free);
+    SSL_CTX_set_info_callback(ctx.get(), &recordHandshakeThread);
+
+    SSLStream::ptr sslserver(new SSLStream(pipes.first, false));
+    SSLStream::ptr sslclient(new SSLStream(pipes.second, true, true,
+        ctx.get()));
+    sslserver->handshakeScheduler(&crypto);
+    sslclient->handshakeScheduler(&crypto);
+
+    // pool.dispatch() wouldn't wait for a Fiber that's over on crypto
+    g_handshakeTid = 0;
+    std::vector<std::function<void ()> > dgs;
+    dgs.push_back(std::bind(&accept_func, sslserver));
+    dgs.push_back(std::bind(&SSLStream::connect, sslclient));
+    parallel_do(dgs);
+    MORDOR_TEST_ASSERT(g_handshakeTid != 0);
+    MORDOR_TEST_ASSERT(g_handshakeTid != gettid());
+    // ... but the caller is back where it started
+    MORDOR_TEST_ASSERT_EQUAL(Scheduler::getThis(), &pool);
+
+    char buf[6];
+    buf[5] = '\0';
+    sslclient->write("hello", 5);
+    sslclient->flush(false);
+    MORDOR_TEST_ASSERT_EQUAL(sslserver->read(buf, 5), 5u);
+    MORDOR_TEST_ASSERT_EQUAL((const char *)buf, "hello");
+}
+
+static void connectUnverified(SSLStream::ptr client, std::string &message)
+{
+    try {
+        client->connect();
+    } catch (const OpenSSLException &ex) {
+        message = ex.what();
+    }
+    // Let the server see that the handshake is over
+    client->parent()->close();
+}
+
+static void acceptUnverified(SSLStream::ptr server)
+{
+    try {
+        server->accept();
+    } catch (const std::exception &) {
+    }
+}
+
+MORDOR_UNITTEST(SSLStream, handshakeSchedulerFailure)
+{
+    WorkerPool pool, crypto(1, false);
+    std::pair<Stream::ptr, Stream::ptr> pipes = pipeStream();
+    // The default server certificate is self-signed
+    std::shared_ptr<SSL_CTX> ctx(SSL_CTX_new(SSLv23_client_method()),
+        &SSL_CTX_free);
+    SSL_CTX_set_verify(ctx.get(), SSL_VERIFY_PEER, NULL);
+
+    SSLStream::ptr sslserver(new SSLStream(pipes.first, false));
+    SSLStream::ptr sslclient(new SSLStream(pipes.second, true, true,
+        ctx.get()));
+    sslserver->handshakeScheduler(&crypto);
+    sslclient->handshakeScheduler(&crypto);
+
+    // The error is only on crypto's thread's error queue
+    std::string message;
+    std::vector<std::function<void ()> > dgs;
+    dgs.push_back(std::bind(&acceptUnverified, sslserver));
+    dgs.push_back(std::bind(&connectUnverified, sslclient,
+        std::ref(message)));
+    parallel_do(dgs);
+    MORDOR_TEST_ASSERT(message.find("certificate verify failed") !=
+        std::string::npos);
+    MORDOR_TEST_ASSERT_EQUAL(Scheduler::getThis(), &pool);
+}
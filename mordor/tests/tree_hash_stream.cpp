@@ -0,0 +1,168 @@
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include "mordor/streams/memory.h"
+#include "mordor/streams/null.h"
+#include "mordor/streams/temp.h"
+#include "mordor/streams/tree_hash.h"
+#include "mordor/string.h"
+#include "mordor/test/test.h"
+#include "mordor/workerpool.h"
+
+using namespace Mordor;
+using namespace Mordor::Test;
+
+static std::string
+sha256(const std::string &data)
+{
+    std::string result(SHA256_DIGEST_LENGTH, '\0');
+    ::SHA256((const unsigned char *)data.c_str(), data.size(),
+        (unsigned char *)&result[0]);
+    return result;
+}
+
+// RFC 6962's Merkle Tree Hash, straight from its recursive definition
+static std::string
+merkleTreeHash(const std::vector<std::string> &leaves, size_t begin,
+    size_t end)
+{
+    if (end - begin == 1)
+        return sha256(std::string(1, '\0') + leaves[begin]);
+    size_t split = 1;
+    while (split * 2 < end - begin)
+        split *= 2;
+    return sha256(std::string(1, '\1') +
+        merkleTreeHash(leaves, begin, begin + split) +
+        merkleTreeHash(leaves, begin + split, end));
+}
+
+static std::string
+expected(const std::string &data, size_t leafSize)
+{
+    std::vector<std::string> leaves;
+    for (size_t offset = 0; offset < data.size(); offset += leafSize)
+        leaves.push_back(data.substr(offset, leafSize));
+    if (leaves.empty())
+        leaves.push_back(std::string());
+    return merkleTreeHash(leaves, 0, leaves.size());
+}
+
+static std::string
+data(size_t size)
+{
+    std::string result;
+    unsigned int seed = 12345;
+    for (size_t i = 0; i < size; ++i) {
+        seed = seed * 1103515245 + 12345;
+        result.push_back((char)(seed >> 16));
+    }
+    return result;
+}
+
+MORDOR_UNITTEST(TreeHashStream, empty)
+{
+    WorkerPool pool(1);
+    TreeHashStream stream(NullStream::get_ptr(), pool);
+    MORDOR_TEST_ASSERT_EQUAL(stream.hashSize(), 32u);
+    // RFC 6962's hash of a single empty leaf
+    MORDOR_TEST_ASSERT_EQUAL(hexstringFromData(stream.hash()), std::string(
+        "6e340b9cffb37a989ca544e6bb780a2c78901d3fb33738768511a30617afa01d"));
+    // Rather than a context that can't be resumed from
+    MORDOR_TEST_ASSERT_EXCEPTION(stream.dumpContext(), std::logic_error);
+}
+
+MORDOR_UNITTEST(TreeHashStream, leafCounts)
+{
+    WorkerPool pool(1);
+    // 1 through 8 leaves, including exact multiples of the leaf size
+    const size_t sizes[] = { 1, 999, 1000, 1001, 2000, 3000, 4000, 5000,
+        7500, 8000 };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        std::string plain = data(sizes[i]);
+        TreeHashStream stream(NullStream::get_ptr(), pool, 1000);
+        for (size_t offset = 0; offset < plain.size(); offset += 333)
+            stream.write(plain.c_str() + offset,
+                (std::min)((size_t)333, plain.size() - offset));
+        MORDOR_TEST_ASSERT(stream.hash() == expected(plain, 1000));
+    }
+}
+
+MORDOR_UNITTEST(TreeHashStream, parallel)
+{
+    WorkerPool pool(4);
+    std::string plain = data(1000000);
+    TreeHashStream stream(NullStream::get_ptr(), pool, 4096, 3);
+    Buffer buffer(plain);
+    while (buffer.readAvailable() > 0)
+        buffer.consume(stream.write(buffer, buffer.readAvailable()));
+    MORDOR_TEST_ASSERT(stream.hash() == expected(plain, 4096));
+    // hash() doesn't stop more from being added
+    stream.write("x", 1);
+    MORDOR_TEST_ASSERT(stream.hash() == expected(plain + "x", 4096));
+
+    stream.reset();
+    stream.write("x", 1);
+    MORDOR_TEST_ASSERT(stream.hash() == expected("x", 4096));
+}
+
+MORDOR_UNITTEST(TreeHashStream, rawWrites)
+{
+    WorkerPool pool(4);
+    std::string plain = data(100000);
+    TreeHashStream stream(NullStream::get_ptr(), pool, 1000);
+    // Several whole leaves each, starting and ending mid-leaf
+    std::string scratch;
+    for (size_t offset = 0; offset < plain.size(); offset += 4321) {
+        scratch = plain.substr(offset, 4321);
+        stream.write(scratch.c_str(), scratch.size());
+        // The stream is done with it by now
+        scratch.assign(scratch.size(), 'x');
+    }
+    MORDOR_TEST_ASSERT(stream.hash() == expected(plain, 1000));
+}
+
+MORDOR_UNITTEST(TreeHashStream, read)
+{
+    WorkerPool pool(2);
+    std::string plain = data(100000);
+    TreeHashStream stream(Stream::ptr(new MemoryStream(Buffer(plain))), pool,
+        10000);
+    Buffer result;
+    while (stream.read(result, 7777) > 0);
+    MORDOR_TEST_ASSERT(result == plain);
+    MORDOR_TEST_ASSERT(stream.hash() == expected(plain, 10000));
+}
+
+#ifndef WINDOWS
+static std::string
+hashFile(const std::string &plain, size_t leafSize, int parallelism)
+{
+    TempStream temp("mordor", false);
+    std::string path = temp.path();
+    try {
+        Buffer buffer(plain);
+        while (buffer.readAvailable() > 0)
+            buffer.consume(temp.write(buffer, buffer.readAvailable()));
+        temp.close();
+        std::string result = TreeHashStream::hashFile(path, leafSize,
+            parallelism);
+        unlink(path.c_str());
+        return result;
+    } catch (...) {
+        unlink(path.c_str());
+        throw;
+    }
+}
+
+MORDOR_UNITTEST(TreeHashStream, hashFile)
+{
+    WorkerPool pool(4);
+    std::string plain = data(1000000);
+    MORDOR_TEST_ASSERT(hashFile(plain, 4096, -1) == expected(plain, 4096));
+    MORDOR_TEST_ASSERT(hashFile(plain, 4096, 1) == expected(plain, 4096));
+    // An exact number of leaves, and none at all
+    MORDOR_TEST_ASSERT(hashFile(plain.substr(0, 40960), 4096, -1) ==
+        expected(plain.substr(0, 40960), 4096));
+    MORDOR_TEST_ASSERT(hashFile(std::string(), 4096, -1) ==
+        expected(std::string(), 4096));
+}
+#endif
@@ -184,6 +184,113 @@ MORDOR_UNITTEST(DeflateStream, decompress)
     testDecompress<DeflateStream>(test_deflate, sizeof(test_deflate));
 }
 
+MORDOR_UNITTEST(ZlibStream, flushAndLargeData)
+{
+    Buffer origData;
+    for (int i = 0; i < 4096; ++i)
+        origData.copyIn(test_uncompressed, sizeof(test_uncompressed));
+
+    std::shared_ptr<MemoryStream> memstream(new MemoryStream());
+    Stream::ptr writeplex(new SingleplexStream(memstream,
+        SingleplexStream::WRITE));
+    ZlibStream teststream(writeplex, 1, 12);
+    teststream.write("hello", 5);
+    teststream.flush();
+    // Everything written so far can be decompressed without the rest
+    Buffer flushed(memstream->buffer());
+    {
+        Stream::ptr readplex(new SingleplexStream(
+            Stream::ptr(new MemoryStream(flushed)), SingleplexStream::READ));
+        ZlibStream decompress(readplex);
+        Buffer hello;
+        while (hello.readAvailable() < 5u)
+            MORDOR_TEST_ASSERT_GREATER_THAN(decompress.read(hello, 4096), 0u);
+        MORDOR_TEST_ASSERT(hello == "hello");
+    }
+    Buffer data(origData);
+    while (data.readAvailable() > 0)
+        data.consume(teststream.write(data, data.readAvailable()));
+    teststream.close();
+    MORDOR_TEST_ASSERT_LESS_THAN(memstream->buffer().readAvailable(),
+        origData.readAvailable() / 10);
+
+    Stream::ptr readplex(new SingleplexStream(
+        Stream::ptr(new MemoryStream(memstream->buffer())),
+        SingleplexStream::READ));
+    ZlibStream decompress(readplex);
+    decompress.bufferSize(100);
+    Buffer decomp;
+    while (0 < decompress.read(decomp, 1000));
+    MORDOR_TEST_ASSERT(decomp == "hello" + origData.toString());
+}
+
+MORDOR_UNITTEST(ZlibStream, truncated)
+{
+    Buffer compressed;
+    compressed.copyIn(test_zlib, sizeof(test_zlib) - 10);
+    Stream::ptr readplex(new SingleplexStream(
+        Stream::ptr(new MemoryStream(compressed)), SingleplexStream::READ));
+    ZlibStream teststream(readplex);
+    Buffer testBuf;
+    MORDOR_TEST_ASSERT_EXCEPTION(while(0 < teststream.read(testBuf, 4096)),
+        UnexpectedEofException);
+}
+
+MORDOR_UNITTEST(ZlibStream, corrupted)
+{
+    // A real zlib stream, with a byte of the body and one of the Adler-32
+    // trailer flipped
+    unsigned char corrupted[sizeof(test_zlib)];
+    memcpy(corrupted, test_zlib, sizeof(test_zlib));
+    corrupted[sizeof(corrupted) / 2] ^= 0x55;
+    corrupted[sizeof(corrupted) - 2] ^= 0x55;
+    Buffer compressed;
+    compressed.copyIn(corrupted, sizeof(corrupted));
+    Stream::ptr readplex(new SingleplexStream(
+        Stream::ptr(new MemoryStream(compressed)), SingleplexStream::READ));
+    ZlibStream teststream(readplex);
+    Buffer testBuf;
+    MORDOR_TEST_ASSERT_EXCEPTION(while(0 < teststream.read(testBuf, 4096)),
+        CorruptedZlibStreamException);
+}
+
+MORDOR_UNITTEST(ZlibStream, gzipHeader)
+{
+    // Fails the zlib header check
+    Buffer compressed;
+    compressed.copyIn(test_gzip, sizeof(test_gzip));
+    Stream::ptr readplex(new SingleplexStream(
+        Stream::ptr(new MemoryStream(compressed)), SingleplexStream::READ));
+    ZlibStream teststream(readplex);
+    Buffer testBuf;
+    MORDOR_TEST_ASSERT_EXCEPTION(while(0 < teststream.read(testBuf, 4096)),
+        CorruptedZlibStreamException);
+}
+
+MORDOR_UNITTEST(GzipStream, invert)
+{
+    // Compress on read, decompress on write
+    Buffer origData;
+    origData.copyIn(test_uncompressed, sizeof(test_uncompressed));
+    Stream::ptr readplex(new SingleplexStream(
+        Stream::ptr(new MemoryStream(origData)), SingleplexStream::READ));
+    GzipStream compress(readplex, Z_BEST_COMPRESSION, 15, 8,
+        ZlibStream::DEFAULT, true);
+    Buffer compressed;
+    while (0 < compress.read(compressed, 7));
+
+    std::shared_ptr<MemoryStream> memstream(new MemoryStream());
+    Stream::ptr writeplex(new SingleplexStream(memstream,
+        SingleplexStream::WRITE));
+    GzipStream decompress(writeplex, Z_DEFAULT_COMPRESSION, 15, 8,
+        ZlibStream::DEFAULT, true);
+    while (compressed.readAvailable() > 0)
+        compressed.consume(decompress.write(compressed,
+            compressed.readAvailable()));
+    decompress.close();
+    MORDOR_TEST_ASSERT(memstream->buffer() == origData);
+}
+
 #if !defined(HAVE_CONFIG_H) || defined(HAVE_LIBLZMA)
 
 // enable lzma by default
@@ -201,7 +308,7 @@ MORDOR_UNITTEST(LZMAStream, decompress)
 MORDOR_UNITTEST(LZMAStream, badFormat)
 {
     // feed a zlib stream to LZMAStream, and see what will happen.
-    MORDOR_TEST_ASSERT_EXCEPTION(testDecompress<LZMAStream>(test_zlib, sizeof(test_lzma)),
+    MORDOR_TEST_ASSERT_EXCEPTION(testDecompress<LZMAStream>(test_zlib, sizeof(test_zlib)),
                                  UnknownLZMAFormatException);
 }
 
@@ -218,8 +325,8 @@ MORDOR_UNITTEST(LZMAStream, corruptedStream)
     MORDOR_ASSERT(HEADER_SIZE + 42 + 42 < STREAM_SIZE);
     // so we keep the header unchanged, but just mess up with the stream body.
     memset(corrupted + HEADER_SIZE + 42, 42, 42);
-    MORDOR_TEST_ASSERT_EXCEPTION(testDecompress<LZMAStream>(test_zlib, STREAM_SIZE),
-                                 UnknownLZMAFormatException);
+    MORDOR_TEST_ASSERT_EXCEPTION(testDecompress<LZMAStream>(corrupted, STREAM_SIZE),
+                                 CorruptedLZMAStreamException);
 }
 
 #endif
@@ -0,0 +1,287 @@
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include "mordor/streams/lz4.h"
+#include "mordor/streams/memory.h"
+#include "mordor/streams/singleplex.h"
+#include "mordor/streams/zstd.h"
+#include "mordor/test/test.h"
+
+using namespace Mordor;
+using namespace Mordor::Test;
+
+static const char *sample = "Unfortunately, computers are vulnerable to hard "
+    "drive crashes, virus attacks, theft and natural disasters, which can "
+    "erase everything in an instant.\r\n";
+
+static Buffer
+corpus(int copies)
+{
+    Buffer result;
+    for (int i = 0; i < copies; ++i)
+        result.copyIn(sample);
+    return result;
+}
+
+template <class StreamType>
+static int defaultLevel();
+
+template <>
+int defaultLevel<ZstdStream>()
+{
+    return ZSTD_CLEVEL_DEFAULT;
+}
+
+template <>
+int defaultLevel<LZ4Stream>()
+{
+    return 0;
+}
+
+static void
+writeAll(Stream &stream, const Buffer &data)
+{
+    Buffer copy(data);
+    while (copy.readAvailable() > 0)
+        copy.consume(stream.write(copy, copy.readAvailable()));
+}
+
+template <class StreamType>
+static std::shared_ptr<MemoryStream>
+compress(const Buffer &data, int level = defaultLevel<StreamType>(),
+    const std::string &dictionary = std::string())
+{
+    std::shared_ptr<MemoryStream> result(new MemoryStream());
+    StreamType stream(Stream::ptr(new SingleplexStream(result,
+        SingleplexStream::WRITE)), level, dictionary);
+    writeAll(stream, data);
+    stream.close();
+    return result;
+}
+
+template <class StreamType>
+static Buffer
+decompress(const Buffer &compressed,
+    const std::string &dictionary = std::string())
+{
+    StreamType stream(Stream::ptr(new SingleplexStream(
+        Stream::ptr(new MemoryStream(compressed)), SingleplexStream::READ)),
+        defaultLevel<StreamType>(), dictionary);
+    Buffer result;
+    while (stream.read(result, 4096) > 0);
+    return result;
+}
+
+// The cases every codec has to get right
+
+template <class StreamType>
+static void
+testRoundTrip(int minLevel, int maxLevel, int step)
+{
+    Buffer data = corpus(10000);
+    for (int level = minLevel; level <= maxLevel; level += step) {
+        std::shared_ptr<MemoryStream> compressed =
+            compress<StreamType>(data, level);
+        MORDOR_TEST_ASSERT_LESS_THAN(compressed->buffer().readAvailable(),
+            data.readAvailable() / 100);
+        MORDOR_TEST_ASSERT(decompress<StreamType>(compressed->buffer()) ==
+            data);
+    }
+}
+
+template <class StreamType>
+static void
+testEmpty()
+{
+    // Still a whole frame
+    std::shared_ptr<MemoryStream> compressed = compress<StreamType>(Buffer());
+    MORDOR_TEST_ASSERT_GREATER_THAN(compressed->buffer().readAvailable(), 0u);
+    MORDOR_TEST_ASSERT_EQUAL(
+        decompress<StreamType>(compressed->buffer()).readAvailable(), 0u);
+}
+
+template <class StreamType, class CorruptedException>
+static void
+testDictionary()
+{
+    std::string dictionary(sample);
+    Buffer data(sample);
+    std::shared_ptr<MemoryStream> plain = compress<StreamType>(data);
+    std::shared_ptr<MemoryStream> primed = compress<StreamType>(data,
+        defaultLevel<StreamType>(), dictionary);
+    MORDOR_TEST_ASSERT_LESS_THAN(primed->buffer().readAvailable(),
+        plain->buffer().readAvailable());
+    MORDOR_TEST_ASSERT(decompress<StreamType>(primed->buffer(), dictionary) ==
+        data);
+    MORDOR_TEST_ASSERT_EXCEPTION(decompress<StreamType>(primed->buffer()),
+        CorruptedException);
+}
+
+template <class StreamType>
+static void
+testFlush()
+{
+    std::shared_ptr<MemoryStream> compressed(new MemoryStream());
+    StreamType stream(Stream::ptr(new SingleplexStream(compressed,
+        SingleplexStream::WRITE)));
+    stream.write(sample, strlen(sample));
+    MORDOR_TEST_ASSERT_EQUAL(compressed->buffer().readAvailable(), 0u);
+    stream.flush();
+
+    // What was flushed decompresses on its own, even though the frame isn't
+    // finished
+    StreamType reader(Stream::ptr(new SingleplexStream(
+        Stream::ptr(new MemoryStream(compressed->buffer())),
+        SingleplexStream::READ)));
+    Buffer result;
+    while (result.readAvailable() < strlen(sample))
+        reader.read(result, 4096);
+    MORDOR_TEST_ASSERT(result == sample);
+    MORDOR_TEST_ASSERT_EXCEPTION(reader.read(result, 4096),
+        UnexpectedEofException);
+}
+
+template <class StreamType, class CorruptedException>
+static void
+testCorrupted()
+{
+    std::string compressed =
+        compress<StreamType>(corpus(100))->buffer().toString();
+    compressed[compressed.size() / 2] ^= 0x55;
+    compressed[compressed.size() - 2] ^= 0x55;
+    MORDOR_TEST_ASSERT_EXCEPTION(decompress<StreamType>(Buffer(compressed)),
+        CorruptedException);
+}
+
+MORDOR_UNITTEST(ZstdStream, roundTrip)
+{
+    testRoundTrip<ZstdStream>(1, 19, 9);
+}
+
+MORDOR_UNITTEST(ZstdStream, empty)
+{
+    testEmpty<ZstdStream>();
+}
+
+MORDOR_UNITTEST(ZstdStream, dictionary)
+{
+    testDictionary<ZstdStream, CorruptedZstdStreamException>();
+}
+
+MORDOR_UNITTEST(ZstdStream, flush)
+{
+    testFlush<ZstdStream>();
+}
+
+MORDOR_UNITTEST(ZstdStream, corrupted)
+{
+    testCorrupted<ZstdStream, CorruptedZstdStreamException>();
+}
+
+MORDOR_UNITTEST(ZstdStream, windowLog)
+{
+    Buffer data = corpus(100);
+    std::shared_ptr<MemoryStream> compressed(new MemoryStream());
+    ZstdStream compressor(Stream::ptr(new SingleplexStream(compressed,
+        SingleplexStream::WRITE)), ZSTD_CLEVEL_DEFAULT, std::string(), 22);
+    writeAll(compressor, data);
+    compressor.close();
+
+    // Streamed, so the frame asks for the whole window, not just the size of
+    // the content; a decompressor limited to less refuses it
+    ZstdStream limited(Stream::ptr(new SingleplexStream(
+        Stream::ptr(new MemoryStream(compressed->buffer())),
+        SingleplexStream::READ)), ZSTD_CLEVEL_DEFAULT, std::string(), 21);
+    Buffer result;
+    MORDOR_TEST_ASSERT_EXCEPTION(while (limited.read(result, 4096) > 0),
+        CorruptedZstdStreamException);
+
+    ZstdStream allowed(Stream::ptr(new SingleplexStream(
+        Stream::ptr(new MemoryStream(compressed->buffer())),
+        SingleplexStream::READ)), ZSTD_CLEVEL_DEFAULT, std::string(), 22);
+    result.clear();
+    while (allowed.read(result, 4096) > 0);
+    MORDOR_TEST_ASSERT(result == data);
+    // As does the default limit
+    MORDOR_TEST_ASSERT(decompress<ZstdStream>(compressed->buffer()) == data);
+}
+
+MORDOR_UNITTEST(LZ4Stream, roundTrip)
+{
+    testRoundTrip<LZ4Stream>(0, 12, 6);
+}
+
+MORDOR_UNITTEST(LZ4Stream, empty)
+{
+    testEmpty<LZ4Stream>();
+}
+
+MORDOR_UNITTEST(LZ4Stream, dictionary)
+{
+    testDictionary<LZ4Stream, CorruptedLZ4StreamException>();
+}
+
+MORDOR_UNITTEST(LZ4Stream, flush)
+{
+    testFlush<LZ4Stream>();
+}
+
+MORDOR_UNITTEST(LZ4Stream, corrupted)
+{
+    testCorrupted<LZ4Stream, CorruptedLZ4StreamException>();
+}
+
+MORDOR_UNITTEST(LZ4Stream, blockSizes)
+{
+    Buffer data = corpus(10000);
+    LZ4F_blockSizeID_t blockSizes[] = { LZ4F_max64KB, LZ4F_max256KB,
+        LZ4F_max1MB, LZ4F_max4MB };
+    for (size_t i = 0; i < sizeof(blockSizes) / sizeof(blockSizes[0]); ++i) {
+        std::shared_ptr<MemoryStream> compressed(new MemoryStream());
+        LZ4Stream stream(Stream::ptr(new SingleplexStream(compressed,
+            SingleplexStream::WRITE)), 0, std::string(), blockSizes[i]);
+        writeAll(stream, data);
+        stream.close();
+        // The block size is in the frame header, so the reader needn't know
+        MORDOR_TEST_ASSERT(decompress<LZ4Stream>(compressed->buffer()) ==
+            data);
+    }
+}
+
+MORDOR_UNITTEST(LZ4Stream, pendingOutput)
+{
+    // Far less room than LZ4F_compressBound() wants for a block, so every
+    // step is staged in Context::pending and handed out 16 bytes at a time
+    Buffer data = corpus(1000);
+    std::shared_ptr<MemoryStream> compressed(new MemoryStream());
+    LZ4Stream stream(Stream::ptr(new SingleplexStream(compressed,
+        SingleplexStream::WRITE)));
+    stream.bufferSize(16);
+    stream.write(sample, strlen(sample));
+    stream.flush();
+    Buffer flushed(compressed->buffer());
+    writeAll(stream, data);
+    stream.close();
+    // Nothing was lost or reordered across the staging
+    MORDOR_TEST_ASSERT(decompress<LZ4Stream>(compressed->buffer()) ==
+        sample + data.toString());
+
+    LZ4Stream reader(Stream::ptr(new SingleplexStream(
+        Stream::ptr(new MemoryStream(flushed)), SingleplexStream::READ)));
+    Buffer result;
+    while (result.readAvailable() < strlen(sample))
+        reader.read(result, 4096);
+    MORDOR_TEST_ASSERT(result == sample);
+}
+
+MORDOR_UNITTEST(LZ4Stream, invert)
+{
+    // Compressing on read, a 10 byte read is all the room there is, so this
+    // goes through Context::pending as well
+    Buffer data = corpus(100);
+    LZ4Stream compressor(Stream::ptr(new SingleplexStream(
+        Stream::ptr(new MemoryStream(data)), SingleplexStream::READ)),
+        0, std::string(), LZ4F_max64KB, true);
+    Buffer compressed;
+    while (compressor.read(compressed, 10) > 0);
+    MORDOR_TEST_ASSERT(decompress<LZ4Stream>(compressed) == data);
+}